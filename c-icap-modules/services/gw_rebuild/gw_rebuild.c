@@ -38,6 +38,8 @@ static const int GW_DISABLE_FILE_ID_REPORTING = 0;
 #define GW_VERSION_SIZE 15
 #define GW_BT_FILE_PATH_SIZE 150
 #define STATS_BUFFER 1024
+/*The maximum size of a body block sent directly from the stored file*/
+#define GW_SEND_FILE_BLOCK (1024 * 1024)
 
 enum rebuild_request_body_return {REBUILD_UNPROCESSED=0, REBUILD_REBUILT=1, REBUILD_FAILED=2, REBUILD_ERROR=9};
 
@@ -322,6 +324,13 @@ int gw_rebuild_write_to_net(char *buf, int len, ci_request_t *req)
     if (!data)
         return CI_ERROR;
 
+#if defined(HAVE_CICAP_SEND_BODY_FILE)
+    /*Let c-icap send the stored data directly from the file*/
+    if (len > 0 && (bytes = ci_request_send_body_simple_file(req, data->body.store, GW_SEND_FILE_BLOCK)) != 0) {
+        ci_debug_printf(9, "gw_rebuild_write_to_net:FileId:%s, send from file %d bytes\n", data->file_id, bytes);
+        return bytes == CI_EOF ? CI_EOF : 0;
+    }
+#endif
     bytes = gw_body_data_read(&data->body, buf, len);
 
     ci_debug_printf(9, "gw_rebuild_write_to_net:FileId:%s, write bytes is %d\n", data->file_id, bytes);
@@ -27,6 +27,7 @@
 #include "access.h"
 #include "mem.h"
 #include "filetype.h"
+#include "util.h"
 #include <ctype.h>
 #include <time.h>
 
@@ -460,8 +461,7 @@ void *get_time_data(ci_request_t *req, char *param)
 {
     struct acl_time_data *tmd_req = ci_buffer_alloc(sizeof(struct acl_time_data));
     struct tm br_tm;
-    time_t tm;
-    time(&tm);
+    time_t tm = ci_coarse_time();
     localtime_r(&tm, &br_tm);
     tmd_req->days = 0;
     tmd_req->days |= (1 << br_tm.tm_wday);
@@ -568,6 +568,9 @@ int ci_access_entry_add_acl_by_name(ci_access_entry_t *access_entry, const char
 /*********************************************************************************/
 /*ci_acl_spec functions                                                          */
 
+/*The number of acl specs, used to size the per request results memo*/
+static int ACL_SPECS_NUM = 0;
+
 ci_acl_spec_t *  ci_acl_spec_new(const char *name, const char *type, const char *param, struct ci_acl_type_list *list, ci_acl_spec_t **spec_list)
 {
     ci_acl_spec_t *spec,*cur;
@@ -591,6 +594,9 @@ ci_acl_spec_t *  ci_acl_spec_new(const char *name, const char *type, const char
     spec->type = acl_type;
     spec->data = NULL;
     spec->next = NULL;
+    spec->id = ACL_SPECS_NUM++;
+    spec->ip_index = NULL;
+    spec->ip_unindexed = 0;
 
     if (spec_list != NULL) {
         if (*spec_list != NULL) {
@@ -625,6 +631,14 @@ ci_acl_data_t *ci_acl_spec_new_data(ci_acl_spec_t *spec, const char *val)
     }
     new_data->data = data;
     new_data->next = NULL;
+
+    if (ops == &ci_ip_ops || ops == &ci_ip_sockaddr_ops) {
+        if (!spec->ip_index)
+            spec->ip_index = ci_ip_trie_create();
+        if (!ci_ip_trie_add(spec->ip_index, data, new_data))
+            spec->ip_unindexed++;
+    }
+
     if ((list = spec->data) != NULL) {
         while (list->next != NULL)
             list = list->next;
@@ -664,6 +678,8 @@ void ci_acl_spec_release(ci_acl_spec_t *cur)
         ops->free(dtmp->data, default_allocator);
         free(dtmp);
     }
+    ci_ip_trie_destroy(cur->ip_index);
+    cur->ip_index = NULL;
 }
 
 void ci_acl_spec_list_release(ci_acl_spec_t *spec)
@@ -718,6 +734,7 @@ int ci_acl_typelist_add(struct ci_acl_type_list *list, const ci_acl_type_t *type
     cur->name[MAX_NAME_LEN] = '\0';
     cur->type = type->type;
     cur->get_test_data = type->get_test_data;
+    cur->free_test_data = type->free_test_data;
     list->acl_type_list_num++;
     return 1;
 }
@@ -755,8 +772,19 @@ int spec_data_check(const ci_acl_spec_t *spec, const void *req_raw_data)
 //    int (*comp)(void *req_spec, void *acl_spec);
     struct ci_acl_data *spec_data = spec->data;
     const ci_type_ops_t *ops = spec->type->type;
+    const void *address;
+    int family;
 
     ci_debug_printf(9,"Check request with ci_acl_spec_t:%s\n", spec->name);
+    if (spec->ip_index) {
+        address = ci_ip_key_address(ops, req_raw_data, &family);
+        if (address && ci_ip_trie_search(spec->ip_index, family, address)) {
+            ci_debug_printf(9,"The ci_acl_spec_t:%s matches\n", spec->name);
+            return 1;
+        }
+        if (!spec->ip_unindexed)
+            return 0;
+    }
     while (spec_data != NULL) {
         if (ops->equal(spec_data->data, (void *)req_raw_data)) {
             ci_debug_printf(9,"The ci_acl_spec_t:%s matches\n", spec->name);
@@ -767,34 +795,148 @@ int spec_data_check(const ci_acl_spec_t *spec, const void *req_raw_data)
     return 0;
 }
 
-int request_match_specslist(ci_request_t *req, const struct ci_specs_list *spec_list)
+/*
+  The acl specs results are memoized in the request. A result is valid while
+  the request stays in the same processing phase, no new request data
+  (encapsulated headers, preview data) are read and its user does not change
+  (the "auth" acls set the user), so an acl shared by many access entries or
+  access lists (client_access, icap_access, log access lists, ...) is
+  evaluated at most once per phase. The specs without data to test are not
+  memoized, the data may be available on the next check.
+*/
+enum acl_result {
+    ACL_RESULT_UNKNOWN = 0,
+    ACL_RESULT_MATCH,
+    ACL_RESULT_NOMATCH,
+    ACL_RESULT_NODATA
+};
+
+struct ci_acl_memo {
+    int size;
+    int generation;
+    unsigned char *results;
+};
+
+static int acl_memo_generation(const ci_request_t *req)
+{
+    int phase;
+    for (phase = CI_PHASES_NUM - 1; phase > 0 && !req->phase_time[phase]; phase--);
+    return ((req->data_generation * CI_PHASES_NUM + phase) << 1) + (req->user[0] != '\0');
+}
+
+static struct ci_acl_memo *acl_memo_get(ci_request_t *req)
 {
-    const ci_acl_spec_t *spec;
-    const ci_acl_type_t *type;
-    int ret, negate, check_result;
+    struct ci_acl_memo *memo = req->acl_memo;
+    int generation;
+
+    if (!memo) {
+        if (ACL_SPECS_NUM == 0)
+            return NULL;
+        memo = ci_request_mem_alloc(req, sizeof(struct ci_acl_memo) + ACL_SPECS_NUM);
+        if (!memo)
+            return NULL;
+        memo->size = ACL_SPECS_NUM;
+        memo->results = (unsigned char *)memo + sizeof(struct ci_acl_memo);
+        memo->generation = -1;
+        req->acl_memo = memo;
+    }
+
+    generation = acl_memo_generation(req);
+    if (memo->generation != generation) {
+        memset(memo->results, ACL_RESULT_UNKNOWN, memo->size);
+        memo->generation = generation;
+    }
+    return memo;
+}
+
+/*
+  The test data extracted from the request while an access list is checked.
+  The specs with the same type and parameter share them.
+*/
+#define ACL_FACTS_MAX 16
+struct acl_facts {
+    int num;
+    struct acl_fact {
+        const ci_acl_type_t *type;
+        const char *parameter;
+        void *data;
+    } items[ACL_FACTS_MAX];
+};
+
+static void *acl_fact_get(ci_request_t *req, const ci_acl_spec_t *spec, struct acl_facts *facts, int *owned)
+{
+    struct acl_fact *fact;
+    void *data;
+    int i;
+
+    *owned = 0;
+    for (i = 0; i < facts->num; i++) {
+        fact = &facts->items[i];
+        if (fact->type == spec->type &&
+                (fact->parameter == spec->parameter ||
+                 (fact->parameter && spec->parameter && strcmp(fact->parameter, spec->parameter) == 0)))
+            return fact->data;
+    }
+
+    data = spec->type->get_test_data(req, spec->parameter);
+    if (facts->num < ACL_FACTS_MAX) {
+        fact = &facts->items[facts->num++];
+        fact->type = spec->type;
+        fact->parameter = spec->parameter;
+        fact->data = data;
+    } else
+        *owned = 1;
+    return data;
+}
+
+static void acl_facts_release(ci_request_t *req, struct acl_facts *facts)
+{
+    struct acl_fact *fact;
+    int i;
+    for (i = 0; i < facts->num; i++) {
+        fact = &facts->items[i];
+        if (fact->data && fact->type->free_test_data)
+            fact->type->free_test_data(req, fact->data);
+    }
+    facts->num = 0;
+}
+
+static enum acl_result acl_spec_check(ci_request_t *req, const ci_acl_spec_t *spec, struct acl_facts *facts)
+{
+    struct ci_acl_memo *memo = acl_memo_get(req);
+    enum acl_result result;
     void *test_data;
+    int owned;
 
-    ret = 1;
-    while (spec_list != NULL) {
-        spec = spec_list->spec;
-        negate = spec_list->negate;
-        type = spec->type;
-        test_data = type->get_test_data(req, spec->parameter);
-        if (!test_data) {
-            ci_debug_printf(9,"No data to test for %s/%s, ignore\n", type->name, spec->parameter);
-            return 0;
-        }
+    if (memo && spec->id < memo->size && memo->results[spec->id] != ACL_RESULT_UNKNOWN)
+        return (enum acl_result)memo->results[spec->id];
+
+    test_data = acl_fact_get(req, spec, facts, &owned);
+    if (!test_data) {
+        ci_debug_printf(9,"No data to test for %s/%s, ignore\n", spec->type->name, spec->parameter);
+        result = ACL_RESULT_NODATA;
+    } else
+        result = spec_data_check(spec, test_data) ? ACL_RESULT_MATCH : ACL_RESULT_NOMATCH;
 
-        check_result = spec_data_check(spec, test_data);
-        if (check_result == 0 && negate == 0)
-            ret = 0;
-        else if (check_result != 0 && negate != 0)
-            ret = 0;
+    if (owned && test_data && spec->type->free_test_data)
+        spec->type->free_test_data(req, test_data);
 
-        if (type->free_test_data)
-            type->free_test_data(req, test_data);
+    /*The test data retrieval may changed the user*/
+    if (result != ACL_RESULT_NODATA && (memo = acl_memo_get(req)) && spec->id < memo->size)
+        memo->results[spec->id] = (unsigned char)result;
+    return result;
+}
 
-        if (ret == 0)
+int request_match_specslist(ci_request_t *req, const struct ci_specs_list *spec_list, struct acl_facts *facts)
+{
+    enum acl_result result;
+
+    while (spec_list != NULL) {
+        result = acl_spec_check(req, spec_list->spec, facts);
+        if (result == ACL_RESULT_NODATA)
+            return 0;
+
+        if ((result == ACL_RESULT_MATCH) == (spec_list->negate != 0))
             return 0;
 
         spec_list = spec_list->next;
@@ -805,19 +947,25 @@ int request_match_specslist(ci_request_t *req, const struct ci_specs_list *spec_
 int ci_access_entry_match_request(ci_access_entry_t *access_entry, ci_request_t *req)
 {
     struct ci_specs_list *spec_list;
+    struct acl_facts facts;
+    int ret = CI_ACCESS_UNKNOWN;
 
     if (!access_entry)
         return CI_ACCESS_ALLOW;
 
+    facts.num = 0;
     while (access_entry) {
         ci_debug_printf(9,"Check request with an access entry\n");
         spec_list = access_entry->spec_list;
-        if (spec_list && spec_list->spec && request_match_specslist(req, spec_list))
-            return access_entry->type;
+        if (spec_list && spec_list->spec && request_match_specslist(req, spec_list, &facts)) {
+            ret = access_entry->type;
+            break;
+        }
 
         access_entry = access_entry->next;
     }
-    return CI_ACCESS_UNKNOWN;
+    acl_facts_release(req, &facts);
+    return ret;
 }
 
 
@@ -864,6 +1012,7 @@ void ci_acl_reset()
 {
     ci_acl_spec_list_release(specs_list);
     specs_list = NULL;
+    ACL_SPECS_NUM = 0;
     ci_acl_typelist_reset(&types_list);
     acl_load_defaults();
 }
@@ -942,10 +1091,8 @@ const char *get_header(ci_headers_list_t *headers, char *head)
     if (!(val = ci_headers_value2(headers, head, &value_size)))
         return NULL;
 
-    if (!headers->packed) /*The headers are not packed, so it is NULL terminated*/
-        return val;
-
-    /*assume that an 8k buffer is enough for a header value*/
+    /*Always return a copy. The headers may be packed, and they may be
+      packed or unpacked before the value is released.*/
     if (!(buf = ci_buffer_alloc(value_size + 1)))
         return NULL;
 
@@ -957,7 +1104,7 @@ const char *get_header(ci_headers_list_t *headers, char *head)
 
 void release_header_value(ci_headers_list_t *headers, char *head)
 {
-    if (headers && headers->packed && head) /*The headers are packed, we have allocated buffer*/
+    if (head) /*Allocated by get_header*/
         ci_buffer_free(head);
 }
 
@@ -992,27 +1139,27 @@ void free_icap_response_header(ci_request_t *req, void *param)
 void *get_http_req_header(ci_request_t *req, char *param)
 {
     ci_headers_list_t *heads;
-    heads = ci_http_request_headers(req);
+    heads = ci_http_request_headers_ro(req);
     return (void *)get_header(heads, param);
 }
 void free_http_req_header(ci_request_t *req, void *param)
 {
     ci_headers_list_t *heads;
-    heads = ci_http_request_headers(req);
+    heads = ci_http_request_headers_ro(req);
     release_header_value(heads, param);
 }
 
 void *get_http_resp_header(ci_request_t *req, char *param)
 {
     ci_headers_list_t *heads;
-    heads = ci_http_response_headers(req);
+    heads = ci_http_response_headers_ro(req);
     return (void *)get_header(heads, param);
 }
 
 void free_http_resp_header(ci_request_t *req, void *param)
 {
     ci_headers_list_t *heads;
-    heads = ci_http_response_headers(req);
+    heads = ci_http_response_headers_ro(req);
     release_header_value(heads, param);
 }
 
@@ -1020,7 +1167,7 @@ void *get_http_req_url(ci_request_t *req, char *param)
 {
     char *buf;
     ci_headers_list_t *heads;
-    heads = ci_http_request_headers(req);
+    heads = ci_http_request_headers_ro(req);
     if (!heads)
         return NULL;
     buf = ci_buffer_alloc(8192);
@@ -1038,7 +1185,7 @@ void *get_http_req_line(ci_request_t *req, char *param)
     size_t first_line_size;
     const char *first_line;
     char *buf;
-    heads = ci_http_request_headers(req);
+    heads = ci_http_request_headers_ro(req);
     if (!heads)
         return NULL;
 
@@ -1047,10 +1194,9 @@ void *get_http_req_line(ci_request_t *req, char *param)
     if (!first_line || first_line_size == 0)
         return NULL;
 
-    if (!heads->packed) /*The headers are not packed, so it is NULL terminated*/
-        return (void *)first_line;
-
-    buf = ci_buffer_alloc(first_line_size + 1);
+    /*Always a copy, as in get_header*/
+    if (!(buf = ci_buffer_alloc(first_line_size + 1)))
+        return NULL;
     memcpy(buf, first_line, first_line_size);
     buf[first_line_size] = '\0';
     return buf;
@@ -1058,9 +1204,7 @@ void *get_http_req_line(ci_request_t *req, char *param)
 
 void free_http_req_line(ci_request_t *req, void *data)
 {
-    ci_headers_list_t *heads;
-    heads = ci_http_request_headers(req);
-    if (heads->packed)
+    if (data)
         ci_buffer_free(data);
 }
 
@@ -1070,7 +1214,7 @@ void *get_http_resp_line(ci_request_t *req, char *param)
     const char *first_line;
     char *buf;
     ci_headers_list_t *heads;
-    heads = ci_http_response_headers(req);
+    heads = ci_http_response_headers_ro(req);
     if (!heads)
         return NULL;
 
@@ -1079,10 +1223,9 @@ void *get_http_resp_line(ci_request_t *req, char *param)
     if (!first_line || first_line_size == 0)
         return NULL;
 
-    if (!heads->packed) /*The headers are not packed, so it is NULL terminated*/
-        return (void *)first_line;
-
-    buf = ci_buffer_alloc(first_line_size + 1);
+    /*Always a copy, as in get_header*/
+    if (!(buf = ci_buffer_alloc(first_line_size + 1)))
+        return NULL;
     memcpy(buf, first_line, first_line_size);
     buf[first_line_size] = '\0';
     return buf;
@@ -1090,9 +1233,7 @@ void *get_http_resp_line(ci_request_t *req, char *param)
 
 void free_http_resp_line(ci_request_t *req, void *data)
 {
-    ci_headers_list_t *heads;
-    heads = ci_http_response_headers(req);
-    if (heads->packed)
+    if (data)
         ci_buffer_free(data);
 }
 #endif
@@ -1103,7 +1244,7 @@ void *get_http_req_method(ci_request_t *req, char *param)
     size_t found_size;
     const char *first_line, *e, *eol;
     char *buf;
-    heads = ci_http_request_headers(req);
+    heads = ci_http_request_headers_ro(req);
     if (!heads)
         return NULL;
 
@@ -1152,10 +1293,12 @@ void free_data_type(ci_request_t *req,void *param)
 
 void *get_content_length(ci_request_t *req, char *param)
 {
-    struct acl_cmp_uint64_data *clen_p = (struct acl_cmp_uint64_data *)ci_buffer_alloc(sizeof(struct acl_cmp_uint64_data));
+    struct acl_cmp_uint64_data *clen_p;
     ci_off_t clen = ci_http_content_length(req);
     if (clen < 0)
         return NULL;
+    if (!(clen_p = (struct acl_cmp_uint64_data *)ci_buffer_alloc(sizeof(struct acl_cmp_uint64_data))))
+        return NULL;
     clen_p->data = (uint64_t)clen;
     if (param[0] == '=') {
         clen_p->operator = 0;
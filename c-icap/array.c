@@ -26,25 +26,17 @@
 
 #define array_item_size(type) ( (size_t)&((type *)0)[1])
 
-ci_array_t * ci_array_new(size_t size)
+static ci_array_t * array_build(void *buffer, size_t size)
 {
     ci_array_t *array;
     ci_mem_allocator_t *packer;
-    void  *buffer;
-
-    buffer = ci_buffer_alloc(size);
-    if (!buffer)
-        return NULL;
 
     packer = ci_create_pack_allocator_on_memblock(buffer, size);
-    if (!packer) {
-        ci_buffer_free(buffer);
+    if (!packer)
         return NULL;
-    }
 
     array = ci_pack_allocator_alloc(packer, sizeof(ci_array_t));
     if (!array) {
-        ci_buffer_free(buffer);
         ci_mem_allocator_destroy(packer);
         return NULL;
     }
@@ -57,6 +49,40 @@ ci_array_t * ci_array_new(size_t size)
     return array;
 }
 
+ci_array_t * ci_array_new(size_t size)
+{
+    ci_array_t *array;
+    void  *buffer;
+
+    buffer = ci_buffer_alloc(size);
+    if (!buffer)
+        return NULL;
+
+    if (!(array = array_build(buffer, size))) {
+        ci_buffer_free(buffer);
+        return NULL;
+    }
+    return array;
+}
+
+ci_array_t * ci_array_new_from_allocator(ci_mem_allocator_t *allocator, size_t size)
+{
+    ci_array_t *array;
+    void  *buffer;
+
+    buffer = allocator->alloc(allocator, size);
+    if (!buffer)
+        return NULL;
+
+    if (!(array = array_build(buffer, size))) {
+        allocator->free(allocator, buffer);
+        return NULL;
+    }
+    /*The memory belongs to the allocator*/
+    array->mem = NULL;
+    return array;
+}
+
 ci_array_t * ci_array_new2(size_t items, size_t item_size)
 {
     size_t array_size;
@@ -69,10 +95,10 @@ ci_array_t * ci_array_new2(size_t items, size_t item_size)
 void ci_array_destroy(ci_array_t *array)
 {
     void *buffer = array->mem;
-    assert(buffer);
     if (array->alloc)
         ci_mem_allocator_destroy(array->alloc);
-    ci_buffer_free(buffer);
+    if (buffer)
+        ci_buffer_free(buffer);
 }
 
 const ci_array_item_t * ci_array_add(ci_array_t *array, const char *name, const void *value, size_t size)
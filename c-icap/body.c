@@ -304,6 +304,40 @@ int do_read(int fd, void *buf, size_t count)
     return bytes;
 }
 
+/*
+  Positional write/read. Saves the lseek system call per spool file
+  write or read on systems supporting pwrite/pread.
+*/
+int do_pwrite(int fd, const void *buf, size_t count, ci_off_t offset)
+{
+    int bytes;
+#if defined(HAVE_PWRITE)
+    errno = 0;
+    do {
+        bytes = pwrite(fd, buf, count, offset);
+    } while (bytes < 0 && errno == EINTR);
+#else
+    lseek(fd, offset, SEEK_SET);
+    bytes = do_write(fd, buf, count);
+#endif
+    return bytes;
+}
+
+int do_pread(int fd, void *buf, size_t count, ci_off_t offset)
+{
+    int bytes;
+#if defined(HAVE_PREAD)
+    errno = 0;
+    do {
+        bytes = pread(fd, buf, count, offset);
+    } while (bytes < 0 && errno == EINTR);
+#else
+    lseek(fd, offset, SEEK_SET);
+    bytes = do_read(fd, buf, count);
+#endif
+    return bytes;
+}
+
 #ifdef _WIN32
 #define F_PERM S_IREAD|S_IWRITE
 #else
@@ -479,8 +513,7 @@ int ci_cached_file_write(ci_cached_file_t * body, const char *buf, int len, int
         return 0;
 
     if (body->fd > 0) {        /*A file was open so write the data at the end of file....... */
-        lseek(body->fd, 0, SEEK_END);
-        if ((ret = do_write(body->fd, buf, len)) < 0) {
+        if ((ret = do_pwrite(body->fd, buf, len, body->endpos)) < 0) {
             ci_debug_printf(1, "Cannot write to file!!! (errno=%d)\n",
                             errno);
         }
@@ -542,8 +575,7 @@ int ci_cached_file_read(ci_cached_file_t * body, char *buf, int len)
 
         bytes = (remains > len ? len : remains);      /*Number of bytes that we are going to read from file..... */
 
-        lseek(body->fd, body->readpos, SEEK_SET);
-        if ((bytes = do_read(body->fd, buf, bytes)) > 0)
+        if ((bytes = do_pread(body->fd, buf, bytes, body->readpos)) > 0)
             body->readpos += bytes;
         return bytes;
     }
@@ -730,8 +762,7 @@ int ci_simple_file_write(ci_simple_file_t * body, const char *buf, int len, int
             wsize = len;
     }
 
-    lseek(body->fd, body->endpos, SEEK_SET);
-    if ((ret = do_write(body->fd, buf, wsize)) < 0) {
+    if ((ret = do_pwrite(body->fd, buf, wsize, body->endpos)) < 0) {
         ci_debug_printf(1, "Cannot write to file: %s\n", strerror(errno));
     } else {
         body->endpos += ret;
@@ -784,8 +815,7 @@ int ci_simple_file_read(ci_simple_file_t * body, char *buf, int len)
 
     assert(remains >= 0);
     bytes = (remains > len ? len : remains);   /*Number of bytes that we are going to read from file..... */
-    lseek(body->fd, body->readpos, SEEK_SET);
-    if ((bytes = do_read(body->fd, buf, bytes)) > 0) {
+    if ((bytes = do_pread(body->fd, buf, bytes, body->readpos)) > 0) {
         body->readpos += bytes;
         body->bytes_out += bytes;
     }
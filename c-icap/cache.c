@@ -27,11 +27,13 @@
 #include "registry.h"
 #include "proc_mutex.h"
 #include "ci_threads.h"
+#include "stats.h"
+#include "util.h"
 #include <assert.h>
 
 time_t ci_internal_time()
 {
-    return time(NULL);
+    return ci_coarse_time();
 }
 
 void ci_cache_type_register(const struct ci_cache_type *type)
@@ -63,6 +65,14 @@ int ci_cache_update(ci_cache_t *cache, const void *key, const void *val, size_t
 /*****************************************/
 /*Simple local cache implementation      */
 
+/*
+  The local cache is split to shards, each one with its own lock, hash
+  table and a segmented LRU: new entries are stored in the probation
+  segment and move to the protected segment when they are found again.
+  Entries are evicted from the tail of the probation segment first,
+  when the bytes stored in a shard exceed its share of the cache size.
+*/
+
 int ci_local_cache_init(struct ci_cache *cache, const char *name);
 const void *ci_local_cache_search(struct ci_cache *cache, const void *key, void **val, void *data, void *(*dup_from_cache)(const void *stored_val, size_t stored_val_size, void *data));
 int ci_local_cache_update(struct ci_cache *cache, const void *key, const void *val, size_t val_size, void *(*copy_to_cache)(void *buf, const void *val, size_t buf_size));
@@ -76,13 +86,22 @@ struct ci_cache_type ci_local_cache = {
     "local"
 };
 
+#define LOCAL_CACHE_SHARDS_MAX 16
+/*The minimum objects a shard should be able to hold*/
+#define LOCAL_CACHE_SHARD_OBJECTS 64
+/*The percent of the shard size the protected segment may use*/
+#define LOCAL_CACHE_PROTECTED_PERCENT 80
+
 struct ci_cache_entry {
     unsigned int hash;
     time_t time;
     void *key;
     void *val;
     int val_size;
-    struct ci_cache_entry *qnext;
+    size_t size;
+    int protected;
+    struct ci_cache_entry *prev;
+    struct ci_cache_entry *next;
     struct ci_cache_entry *hnext;
 };
 
@@ -94,15 +113,33 @@ typedef struct common_mutex {
     } mtx;
 } common_mutex_t;
 
-struct ci_local_cache_data {
-    struct ci_cache_entry *first_queue_entry;
-    struct ci_cache_entry *last_queue_entry;
+struct local_cache_lru {
+    struct ci_cache_entry *head;
+    struct ci_cache_entry *tail;
+    size_t bytes;
+};
+
+struct local_cache_shard {
     struct ci_cache_entry **hash_table;
     unsigned int hash_table_size;
-    ci_mem_allocator_t *allocator;
+    struct local_cache_lru probation;
+    struct local_cache_lru protected;
+    size_t max_bytes;
     common_mutex_t mtx;
 };
 
+struct ci_local_cache_data {
+    struct local_cache_shard *shards;
+    unsigned int shards_num;
+    ci_mem_allocator_t *allocator;
+    struct {
+        int hits;
+        int misses;
+        int evictions;
+        int rejections;
+    } stat;
+};
+
 int common_mutex_init(common_mutex_t *mtx, int proc_mtx)
 {
     if (proc_mtx)
@@ -133,17 +170,40 @@ int common_mutex_unlock(common_mutex_t *mtx)
     return ci_thread_mutex_unlock(&mtx->mtx.thread_mutex);
 }
 
+/*Local cache entries expire on the monotonic clock*/
+static inline time_t local_cache_time()
+{
+    return (time_t)(ci_coarse_msec() / 1000);
+}
+
+static void local_cache_stats_register(struct ci_local_cache_data *cache_data, const char *name)
+{
+    char group[128], label[256];
+    snprintf(group, sizeof(group), "Local cache %s", name);
+    snprintf(label, sizeof(label), "%s HITS", group);
+    cache_data->stat.hits = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s MISSES", group);
+    cache_data->stat.misses = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s EVICTIONS", group);
+    cache_data->stat.evictions = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s REJECTIONS", group);
+    cache_data->stat.rejections = ci_stat_entry_register(label, STAT_INT64_T, group);
+}
+
 int ci_local_cache_init(struct ci_cache *cache, const char *name)
 {
     struct ci_local_cache_data *cache_data;
-    int i;
-    unsigned int new_hash_size;
+    struct local_cache_shard *shard;
+    unsigned int i, new_hash_size, cache_items, shard_items;
     ci_mem_allocator_t *allocator;
 
+    cache_items = cache->mem_size/(cache->max_object_size+sizeof(struct ci_cache_entry));
+    if (cache_items == 0)
+        return 0;
+
     cache_data = malloc(sizeof(struct ci_local_cache_data));
     if (!cache_data)
         return 0;
-    cache->cache_data = cache_data;
 
     /*until we are going to create an allocator which can allocate/release from
      continues memory blocks like those we have in shared memory*/
@@ -152,86 +212,125 @@ int ci_local_cache_init(struct ci_cache *cache, const char *name)
         free(cache_data);
         return 0;
     }
-
     cache_data->allocator = allocator;
-    cache_data->first_queue_entry = (struct ci_cache_entry *)allocator->alloc(allocator, sizeof(struct ci_cache_entry));
-    if (!cache_data->first_queue_entry) {
-        ci_mem_allocator_destroy(allocator);
-        free(cache_data);
-        return 0;
-    }
-    cache_data->last_queue_entry = cache_data->first_queue_entry;
-    cache_data->last_queue_entry->hnext = NULL;
-    cache_data->last_queue_entry->qnext = NULL;
-    cache_data->last_queue_entry->key = NULL;
-    cache_data->last_queue_entry->val = NULL;
-    cache_data->last_queue_entry->time = 0;
-    cache_data->last_queue_entry->hash = 0;
-
-    unsigned int cache_items = cache->mem_size/(cache->max_object_size+sizeof(struct ci_cache_entry));
-    if (cache_items == 0) {
+
+    for (cache_data->shards_num = 1;
+            cache_data->shards_num < LOCAL_CACHE_SHARDS_MAX && cache_items / (cache_data->shards_num * 2) >= LOCAL_CACHE_SHARD_OBJECTS;
+            cache_data->shards_num <<= 1);
+    cache_data->shards = calloc(cache_data->shards_num, sizeof(struct local_cache_shard));
+    if (!cache_data->shards) {
         ci_mem_allocator_destroy(allocator);
         free(cache_data);
         return 0;
     }
 
-    for (i = 0; i < cache_items-1; i++) {
-        cache_data->last_queue_entry->qnext = (struct ci_cache_entry *)allocator->alloc(allocator, sizeof(struct ci_cache_entry));
-        if (!cache_data->last_queue_entry->qnext) {
-            /*we are leaking here the cache->first_queue_entry elements. TODO...*/
-            ci_mem_allocator_destroy(allocator);
-            return 0;
-        }
-        cache_data->last_queue_entry = cache_data->last_queue_entry->qnext;
-        cache_data->last_queue_entry->hnext = NULL;
-        cache_data->last_queue_entry->qnext = NULL;
-        cache_data->last_queue_entry->key = NULL;
-        cache_data->last_queue_entry->val = NULL;
-        cache_data->last_queue_entry->time = 0;
-        cache_data->last_queue_entry->hash = 0;
-    }
-
+    /*The hash tables are sized for objects of the max_object_size,
+      smaller objects share the hash buckets*/
+    shard_items = cache_items / cache_data->shards_num;
     new_hash_size = 63;
-    if (cache_items > 63) {
-        while (new_hash_size<cache_items && new_hash_size < 0xFFFFFF) {
+    if (shard_items > 63) {
+        while (new_hash_size<shard_items && new_hash_size < 0xFFFFFF) {
             new_hash_size++;
             new_hash_size = (new_hash_size << 1) -1;
         }
     }
-    ci_debug_printf(7,"Hash size: %d\n",new_hash_size);
-    cache_data->hash_table = (struct ci_cache_entry **)allocator->alloc(allocator, (new_hash_size+1)*sizeof(struct ci_cache_entry *));
-    if (!cache_data->hash_table) {
-        /*we are leaking here the cache->first_queue_entry elements. TODO...*/
-        ci_mem_allocator_destroy(allocator);
-        free(cache);
-        free(cache_data);
-        return 0;
+    ci_debug_printf(7,"Hash size: %d, shards: %d\n",new_hash_size, cache_data->shards_num);
+    for (i = 0; i < cache_data->shards_num; ++i) {
+        shard = &cache_data->shards[i];
+        shard->hash_table = (struct ci_cache_entry **)allocator->alloc(allocator, (new_hash_size+1)*sizeof(struct ci_cache_entry *));
+        if (!shard->hash_table) {
+            while (i > 0) {
+                --i;
+                allocator->free(allocator, cache_data->shards[i].hash_table);
+                common_mutex_destroy(&cache_data->shards[i].mtx);
+            }
+            free(cache_data->shards);
+            ci_mem_allocator_destroy(allocator);
+            free(cache_data);
+            return 0;
+        }
+        memset(shard->hash_table,0,(new_hash_size+1)*sizeof(struct ci_cache_entry *));
+        shard->hash_table_size = new_hash_size;
+        shard->max_bytes = cache->mem_size / cache_data->shards_num;
+        common_mutex_init(&shard->mtx, 0);
     }
-    memset(cache_data->hash_table,0,(new_hash_size+1)*sizeof(struct ci_cache_entry *));
-    cache_data->hash_table_size = new_hash_size;
-
-    common_mutex_init(&cache_data->mtx, 0);
 
+    local_cache_stats_register(cache_data, name);
+    cache->cache_data = cache_data;
     return 1;
 }
 
+static void lru_unlink(struct local_cache_lru *lru, struct ci_cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru->tail = e->prev;
+    e->prev = e->next = NULL;
+    lru->bytes -= e->size;
+}
+
+static void lru_push(struct local_cache_lru *lru, struct ci_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru->head;
+    if (lru->head)
+        lru->head->prev = e;
+    else
+        lru->tail = e;
+    lru->head = e;
+    lru->bytes += e->size;
+}
+
+static void local_cache_entry_free(struct ci_cache *cache, struct ci_local_cache_data *cache_data, struct ci_cache_entry *e)
+{
+    if (e->key)
+        cache->key_ops->free(e->key, cache_data->allocator);
+    if (e->val && e->val_size > 0)
+        cache_data->allocator->free(cache_data->allocator, e->val);
+    cache_data->allocator->free(cache_data->allocator, e);
+}
+
+/*Removes the entry from the hash table and the LRU lists and releases it*/
+static void local_cache_remove(struct ci_cache *cache, struct ci_local_cache_data *cache_data, struct local_cache_shard *shard, struct ci_cache_entry *e)
+{
+    struct ci_cache_entry **p;
+    for (p = &shard->hash_table[e->hash]; *p && *p != e; p = &(*p)->hnext);
+    if (*p)
+        *p = e->hnext;
+    lru_unlink(e->protected ? &shard->protected : &shard->probation, e);
+    local_cache_entry_free(cache, cache_data, e);
+}
+
+static inline struct local_cache_shard *local_cache_shard(struct ci_local_cache_data *cache_data, const void *key, size_t key_size, unsigned int *hash)
+{
+    unsigned int h = ci_hash_compute(0xFFFFFFFF, key, key_size);
+    struct local_cache_shard *shard = &cache_data->shards[((h * 2654435761U) >> 16) & (cache_data->shards_num - 1)];
+    *hash = h & shard->hash_table_size;
+    return shard;
+}
+
 void ci_local_cache_destroy(struct ci_cache *cache)
 {
     struct ci_cache_entry *e;
+    struct local_cache_shard *shard;
     struct ci_local_cache_data *cache_data;
+    unsigned int i;
     cache_data = (struct ci_local_cache_data *)cache->cache_data;
-    e = cache_data->first_queue_entry;
-    while (e) {
-        cache_data->first_queue_entry = cache_data->first_queue_entry->qnext;
-        if (e->key)
-            cache->key_ops->free(e->key, cache_data->allocator);
-        if (e->val && e->val_size > 0)
-            cache_data->allocator->free(cache_data->allocator, e->val);
-        cache_data->allocator->free(cache_data->allocator, e);
-        e = cache_data->first_queue_entry;
+    for (i = 0; i < cache_data->shards_num; ++i) {
+        shard = &cache_data->shards[i];
+        while ((e = shard->probation.head))
+            local_cache_remove(cache, cache_data, shard, e);
+        while ((e = shard->protected.head))
+            local_cache_remove(cache, cache_data, shard, e);
+        cache_data->allocator->free(cache_data->allocator, shard->hash_table);
+        common_mutex_destroy(&shard->mtx);
     }
-    cache_data->allocator->free(cache_data->allocator, cache_data->hash_table);
-    common_mutex_destroy(&cache_data->mtx);
+    free(cache_data->shards);
     ci_mem_allocator_destroy(cache_data->allocator);
     free(cache_data);
 }
@@ -240,104 +339,92 @@ const void *ci_local_cache_search(struct ci_cache *cache, const void *key, void
 {
     struct ci_cache_entry *e;
     struct ci_local_cache_data *cache_data;
+    struct local_cache_shard *shard;
+    unsigned int hash;
     time_t current_time;
     cache_data = (struct ci_local_cache_data *)cache->cache_data;
 
-    unsigned int hash = ci_hash_compute(cache_data->hash_table_size, key, cache->key_ops->size(key));
-
-    assert(hash <= cache_data->hash_table_size);
+    shard = local_cache_shard(cache_data, key, cache->key_ops->size(key), &hash);
 
-    common_mutex_lock(&cache_data->mtx);
-    e = cache_data->hash_table[hash];
+    common_mutex_lock(&shard->mtx);
+    e = shard->hash_table[hash];
     *val = NULL;
     while (e != NULL) {
         ci_debug_printf(10," \t\t->>>>Val %s\n",(char *)e->val);
         ci_debug_printf(10," \t\t->>>>compare %s ~ %s\n",(char *)e->key, (char *)key);
         if (cache->key_ops->compare(e->key, key) == 0) {
-            current_time = ci_internal_time();
-            if ((current_time - e->time) > cache->ttl) /*if expired*/
+            current_time = local_cache_time();
+            if ((current_time - e->time) > cache->ttl) { /*if expired*/
+                local_cache_remove(cache, cache_data, shard, e);
                 key = NULL;
-            else if (e->val_size) {
-                if (dup_from_cache)
-                    *val = dup_from_cache(e->val, e->val_size, data);
-                else {
-                    *val = ci_buffer_alloc(e->val_size);
-                    memcpy(*val, e->val, e->val_size);
+            } else {
+                if (e->val_size) {
+                    if (dup_from_cache)
+                        *val = dup_from_cache(e->val, e->val_size, data);
+                    else {
+                        *val = ci_buffer_alloc(e->val_size);
+                        memcpy(*val, e->val, e->val_size);
+                    }
+                }
+                /*Found again, move it to the head of protected segment*/
+                lru_unlink(e->protected ? &shard->protected : &shard->probation, e);
+                e->protected = 1;
+                lru_push(&shard->protected, e);
+                while (shard->protected.bytes > shard->max_bytes / 100 * LOCAL_CACHE_PROTECTED_PERCENT) {
+                    e = shard->protected.tail;
+                    lru_unlink(&shard->protected, e);
+                    e->protected = 0;
+                    lru_push(&shard->probation, e);
                 }
             }
-            common_mutex_unlock(&cache_data->mtx);
+            common_mutex_unlock(&shard->mtx);
+            ci_stat_uint64_inc(key ? cache_data->stat.hits : cache_data->stat.misses, 1);
             return key;
         }
         assert(e != e->hnext);
         e = e->hnext;
     }
-    common_mutex_unlock(&cache_data->mtx);
+    common_mutex_unlock(&shard->mtx);
+    ci_stat_uint64_inc(cache_data->stat.misses, 1);
     return NULL;
 }
 
 int ci_local_cache_update(struct ci_cache *cache, const void *key, const void *val, size_t val_size, void *(*copy_to_cache)(void *buf, const void *val, size_t buf_size))
 {
-    struct ci_cache_entry *e,*tmp;
-    int key_size;
+    struct ci_cache_entry *e, *old;
+    int key_size, evictions = 0;
     time_t current_time;
     struct ci_local_cache_data *cache_data;
+    struct local_cache_shard *shard;
     unsigned int hash;
     cache_data = (struct ci_local_cache_data *)cache->cache_data;
-    hash = ci_hash_compute(cache_data->hash_table_size, key, cache->key_ops->size(key));
-
-    assert(hash <= cache_data->hash_table_size);
-    ci_debug_printf(10,"Adding :%s:%p\n",(char *)key, (char *)val);
-
-    current_time = ci_internal_time();
-
-    common_mutex_lock(&cache_data->mtx);
-    /*Get the oldest entry*/
-    e = cache_data->first_queue_entry;
+    key_size = cache->key_ops->size(key);
 
-    /*if the oldest entry does not expired do not store tke key/value pair*/
-    if ((current_time - e->time)< cache->ttl) {
-        ci_debug_printf(6, "ci_cache_update: not available slot (%d-%d %d).\n",
-                        (unsigned int) current_time,
-                        (unsigned int) e->time,
-                        (unsigned int) cache->ttl
-                       );
-        common_mutex_unlock(&cache_data->mtx);
+    if (key_size + val_size > cache->max_object_size) {
+        ci_debug_printf(6, "ci_cache_update: object of size %d is bigger than the maximum allowed\n", (int)(key_size + val_size));
+        ci_stat_uint64_inc(cache_data->stat.rejections, 1);
         return 0;
     }
 
-    /*If it has data release its data*/
-    if (e->key) {
-        cache->key_ops->free(e->key, cache_data->allocator);
-        e->key = NULL;
-    }
-    if (e->val && e->val_size > 0) {
-        cache_data->allocator->free(cache_data->allocator, e->val);
-        e->val = NULL;
-    }
+    shard = local_cache_shard(cache_data, key, key_size, &hash);
+    ci_debug_printf(10,"Adding :%s:%p\n",(char *)key, (char *)val);
 
-    /*If it is in the hash table remove it...*/
-    {
-        assert(e->hash <= cache_data->hash_table_size);
-        tmp = cache_data->hash_table[e->hash];
-        if (tmp == e)
-            cache_data->hash_table[e->hash] = tmp->hnext;
-        else if (tmp) {
-            while (tmp->hnext != NULL && e != tmp->hnext) tmp = tmp->hnext;
-            if (tmp->hnext)
-                tmp->hnext = tmp->hnext->hnext;
-        }
-    }
+    current_time = local_cache_time();
 
-    e->hnext = NULL;
-    e->time = 0;
-    e->hash = 0;
+    /*Build the new entry outside the lock*/
+    e = cache_data->allocator->alloc(cache_data->allocator, sizeof(struct ci_cache_entry));
+    if (!e) {
+        ci_stat_uint64_inc(cache_data->stat.rejections, 1);
+        return 0;
+    }
+    memset(e, 0, sizeof(struct ci_cache_entry));
 
     /*I should implement a ci_type_ops::clone method. Maybe the memcpy is not enough....*/
-    key_size = cache->key_ops->size(key);
     e->key = cache_data->allocator->alloc(cache_data->allocator, key_size);
     if (!e->key) {
-        common_mutex_unlock(&cache_data->mtx);
+        local_cache_entry_free(cache, cache_data, e);
         ci_debug_printf(6, "ci_cache_update: failed to allocate memory for key.\n");
+        ci_stat_uint64_inc(cache_data->stat.rejections, 1);
         return 0;
     }
     memcpy(e->key, key, key_size);
@@ -355,32 +442,41 @@ int ci_local_cache_update(struct ci_cache *cache, const void *key, const void *v
                 memcpy(e->val, val, e->val_size);
         }
         if (!e->val) {
-            cache_data->allocator->free(cache_data->allocator, e->key);
-            e->key = NULL;
-            common_mutex_unlock(&cache_data->mtx);
+            e->val_size = 0;
+            local_cache_entry_free(cache, cache_data, e);
             ci_debug_printf(6, "ci_cache_update: failed to allocate memory for cache data.\n");
+            ci_stat_uint64_inc(cache_data->stat.rejections, 1);
             return 0;
         }
-    } else {
-        e->val = NULL;
-        e->val_size = 0;
     }
 
     e->hash = hash;
     e->time = current_time;
-    cache_data->first_queue_entry = cache_data->first_queue_entry->qnext;
-    /*Make it the newest entry (make it last entry in queue)*/
-    cache_data->last_queue_entry->qnext = e;
-    cache_data->last_queue_entry = e;
-    e->qnext = NULL;
-
-    if (cache_data->hash_table[hash])
-        ci_debug_printf(10,"\t\t:::Found %s\n", (char *)cache_data->hash_table[hash]->val);
+    e->size = sizeof(struct ci_cache_entry) + key_size + val_size;
+
+    common_mutex_lock(&shard->mtx);
+    /*Replace the old value of the key*/
+    for (old = shard->hash_table[hash]; old && cache->key_ops->compare(old->key, key) != 0; old = old->hnext);
+    if (old)
+        local_cache_remove(cache, cache_data, shard, old);
+
+    /*Make room, evicting first the least recently used entries
+      of the probation segment*/
+    while (shard->probation.bytes + shard->protected.bytes + e->size > shard->max_bytes) {
+        if ((old = shard->probation.tail) == NULL && (old = shard->protected.tail) == NULL)
+            break;
+        local_cache_remove(cache, cache_data, shard, old);
+        evictions++;
+    }
+
+    lru_push(&shard->probation, e);
     /*Make it the first entry in the current hash entry*/
-    e->hnext = cache_data->hash_table[hash];
-    cache_data->hash_table[hash] = e;
+    e->hnext = shard->hash_table[hash];
+    shard->hash_table[hash] = e;
 
-    common_mutex_unlock(&cache_data->mtx);
+    common_mutex_unlock(&shard->mtx);
+    if (evictions)
+        ci_stat_uint64_inc(cache_data->stat.evictions, evictions);
     return 1;
 }
 
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <assert.h>
 #include "service.h"
+#include "request.h"
 #include "debug.h"
 #include "module.h"
 #include "filetype.h"
@@ -95,6 +96,7 @@ int PIPELINING = 1;
 int CHECK_FOR_BUGGY_CLIENT = 0;
 int ALLOW204_AS_200OK_ZERO_ENCAPS = 0;
 int FAKE_ALLOW204 = 1;
+int SLOW_REQUEST_THRESHOLD = 0;
 
 
 /* txtTemplate stuff */
@@ -105,6 +107,8 @@ extern int TEMPLATE_CACHE_SIZE; // How many templates can be cached
 extern int TEMPLATE_MEMBUF_SIZE; // Max memory for txtTemplate to expand template into txt
 
 extern char *SERVER_LOG_FILE;
+extern long int LOG_QUEUE_SIZE;
+extern int LOG_QUEUE_DROP;
 extern char *ACCESS_LOG_FILE;
 extern char *ACCESS_LOG_FORMAT;
 /*extern char *LOGS_DIR;*/
@@ -131,6 +135,7 @@ int cfg_set_accesslog(const char *directive, const char **argv, void *setdata);
 int cfg_set_debug_level(const char *directive, const char **argv, void *setdata);
 int cfg_set_debug_stdout(const char *directive, const char **argv, void *setdata);
 int cfg_set_body_maxmem(const char *directive, const char **argv, void *setdata);
+int cfg_set_io_buf_size(const char *directive, const char **argv, void *setdata);
 int cfg_set_tmp_dir(const char *directive, const char **argv, void *setdata);
 int cfg_set_acl_controllers(const char *directive, const char **argv, void *setdata);
 int cfg_set_auth_method(const char *directive, const char **argv, void *setdata);
@@ -184,6 +189,8 @@ static struct ci_conf_entry conf_variables[] = {
     {"ServerLog", &SERVER_LOG_FILE, intl_cfg_set_str, NULL},
     {"AccessLog", NULL, cfg_set_accesslog, NULL},
     {"LogFormat", NULL, cfg_set_logformat, NULL},
+    {"LogQueueSize", &LOG_QUEUE_SIZE, intl_cfg_size_long, NULL},
+    {"LogQueueDrop", &LOG_QUEUE_DROP, intl_cfg_onoff, NULL},
     {"DebugLevel", NULL, cfg_set_debug_level, NULL},   /*Set library's debug level */
     {"ServicesDir", &CI_CONF.SERVICES_DIR, intl_cfg_set_str, NULL},
     {"ModulesDir", &CI_CONF.MODULES_DIR, intl_cfg_set_str, NULL},
@@ -192,6 +199,8 @@ static struct ci_conf_entry conf_variables[] = {
     {"Module", NULL, cfg_load_module, NULL},
     {"TmpDir", NULL, cfg_set_tmp_dir, NULL},
     {"MaxMemObject", NULL, cfg_set_body_maxmem, NULL}, /*Set library's body max mem */
+    {"IOBufferSize", &CI_IO_BUF_SIZE, cfg_set_io_buf_size, NULL}, /*Set library's request I/O buffers size*/
+    {"MaxIOBufferSize", &CI_IO_MAX_BUF_SIZE, cfg_set_io_buf_size, NULL},
     {"AclControllers", NULL, cfg_set_acl_controllers, NULL},
     {"acl", NULL, cfg_acl_add, NULL},
     {"icap_access", NULL, cfg_default_acl_access, NULL},
@@ -215,6 +224,7 @@ static struct ci_conf_entry conf_variables[] = {
     {"SupportBuggyClients", &CHECK_FOR_BUGGY_CLIENT, intl_cfg_onoff, NULL},
     {"Allow204As200okZeroEncaps", &ALLOW204_AS_200OK_ZERO_ENCAPS, intl_cfg_enable, NULL},
     {"FakeAllow204", &FAKE_ALLOW204, intl_cfg_onoff, NULL},
+    {"SlowRequestThreshold", &SLOW_REQUEST_THRESHOLD, intl_cfg_set_int, NULL},
     {NULL, NULL, NULL, NULL}
 };
 
@@ -483,6 +493,38 @@ int cfg_set_body_maxmem(const char *directive, const char **argv, void *setdata)
     return intl_cfg_size_long(directive, argv, &CI_BODY_MAX_MEM);
 }
 
+#define CI_IO_BUF_SIZE_LIMIT (1024 * 1024)
+int cfg_set_io_buf_size(const char *directive, const char **argv, void *setdata)
+{
+    long int val = 0;
+    if (!setdata)
+        return 0;
+
+    if (!ci_cfg_size_long(directive, argv, &val))
+        return 0;
+
+    if (val < BUFSIZE || val > CI_IO_BUF_SIZE_LIMIT) {
+        ci_debug_printf(1, "The %s value must be between %d and %d bytes\n",
+                        directive, BUFSIZE, CI_IO_BUF_SIZE_LIMIT);
+        return 0;
+    }
+    /*The IOBufferSize is the initial size of the buffers, which grow up
+      to the MaxIOBufferSize*/
+    if (setdata == &CI_IO_BUF_SIZE && val > CI_IO_MAX_BUF_SIZE) {
+        ci_debug_printf(1, "The %s value must not be greater than the MaxIOBufferSize (%d bytes)\n",
+                        directive, CI_IO_MAX_BUF_SIZE);
+        return 0;
+    }
+    if (setdata == &CI_IO_MAX_BUF_SIZE && val < CI_IO_BUF_SIZE) {
+        ci_debug_printf(1, "The %s value must not be less than the IOBufferSize (%d bytes)\n",
+                        directive, CI_IO_BUF_SIZE);
+        return 0;
+    }
+    cfg_default_value_store(setdata, setdata, sizeof(int));
+    *(int *)setdata = (int)val;
+    return 1;
+}
+
 int cfg_load_service(const char *directive, const char **argv, void *setdata)
 {
     ci_service_module_t *service = NULL;
@@ -1027,6 +1069,12 @@ void system_shutdown()
     */
     ci_registry_clean();
 
+    /*
+      - drop the cached templates before unloading services and modules:
+        the compiled templates point into their format tables
+    */
+    ci_txt_template_reset();
+
     /*
       - close/release services and modules
     */
@@ -630,7 +630,7 @@ int extend_object_type(struct ci_magics_db *db, ci_headers_list_t *headers, cons
     /*The following until we have an internal html recognizer ..... */
     if (ci_belongs_to_group(db, file_type, CI_TEXT_DATA)
             && headers
-            && (content_type = ci_headers_value(headers, "Content-Type")) != NULL) {
+            && (content_type = ci_headers_value_id(headers, CI_HEADER_CONTENT_TYPE)) != NULL) {
         if (strcasestr(content_type, "text/html")
                 || strcasestr(content_type, "text/css")
                 || strcasestr(content_type, "text/javascript"))
@@ -179,12 +179,190 @@ ci_headers_list_t *ci_headers_create()
     h->bufsize = HEADSBUFSIZE;
     h->bufused = 0;
     h->packed = 0;
+    h->index = NULL;
 
     return h;
 }
 
+/*
+  The headers index. It is a case-insensitive open addressing hash
+  table of the header names, built on the first search if the list has
+  at least HEADERS_INDEX_MIN headers. It stores positions in the
+  h->headers array, so it is not affected by the reallocation of the
+  headers buffer. For each header name only the first occurrence is
+  stored, to match the linear search.
+*/
+#define HEADERS_INDEX_MIN 8
+#define HEADERS_INDEX_MIN_SLOTS 32
+
+struct ci_headers_index_slot {
+    unsigned int hash;
+    int len;
+    int pos;
+};
+
+struct ci_headers_index {
+    int valid;
+    int slots_num;
+    int items;
+    int known[CI_HEADER_IDS_NUM];
+    struct ci_headers_index_slot *slots;
+};
+
+static const struct {
+    const char *name;
+    size_t len;
+} KNOWN_HEADERS[CI_HEADER_IDS_NUM] = {
+    {"Content-Length", 14},
+    {"Content-Type", 12},
+    {"Encapsulated", 12},
+    {"Allow", 5},
+    {"Preview", 7}
+};
+
+#define ascii_tolower(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+static unsigned int header_name_hash(const char *name, size_t len)
+{
+    unsigned int hash = 5381;
+    const unsigned char *s = (const unsigned char *)name;
+    size_t i;
+    for (i = 0; i < len; i++)
+        hash = ((hash << 5) + hash) + ascii_tolower(s[i]);
+    return hash;
+}
+
+/*Returns the length of the header name, or -1 if it is not a
+  "name: value" line*/
+static int header_name_len(const char *line)
+{
+    const char *s;
+    for (s = line; *s != ':'; s++) {
+        if (*s == '\0' || *s == '\r' || *s == '\n')
+            return -1;
+    }
+    return s - line;
+}
+
+static void headers_index_free(ci_headers_list_t * h)
+{
+    if (h->index) {
+        free(h->index->slots);
+        free(h->index);
+        h->index = NULL;
+    }
+}
+
+static inline void headers_index_invalidate(ci_headers_list_t * h)
+{
+    if (h->index)
+        h->index->valid = 0;
+}
+
+/*Adds the h->headers[pos] header to the index. Returns 0 if the index
+  needs to grow*/
+static int headers_index_insert(ci_headers_list_t * h, int pos)
+{
+    struct ci_headers_index *idx = h->index;
+    const char *line = h->headers[pos];
+    unsigned int hash, mask;
+    int len, i, k;
+
+    if ((idx->items + 1) * 2 > idx->slots_num)
+        return 0;
+
+    if ((len = header_name_len(line)) <= 0)
+        return 1;
+
+    hash = header_name_hash(line, len);
+    mask = idx->slots_num - 1;
+    for (i = hash & mask; idx->slots[i].pos >= 0; i = (i + 1) & mask) {
+        if (idx->slots[i].hash == hash && idx->slots[i].len == len &&
+                strncasecmp(h->headers[idx->slots[i].pos], line, len) == 0)
+            return 1; /*Keep the first occurrence*/
+    }
+    idx->slots[i].hash = hash;
+    idx->slots[i].len = len;
+    idx->slots[i].pos = pos;
+    idx->items++;
+
+    for (k = 0; k < CI_HEADER_IDS_NUM; k++) {
+        if (idx->known[k] < 0 && KNOWN_HEADERS[k].len == (size_t)len &&
+                strncasecmp(KNOWN_HEADERS[k].name, line, len) == 0) {
+            idx->known[k] = pos;
+            break;
+        }
+    }
+    return 1;
+}
+
+static int headers_index_build(ci_headers_list_t * h)
+{
+    struct ci_headers_index *idx = h->index;
+    struct ci_headers_index_slot *slots;
+    int slots_num, i;
+
+    if (!idx) {
+        if (!(idx = malloc(sizeof(struct ci_headers_index))))
+            return 0;
+        idx->slots = NULL;
+        idx->slots_num = 0;
+        h->index = idx;
+    }
+
+    for (slots_num = HEADERS_INDEX_MIN_SLOTS; slots_num < h->used * 4; slots_num <<= 1);
+    if (slots_num > idx->slots_num) {
+        if (!(slots = realloc(idx->slots, slots_num * sizeof(struct ci_headers_index_slot))))
+            return 0;
+        idx->slots = slots;
+        idx->slots_num = slots_num;
+    }
+
+    for (i = 0; i < idx->slots_num; i++)
+        idx->slots[i].pos = -1;
+    for (i = 0; i < CI_HEADER_IDS_NUM; i++)
+        idx->known[i] = -1;
+    idx->items = 0;
+    idx->valid = 1;
+
+    for (i = 0; i < h->used; i++) {
+        if (!headers_index_insert(h, i)) {
+            idx->valid = 0;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*Returns the index of the header in h->headers array or -1*/
+static int headers_index_search(ci_headers_list_t * h, const char *header, size_t header_size)
+{
+    struct ci_headers_index *idx = h->index;
+    unsigned int hash, mask;
+    int i, pos;
+
+    hash = header_name_hash(header, header_size);
+    mask = idx->slots_num - 1;
+    for (i = hash & mask; (pos = idx->slots[i].pos) >= 0; i = (i + 1) & mask) {
+        if (idx->slots[i].hash == hash && idx->slots[i].len == (int)header_size &&
+                strncasecmp(h->headers[pos], header, header_size) == 0)
+            return pos;
+    }
+    return -1;
+}
+
+static inline int headers_index_ready(ci_headers_list_t * h)
+{
+    if (h->index && h->index->valid)
+        return 1;
+    if (h->used < HEADERS_INDEX_MIN)
+        return 0;
+    return headers_index_build(h);
+}
+
 void ci_headers_destroy(ci_headers_list_t * h)
 {
+    headers_index_free(h);
     free(h->headers);
     free(h->buf);
     free(h);
@@ -212,18 +390,26 @@ int ci_headers_setsize(ci_headers_list_t * h, int size)
 
 void ci_headers_reset(ci_headers_list_t * h)
 {
+    headers_index_invalidate(h);
     h->packed = 0;
     h->used = 0;
     h->bufused = 0;
 }
 
+/*
+  Headers lists read from the network are kept packed, in the form they
+  were received (see ci_headers_unpack_wire). New headers can be appended
+  to a packed list, before the final "\r\n", without unpacking it.
+*/
+#define packed_crlf_ended(h) ((h)->bufused >= 2 && (h)->buf[(h)->bufused - 2] == '\r' && (h)->buf[(h)->bufused - 1] == '\n')
+
 const char *ci_headers_add(ci_headers_list_t * h, const char *line)
 {
     char *newhead, **newspace, *newbuf;
     int len, linelen;
     int i = 0;
 
-    if (h->packed) { /*Not in edit mode*/
+    if (h->packed && !packed_crlf_ended(h)) { /*Not in edit mode*/
         return NULL;
     }
 
@@ -242,24 +428,37 @@ const char *ci_headers_add(ci_headers_list_t * h, const char *line)
     while ( len - h->bufused < linelen + 4 )
         len += HEADSBUFSIZE;
     if (len > h->bufsize) {
-        newbuf = realloc(h->buf, len * sizeof(char));
+        /*Packed headers are not NULL terminated, relocate the index using
+          the offsets of headers in the old buffer*/
+        newbuf = malloc(len * sizeof(char));
         if (!newbuf) {
             ci_debug_printf(1, "Server Error:Error allocation memory \n");
             return NULL;
         }
+        memcpy(newbuf, h->buf, h->bufsize);
+        for (i = 0; i < h->used; i++)
+            h->headers[i] = newbuf + (h->headers[i] - h->buf);
+        free(h->buf);
         h->buf = newbuf;
         h->bufsize = len;
-        h->headers[0] = h->buf;
-        for (i = 1; i < h->used; i++)
-            h->headers[i] = h->headers[i - 1] + strlen(h->headers[i - 1]) + 2;
-    }
-    newhead = h->buf + h->bufused;
-    strcpy(newhead, line);
-    h->bufused += linelen + 2; //2 char size for \r\n at the end of each header
-    *(newhead + linelen + 1) = '\n';
-    *(newhead + linelen + 3) = '\n';
-    if (newhead)
-        h->headers[h->used++] = newhead;
+    }
+    if (h->packed) {
+        /*Replace the final "\r\n" with the new header line*/
+        newhead = h->buf + h->bufused - 2;
+        memcpy(newhead, line, linelen);
+        memcpy(newhead + linelen, "\r\n\r\n", 4);
+        h->bufused += linelen + 2;
+    } else {
+        newhead = h->buf + h->bufused;
+        strcpy(newhead, line);
+        h->bufused += linelen + 2; //2 char size for \r\n at the end of each header
+        *(newhead + linelen + 1) = '\n';
+        *(newhead + linelen + 3) = '\n';
+    }
+    h->headers[h->used++] = newhead;
+
+    if (h->index && h->index->valid && !headers_index_insert(h, h->used - 1))
+        h->index->valid = 0;
 
     return newhead;
 }
@@ -301,6 +500,7 @@ int ci_headers_addheaders(ci_headers_list_t * h, const ci_headers_list_t * heade
     }
 
     memcpy(h->buf + h->bufused, headers->buf, headers->bufused + 2);
+    headers_index_invalidate(h);
 
     h->bufused += headers->bufused;
     h->used += headers->used;
@@ -331,38 +531,91 @@ const char *ci_headers_first_line(ci_headers_list_t *h)
     return h->buf;
 }
 
-static const char *do_header_search(ci_headers_list_t * h, const char *header, const char **value, const char **end)
+static int linear_header_search(ci_headers_list_t * h, const char *header, size_t header_size)
 {
     int i;
-    size_t header_size = strlen(header);
     const char *h_end = (h->buf + h->bufused);
-    const char *check_head, *lval;
-
-    if (!header_size)
-        return NULL;
+    const char *check_head;
 
     for (i = 0; i < h->used; i++) {
         check_head = h->headers[i];
         if (h_end < check_head + header_size)
-            return NULL;
+            return -1;
         if (*(check_head + header_size) != ':')
             continue;
-        if (strncasecmp(check_head, header, header_size) == 0) {
-            lval = check_head + header_size + 1;
-            if (value) {
-                while (lval <= h_end && (*lval == ' ' || *lval == '\t'))
-                    ++(lval);
-                *value = lval;
-            }
-            if (end) {
-                *end = (i < h->used -1) ? (h->headers[i + 1] - 1) : (h->buf + h->bufused - 1);
-                if (*end < lval) /*parse error in headers ?*/
-                    return NULL;
-                while ((*end > lval) && (**end == '\0' || **end == '\r' || **end == '\n')) --(*end);
-            }
-            return check_head;
-        }
+        if (strncasecmp(check_head, header, header_size) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static const char *header_at(ci_headers_list_t * h, int i, size_t header_size, const char **value, const char **end)
+{
+    const char *h_end = (h->buf + h->bufused);
+    const char *check_head, *lval;
+
+    check_head = h->headers[i];
+    lval = check_head + header_size + 1;
+    if (value) {
+        while (lval <= h_end && (*lval == ' ' || *lval == '\t'))
+            ++(lval);
+        *value = lval;
     }
+    if (end) {
+        *end = (i < h->used -1) ? (h->headers[i + 1] - 1) : (h->buf + h->bufused - 1);
+        if (*end < lval) /*parse error in headers ?*/
+            return NULL;
+        while ((*end > lval) && (**end == '\0' || **end == '\r' || **end == '\n')) --(*end);
+    }
+    return check_head;
+}
+
+static const char *do_header_search(ci_headers_list_t * h, const char *header, const char **value, const char **end)
+{
+    int i;
+    size_t header_size = strlen(header);
+
+    if (!header_size)
+        return NULL;
+
+    /*The index stores names up to the first ':' character*/
+    if (headers_index_ready(h) && !memchr(header, ':', header_size))
+        i = headers_index_search(h, header, header_size);
+    else
+        i = linear_header_search(h, header, header_size);
+
+    if (i < 0)
+        return NULL;
+    return header_at(h, i, header_size, value, end);
+}
+
+static const char *do_header_search_id(ci_headers_list_t * h, int id, const char **value, const char **end)
+{
+    int i;
+
+    if (id < 0 || id >= CI_HEADER_IDS_NUM)
+        return NULL;
+
+    if (headers_index_ready(h))
+        i = h->index->known[id];
+    else
+        i = linear_header_search(h, KNOWN_HEADERS[id].name, KNOWN_HEADERS[id].len);
+
+    if (i < 0)
+        return NULL;
+    return header_at(h, i, KNOWN_HEADERS[id].len, value, end);
+}
+
+const char *ci_headers_search_id(ci_headers_list_t * h, int id)
+{
+    return do_header_search_id(h, id, NULL, NULL);
+}
+
+const char *ci_headers_value_id(ci_headers_list_t * h, int id)
+{
+    const char *pval = NULL;
+    if (do_header_search_id(h, id, &pval, NULL))
+        return pval;
     return NULL;
 }
 
@@ -446,6 +699,7 @@ int ci_headers_remove(ci_headers_list_t * h, const char *header)
             continue;
         if (strncasecmp(phead, header, header_size) == 0) {
             /*remove it........ */
+            headers_index_invalidate(h);
             if (i == h->used - 1) {
                 phead = h->headers[i];
                 *phead = '\r';
@@ -459,7 +713,8 @@ int ci_headers_remove(ci_headers_list_t * h, const char *header)
                     h->bufused - (h->headers[i] - h->buf) - cur_head_size;
                 ci_debug_printf(5, "remove_header : remain len %d\n",
                                 rest_len);
-                memmove(phead, h->headers[i + 1], rest_len);
+                /*Also move the "\r\n" after the end of headers*/
+                memmove(phead, h->headers[i + 1], rest_len + 2);
                 /*reconstruct index..... */
                 h->bufused -= cur_head_size;
                 (h->used)--;
@@ -517,6 +772,8 @@ void ci_headers_pack(ci_headers_list_t * h)
 {
     /*Put the \r\n sequence at the end of each header before sending...... */
     int i = 0, len = 0;
+    if (h->packed)
+        return;
     for (i = 0; i < h->used; i++) {
         len = strlen(h->headers[i]);
         if (h->headers[i][len + 1] == '\n') {
@@ -539,7 +796,11 @@ void ci_headers_pack(ci_headers_list_t * h)
 }
 
 
-int ci_headers_unpack(ci_headers_list_t * h)
+/*
+  Builds the index of headers. If keep_wire is set the headers block is
+  not modified, and the list is left packed.
+*/
+static int headers_unpack(ci_headers_list_t * h, int keep_wire)
 {
     int len, eoh;
     char **newspace;
@@ -557,8 +818,16 @@ int ci_headers_unpack(ci_headers_list_t * h)
                         (unsigned int) *(ebuf + 1));
         return EC_400;        /*Bad request .... */
     }
-    *ebuf = '\0';
-
+    if (keep_wire && (*ebuf != '\r' || *(ebuf + 2) != '\r' || *(ebuf + 3) != '\n'))
+        keep_wire = 0; /*Handle it as usual*/
+    /*The embedded NUL chars are replaced by spaces below, which would
+      modify the wire form*/
+    if (keep_wire && memchr(h->buf, '\0', ebuf - h->buf))
+        keep_wire = 0;
+    if (!keep_wire)
+        *ebuf = '\0';
+
+    headers_index_invalidate(h);
     h->headers[0] = h->buf;
     h->used = 1;
 
@@ -576,7 +845,8 @@ int ci_headers_unpack(ci_headers_list_t * h)
             *str = ' ';
 
         if (eoh) {
-            *str = '\0';
+            if (!keep_wire)
+                *str = '\0';
             if (h->size <= h->used) {        /*  Resize the headers index space ........ */
                 len = h->size + HEADERSTARTSIZE;
                 newspace = realloc(h->headers, len * sizeof(char *));
@@ -595,11 +865,30 @@ int ci_headers_unpack(ci_headers_list_t * h)
             h->used++;
         }
     }
-    h->packed = 0;
+    if (keep_wire) {
+        h->bufused += 2; /*include the final "\r\n"*/
+        h->packed = 1;
+    } else
+        h->packed = 0;
     /*OK headers index construction ...... */
     return EC_100;
 }
 
+int ci_headers_unpack(ci_headers_list_t * h)
+{
+    if (h->packed) {
+        /*Remove the final "\r\n" or "\n" added by ci_headers_pack*/
+        h->bufused -= packed_crlf_ended(h) ? 2 : 1;
+        h->packed = 0;
+    }
+    return headers_unpack(h, 0);
+}
+
+int ci_headers_unpack_wire(ci_headers_list_t * h)
+{
+    return headers_unpack(h, 1);
+}
+
 size_t ci_headers_pack_to_buffer(ci_headers_list_t *heads, char *buf, size_t size)
 {
     size_t n;
@@ -696,7 +985,7 @@ int sizeofheader(ci_headers_list_t * h)
       size+=2;
       return size;
     */
-    return h->bufused + 2;
+    return h->packed ? h->bufused : h->bufused + 2;
 }
 
 int sizeofencaps(ci_encaps_entity_t * e)
@@ -122,6 +122,9 @@ struct ci_acl_spec {
     char *parameter;
     ci_acl_data_t *data;
     ci_acl_spec_t *next;
+    int id; /*The index of the spec in the per request results memo*/
+    ci_ip_trie_t *ip_index; /*The networks of the ip acls*/
+    int ip_unindexed; /*The networks which can not be stored in ip_index*/
 };
 
 /*Specs lists and access entries structures and functions */
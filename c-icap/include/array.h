@@ -98,6 +98,17 @@ CI_DECLARE_FUNC(ci_array_t *) ci_array_new(size_t max_mem_size);
  */
 CI_DECLARE_FUNC(ci_array_t *) ci_array_new2(size_t items, size_t item_size);
 
+/**
+ * Similar to ci_array_new but allocates the array memory using the given
+ * allocator. The memory is released by the allocator, not by the
+ * ci_array_destroy function.
+ \ingroup SIMPLE_ARRAYS
+ \param allocator the allocator to use
+ \param max_mem_size the maximum memory to use
+ \return the allocated object on success, or NULL on failure
+ */
+CI_DECLARE_FUNC(ci_array_t *) ci_array_new_from_allocator(ci_mem_allocator_t *allocator, size_t max_mem_size);
+
 /**
  * Destroy an ci_array_t object
  \ingroup SIMPLE_ARRAYS
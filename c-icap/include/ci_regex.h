@@ -42,6 +42,7 @@ typedef struct ci_regex_replace_part {
 #define ci_regex_create_match_list() ci_list_create(32768, sizeof(ci_regex_replace_part_t))
 CI_DECLARE_FUNC(char *) ci_regex_parse(const char *str, int *flags, int *recursive);
 CI_DECLARE_FUNC(ci_regex_t) ci_regex_build(const char *regex_str, int regex_flags);
+CI_DECLARE_FUNC(int) ci_regex_literal(const char *regex_str, int regex_flags, char *buf, size_t buf_size);
 CI_DECLARE_FUNC(void) ci_regex_free(ci_regex_t regex);
 CI_DECLARE_FUNC(int) ci_regex_apply(const ci_regex_t regex, const char *str, int len, int recurs, ci_list_t *matches, const void *user_data);
 
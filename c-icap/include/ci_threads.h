@@ -40,6 +40,7 @@ CI_DECLARE_FUNC(int) ci_thread_mutex_init(ci_thread_mutex_t *pmutex);
 CI_DECLARE_FUNC(int) ci_thread_mutex_destroy(ci_thread_mutex_t *pmutex);
 #define ci_thread_mutex_lock(pmutex) pthread_mutex_lock(pmutex)
 #define ci_thread_mutex_unlock(pmutex) pthread_mutex_unlock(pmutex)
+#define ci_thread_mutex_trylock(pmutex) pthread_mutex_trylock(pmutex)
 #define ci_thread_self  pthread_self
 
 #ifdef USE_PTHREADS_RWLOCK
@@ -80,6 +81,7 @@ CI_DECLARE_FUNC(int)  ci_thread_mutex_init(ci_thread_mutex_t *pmutex);
 CI_DECLARE_FUNC(int) ci_thread_mutex_destroy(ci_thread_mutex_t *pmutex);
 CI_DECLARE_FUNC(int) ci_thread_mutex_lock(ci_thread_mutex_t *pmutex);
 CI_DECLARE_FUNC(int) ci_thread_mutex_unlock(ci_thread_mutex_t *pmutex);
+CI_DECLARE_FUNC(int) ci_thread_mutex_trylock(ci_thread_mutex_t *pmutex);
 
 CI_DECLARE_FUNC(int) ci_thread_rwlock_init(ci_thread_rwlock_t *);
 CI_DECLARE_FUNC(int) ci_thread_rwlock_destroy(ci_thread_rwlock_t *);
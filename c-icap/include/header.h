@@ -77,6 +77,7 @@ typedef struct ci_headers_list {
     int bufused;
     char *buf;
     int packed;
+    struct ci_headers_index *index;
 } ci_headers_list_t;
 
 
@@ -182,6 +183,41 @@ CI_DECLARE_FUNC(int) ci_headers_remove(ci_headers_list_t *heads, const char *hea
  */
 CI_DECLARE_FUNC(const char *)  ci_headers_search(ci_headers_list_t *heads, const char *header);
 
+/**
+ \ingroup HEADERS
+ * IDs of well-known headers, which can be retrieved without searching
+ * the headers list, using the ci_headers_search_id and
+ * ci_headers_value_id functions
+ */
+enum ci_header_ids {
+    CI_HEADER_CONTENT_LENGTH,
+    CI_HEADER_CONTENT_TYPE,
+    CI_HEADER_ENCAPSULATED,
+    CI_HEADER_ALLOW,
+    CI_HEADER_PREVIEW,
+    CI_HEADER_IDS_NUM
+};
+
+/**
+ * Search for a well-known header in a header list
+ \ingroup HEADERS
+ \param heads is a pointer to the ci_headers_list_t object
+ \param id is the header ID, one of the CI_HEADER_* values
+ \return a pointer to the start of the first occurrence of the header on
+ *       success, NULL otherwise
+ */
+CI_DECLARE_FUNC(const char *) ci_headers_search_id(ci_headers_list_t *heads, int id);
+
+/**
+ * Similar to ci_headers_value but for a well-known header
+ \ingroup HEADERS
+ \param heads is a pointer to the ci_headers_list_t object
+ \param id is the header ID, one of the CI_HEADER_* values
+ \return a pointer to the start of the header value on success, NULL
+ *       otherwise
+ */
+CI_DECLARE_FUNC(const char *) ci_headers_value_id(ci_headers_list_t *heads, int id);
+
 /**
  * Similar to ci_headers_search but also sets to a parameter the size of
  * returned header
@@ -285,6 +321,10 @@ CI_DECLARE_FUNC(const char *) ci_headers_first_line2(ci_headers_list_t *heads, s
 /*The following headers are only used internally */
 CI_DECLARE_FUNC(void) ci_headers_pack(ci_headers_list_t *heads);
 CI_DECLARE_FUNC(int)  ci_headers_unpack(ci_headers_list_t *heads);
+/*Indexes a headers block as received from the network, without modifying
+  it. The list is left packed, and it is unpacked only when it needs to
+  be modified or examined.*/
+CI_DECLARE_FUNC(int)  ci_headers_unpack_wire(ci_headers_list_t *heads);
 CI_DECLARE_FUNC(int)  sizeofheader(ci_headers_list_t *heads);
 
 CI_DECLARE_FUNC(ci_encaps_entity_t) *mk_encaps_entity(int type,int val);
@@ -22,6 +22,7 @@
 #define __LOG_H
 
 #include "request.h"
+#include "txt_format.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -39,6 +40,7 @@ void vlog_server(ci_request_t *req, const char *format, va_list ap);
 
 /* The followings can be used by modules */
 CI_DECLARE_FUNC(char *) logformat_fmt(const char *name);
+CI_DECLARE_FUNC(ci_fmt_program_t *) logformat_program(const char *name);
 #ifdef __cplusplus
 }
 #endif
@@ -73,6 +73,11 @@ CI_DECLARE_FUNC(void)    ci_object_pool_unregister(int id);
 CI_DECLARE_FUNC(void *)  ci_object_pool_alloc(int id);
 CI_DECLARE_FUNC(void)    ci_object_pool_free(void *ptr);
 
+/*Called by the threads with the pools usage counters collected since
+  the previous call*/
+typedef void (*ci_mem_pool_stats_cb_t)(int hits, int misses, int transfers, int contention);
+CI_DECLARE_FUNC(void)    ci_mem_pool_stats_callback(ci_mem_pool_stats_cb_t cb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,8 +30,14 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #else
 #include <WinSock2.h>
+/*The posix scatter-gather buffer, used by ci_wait_rw and the writev calls*/
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
 #endif
 #ifdef USE_OPENSSL
 #include <openssl/bio.h>
@@ -112,6 +118,7 @@ typedef struct ci_ip {
 
 /*Flags for ci_connection_t object*/
 #define CI_CONNECTION_CONNECTED 0x1
+#define CI_CONNECTION_NO_URING  0x2 /*Do not use io_uring for this connection*/
 
 typedef struct ci_connection {
     ci_socket fd;
@@ -160,6 +167,7 @@ CI_DECLARE_FUNC(int) icap_accept_raw_connection(struct ci_port *port, ci_connect
 
 
 CI_DECLARE_FUNC(int) ci_wait_for_data(ci_socket fd,int secs,int what_wait);
+CI_DECLARE_FUNC(int) ci_wait_rw(ci_socket fd, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen);
 
 #define ci_wait_for_incomming_data(fd,timeout) ci_wait_for_data(fd,timeout,wait_for_read)
 #define ci_wait_for_outgoing_data(fd,timeout) ci_wait_for_data(fd,timeout,wait_for_write)
@@ -173,6 +181,8 @@ CI_DECLARE_FUNC(int) ci_read(ci_socket fd,void *buf,size_t count,int timeout);
 CI_DECLARE_FUNC(int) ci_write(ci_socket fd, const void *buf,size_t count,int timeout);
 CI_DECLARE_FUNC(int) ci_read_nonblock(ci_socket fd, void *buf,size_t count);
 CI_DECLARE_FUNC(int) ci_write_nonblock(ci_socket fd, const void *buf,size_t count);
+CI_DECLARE_FUNC(int) ci_writev_nonblock(ci_socket fd, const struct iovec *iov, int iovcnt);
+CI_DECLARE_FUNC(int) ci_sendfile_nonblock(ci_socket fd, int file_fd, ci_off_t offset, size_t count);
 
 CI_DECLARE_FUNC(int) ci_linger_close(ci_socket fd,int secs_to_linger);
 CI_DECLARE_FUNC(int) ci_hard_close(ci_socket fd);
@@ -181,10 +191,34 @@ CI_DECLARE_FUNC(ci_connection_t *) ci_connect_to(const char *servername, int por
 CI_DECLARE_FUNC(int) ci_connect_to_nonblock(ci_connection_t *connection, const char *servername, int port, int proto);
 
 CI_DECLARE_FUNC(int) ci_connection_wait(ci_connection_t *conn, int secs, int what_wait);
+
+/*
+  Waits for the connection to become readable and/or writable, as
+  requested by what_wait, and reads to rbuf and/or writes the wiovcnt
+  buffers of wiov, in order, in the same step. On input *rlen is the
+  size of rbuf. On output *rlen and *wlen are the number of bytes read
+  and written.
+  Returns the ci_wait_for_read/ci_wait_for_write flags of the completed
+  operations, 0 on timeout or a negative value on error or when the
+  connection is closed. The ci_wait_should_retry flag is set if the
+  wait was interrupted by a signal.
+*/
+CI_DECLARE_FUNC(int) ci_connection_wait_rw(ci_connection_t *conn, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen);
+/*The ci_connection_wait_rw for non TLS connections, implemented by the os port*/
+int ci_connection_wait_rw_raw(ci_connection_t *conn, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen);
 CI_DECLARE_FUNC(int) ci_connection_read(ci_connection_t *conn, void *buf, size_t count, int timeout);
 CI_DECLARE_FUNC(int) ci_connection_write(ci_connection_t *conn, void *buf, size_t count, int timeout);
 CI_DECLARE_FUNC(int) ci_connection_read_nonblock(ci_connection_t *conn, void *buf, size_t count);
 CI_DECLARE_FUNC(int) ci_connection_write_nonblock(ci_connection_t *conn, void *buf, size_t count);
+CI_DECLARE_FUNC(int) ci_connection_writev_nonblock(ci_connection_t *conn, const struct iovec *iov, int iovcnt);
+
+/*
+  Sends up to count bytes of the file file_fd, starting at offset, without
+  copying them to user space when the system supports it.
+  Returns the number of bytes sent, 0 if the connection is not writable
+  or a negative value on error.
+*/
+CI_DECLARE_FUNC(int) ci_connection_sendfile_nonblock(ci_connection_t *conn, int file_fd, ci_off_t offset, size_t count);
 CI_DECLARE_FUNC(int) ci_connection_linger_close(ci_connection_t *conn, int timeout);
 CI_DECLARE_FUNC(int) ci_connection_hard_close(ci_connection_t *conn);
 #ifdef __cplusplus
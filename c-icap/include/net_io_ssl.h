@@ -183,6 +183,7 @@ int ci_connection_read_tls(ci_connection_t *conn, void *buf, size_t count, int t
 int ci_connection_write_tls(ci_connection_t *conn, const void *buf, size_t count, int timeout);
 int ci_connection_read_nonblock_tls(ci_connection_t *conn, void *buf, size_t count);
 int ci_connection_write_nonblock_tls(ci_connection_t *conn, const void *buf, size_t count);
+int ci_connection_sendfile_nonblock_tls(ci_connection_t *conn, int file_fd, ci_off_t offset, size_t count);
 int ci_connection_linger_close_tls(ci_connection_t *conn, int timeout);
 int ci_connection_hard_close_tls(ci_connection_t *conn);
 
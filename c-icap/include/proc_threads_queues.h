@@ -73,6 +73,16 @@ struct server_statistics {
     unsigned int crashed_childs;
 };
 
+/*Samples of the merged statistics, taken by the main process*/
+#define STATS_WINDOW_SLOTS 62
+enum stats_windows {STATS_WINDOW_SECONDS, STATS_WINDOW_MINUTES, STATS_WINDOWS_NUM};
+
+struct stats_window {
+    int pos; /*the latest sample*/
+    int samples;
+    time_t times[STATS_WINDOW_SLOTS];
+};
+
 struct childs_queue {
     child_shared_data_t *childs;
     int size;
@@ -83,6 +93,8 @@ struct childs_queue {
     ci_shared_mem_id_t shmid;
     ci_proc_mutex_t queue_mtx;
     struct server_statistics *srv_stats;
+    struct stats_window *stats_windows;
+    void *stats_samples;
 };
 
 
@@ -115,6 +127,10 @@ int find_an_idle_child(struct childs_queue *q);
 int childs_queue_stats(struct childs_queue *q, int *childs,
                        int *freeservers, int *used, int *maxrequests);
 void dump_queue_statistics(struct childs_queue *q);
+void childs_queue_stats_sample(struct childs_queue *q);
+int childs_queue_stats_window(struct childs_queue *q, int seconds,
+                              struct stat_memblock *latest,
+                              struct stat_memblock *oldest);
 
 #ifdef __cplusplus
 }
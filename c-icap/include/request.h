@@ -91,7 +91,7 @@ enum CLIENT_STATUS {
 
 
 #define EXTRA_CHUNK_SIZE  30
-#define MAX_CHUNK_SIZE    4064   /*4096 -EXTRA_CHUNK_SIZE-2*/
+#define MAX_CHUNK_SIZE    4064   /*4096 -EXTRA_CHUNK_SIZE-2, the chunk size for the default wbuf size*/
 #define MAX_USERNAME_LEN 255
 
 typedef struct ci_buf {
@@ -103,6 +103,31 @@ typedef struct ci_buf {
 
 struct ci_service_module;
 struct ci_ring_buf;
+struct ci_simple_file;
+
+/*The maximum number of body data blocks a service can hand over to be
+  sent without copying, see ci_request_send_body_ref*/
+#define CI_MAX_BODY_REFS 8
+
+struct ci_body_ref {
+    const char *data;
+    int fd;  /*If it is not -1, the data are stored in the file fd*/
+    ci_off_t offset;
+    int len;
+    char head[12]; /*The chunk size line, "%x\r\n"*/
+    int head_len;
+};
+
+/*The request processing phases*/
+enum ci_request_phase {
+    CI_PHASE_ACCEPT,   /*Connection accepted or request data available*/
+    CI_PHASE_HEADER,   /*ICAP headers read and parsed*/
+    CI_PHASE_PREVIEW,  /*Preview data handled by the service*/
+    CI_PHASE_EOF,      /*The last body chunk received*/
+    CI_PHASE_SERVICE,  /*Service end of data handler done*/
+    CI_PHASE_SENT,     /*The last response byte sent*/
+    CI_PHASES_NUM
+};
 
 /**
    \typedef ci_request_t
@@ -135,8 +160,13 @@ typedef struct ci_request {
 
     void *service_data;
 
-    char rbuf[BUFSIZE];
-    char wbuf[MAX_CHUNK_SIZE+EXTRA_CHUNK_SIZE+2];
+    /*I/O buffers, allocated using ci_buffer_alloc. They may grow while
+      large objects are transferred, up to CI_IO_MAX_BUF_SIZE bytes*/
+    char *rbuf;
+    char *wbuf;
+    int rbuf_size;
+    int wbuf_size;
+    int full_reads;
     int eof_received;
     int eof_sent;
     int data_locked;
@@ -151,6 +181,11 @@ typedef struct ci_request {
     int return_code;
     char *pstrblock_responce;
     int remain_send_block_bytes;
+    /*Body data blocks of the service, sent as chunks after the current
+      block*/
+    struct ci_body_ref body_refs[CI_MAX_BODY_REFS];
+    int body_refs_num;
+    int body_refs_sent; /*bytes of the first block chunk already sent*/
 
     /*Used to echo data back to a client which does not support preview
       in the case of 204 outside preview.*/
@@ -164,6 +199,14 @@ typedef struct ci_request {
     char *log_str;
     ci_str_array_t *attributes;
 
+    /*Memory released when the request is reset or destroyed*/
+    ci_mem_allocator_t *arena;
+
+    /*The acl results memo, allocated in request arena*/
+    struct ci_acl_memo *acl_memo;
+    /*Incremented when the encapsulated headers or preview data are read*/
+    int data_generation;
+
     /* statistics */
     uint64_t bytes_in; /*May include bytes from next pipelined request*/
     uint64_t bytes_out;
@@ -173,6 +216,10 @@ typedef struct ci_request {
     uint64_t body_bytes_in;
     uint64_t body_bytes_out;
 
+    /*Monotonic timestamps (microseconds) of the request processing
+      phases, see ci_request_phase_mark. Zero for phases not reached*/
+    uint64_t phase_time[CI_PHASES_NUM];
+
     /* added flags/variables*/
     int allow206;
     int64_t i206_use_original_body;
@@ -182,6 +229,13 @@ typedef struct ci_request {
 #define lock_data(req) (req->data_locked = 1)
 #define unlock_data(req) (req->data_locked = 0)
 
+/*The maximum body chunk size which fits in req->wbuf*/
+#define ci_req_max_chunk_size(req) ((req)->wbuf_size - EXTRA_CHUNK_SIZE - 2)
+
+/*The initial and maximum size of the request I/O buffers*/
+CI_DECLARE_DATA extern int CI_IO_BUF_SIZE;
+CI_DECLARE_DATA extern int CI_IO_MAX_BUF_SIZE;
+
 /*This functions needed in server (mpmt_server.c ) */
 ci_request_t *newrequest(ci_connection_t *connection);
 int recycle_request(ci_request_t *req,ci_connection_t *connection);
@@ -192,6 +246,8 @@ int process_request(ci_request_t *);
 CI_DECLARE_FUNC(int) parse_chunk_data(ci_request_t *req, char **wdata);
 CI_DECLARE_FUNC(int) net_data_read(ci_request_t *req);
 CI_DECLARE_FUNC(int) process_encapsulated(ci_request_t *req, const char *buf);
+CI_DECLARE_FUNC(int) ci_request_resize_rbuf(ci_request_t *req, int new_size);
+CI_DECLARE_FUNC(int) ci_request_resize_wbuf(ci_request_t *req, int new_size);
 
 /*********************************************/
 /*Buffer functions (I do not know if they must included in ci library....) */
@@ -218,8 +274,76 @@ CI_DECLARE_FUNC(int)          ci_request_release_entity(ci_request_t *req,int po
 CI_DECLARE_FUNC(char *)       ci_request_set_log_str(ci_request_t *req, char *logstr);
 CI_DECLARE_FUNC(int)       ci_request_set_str_attribute(ci_request_t *req, const char *name, const char *value);
 
+/**
+ * Allocates memory from the request memory arena. The memory does not
+ * need to be released, it is released all at once when the request is
+ * reset or destroyed. Services can use it for their per request data.
+ \param req the ci_request_t object
+ \param size the size of memory to allocate
+ \return a pointer to the allocated memory, or NULL on failure
+ */
+CI_DECLARE_FUNC(void *)       ci_request_mem_alloc(ci_request_t *req, size_t size);
+
+/**
+ * Returns the memory allocator of the request memory arena
+ \param req the ci_request_t object
+ */
+CI_DECLARE_FUNC(ci_mem_allocator_t *) ci_request_mem_allocator(ci_request_t *req);
+
+/**
+ * Records the current time as the time the request reached a processing
+ * phase. Only the first call for each phase is recorded.
+ \param req the ci_request_t object
+ \param phase one of the ci_request_phase values
+ */
+CI_DECLARE_FUNC(void)         ci_request_phase_mark(ci_request_t *req, int phase);
+
+/**
+ * Returns the time in microseconds spent in a request processing phase,
+ * counted from the previous recorded phase, or -1 if the phase is not
+ * reached. For the CI_PHASE_ACCEPT phase the total request time is
+ * returned.
+ \param req the ci_request_t object
+ \param phase one of the ci_request_phase values
+ */
+CI_DECLARE_FUNC(int64_t)      ci_request_phase_time(const ci_request_t *req, int phase);
+
 CI_DECLARE_FUNC(int)          ci_request_206_origin_body(ci_request_t *req, uint64_t offset);
 
+/**
+ * Hands over a block of response body data to be sent to the ICAP client
+ * without copying it to the wbuf of the service io function. It can be
+ * called only from the service io function. Any data written to wbuf in
+ * the same call are sent before the block.
+ * The data must remain valid and unchanged until the service io function
+ * is called again with a non zero *wlen, or until the request is released.
+ \param req pointer to the related ci_request struct
+ \param data the body data
+ \param len the size of data
+ \return non zero on success, 0 if the block can not be queued, in which
+ *       case the service should copy the data to wbuf
+ */
+CI_DECLARE_FUNC(int)          ci_request_send_body_ref(ci_request_t *req, const char *data, int len);
+
+/**
+ * Like ci_request_send_body_ref but hands over len bytes of the file fd,
+ * starting at offset. The data are sent using sendfile where it is
+ * supported. The file must not be closed or modified at this range until
+ * the service io function is called again with a non zero *wlen, or
+ * until the request is released.
+ */
+CI_DECLARE_FUNC(int)          ci_request_send_body_file(ci_request_t *req, int fd, ci_off_t offset, int len);
+
+/**
+ * Hands over up to len bytes of the body, starting at its read position,
+ * to be sent using ci_request_send_body_file. It moves the read position
+ * of body like the ci_simple_file_read does.
+ \return the number of bytes handed over, CI_EOF if all of the body data
+ *       are read, or 0 if there are no available data or the data can not
+ *       be handed over and must be read using ci_simple_file_read.
+ */
+CI_DECLARE_FUNC(int)          ci_request_send_body_simple_file(ci_request_t *req, struct ci_simple_file *body, int len);
+
 /*ICAP client api*/
 CI_DECLARE_FUNC(ci_request_t *)  ci_client_request(ci_connection_t *conn,const char *server,const char *service);
 CI_DECLARE_FUNC(void)         ci_client_request_reuse(ci_request_t *req);
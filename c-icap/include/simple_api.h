@@ -435,6 +435,31 @@ CI_DECLARE_FUNC(ci_headers_list_t *) ci_http_response_headers(ci_request_t *req)
  */
 CI_DECLARE_FUNC(ci_headers_list_t *) ci_http_request_headers(ci_request_t *req);
 
+/**
+ \ingroup HTTP
+ \brief Returns the HTTP response headers for reading only.
+ *
+ * Unlike the ci_http_response_headers function the headers are not
+ * unpacked, they may still be in the form they were received, and they
+ * must not be modified. Use the
+ * functions which return the size of the found data (ci_headers_value2,
+ * ci_headers_search2, ci_headers_first_line2) or the ci_headers_iterate
+ * and ci_headers_copy_value functions to read them.
+ \param req is a pointer to the current ICAP request object.
+ \return Pointer to the HTTP response headers or NULL.
+ */
+CI_DECLARE_FUNC(ci_headers_list_t *) ci_http_response_headers_ro(ci_request_t *req);
+
+/**
+ \ingroup HTTP
+ \brief Returns the HTTP request headers for reading only.
+ *
+ * See the ci_http_response_headers_ro function.
+ \param req is a pointer to the current ICAP request object.
+ \return Pointer to the HTTP request headers or NULL.
+ */
+CI_DECLARE_FUNC(ci_headers_list_t *) ci_http_request_headers_ro(ci_request_t *req);
+
 /**
  \ingroup HTTP
  \brief Add a custom header to the HTTP response headers.
@@ -33,13 +33,29 @@ typedef struct kbs {
     unsigned int bytes;
 } kbs_t;
 
+/*
+  Log-linear histogram buckets: values up to 7 have their own bucket, the
+  larger values are split to 8 buckets for each power of two.
+*/
+#define STAT_HISTOGRAM_BUCKETS 496
+typedef struct stat_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STAT_HISTOGRAM_BUCKETS];
+} stat_histogram_t;
+
 #define MEMBLOCK_SIG 0xFAFA
 struct stat_memblock {
     unsigned int sig;
     int counters64_size;
     int counterskbs_size;
+    int gauges_size;
+    int histograms_size;
     uint64_t *counters64;
     kbs_t *counterskbs;
+    int64_t *gauges;
+    stat_histogram_t *histograms;
 };
 
 struct stat_area {
@@ -69,9 +85,11 @@ struct stat_groups_list {
 
 CI_DECLARE_DATA extern struct stat_entry_list STAT_INT64;
 CI_DECLARE_DATA extern struct stat_entry_list STAT_KBS;
+CI_DECLARE_DATA extern struct stat_entry_list STAT_GAUGES;
+CI_DECLARE_DATA extern struct stat_entry_list STAT_HISTOGRAMS;
 CI_DECLARE_DATA extern struct stat_groups_list STAT_GROUPS;
 
-enum ci_stat_type {STAT_INT64_T, STAT_KBS_T};
+enum ci_stat_type {STAT_INT64_T, STAT_KBS_T, STAT_GAUGE_T, STAT_HISTOGRAM_T};
 CI_DECLARE_DATA extern struct stat_area *STATS;
 
 CI_DECLARE_FUNC(int) ci_stat_memblock_size(void);
@@ -83,6 +101,13 @@ CI_DECLARE_FUNC(void) ci_stat_attach_mem(void *mem_block,
 CI_DECLARE_FUNC(void) ci_stat_release();
 CI_DECLARE_FUNC(void) ci_stat_uint64_inc(int ID, int count);
 CI_DECLARE_FUNC(void) ci_stat_kbs_inc(int ID, int count);
+CI_DECLARE_FUNC(void) ci_stat_kbs_add(int ID, uint64_t bytes);
+CI_DECLARE_FUNC(void) ci_stat_publish();
+CI_DECLARE_FUNC(void) ci_stat_gauge_set(int ID, int64_t value);
+CI_DECLARE_FUNC(void) ci_stat_gauge_add(int ID, int64_t count);
+CI_DECLARE_FUNC(void) ci_stat_histogram_add(int ID, uint64_t value);
+CI_DECLARE_FUNC(uint64_t) ci_stat_histogram_percentile(const stat_histogram_t *histogram, double percentile);
+CI_DECLARE_FUNC(void) ci_stat_histogram_diff(stat_histogram_t *diff, const stat_histogram_t *latest, const stat_histogram_t *oldest);
 
 /*Low level functions */
 CI_DECLARE_FUNC(struct stat_area *) ci_stat_area_construct(void *mem_block, int size, void (*release_mem)(void *));
@@ -96,6 +121,7 @@ CI_DECLARE_FUNC(void) ci_stat_memblock_reset(struct stat_memblock *block);
 /*DO NOT USE the folllowings are only for internal c-icap server use!*/
 CI_DECLARE_FUNC(void) stat_memblock_fix(struct stat_memblock *mem_block);
 CI_DECLARE_FUNC(void) stat_memblock_reconstruct(struct stat_memblock *mem_block);
+CI_DECLARE_FUNC(void) stat_memblock_view(struct stat_memblock *view, struct stat_memblock *mem_block);
 
 /*Private defines and functions*/
 #define STATS_LOCK() ci_thread_mutex_lock(&STATS->mtx)
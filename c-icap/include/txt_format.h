@@ -75,6 +75,40 @@ struct ci_fmt_entry {
 CI_DECLARE_FUNC(int) ci_format_text(ci_request_t *req_data, const char *fmt, char *buffer, int len,
                                     struct ci_fmt_entry *user_table);
 
+/**
+ * \brief A compiled format string
+ * \ingroup FORMATING
+ */
+typedef struct ci_fmt_program ci_fmt_program_t;
+
+/**
+ * \brief Compiles a format string to a list of literal text spans and
+ * formating directives, to be used with ci_format_program_run
+ * \ingroup FORMATING
+ * \param fmt The format string
+ * \param user_table An array of user defined directives
+ * \return The compiled format, or NULL on error
+ */
+CI_DECLARE_FUNC(ci_fmt_program_t *) ci_format_compile(const char *fmt, struct ci_fmt_entry *user_table);
+
+/**
+ * \brief Releases a compiled format
+ * \ingroup FORMATING
+ */
+CI_DECLARE_FUNC(void) ci_format_program_free(ci_fmt_program_t *prog);
+
+/**
+ * \brief Produces formated text based on a compiled format.
+ * \ingroup FORMATING
+ * \param req_data The current request
+ * \param prog The compiled format
+ * \param buffer The output buffer
+ * \param len The length of the output buffer
+ * \return The same as the ci_format_text
+ */
+CI_DECLARE_FUNC(int) ci_format_program_run(ci_request_t *req_data, const ci_fmt_program_t *prog,
+                                           char *buffer, int len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,6 +50,17 @@ CI_DECLARE_DATA extern const ci_type_ops_t  ci_regex_ops;
 #define ci_type_ops_is_string(tops) ((tops) == &ci_str_ops || (tops) == &ci_str_ext_ops)
 #endif
 
+/*IP networks radix trie, longest prefix match for ci_ip_t networks*/
+struct ci_ip;
+typedef struct ci_ip_trie ci_ip_trie_t;
+CI_DECLARE_FUNC(ci_ip_trie_t *) ci_ip_trie_create();
+CI_DECLARE_FUNC(void) ci_ip_trie_destroy(ci_ip_trie_t *trie);
+CI_DECLARE_FUNC(int) ci_ip_trie_add(ci_ip_trie_t *trie, const struct ci_ip *net, void *data);
+CI_DECLARE_FUNC(void *) ci_ip_trie_search(const ci_ip_trie_t *trie, int family, const void *addr);
+CI_DECLARE_FUNC(size_t) ci_ip_trie_size(const ci_ip_trie_t *trie);
+/*Returns the address and the family of a ci_ip_ops or ci_ip_sockaddr_ops
+  key, to use with ci_ip_trie_search*/
+CI_DECLARE_FUNC(const void *) ci_ip_key_address(const ci_type_ops_t *ops, const void *key, int *family);
 
 #ifdef __cplusplus
 }
@@ -34,6 +34,16 @@ CI_DECLARE_FUNC(void) ci_strtime_rfc822(char *buf);
 CI_DECLARE_FUNC(int)  ci_mktemp_file(char*dir,char *name_template,char *filename);
 CI_DECLARE_FUNC(int)  ci_usleep(unsigned long usec);
 
+/*Returns a monotonic clock value in microseconds. Only the difference
+  of two values is meaningful*/
+CI_DECLARE_FUNC(uint64_t) ci_clock_usec();
+
+/*Cheap, tick resolution clocks for timestamps and expiration checks.
+  ci_coarse_time returns the current time in seconds, ci_coarse_msec
+  a monotonic clock value in milliseconds.*/
+CI_DECLARE_FUNC(time_t) ci_coarse_time();
+CI_DECLARE_FUNC(uint64_t) ci_coarse_msec();
+
 
 #ifdef _WIN32
 CI_DECLARE_FUNC(int) mkstemp(char *filename);
@@ -47,6 +57,16 @@ CI_DECLARE_FUNC(const char *) ci_strncasestr(const char *s, const char *find, si
 
 CI_DECLARE_FUNC(const char *) ci_strcasestr(const char *str, const char *find);
 
+/*Scanning functions for the ICAP protocol parsers, using SIMD
+  instructions where they are supported*/
+CI_DECLARE_FUNC(const char *) ci_find_crlf(const char *s, size_t len);
+CI_DECLARE_FUNC(const char *) ci_find_crlfcrlf(const char *s, size_t len);
+CI_DECLARE_FUNC(const char *) ci_scan_impl();
+
+/*Parses the hex number at the beginning of s, without reading more than
+  len bytes. Returns 0 if there is not any hex digit or on overflow.*/
+CI_DECLARE_FUNC(int) ci_parse_hex(const char *s, size_t len, const char **end, int64_t *val);
+
 /*Handle M/m/k/K suffixes and try to detect errors*/
 CI_DECLARE_FUNC(long int) ci_atol_ext(const char *str, const char **error);
 
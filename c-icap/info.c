@@ -26,6 +26,7 @@
 #include "stats.h"
 #include "proc_threads_queues.h"
 #include "debug.h"
+#include <stdarg.h>
 
 int info_init_service(ci_service_xdata_t * srv_xdata,
                       struct ci_server_conf *server_conf);
@@ -58,6 +59,7 @@ CI_DECLARE_MOD_DATA ci_service_module_t info_service = {
 struct info_req_data {
     ci_membuf_t *body;
     int txt_mode;
+    int metrics_mode;
     int childs;
     int *child_pids;
     int free_servers;
@@ -74,6 +76,7 @@ extern struct childs_queue *childs_queue;
 extern ci_proc_mutex_t accept_mutex;
 
 int build_statistics(struct info_req_data *info_data);
+int build_metrics(struct info_req_data *info_data);
 
 int info_init_service(ci_service_xdata_t * srv_xdata,
                       struct ci_server_conf *server_conf)
@@ -104,9 +107,12 @@ void *info_init_request_data(ci_request_t * req)
     info_data->closed_childs = 0;
     info_data->crashed_childs = 0;
     info_data->txt_mode = 0;
+    info_data->metrics_mode = 0;
     if (req->args[0] != '\0') {
         if (strstr(req->args, "view=text"))
             info_data->txt_mode = 1;
+        else if (strstr(req->args, "view=metrics"))
+            info_data->metrics_mode = 1;
     }
 
     info_data->collect_stats = malloc(ci_stat_memblock_size());
@@ -151,11 +157,17 @@ int info_check_preview_handler(char *preview_data, int preview_data_len,
 
     ci_http_response_add_header(req, "HTTP/1.0 200 OK");
     ci_http_response_add_header(req, "Server: C-ICAP");
-    ci_http_response_add_header(req, "Content-Type: text/html");
+    if (info_data->metrics_mode)
+        ci_http_response_add_header(req, "Content-Type: text/plain; version=0.0.4");
+    else
+        ci_http_response_add_header(req, "Content-Type: text/html");
     ci_http_response_add_header(req, "Content-Language: en");
     ci_http_response_add_header(req, "Connection: close");
     if (info_data->body) {
-        build_statistics (info_data);
+        if (info_data->metrics_mode)
+            build_metrics(info_data);
+        else
+            build_statistics (info_data);
     }
 
     return CI_MOD_CONTINUE;
@@ -206,11 +218,7 @@ void fill_queue_statistics(struct childs_queue *q, struct info_req_data *info_da
             requests += q->childs[i].requests;
 
             stats = q->stats_area + i * (q->stats_block_size);
-            copy_stats.counters64_size = stats->counters64_size;
-            copy_stats.counterskbs_size = stats->counterskbs_size;
-            copy_stats.counters64 = (void *)stats + _CI_ALIGN(sizeof(struct stat_memblock));
-            copy_stats.counterskbs = (void *)stats + _CI_ALIGN(sizeof(struct stat_memblock))
-                                     + stats->counters64_size*sizeof(uint64_t);
+            stat_memblock_view(&copy_stats, stats);
 
             ci_stat_memblock_merge(info_data->collect_stats, &copy_stats);
         } else if (q->childs[i].pid != 0 && q->childs[i].to_be_killed) {
@@ -221,11 +229,7 @@ void fill_queue_statistics(struct childs_queue *q, struct info_req_data *info_da
     }
     /*Merge history data*/
     stats = q->stats_area + q->size * q->stats_block_size;
-    copy_stats.counters64_size = stats->counters64_size;
-    copy_stats.counterskbs_size = stats->counterskbs_size;
-    copy_stats.counters64 = (void *)stats + _CI_ALIGN(sizeof(struct stat_memblock));
-    copy_stats.counterskbs = (void *)stats + _CI_ALIGN(sizeof(struct stat_memblock))
-                             + stats->counters64_size*sizeof(uint64_t);
+    stat_memblock_view(&copy_stats, stats);
 
     ci_stat_memblock_merge(info_data->collect_stats, &copy_stats);
 
@@ -250,6 +254,8 @@ struct stats_tmpl {
     char *d1TableEnd_tmpl;
     char *statline_tmpl_int;
     char *statline_tmpl_kbs;
+    char *statline_tmpl_gauge;
+    char *statline_tmpl_histogram;
 };
 
 struct stats_tmpl txt_tmpl = {
@@ -268,7 +274,9 @@ struct stats_tmpl txt_tmpl = {
     "\t %s\n",
     "\n\n",
     "%s : %lld\n",
-    "%s : %lld Kbs %d bytes\n"
+    "%s : %lld Kbs %d bytes\n",
+    "%s : %lld\n",
+    "%s : count %llu, avg %llu, p50 %llu, p90 %llu, p99 %llu, max %llu\n"
 };
 
 struct stats_tmpl html_tmpl = {
@@ -292,7 +300,9 @@ struct stats_tmpl html_tmpl = {
     "<TR><TD>%s</TD></TR>\n",
     "</TABLE>\n",
     "<TR><TH>%s:</TH><TD>  %lld</TD>\n",
-    "<TR><TH>%s:</TH><TD>  %lld Kbs %d bytes</TD>\n"
+    "<TR><TH>%s:</TH><TD>  %lld Kbs %d bytes</TD>\n",
+    "<TR><TH>%s:</TH><TD>  %lld</TD>\n",
+    "<TR><TH>%s:</TH><TD>  count %llu, avg %llu, p50 %llu, p90 %llu, p99 %llu, max %llu</TD>\n"
 };
 
 #define LOCAL_BUF_SIZE 1024
@@ -303,6 +313,7 @@ int build_statistics(struct info_req_data *info_data)
     int sz, gid, k;
     char *stat_group;
     struct stats_tmpl *tmpl;
+    stat_histogram_t *histogram;
 
     if (info_data->txt_mode)
         tmpl = &txt_tmpl;
@@ -312,6 +323,8 @@ int build_statistics(struct info_req_data *info_data)
     if (!info_data->body)
         return 0;
 
+    /*The other children publish their counters every second*/
+    ci_stat_publish();
     fill_queue_statistics(childs_queue, info_data);
 
     sz = snprintf(buf, LOCAL_BUF_SIZE,tmpl->gen_template,
@@ -408,6 +421,34 @@ int build_statistics(struct info_req_data *info_data)
                 ci_membuf_write(info_data->body,buf, sz, 0);
             }
         }
+
+        for (k = 0; k < info_data->collect_stats->gauges_size && k < STAT_GAUGES.entries_num; k++) {
+            if (gid == STAT_GAUGES.entries[k].gid) {
+                sz = snprintf(buf, LOCAL_BUF_SIZE, tmpl->statline_tmpl_gauge,
+                              STAT_GAUGES.entries[k].label,
+                              (long long)info_data->collect_stats->gauges[k]);
+                if (sz > LOCAL_BUF_SIZE)
+                    sz = LOCAL_BUF_SIZE;
+                ci_membuf_write(info_data->body,buf, sz, 0);
+            }
+        }
+
+        for (k = 0; k < info_data->collect_stats->histograms_size && k < STAT_HISTOGRAMS.entries_num; k++) {
+            if (gid == STAT_HISTOGRAMS.entries[k].gid) {
+                histogram = &info_data->collect_stats->histograms[k];
+                sz = snprintf(buf, LOCAL_BUF_SIZE, tmpl->statline_tmpl_histogram,
+                              STAT_HISTOGRAMS.entries[k].label,
+                              (unsigned long long)histogram->count,
+                              (unsigned long long)(histogram->count ? histogram->sum / histogram->count : 0),
+                              (unsigned long long)ci_stat_histogram_percentile(histogram, 50),
+                              (unsigned long long)ci_stat_histogram_percentile(histogram, 90),
+                              (unsigned long long)ci_stat_histogram_percentile(histogram, 99),
+                              (unsigned long long)histogram->max);
+                if (sz > LOCAL_BUF_SIZE)
+                    sz = LOCAL_BUF_SIZE;
+                ci_membuf_write(info_data->body,buf, sz, 0);
+            }
+        }
         ci_membuf_write(info_data->body,tmpl->statsEnd, strlen(tmpl->statsEnd), 0);
     }
     ci_membuf_write(info_data->body, NULL, 0, 1);
@@ -415,3 +456,204 @@ int build_statistics(struct info_req_data *info_data)
     return 1;
 }
 
+/*Prometheus text format output*/
+static void metrics_printf(struct info_req_data *info_data, const char *format, ...)
+{
+    char buf[LOCAL_BUF_SIZE];
+    va_list ap;
+    int sz;
+
+    va_start(ap, format);
+    sz = vsnprintf(buf, LOCAL_BUF_SIZE, format, ap);
+    va_end(ap);
+    if (sz > LOCAL_BUF_SIZE - 1)
+        sz = LOCAL_BUF_SIZE - 1;
+    if (sz > 0)
+        ci_membuf_write(info_data->body, buf, sz, 0);
+}
+
+static const char *metrics_label(const char *value, char *buf, int size)
+{
+    int i = 0;
+    for (; *value != '\0' && i < size - 2; value++) {
+        if (*value == '\\' || *value == '"') {
+            buf[i++] = '\\';
+            buf[i++] = *value;
+        } else if (*value == '\n') {
+            buf[i++] = '\\';
+            buf[i++] = 'n';
+        } else
+            buf[i++] = *value;
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+static uint64_t kbs_bytes(const kbs_t *kbs)
+{
+    return (kbs->kb << 10) + kbs->bytes;
+}
+
+static const double METRICS_QUANTILES[] = {50, 90, 99};
+#define METRICS_QUANTILES_NUM (sizeof(METRICS_QUANTILES) / sizeof(METRICS_QUANTILES[0]))
+
+static const struct {
+    const char *name;
+    int seconds;
+} METRICS_WINDOWS[] = {
+    {"1s", 1},
+    {"1m", 60},
+    {"1h", 3600}
+};
+#define METRICS_WINDOWS_NUM (sizeof(METRICS_WINDOWS) / sizeof(METRICS_WINDOWS[0]))
+
+static void metrics_entry_labels(const struct stat_entry *entry, char *buf, int size)
+{
+    char group[256], name[256];
+    snprintf(buf, size, "group=\"%s\",name=\"%s\"",
+             metrics_label(STAT_GROUPS.groups[entry->gid], group, sizeof(group)),
+             metrics_label(entry->label, name, sizeof(name)));
+}
+
+static void build_metrics_windows(struct info_req_data *info_data)
+{
+    struct stat_memblock latest[METRICS_WINDOWS_NUM], oldest[METRICS_WINDOWS_NUM];
+    int interval[METRICS_WINDOWS_NUM];
+    stat_histogram_t diff;
+    char labels[600];
+    int w, k, q;
+
+    for (w = 0; w < METRICS_WINDOWS_NUM; w++)
+        interval[w] = childs_queue_stats_window(childs_queue, METRICS_WINDOWS[w].seconds, &latest[w], &oldest[w]);
+
+    metrics_printf(info_data, "# TYPE c_icap_counter_rate gauge\n");
+    for (k = 0; k < STAT_INT64.entries_num; k++) {
+        metrics_entry_labels(&STAT_INT64.entries[k], labels, sizeof(labels));
+        for (w = 0; w < METRICS_WINDOWS_NUM; w++) {
+            if (!interval[w] || k >= latest[w].counters64_size || k >= oldest[w].counters64_size)
+                continue;
+            metrics_printf(info_data, "c_icap_counter_rate{%s,window=\"%s\"} %.3f\n",
+                           labels, METRICS_WINDOWS[w].name,
+                           (double)(latest[w].counters64[k] - oldest[w].counters64[k]) / interval[w]);
+        }
+    }
+
+    metrics_printf(info_data, "# TYPE c_icap_bytes_rate gauge\n");
+    for (k = 0; k < STAT_KBS.entries_num; k++) {
+        metrics_entry_labels(&STAT_KBS.entries[k], labels, sizeof(labels));
+        for (w = 0; w < METRICS_WINDOWS_NUM; w++) {
+            if (!interval[w] || k >= latest[w].counterskbs_size || k >= oldest[w].counterskbs_size)
+                continue;
+            metrics_printf(info_data, "c_icap_bytes_rate{%s,window=\"%s\"} %.3f\n",
+                           labels, METRICS_WINDOWS[w].name,
+                           (double)(kbs_bytes(&latest[w].counterskbs[k]) - kbs_bytes(&oldest[w].counterskbs[k])) / interval[w]);
+        }
+    }
+
+    metrics_printf(info_data, "# TYPE c_icap_histogram_window gauge\n");
+    for (k = 0; k < STAT_HISTOGRAMS.entries_num; k++) {
+        metrics_entry_labels(&STAT_HISTOGRAMS.entries[k], labels, sizeof(labels));
+        for (w = 0; w < METRICS_WINDOWS_NUM; w++) {
+            if (!interval[w] || k >= latest[w].histograms_size || k >= oldest[w].histograms_size)
+                continue;
+            ci_stat_histogram_diff(&diff, &latest[w].histograms[k], &oldest[w].histograms[k]);
+            for (q = 0; q < METRICS_QUANTILES_NUM; q++)
+                metrics_printf(info_data, "c_icap_histogram_window{%s,window=\"%s\",quantile=\"%g\"} %llu\n",
+                               labels, METRICS_WINDOWS[w].name, METRICS_QUANTILES[q] / 100,
+                               (unsigned long long)ci_stat_histogram_percentile(&diff, METRICS_QUANTILES[q]));
+        }
+    }
+
+    /*The lines of a metric must be grouped together*/
+    metrics_printf(info_data, "# TYPE c_icap_histogram_window_count gauge\n");
+    for (k = 0; k < STAT_HISTOGRAMS.entries_num; k++) {
+        metrics_entry_labels(&STAT_HISTOGRAMS.entries[k], labels, sizeof(labels));
+        for (w = 0; w < METRICS_WINDOWS_NUM; w++) {
+            if (!interval[w] || k >= latest[w].histograms_size || k >= oldest[w].histograms_size)
+                continue;
+            metrics_printf(info_data, "c_icap_histogram_window_count{%s,window=\"%s\"} %llu\n",
+                           labels, METRICS_WINDOWS[w].name,
+                           (unsigned long long)(latest[w].histograms[k].count - oldest[w].histograms[k].count));
+        }
+    }
+}
+
+int build_metrics(struct info_req_data *info_data)
+{
+    struct stat_memblock *stats = info_data->collect_stats;
+    stat_histogram_t *histogram;
+    char labels[600];
+    int i, k, q;
+
+    if (!info_data->body)
+        return 0;
+
+    ci_stat_publish();
+    fill_queue_statistics(childs_queue, info_data);
+
+    metrics_printf(info_data, "# TYPE c_icap_children gauge\nc_icap_children %d\n", info_data->childs);
+    metrics_printf(info_data, "# TYPE c_icap_closing_children gauge\nc_icap_closing_children %u\n", info_data->closing_childs);
+    metrics_printf(info_data, "# TYPE c_icap_free_servers gauge\nc_icap_free_servers %d\n", info_data->free_servers);
+    metrics_printf(info_data, "# TYPE c_icap_used_servers gauge\nc_icap_used_servers %d\n", info_data->used_servers);
+    metrics_printf(info_data, "# TYPE c_icap_started_children_total counter\nc_icap_started_children_total %u\n", info_data->started_childs);
+    metrics_printf(info_data, "# TYPE c_icap_closed_children_total counter\nc_icap_closed_children_total %u\n", info_data->closed_childs);
+    metrics_printf(info_data, "# TYPE c_icap_crashed_children_total counter\nc_icap_crashed_children_total %u\n", info_data->crashed_childs);
+
+    if (childs_queue->childs) {
+        metrics_printf(info_data, "# TYPE c_icap_child_free_servers gauge\n");
+        for (i = 0; i < childs_queue->size; i++) {
+            if (childs_queue->childs[i].pid != 0)
+                metrics_printf(info_data, "c_icap_child_free_servers{pid=\"%d\"} %d\n",
+                               (int)childs_queue->childs[i].pid, childs_queue->childs[i].freeservers);
+        }
+        metrics_printf(info_data, "# TYPE c_icap_child_used_servers gauge\n");
+        for (i = 0; i < childs_queue->size; i++) {
+            if (childs_queue->childs[i].pid != 0)
+                metrics_printf(info_data, "c_icap_child_used_servers{pid=\"%d\"} %d\n",
+                               (int)childs_queue->childs[i].pid, childs_queue->childs[i].usedservers);
+        }
+        metrics_printf(info_data, "# TYPE c_icap_child_requests_total counter\n");
+        for (i = 0; i < childs_queue->size; i++) {
+            if (childs_queue->childs[i].pid != 0)
+                metrics_printf(info_data, "c_icap_child_requests_total{pid=\"%d\"} %d\n",
+                               (int)childs_queue->childs[i].pid, childs_queue->childs[i].requests);
+        }
+    }
+
+    metrics_printf(info_data, "# TYPE c_icap_counter_total counter\n");
+    for (k = 0; k < stats->counters64_size && k < STAT_INT64.entries_num; k++) {
+        metrics_entry_labels(&STAT_INT64.entries[k], labels, sizeof(labels));
+        metrics_printf(info_data, "c_icap_counter_total{%s} %llu\n", labels,
+                       (unsigned long long)stats->counters64[k]);
+    }
+
+    metrics_printf(info_data, "# TYPE c_icap_bytes_total counter\n");
+    for (k = 0; k < stats->counterskbs_size && k < STAT_KBS.entries_num; k++) {
+        metrics_entry_labels(&STAT_KBS.entries[k], labels, sizeof(labels));
+        metrics_printf(info_data, "c_icap_bytes_total{%s} %llu\n", labels,
+                       (unsigned long long)kbs_bytes(&stats->counterskbs[k]));
+    }
+
+    metrics_printf(info_data, "# TYPE c_icap_gauge gauge\n");
+    for (k = 0; k < stats->gauges_size && k < STAT_GAUGES.entries_num; k++) {
+        metrics_entry_labels(&STAT_GAUGES.entries[k], labels, sizeof(labels));
+        metrics_printf(info_data, "c_icap_gauge{%s} %lld\n", labels,
+                       (long long)stats->gauges[k]);
+    }
+
+    metrics_printf(info_data, "# TYPE c_icap_histogram summary\n");
+    for (k = 0; k < stats->histograms_size && k < STAT_HISTOGRAMS.entries_num; k++) {
+        metrics_entry_labels(&STAT_HISTOGRAMS.entries[k], labels, sizeof(labels));
+        histogram = &stats->histograms[k];
+        for (q = 0; q < METRICS_QUANTILES_NUM; q++)
+            metrics_printf(info_data, "c_icap_histogram{%s,quantile=\"%g\"} %llu\n", labels,
+                           METRICS_QUANTILES[q] / 100,
+                           (unsigned long long)ci_stat_histogram_percentile(histogram, METRICS_QUANTILES[q]));
+        metrics_printf(info_data, "c_icap_histogram_sum{%s} %llu\n", labels, (unsigned long long)histogram->sum);
+        metrics_printf(info_data, "c_icap_histogram_count{%s} %llu\n", labels, (unsigned long long)histogram->count);
+    }
+
+    build_metrics_windows(info_data);
+    ci_membuf_write(info_data->body, NULL, 0, 1);
+    return 1;
+}
@@ -34,6 +34,10 @@
 #include "commands.h"
 #include <errno.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/uio.h>
+#endif
 
 logger_module_t *default_logger = NULL;
 
@@ -109,6 +113,7 @@ void vlog_server(ci_request_t * req, const char *format, va_list ap)
 struct logformat {
     char *name;
     char *fmt;
+    ci_fmt_program_t *prog;
     struct logformat *next;
 };
 
@@ -127,6 +132,15 @@ int logformat_add(const char *name, const char *format)
 
     if (!lf->name || !lf->fmt) {
         ci_debug_printf(1, "Error strduping in add_logformat\n");
+        free(lf->name);
+        free(lf->fmt);
+        free(lf);
+        return 0;
+    }
+
+    if (!(lf->prog = ci_format_compile(lf->fmt, NULL))) {
+        free(lf->name);
+        free(lf->fmt);
         free(lf);
         return 0;
     }
@@ -155,6 +169,7 @@ void logformat_release()
         tmp = tmp->next;
         free(cur->name);
         free(cur->fmt);
+        ci_format_program_free(cur->prog);
         free(cur);
     } while (tmp);
     LOGFORMATS = NULL;
@@ -174,6 +189,16 @@ char *logformat_fmt(const char *name)
     return NULL;
 }
 
+ci_fmt_program_t *logformat_program(const char *name)
+{
+    struct logformat *tmp;
+    for (tmp = LOGFORMATS; tmp != NULL; tmp = tmp->next) {
+        if (strcmp(tmp->name, name) == 0)
+            return tmp->prog;
+    }
+    return NULL;
+}
+
 
 /******************************************************************/
 /*  file_logger implementation. This is the default logger        */
@@ -189,12 +214,54 @@ void file_log_relog(const char *name, int type, const char **argv);
 char *SERVER_LOG_FILE = LOGDIR "/cicap-server.log";
 /*char *ACCESS_LOG_FILE = LOGDIR "/cicap-access.log";*/
 
+/*Asynchronous logging. The log lines are copied into queues of memory
+  blocks, one queue per log file, and a writer thread writes the queued
+  blocks to the log files using writev. The LOG_QUEUE_SIZE is the maximum
+  memory used by the queued blocks of all log files. When the queues are
+  full, the log lines are dropped if LOG_QUEUE_DROP is set, else the
+  logging threads wait for the writer. Setting LOG_QUEUE_SIZE to 0
+  disables queuing and the log lines are written directly.*/
+#define LOG_BLOCK_SIZE 16384
+#define LOG_WRITEV_MAX 64
+long int LOG_QUEUE_SIZE = 1048576;
+int LOG_QUEUE_DROP = 0;
+
+struct log_block {
+    struct log_block *next;
+    size_t used;
+    char data[LOG_BLOCK_SIZE];
+};
+
+struct log_queue {
+    struct log_block *head;
+    struct log_block *tail;
+    struct log_block *writing; /*The blocks the writer is writing now*/
+    uint64_t dropped;
+};
+
+static ci_thread_mutex_t LOG_QUEUE_MTX;
+static ci_thread_cond_t LOG_WRITER_COND; /*Wakes up the writer*/
+static ci_thread_cond_t LOG_SPACE_COND;  /*Signaled when the writer done*/
+static ci_thread_t LOG_WRITER;
+static int LOG_QUEUE_INIT = 0;
+static int LOG_QUEUE_ENABLED = 0;
+static int LOG_WRITER_RUNNING = 0;
+static int LOG_WRITER_BUSY = 0;
+static int LOG_WRITER_STOP = 0;
+static int LOG_QUEUED = 0;     /*Blocks waiting to be written*/
+static int LOG_BLOCKS = 0;     /*Allocated blocks*/
+static int LOG_BLOCKS_MAX = 0;
+static struct log_block *LOG_FREE_BLOCKS = NULL;
+static struct log_queue SERVER_LOG_QUEUE;
+
 struct logfile {
     char *file;
     FILE *access_log;
     const char *log_fmt;
+    const ci_fmt_program_t *log_prog;
     ci_access_entry_t *access_list;
     ci_thread_rwlock_t rwlock;
+    struct log_queue queue;
     struct logfile *next;
 };
 struct logfile *ACCESS_LOG_FILES = NULL;
@@ -215,6 +282,7 @@ logger_module_t file_logger = {
 FILE *server_log = NULL;
 
 const char *DEFAULT_LOG_FORMAT = "%tl, %la %a %im %iu %is";
+static ci_fmt_program_t *DEFAULT_LOG_PROGRAM = NULL;
 
 FILE *logfile_open(const char *fname)
 {
@@ -224,6 +292,346 @@ FILE *logfile_open(const char *fname)
     return f;
 }
 
+static void logfile_write(FILE *f, ci_thread_rwlock_t *lock, const char *line, size_t len)
+{
+    ci_thread_rwlock_rdlock(lock); /*obtain a read lock*/
+    if (f && len)
+        fwrite(line, 1, len, f);
+    ci_thread_rwlock_unlock(lock); /*release a read lock*/
+}
+
+static void logfile_writev(FILE **f, ci_thread_rwlock_t *lock, struct log_block *blocks)
+{
+    struct log_block *b;
+#ifndef _WIN32
+    struct iovec iov[LOG_WRITEV_MAX];
+    int i, n;
+    ssize_t ret;
+#endif
+
+    ci_thread_rwlock_rdlock(lock); /*obtain a read lock*/
+    if (!*f) {
+        ci_thread_rwlock_unlock(lock);
+        return;
+    }
+#ifndef _WIN32
+    for (b = blocks; b != NULL;) {
+        for (n = 0; b != NULL && n < LOG_WRITEV_MAX; b = b->next, n++) {
+            iov[n].iov_base = b->data;
+            iov[n].iov_len = b->used;
+        }
+        i = 0;
+        while (i < n) {
+            do {
+                ret = writev(fileno(*f), iov + i, n - i);
+            } while (ret < 0 && errno == EINTR);
+            if (ret < 0)
+                break; /*Nothing we can do, the lines are lost*/
+            /*Partial write, skip the written data*/
+            for (; i < n && (size_t)ret >= iov[i].iov_len; i++)
+                ret -= iov[i].iov_len;
+            if (i < n) {
+                iov[i].iov_base = (char *)iov[i].iov_base + ret;
+                iov[i].iov_len -= ret;
+            }
+        }
+    }
+#else
+    for (b = blocks; b != NULL; b = b->next)
+        fwrite(b->data, 1, b->used, *f);
+#endif
+    ci_thread_rwlock_unlock(lock); /*release a read lock*/
+}
+
+/*Must called with LOG_QUEUE_MTX locked*/
+static struct log_block *log_block_get()
+{
+    struct log_block *b;
+    while (!(b = LOG_FREE_BLOCKS) && LOG_BLOCKS >= LOG_BLOCKS_MAX) {
+        if (LOG_QUEUE_DROP || !LOG_WRITER_RUNNING)
+            return NULL;
+        /*Wait for the writer to release some blocks*/
+        ci_thread_cond_signal(&LOG_WRITER_COND);
+        ci_thread_cond_wait(&LOG_SPACE_COND, &LOG_QUEUE_MTX);
+    }
+
+    if (b)
+        LOG_FREE_BLOCKS = b->next;
+    else if ((b = malloc(sizeof(struct log_block))) != NULL)
+        LOG_BLOCKS++;
+    else
+        return NULL;
+
+    b->next = NULL;
+    b->used = 0;
+    return b;
+}
+
+/*Must called with LOG_QUEUE_MTX locked*/
+static void log_blocks_release(struct log_block *blocks)
+{
+    struct log_block *b;
+    while ((b = blocks) != NULL) {
+        blocks = b->next;
+        b->next = LOG_FREE_BLOCKS;
+        LOG_FREE_BLOCKS = b;
+    }
+}
+
+static void log_queue_take(struct log_queue *q)
+{
+    q->writing = q->head;
+    q->head = q->tail = NULL;
+}
+
+static void log_queue_reset(struct log_queue *q)
+{
+    log_blocks_release(q->head);
+    log_blocks_release(q->writing);
+    q->head = q->tail = q->writing = NULL;
+}
+
+static void *log_writer(void *arg)
+{
+    struct logfile *lf;
+    uint64_t dropped;
+    char buf[STR_TIME_SIZE];
+#ifndef _WIN32
+    sigset_t sig_mask;
+
+    /*The signals are handled by the other threads*/
+    sigfillset(&sig_mask);
+    pthread_sigmask(SIG_BLOCK, &sig_mask, NULL);
+#endif
+
+    ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+    while (1) {
+        while (!LOG_QUEUED && !LOG_WRITER_STOP)
+            ci_thread_cond_wait(&LOG_WRITER_COND, &LOG_QUEUE_MTX);
+        if (!LOG_QUEUED)
+            break;
+
+        /*Take all queued blocks and write them without holding the lock*/
+        dropped = SERVER_LOG_QUEUE.dropped;
+        SERVER_LOG_QUEUE.dropped = 0;
+        log_queue_take(&SERVER_LOG_QUEUE);
+        for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next) {
+            dropped += lf->queue.dropped;
+            lf->queue.dropped = 0;
+            log_queue_take(&lf->queue);
+        }
+        LOG_QUEUED = 0;
+        LOG_WRITER_BUSY = 1;
+        ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+
+        for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next) {
+            if (lf->queue.writing)
+                logfile_writev(&lf->access_log, &lf->rwlock, lf->queue.writing);
+        }
+        if (SERVER_LOG_QUEUE.writing)
+            logfile_writev(&server_log, &systemlog_rwlock, SERVER_LOG_QUEUE.writing);
+        if (dropped) {
+            ci_strtime(buf);
+            ci_thread_rwlock_rdlock(&systemlog_rwlock);
+            if (server_log)
+                fprintf(server_log, "%s, %u, log queue full, %" PRIu64 " log lines dropped\n", buf, (unsigned int)MY_PROC_PID, dropped);
+            ci_thread_rwlock_unlock(&systemlog_rwlock);
+        }
+
+        ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+        log_queue_reset(&SERVER_LOG_QUEUE);
+        for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next)
+            log_queue_reset(&lf->queue);
+        LOG_WRITER_BUSY = 0;
+        ci_thread_cond_broadcast(&LOG_SPACE_COND);
+    }
+    ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+    return NULL;
+}
+
+/*Must called with LOG_QUEUE_MTX locked*/
+static int log_writer_start()
+{
+    if (LOG_WRITER_RUNNING)
+        return 1;
+    if (ci_thread_create(&LOG_WRITER, log_writer, NULL) != 0)
+        return 0;
+    LOG_WRITER_RUNNING = 1;
+    return 1;
+}
+
+static void log_writer_stop()
+{
+    struct log_block *b;
+    ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+    if (LOG_WRITER_RUNNING) {
+        /*The writer writes all queued lines before exit*/
+        LOG_WRITER_STOP = 1;
+        ci_thread_cond_signal(&LOG_WRITER_COND);
+        ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+        ci_thread_join(LOG_WRITER);
+        ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+        LOG_WRITER_RUNNING = 0;
+        LOG_WRITER_STOP = 0;
+        ci_thread_cond_broadcast(&LOG_SPACE_COND);
+    }
+    while ((b = LOG_FREE_BLOCKS) != NULL) {
+        LOG_FREE_BLOCKS = b->next;
+        free(b);
+        LOG_BLOCKS--;
+    }
+    ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+}
+
+/*Waits until the queued log lines are written*/
+static void log_queue_flush()
+{
+    ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+    while (LOG_WRITER_RUNNING && (LOG_QUEUED || LOG_WRITER_BUSY)) {
+        ci_thread_cond_signal(&LOG_WRITER_COND);
+        ci_thread_cond_wait(&LOG_SPACE_COND, &LOG_QUEUE_MTX);
+    }
+    ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+}
+
+/*Appends a log line to a log queue. Returns 0 if the line is not
+  queued and must be written directly.*/
+static int log_queue_append(struct log_queue *q, const char *line, size_t len)
+{
+    struct log_block *b;
+
+    if (!LOG_QUEUE_ENABLED || len > LOG_BLOCK_SIZE)
+        return 0;
+
+    ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+    if (!LOG_WRITER_RUNNING && !log_writer_start()) {
+        ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+        return 0;
+    }
+
+    /*Do not split lines between blocks, the blocks may be written with
+      different writev calls*/
+    if (!(b = q->tail) || LOG_BLOCK_SIZE - b->used < len) {
+        if (!(b = log_block_get())) {
+            q->dropped++;
+            ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+            return 1;
+        }
+        if (q->tail)
+            q->tail->next = b;
+        else
+            q->head = b;
+        q->tail = b;
+        LOG_QUEUED++;
+    }
+    memcpy(b->data + b->used, line, len);
+    b->used += len;
+    if (!LOG_WRITER_BUSY)
+        ci_thread_cond_signal(&LOG_WRITER_COND);
+    ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+    return 1;
+}
+
+#ifndef _WIN32
+/*A forked child process does not have the writer thread. The parent
+  process writes the queued lines, the child just forgets them.*/
+static void log_atfork_prepare()
+{
+    ci_thread_mutex_lock(&LOG_QUEUE_MTX);
+    /*The writer must not hold the log file locks while forking*/
+    while (LOG_WRITER_BUSY)
+        ci_thread_cond_wait(&LOG_SPACE_COND, &LOG_QUEUE_MTX);
+}
+
+static void log_atfork_parent()
+{
+    ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+}
+
+static void log_atfork_child()
+{
+    struct logfile *lf;
+    log_queue_reset(&SERVER_LOG_QUEUE);
+    for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next)
+        log_queue_reset(&lf->queue);
+    LOG_QUEUED = 0;
+    LOG_WRITER_RUNNING = 0;
+    LOG_WRITER_STOP = 0;
+    ci_thread_cond_init(&LOG_WRITER_COND);
+    ci_thread_cond_init(&LOG_SPACE_COND);
+    ci_thread_mutex_unlock(&LOG_QUEUE_MTX);
+}
+#endif
+
+/*Do not lose the queued lines if the process exits without closing
+  the logs, eg on fatal errors*/
+static void log_queue_exit()
+{
+    log_writer_stop();
+}
+
+#ifndef _WIN32
+static void log_blocks_write_fatal(FILE *f, struct log_block *blocks)
+{
+    struct log_block *b;
+    if (!f)
+        return;
+    for (b = blocks; b != NULL; b = b->next) {
+        if (write(fileno(f), b->data, b->used) < 0)
+            return;
+    }
+}
+
+/*A process killed by a fatal signal does not run the atexit handlers.
+  Write the lines still in the queues, usually the last server log lines
+  explaining the failure. The locks are not used, they may be held by
+  the failed thread. The lines taken by a busy writer may be lost.*/
+static void log_fatal_signal(int sig)
+{
+    struct logfile *lf;
+    if (LOG_WRITER_RUNNING) {
+        for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next)
+            log_blocks_write_fatal(lf->access_log, lf->queue.head);
+        log_blocks_write_fatal(server_log, SERVER_LOG_QUEUE.head);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void log_fatal_signals()
+{
+    const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, 0};
+    void (*old)(int);
+    int i;
+    for (i = 0; signals[i] != 0; i++) {
+        /*Do not replace the handlers installed by others*/
+        old = signal(signals[i], log_fatal_signal);
+        if (old != SIG_DFL && old != log_fatal_signal)
+            signal(signals[i], old);
+    }
+}
+#endif
+
+static void log_queue_init()
+{
+    if (!LOG_QUEUE_INIT) {
+        ci_thread_mutex_init(&LOG_QUEUE_MTX);
+        ci_thread_cond_init(&LOG_WRITER_COND);
+        ci_thread_cond_init(&LOG_SPACE_COND);
+#ifndef _WIN32
+        pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+        log_fatal_signals();
+#endif
+        atexit(log_queue_exit);
+        LOG_QUEUE_INIT = 1;
+    }
+    memset(&SERVER_LOG_QUEUE, 0, sizeof(struct log_queue));
+    LOG_BLOCKS_MAX = LOG_QUEUE_SIZE > 0 ? LOG_QUEUE_SIZE / LOG_BLOCK_SIZE : 0;
+    if (LOG_QUEUE_SIZE > 0 && LOG_BLOCKS_MAX < 2)
+        LOG_BLOCKS_MAX = 2;
+    LOG_QUEUE_ENABLED = (LOG_BLOCKS_MAX > 0);
+}
+
 int file_log_open()
 {
     int error = 0, ret = 0;
@@ -231,6 +639,7 @@ int file_log_open()
 
     assert(ret == 0);
     register_command("relog", MONITOR_PROC_CMD | CHILDS_PROC_CMD, file_log_relog);
+    log_queue_init();
 
     for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next) {
         if (!lf->file) {
@@ -239,6 +648,11 @@ int file_log_open()
         }
         if (lf->log_fmt == NULL)
             lf->log_fmt = (char *)DEFAULT_LOG_FORMAT;
+        if (lf->log_prog == NULL) {
+            if (!DEFAULT_LOG_PROGRAM)
+                DEFAULT_LOG_PROGRAM = ci_format_compile(DEFAULT_LOG_FORMAT, NULL);
+            lf->log_prog = DEFAULT_LOG_PROGRAM;
+        }
 
         if (ci_thread_rwlock_init(&(lf->rwlock)) != 0) {
             ci_debug_printf (1, "WARNING! Can not initialize structures for log file: %s\n", lf->file);
@@ -269,6 +683,11 @@ void file_log_close()
 {
     struct logfile *lf, *tmp;
 
+    /*Write the queued lines and stop the writer*/
+    if (LOG_QUEUE_INIT)
+        log_writer_stop();
+    LOG_QUEUE_ENABLED = 0;
+
     lf = ACCESS_LOG_FILES;
     while (lf != NULL) {
         if (lf->access_log)
@@ -283,6 +702,10 @@ void file_log_close()
         free(tmp);
     }
 
+    if (DEFAULT_LOG_PROGRAM)
+        ci_format_program_free(DEFAULT_LOG_PROGRAM);
+    DEFAULT_LOG_PROGRAM = NULL;
+
     if (server_log)
         fclose(server_log);
     server_log = NULL;
@@ -293,6 +716,10 @@ void file_log_relog(const char *name, int type, const char **argv)
 {
     struct logfile *lf;
 
+    /*Write the queued lines to the old files*/
+    if (LOG_QUEUE_INIT)
+        log_queue_flush();
+
     /* This code should match the appropriate code from file_log_close */
     for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next) {
         ci_thread_rwlock_wrlock(&(lf->rwlock)); /*obtain a write lock. When this function returns all file_log_access will block until write unlock*/
@@ -317,6 +744,7 @@ void file_log_access(ci_request_t *req)
 {
     struct logfile *lf;
     char logline[4096];
+    size_t len;
 
     for (lf = ACCESS_LOG_FILES; lf != NULL; lf = lf->next) {
         if (lf->access_list && !(ci_access_entry_match_request(lf->access_list, req) == CI_ACCESS_ALLOW)) {
@@ -324,36 +752,51 @@ void file_log_access(ci_request_t *req)
             continue;
         }
         ci_debug_printf(6, "Log request to access log file %s\n", lf->file);
-        ci_format_text(req, lf->log_fmt, logline, sizeof(logline), NULL);
-
-        ci_thread_rwlock_rdlock(&lf->rwlock); /*obtain a read lock*/
-        if (lf->access_log)
-            fprintf(lf->access_log,"%s\n", logline);
-        ci_thread_rwlock_unlock(&lf->rwlock); /*obtain a read lock*/
+        if (lf->log_prog)
+            ci_format_program_run(req, lf->log_prog, logline, sizeof(logline) - 1);
+        else
+            ci_format_text(req, lf->log_fmt, logline, sizeof(logline) - 1, NULL);
+        len = strlen(logline);
+        logline[len++] = '\n';
+
+        if (!log_queue_append(&lf->queue, logline, len))
+            logfile_write(lf->access_log, &lf->rwlock, logline, len);
     }
 }
 
 
 void file_log_server(const char *server, const char *format, va_list ap)
 {
-    char buf[1024];
+    char buf[4096];
+    size_t len;
+    int written;
 
     if (!server_log)
         return;
 
     ci_strtime(buf); /* requires STR_TIME_SIZE=64 bytes size */
-    const size_t len = strlen(buf);
-    const size_t written = snprintf(buf + len,  sizeof(buf) - len, ", %s, %s", server, format);
-    assert(written < sizeof(buf) - len);
-    ci_thread_rwlock_rdlock(&systemlog_rwlock); /*obtain a read lock*/
-    vfprintf(server_log, buf, ap);
-    ci_thread_rwlock_unlock(&systemlog_rwlock); /*release a read lock*/
+    len = strlen(buf);
+    len += snprintf(buf + len,  sizeof(buf) - len, ", %s, ", server);
+    assert(len < sizeof(buf));
+    written = vsnprintf(buf + len, sizeof(buf) - len, format, ap);
+    if (written < 0)
+        return;
+    if ((size_t)written >= sizeof(buf) - len) {
+        /*truncated, terminate the line*/
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    } else
+        len += written;
+
+    if (!log_queue_append(&SERVER_LOG_QUEUE, buf, len))
+        logfile_write(server_log, &systemlog_rwlock, buf, len);
 }
 
 
 int file_log_addlogfile(const char *file, const char *format, const char **acls)
 {
     char *access_log_file, *access_log_format;
+    ci_fmt_program_t *access_log_prog;
     const char *acl_name;
     struct logfile *lf, *newlf;
     int i;
@@ -365,14 +808,19 @@ int file_log_addlogfile(const char *file, const char *format, const char **acls)
     if (format) {
         /*the folowing return format txt or NULL. It is OK*/
         access_log_format = logformat_fmt(format);
-    } else
+        access_log_prog = logformat_program(format);
+    } else {
         access_log_format = NULL;
+        access_log_prog = NULL;
+    }
 
     newlf = malloc(sizeof(struct logfile));
     newlf->file = access_log_file;
     newlf->log_fmt = (access_log_format != NULL? access_log_format : DEFAULT_LOG_FORMAT);
+    newlf->log_prog = access_log_prog;
     newlf->access_log = NULL;
     newlf->access_list = NULL;
+    memset(&newlf->queue, 0, sizeof(struct log_queue));
     newlf->next = NULL;
 
     if (acls != NULL && acls[0] != NULL) {
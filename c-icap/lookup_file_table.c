@@ -21,7 +21,11 @@
 #include "lookup_table.h"
 #include "hash.h"
 #include "debug.h"
+#include "array.h"
+#include "util.h"
+#include "ci_regex.h"
 #include <assert.h>
+#include <ctype.h>
 
 /******************************************************/
 /* file lookup table implementation                   */
@@ -46,9 +50,36 @@ struct text_table_entry {
     struct text_table_entry *next;
 };
 
+/*
+  The file tables with exact match keys (strings and integers) are indexed
+  at load time with an open addressing hash. Only the first row of each key
+  is indexed, so a lookup returns the same entry as a walk over the rows.
+  For the "*" keys of the ci_str_ext_ops tables the first such row is kept
+  aside and wins over any later row.
+*/
+struct text_table_slot {
+    struct text_table_entry *e;
+    unsigned int hash;
+    int row;
+};
+
+struct text_table_index {
+    struct text_table_slot *slots;
+    unsigned int mask;
+    struct text_table_entry *wildcard;
+    int wildcard_row;
+    int domains;
+};
+
+#define TEXT_TABLE_MAX_HOST 1024
+
 struct text_table {
     struct text_table_entry *entries;
     struct ci_hash_table *hash_table;
+    struct text_table_index *index;
+    struct regex_table_index *regex_index;
+    ci_ip_trie_t *ip_index;
+    int ip_unindexed;
     int rows;
 };
 
@@ -242,7 +273,7 @@ int load_text_table(char *filename, struct ci_lookup_table *table)
 }
 
 
-void *file_table_open(struct ci_lookup_table *table)
+static struct text_table *text_table_open(struct ci_lookup_table *table)
 {
     struct ci_mem_allocator *allocator = table->allocator;
     struct text_table *text_table = allocator->alloc(allocator, sizeof(struct text_table));
@@ -251,11 +282,214 @@ void *file_table_open(struct ci_lookup_table *table)
         return NULL;
 
     text_table->entries = NULL;
+    text_table->hash_table = NULL;
+    text_table->index = NULL;
+    text_table->regex_index = NULL;
+    text_table->ip_index = NULL;
+    text_table->ip_unindexed = 0;
     table->data = (void *)text_table;
     if (!load_text_table(table->path, table)) {
         return (table->data = NULL);
     }
-    text_table->hash_table = NULL;
+    return text_table;
+}
+
+static int text_table_domains_arg(struct ci_lookup_table *table)
+{
+    ci_dyn_array_t *args;
+    const ci_array_item_t *arg;
+    int i, domains = 0;
+
+    if (!table->args)
+        return 0;
+
+    if ((args = ci_parse_key_value_list(table->args, ','))) {
+        for (i = 0; (arg = ci_dyn_array_get_item(args, i)) != NULL; ++i) {
+            ci_debug_printf(5, "Table argument %s:%s\n", arg->name, (char *)arg->value);
+            if (strcasecmp(arg->name, "match") == 0) {
+                if (strcasecmp((char *)arg->value, "domain") == 0)
+                    domains = 1;
+                else if (strcasecmp((char *)arg->value, "exact") != 0)
+                    ci_debug_printf(1, "WARNING: wrong match value: %s, will not set\n", (char *)arg->value);
+            }
+        }
+        ci_dyn_array_destroy(args);
+    }
+    return domains;
+}
+
+/*Lower case the domain key and remove the leading dot: ".example.com"
+  and "example.com" both match example.com and all of its subdomains*/
+static void text_table_domain_key(char *key)
+{
+    char *s;
+    if (key[0] == '.')
+        memmove(key, key + 1, strlen(key));
+    for (s = key; *s; s++)
+        *s = tolower(*s);
+}
+
+static const struct text_table_slot *text_table_index_find(const struct ci_lookup_table *table, const struct text_table_index *index, const void *key)
+{
+    const struct text_table_slot *slot;
+    unsigned int hash = ci_hash_compute(0xFFFFFFFF, key, table->key_ops->size(key));
+    unsigned int pos = hash & index->mask;
+    for (slot = &index->slots[pos]; slot->e != NULL; slot = &index->slots[pos]) {
+        if (slot->hash == hash && table->key_ops->compare(slot->e->key, key) == 0)
+            return slot;
+        pos = (pos + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static struct text_table_index *text_table_index_build(struct ci_lookup_table *table, struct text_table *text_table, size_t *index_size)
+{
+    struct ci_mem_allocator *allocator = table->allocator;
+    struct text_table_index *index;
+    struct text_table_entry *e;
+    struct text_table_slot *slot;
+    unsigned int size, pos, hash;
+    int row, domains, str_keys, ext_keys;
+
+    str_keys = (table->key_ops == &ci_str_ops);
+    ext_keys = (table->key_ops == &ci_str_ext_ops);
+    if (!str_keys && !ext_keys &&
+            table->key_ops != &ci_int32_ops && table->key_ops != &ci_uint64_ops)
+        return NULL; /*not exact match keys, search the rows*/
+
+    domains = text_table_domains_arg(table);
+    if (domains && !str_keys && !ext_keys) {
+        ci_debug_printf(1, "WARNING: domain matching requires string keys, table %s will use exact matching\n", table->path);
+        domains = 0;
+    }
+
+    for (size = 16; size < (unsigned int)text_table->rows * 2; size <<= 1);
+    index = allocator->alloc(allocator, sizeof(struct text_table_index));
+    if (!index)
+        return NULL;
+    index->slots = allocator->alloc(allocator, size * sizeof(struct text_table_slot));
+    if (!index->slots) {
+        allocator->free(allocator, index);
+        return NULL;
+    }
+    memset(index->slots, 0, size * sizeof(struct text_table_slot));
+    index->mask = size - 1;
+    index->wildcard = NULL;
+    index->wildcard_row = 0;
+    index->domains = domains;
+
+    for (e = text_table->entries, row = 0; e != NULL; e = e->next, row++) {
+        if (ext_keys && strcmp((char *)e->key, "*") == 0) {
+            if (!index->wildcard) {
+                index->wildcard = e;
+                index->wildcard_row = row;
+            }
+            continue;
+        }
+        if (domains)
+            text_table_domain_key((char *)e->key);
+        if (text_table_index_find(table, index, e->key))
+            continue; /*keep the first row*/
+        hash = ci_hash_compute(0xFFFFFFFF, e->key, table->key_ops->size(e->key));
+        pos = hash & index->mask;
+        while (index->slots[pos].e != NULL)
+            pos = (pos + 1) & index->mask;
+        slot = &index->slots[pos];
+        slot->e = e;
+        slot->hash = hash;
+        slot->row = row;
+    }
+    *index_size = sizeof(struct text_table_index) + size * sizeof(struct text_table_slot);
+    return index;
+}
+
+static void text_table_index_destroy(struct ci_lookup_table *table, struct text_table_index *index)
+{
+    struct ci_mem_allocator *allocator = table->allocator;
+    allocator->free(allocator, index->slots);
+    allocator->free(allocator, index);
+}
+
+/*
+  The tables keyed by IP networks are indexed with a radix trie. A lookup
+  returns the row of the longest matching network. The rows which can not
+  be stored in the trie (see ci_ip_trie_add) are checked one by one when
+  there is not any match.
+*/
+static int text_table_ip_index_build(struct ci_lookup_table *table, struct text_table *text_table, size_t *index_size)
+{
+    struct text_table_entry *e;
+
+    if (table->key_ops != &ci_ip_ops && table->key_ops != &ci_ip_sockaddr_ops)
+        return 0;
+
+    if (!(text_table->ip_index = ci_ip_trie_create()))
+        return 0;
+
+    for (e = text_table->entries; e != NULL; e = e->next) {
+        if (!ci_ip_trie_add(text_table->ip_index, e->key, e))
+            text_table->ip_unindexed++;
+    }
+    *index_size = ci_ip_trie_size(text_table->ip_index);
+    return 1;
+}
+
+static void *text_table_ip_index_search(struct ci_lookup_table *table, struct text_table *text_table, void *key, void ***vals)
+{
+    struct text_table_entry *e = NULL;
+    const void *address;
+    int family;
+
+    if ((address = ci_ip_key_address(table->key_ops, key, &family)) != NULL)
+        e = ci_ip_trie_search(text_table->ip_index, family, address);
+
+    if (!e && text_table->ip_unindexed) {
+        for (e = text_table->entries; e != NULL; e = e->next) {
+            if (table->key_ops->compare((void *)e->key, key) == 0)
+                break;
+        }
+    }
+
+    if (!e)
+        return NULL;
+    *vals = (void **)e->vals;
+    return (void *)e->key;
+}
+
+static size_t text_table_data_size(struct ci_lookup_table *table, struct text_table *text_table)
+{
+    struct text_table_entry *e;
+    size_t size = 0;
+    int i;
+    for (e = text_table->entries; e != NULL; e = e->next) {
+        size += sizeof(struct text_table_entry) + table->key_ops->size(e->key);
+        if (e->vals) {
+            for (i = 0; e->vals[i] != NULL; i++)
+                size += sizeof(void *) + table->val_ops->size(e->vals[i]);
+            size += sizeof(void *);
+        }
+    }
+    return size;
+}
+
+void *file_table_open(struct ci_lookup_table *table)
+{
+    struct text_table *text_table;
+    size_t index_size = 0;
+    uint64_t start = ci_clock_usec();
+
+    if (!(text_table = text_table_open(table)))
+        return NULL;
+
+    if (!text_table_ip_index_build(table, text_table, &index_size))
+        text_table->index = text_table_index_build(table, text_table, &index_size);
+    ci_debug_printf(3, "File table %s: %d rows loaded in %d ms, data %lu bytes, %s index %lu bytes\n",
+                    table->path, text_table->rows,
+                    (int)((ci_clock_usec() - start) / 1000),
+                    (unsigned long)text_table_data_size(table, text_table),
+                    text_table->ip_index ? "ip" :
+                    (text_table->index ? (text_table->index->domains ? "domain" : "hash") : "no"),
+                    (unsigned long)index_size);
     return text_table;
 }
 
@@ -272,6 +506,16 @@ void  file_table_close(struct ci_lookup_table *table)
         return;
     }
 
+    if (text_table->index) {
+        text_table_index_destroy(table, text_table->index);
+        text_table->index = NULL;
+    }
+
+    if (text_table->ip_index) {
+        ci_ip_trie_destroy(text_table->ip_index);
+        text_table->ip_index = NULL;
+    }
+
     while (text_table->entries) {
         tmp = text_table->entries;
         text_table->entries = text_table->entries->next;
@@ -289,6 +533,41 @@ void  file_table_close(struct ci_lookup_table *table)
     table->data = NULL;
 }
 
+static void *text_table_index_search(struct ci_lookup_table *table, const struct text_table_index *index, void *key, void ***vals)
+{
+    const struct text_table_slot *slot = NULL;
+    struct text_table_entry *e;
+    char host[TEXT_TABLE_MAX_HOST];
+    const char *k;
+    char *s;
+
+    if (!key)
+        return NULL;
+
+    if (index->domains) {
+        /*Try the host and then each of its parent domains*/
+        if (strlen((char *)key) < sizeof(host)) {
+            for (k = key, s = host; *k; k++, s++)
+                *s = tolower(*k);
+            *s = '\0';
+            for (s = host; s != NULL && slot == NULL; ) {
+                slot = text_table_index_find(table, index, s);
+                if ((s = strchr(s, '.')) != NULL)
+                    s++;
+            }
+        }
+    } else
+        slot = text_table_index_find(table, index, key);
+
+    e = slot ? slot->e : NULL;
+    if (index->wildcard && (!slot || index->wildcard_row < slot->row))
+        e = index->wildcard;
+    if (!e)
+        return NULL;
+    *vals = (void **)e->vals;
+    return (void *)e->key;
+}
+
 void *file_table_search(struct ci_lookup_table *table, void *key, void ***vals)
 {
     struct text_table_entry *e;
@@ -299,8 +578,14 @@ void *file_table_search(struct ci_lookup_table *table, void *key, void ***vals)
         return NULL;
     }
 
-    e = text_table->entries;
     *vals = NULL;
+    if (text_table->ip_index)
+        return text_table_ip_index_search(table, text_table, key, vals);
+
+    if (text_table->index)
+        return text_table_index_search(table, text_table->index, key, vals);
+
+    e = text_table->entries;
     while (e) {
         if (table->key_ops->compare((void *)e->key,key) == 0) {
             *vals = (void **)e->vals;
@@ -337,10 +622,18 @@ struct ci_lookup_table_type hash_table_type = {
 void *hash_table_open(struct ci_lookup_table *table)
 {
     struct text_table_entry *e;
-    struct text_table *text_table = file_table_open(table);
+    size_t index_size = 0;
+    struct text_table *text_table = text_table_open(table);
     if (!text_table)
         return NULL;
 
+    /*The IP networks can not be hashed, use the radix trie*/
+    if (text_table_ip_index_build(table, text_table, &index_size)) {
+        ci_debug_printf(3, "Hash table %s: %d rows, ip index %lu bytes\n",
+                        table->path, text_table->rows, (unsigned long)index_size);
+        return text_table;
+    }
+
     /* build the hash table*/
     ci_debug_printf(7, "Will build a hash for %d rows of data\n", text_table->rows);
     text_table->hash_table = ci_hash_build(text_table->rows,
@@ -383,6 +676,9 @@ void *hash_table_search(struct ci_lookup_table *table, void *key, void ***vals)
     }
 
     *vals = NULL;
+    if (text_table->ip_index)
+        return text_table_ip_index_search(table, text_table, key, vals);
+
     e = ci_hash_search(text_table->hash_table, key);
     if (!e)
         return NULL;
@@ -413,21 +709,305 @@ struct ci_lookup_table_type regex_table_type = {
     "regex"
 };
 
+#ifdef USE_REGEX
+/*
+  The regex tables keep an Aho-Corasick automaton over a literal string
+  required by each regex (see ci_regex_literal). A search runs the
+  automaton once over the lower cased key and applies only the regexes
+  whose literal was found, plus the regexes without a usable literal, in
+  row order. The first matching row wins, as with a walk over the rows.
+*/
+#define REGEX_TABLE_MIN_LITERAL 3
+#define REGEX_TABLE_MAX_LITERAL 256
+#define REGEX_TABLE_MAX_HITS 256
+
+extern const char *regex_pattern(const void *key, int *flags);
+
+struct regex_ac_state {
+    int edges;  /*first edge, -1 if none*/
+    int fail;
+    int out;    /*first output, -1 if none*/
+    int report; /*next state in the fail chain with outputs, 0 if none*/
+};
+
+struct regex_ac_edge {
+    int next;   /*next sibling edge*/
+    int target;
+    unsigned char c;
+};
+
+struct regex_ac_output {
+    int row;
+    int next;
+};
+
+struct regex_table_index {
+    struct text_table_entry **entries;
+    int *always;
+    int always_num;
+    int root[256];
+    struct regex_ac_state *states;
+    int states_num;
+    struct regex_ac_edge *edges;
+    int edges_num;
+    struct regex_ac_output *outputs;
+    int outputs_num;
+};
+
+static int regex_ac_next(const struct regex_table_index *index, int state, unsigned char c)
+{
+    int e;
+    if (state == 0)
+        return index->root[c];
+    for (e = index->states[state].edges; e >= 0; e = index->edges[e].next) {
+        if (index->edges[e].c == c)
+            return index->edges[e].target;
+    }
+    return -1;
+}
+
+static int regex_ac_grow(void **array, int num, size_t item_size)
+{
+    void *p;
+    /*grow the array when num reaches a power of 2*/
+    if (num < 16 || (num & (num - 1)) != 0)
+        return 1;
+    if (!(p = realloc(*array, 2 * num * item_size)))
+        return 0;
+    *array = p;
+    return 1;
+}
+
+static int regex_ac_add(struct regex_table_index *index, const char *literal, int row)
+{
+    const unsigned char *s;
+    int state = 0, next;
+    struct regex_ac_edge *edge;
+    struct regex_ac_output *out;
+
+    for (s = (const unsigned char *)literal; *s != '\0'; s++) {
+        if ((next = regex_ac_next(index, state, *s)) < 0) {
+            if (!regex_ac_grow((void **)&index->states, index->states_num, sizeof(struct regex_ac_state)))
+                return 0;
+            next = index->states_num++;
+            index->states[next].edges = -1;
+            index->states[next].fail = 0;
+            index->states[next].out = -1;
+            index->states[next].report = 0;
+            if (state == 0)
+                index->root[*s] = next;
+            else {
+                if (!regex_ac_grow((void **)&index->edges, index->edges_num, sizeof(struct regex_ac_edge)))
+                    return 0;
+                edge = &index->edges[index->edges_num];
+                edge->c = *s;
+                edge->target = next;
+                edge->next = index->states[state].edges;
+                index->states[state].edges = index->edges_num++;
+            }
+        }
+        state = next;
+    }
+    if (!regex_ac_grow((void **)&index->outputs, index->outputs_num, sizeof(struct regex_ac_output)))
+        return 0;
+    out = &index->outputs[index->outputs_num];
+    out->row = row;
+    out->next = index->states[state].out;
+    index->states[state].out = index->outputs_num++;
+    return 1;
+}
+
+static int regex_ac_link(struct regex_table_index *index)
+{
+    int *queue, head = 0, tail = 0, state, target, fail, e, c;
+    struct regex_ac_state *states = index->states;
+
+    if (!(queue = malloc(index->states_num * sizeof(int))))
+        return 0;
+    for (c = 0; c < 256; c++) {
+        if (index->root[c] > 0)
+            queue[tail++] = index->root[c];
+    }
+    while (head < tail) {
+        state = queue[head++];
+        for (e = states[state].edges; e >= 0; e = index->edges[e].next) {
+            target = index->edges[e].target;
+            c = index->edges[e].c;
+            for (fail = states[state].fail; fail > 0 && regex_ac_next(index, fail, c) < 0; fail = states[fail].fail);
+            fail = regex_ac_next(index, fail, c);
+            states[target].fail = fail > 0 ? fail : 0;
+            fail = states[target].fail;
+            states[target].report = states[fail].out >= 0 ? fail : states[fail].report;
+            queue[tail++] = target;
+        }
+    }
+    free(queue);
+    return 1;
+}
+
+static void regex_table_index_destroy(struct regex_table_index *index)
+{
+    free(index->entries);
+    free(index->always);
+    free(index->states);
+    free(index->edges);
+    free(index->outputs);
+    free(index);
+}
+
+static struct regex_table_index *regex_table_index_build(struct ci_lookup_table *table, struct text_table *text_table, size_t *index_size)
+{
+    struct regex_table_index *index;
+    struct text_table_entry *e;
+    char literal[REGEX_TABLE_MAX_LITERAL];
+    const char *pattern;
+    char *s;
+    int row, rows, flags, c;
+
+    for (rows = 0, e = text_table->entries; e != NULL; e = e->next, rows++);
+    if (!(index = calloc(1, sizeof(struct regex_table_index))))
+        return NULL;
+    index->entries = malloc((rows + 1) * sizeof(struct text_table_entry *));
+    index->always = malloc((rows + 1) * sizeof(int));
+    index->states = malloc(16 * sizeof(struct regex_ac_state));
+    index->edges = malloc(16 * sizeof(struct regex_ac_edge));
+    index->outputs = malloc(16 * sizeof(struct regex_ac_output));
+    if (!index->entries || !index->always || !index->states || !index->edges || !index->outputs) {
+        regex_table_index_destroy(index);
+        return NULL;
+    }
+    index->states_num = 1; /*the root state*/
+    index->states[0].edges = -1;
+    index->states[0].fail = 0;
+    index->states[0].out = -1;
+    index->states[0].report = 0;
+    for (c = 0; c < 256; c++)
+        index->root[c] = -1;
+
+    for (row = 0, e = text_table->entries; e != NULL; e = e->next, row++) {
+        index->entries[row] = e;
+        pattern = regex_pattern(e->key, &flags);
+        if (ci_regex_literal(pattern, flags, literal, sizeof(literal)) < REGEX_TABLE_MIN_LITERAL) {
+            index->always[index->always_num++] = row;
+            continue;
+        }
+        for (s = literal; *s != '\0'; s++)
+            *s = tolower(*s);
+        if (!regex_ac_add(index, literal, row)) {
+            regex_table_index_destroy(index);
+            return NULL;
+        }
+    }
+
+    if (!regex_ac_link(index)) {
+        regex_table_index_destroy(index);
+        return NULL;
+    }
+
+    *index_size = sizeof(struct regex_table_index) +
+                  (rows + 1) * (sizeof(struct text_table_entry *) + sizeof(int)) +
+                  index->states_num * sizeof(struct regex_ac_state) +
+                  index->edges_num * sizeof(struct regex_ac_edge) +
+                  index->outputs_num * sizeof(struct regex_ac_output);
+    ci_debug_printf(3, "Regex table %s: %d of %d regexes prefiltered, %d automaton states\n",
+                    table->path, rows - index->always_num, rows, index->states_num);
+    return index;
+}
+
+static int regex_row_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*Adds a row to the rows found by a search, kept in an open addressing
+  set with twice the slots of the REGEX_TABLE_MAX_HITS.
+  Returns non zero if the row was not in the set.*/
+#define REGEX_TABLE_SEEN_SIZE (2 * REGEX_TABLE_MAX_HITS)
+static int regex_seen_add(int *seen, int row)
+{
+    unsigned int h = ((unsigned int)row * 2654435761u) % REGEX_TABLE_SEEN_SIZE;
+    while (seen[h] >= 0) {
+        if (seen[h] == row)
+            return 0;
+        h = (h + 1) % REGEX_TABLE_SEEN_SIZE;
+    }
+    seen[h] = row;
+    return 1;
+}
+
+static void *regex_table_index_search(struct ci_lookup_table *table, const struct regex_table_index *index, void *key, void ***vals)
+{
+    const unsigned char *s;
+    int hits[REGEX_TABLE_MAX_HITS];
+    int seen[REGEX_TABLE_SEEN_SIZE];
+    int hits_num = 0, state = 0, next, o, r, i, a, row;
+    struct text_table_entry *e;
+
+    if (!key)
+        return NULL;
+
+    memset(seen, 0xff, sizeof(seen));
+
+    for (s = (const unsigned char *)key; *s != '\0'; s++) {
+        for (;;) {
+            next = regex_ac_next(index, state, tolower(*s));
+            if (next >= 0 || state == 0)
+                break;
+            state = index->states[state].fail;
+        }
+        state = next > 0 ? next : 0;
+        for (r = index->states[state].out >= 0 ? state : index->states[state].report; r > 0; r = index->states[r].report) {
+            for (o = index->states[r].out; o >= 0; o = index->outputs[o].next) {
+                /*a literal found many times in the key is one candidate*/
+                if (!regex_seen_add(seen, index->outputs[o].row))
+                    continue;
+                if (hits_num == REGEX_TABLE_MAX_HITS) /*too many candidates*/
+                    return file_table_search(table, key, vals);
+                hits[hits_num++] = index->outputs[o].row;
+            }
+        }
+    }
+
+    qsort(hits, hits_num, sizeof(int), regex_row_cmp);
+    /*merge the candidates with the regexes without literal, in row order*/
+    for (i = 0, a = 0; i < hits_num || a < index->always_num; ) {
+        if (a >= index->always_num || (i < hits_num && hits[i] < index->always[a])) {
+            row = hits[i++];
+        } else
+            row = index->always[a++];
+        e = index->entries[row];
+        if (table->key_ops->compare(e->key, key) == 0) {
+            *vals = (void **)e->vals;
+            return (void *)e->key;
+        }
+    }
+    return NULL;
+}
+#endif
 
 void *regex_table_open(struct ci_lookup_table *table)
 {
 #ifdef USE_REGEX
     struct text_table *text_table;
+    size_t index_size = 0;
+    uint64_t start = ci_clock_usec();
     if (table->key_ops != &ci_str_ops) {
         ci_debug_printf(1,"This type of table is not compatible with regex tables!\n");
         return NULL;
     }
     table->key_ops = &ci_regex_ops;
 
-    text_table = file_table_open(table);
+    text_table = text_table_open(table);
     if (!text_table)
         return NULL;
 
+    text_table->regex_index = regex_table_index_build(table, text_table, &index_size);
+    ci_debug_printf(3, "Regex table %s: %d rows loaded in %d ms, data %lu bytes, %s index %lu bytes\n",
+                    table->path, text_table->rows,
+                    (int)((ci_clock_usec() - start) / 1000),
+                    (unsigned long)text_table_data_size(table, text_table),
+                    text_table->regex_index ? "literal" : "no",
+                    (unsigned long)index_size);
     return text_table;
 #else
     ci_debug_printf(1,"regex lookup tables are not supported on this system!\n");
@@ -438,7 +1018,12 @@ void *regex_table_open(struct ci_lookup_table *table)
 void  regex_table_close(struct ci_lookup_table *table)
 {
 #ifdef USE_REGEX
-    /*just call the file_table_close:*/
+    struct text_table *text_table = (struct text_table *)table->data;
+    if (text_table && text_table->regex_index) {
+        regex_table_index_destroy(text_table->regex_index);
+        text_table->regex_index = NULL;
+    }
+    /*... and then call the file_table_close:*/
     file_table_close(table);
 #else
     ci_debug_printf(1,"regex lookup tables are not supported on this system!\n");
@@ -449,6 +1034,11 @@ void  regex_table_close(struct ci_lookup_table *table)
 void *regex_table_search(struct ci_lookup_table *table, void *key, void ***vals)
 {
 #ifdef USE_REGEX
+    struct text_table *text_table = (struct text_table *)table->data;
+    if (text_table && text_table->regex_index) {
+        *vals = NULL;
+        return regex_table_index_search(table, text_table->regex_index, key, vals);
+    }
     return file_table_search(table, key, vals);
 #else
     ci_debug_printf(1,"regex lookup tables are not supported on this system!\n");
@@ -166,10 +166,15 @@ int long_buffer_sizes[16] =  {
 void ci_buffers_destroy()
 {
     int i;
+    /*Pools serve more than one consecutive buffer types*/
     for (i = 0; i < 16; i++) {
-        if (short_buffers[i] != NULL)
+        if (short_buffers[i] != NULL && (i == 15 || short_buffers[i] != short_buffers[i + 1]))
             ci_mem_allocator_destroy(short_buffers[i]);
+        if (long_buffers[i] != NULL && (i == 15 || long_buffers[i] != long_buffers[i + 1]))
+            ci_mem_allocator_destroy(long_buffers[i]);
     }
+    for (i = 0; i < 16; i++)
+        short_buffers[i] = long_buffers[i] = NULL;
 }
 
 void *ci_buffer_alloc(int block_size)
@@ -457,13 +462,15 @@ static serial_allocator_t *serial_allocator_build(int size)
     if (size < sizeof(serial_allocator_t) + sizeof(ci_mem_allocator_t))
         return NULL;
     buffer = ci_buffer_alloc(size);
+    if (!buffer)
+        return NULL;
     serial_alloc = buffer;
     /*The allocated block size maybe is larger, than the requested.
       Lets fix size to actual block size: */
     size = ci_buffer_blocksize(buffer);
 
-    serial_alloc->memchunk = buffer + sizeof(serial_allocator_t);
-    size -= sizeof(serial_allocator_t);
+    serial_alloc->memchunk = buffer + _CI_ALIGN(sizeof(serial_allocator_t));
+    size -= _CI_ALIGN(sizeof(serial_allocator_t));
     serial_alloc->curpos = serial_alloc->memchunk;
     serial_alloc->endpos = serial_alloc->memchunk + size;
     serial_alloc->next = NULL;
@@ -474,10 +481,20 @@ static void *serial_allocation(serial_allocator_t *serial_alloc, size_t size)
 {
     int max_size;
     void *mem;
+    serial_allocator_t *large;
     size = _CI_ALIGN(size); /*round size to a correct alignment size*/
     max_size = serial_alloc->endpos - serial_alloc->memchunk;
-    if (size > max_size)
-        return NULL;
+    if (size > max_size) {
+        /*Allocate a dedicated chunk, released with the other chunks on
+          reset. Link it after the first chunk, marked as full.*/
+        large = serial_allocator_build(size + _CI_ALIGN(sizeof(serial_allocator_t)));
+        if (!large)
+            return NULL;
+        large->curpos = large->endpos;
+        large->next = serial_alloc->next;
+        serial_alloc->next = large;
+        return large->memchunk;
+    }
 
     while (size > (serial_alloc->endpos - serial_alloc->curpos)) {
         if (serial_alloc->next == NULL) {
@@ -519,8 +536,8 @@ static void serial_allocator_reset(ci_mem_allocator_t *allocator)
     /*release any other allocated chunk*/
     while (sa) {
         tmp = (void *)sa;
-        ci_buffer_free(tmp);
         sa = sa->next;
+        ci_buffer_free(tmp);
     }
 }
 
@@ -546,6 +563,8 @@ ci_mem_allocator_t *ci_create_serial_allocator(int size)
     ci_mem_allocator_t *allocator;
 
     serial_allocator_t *sdata= serial_allocator_build(size);
+    if (!sdata)
+        return NULL;
 
     /*Allocate space for ci_mem_allocator_t from our serial allocator ...*/
     allocator = serial_allocation(sdata, sizeof(ci_mem_allocator_t));
@@ -754,9 +773,16 @@ void ci_pack_allocator_set_end_pos(ci_mem_allocator_t *allocator, void *p)
 
 /****************************************************************/
 
-struct mem_block_item {
-    void *data;
-    struct mem_block_item *next;
+/*
+  The pool allocator keeps released items in an intrusive free list: the
+  first bytes of a free item store the pointer to the next free item.
+  Every thread keeps a small magazine of free items for each pool and
+  accesses the shared depot of the pool, which is protected by the pool
+  mutex, only to refill or drain half a magazine at once.
+*/
+
+struct pool_item {
+    struct pool_item *next;
 };
 
 struct pool_allocator {
@@ -764,11 +790,296 @@ struct pool_allocator {
     int strict;
     int alloc_count;
     int hits_count;
+    int slot;
+    int magazine_size;
     ci_thread_mutex_t mutex;
-    struct mem_block_item *free;
-    struct mem_block_item *allocated;
+    struct pool_item *free;
+    volatile int depot_count; /*The items in free list*/
 };
 
+#define POOL_SLOTS_MAX 128
+#define POOL_MAGAZINE_MAX 16
+#define POOL_MAGAZINE_BYTES 65536
+#define POOL_STATS_FLUSH 64
+
+static ci_mem_pool_stats_cb_t POOL_STATS_CB = NULL;
+
+void ci_mem_pool_stats_callback(ci_mem_pool_stats_cb_t cb)
+{
+    POOL_STATS_CB = cb;
+}
+
+#ifndef _WIN32
+
+static void pool_depot_lock(struct pool_allocator *palloc, int *contention)
+{
+    if (ci_thread_mutex_trylock(&palloc->mutex) != 0) {
+        ci_thread_mutex_lock(&palloc->mutex);
+        (*contention)++;
+    }
+}
+
+/*
+  A magazine is used only by its owner thread. It keeps the generation of
+  its pool slot: when a pool is destroyed the generation of its slot is
+  increased, and the owner thread drops the items of the magazine the
+  next time it uses the slot or when it exits.
+*/
+struct pool_magazine {
+    int count;
+    unsigned int generation;
+    void *items[1];
+};
+
+struct pool_thread_cache {
+    struct pool_magazine *magazines[POOL_SLOTS_MAX];
+    int hits;
+    int misses;
+    int transfers;
+    int contention;
+};
+
+static struct pool_allocator *POOL_SLOTS[POOL_SLOTS_MAX];
+static volatile unsigned int POOL_SLOTS_GENERATION[POOL_SLOTS_MAX];
+static ci_thread_mutex_t POOL_SLOTS_MTX;
+static pthread_key_t POOL_CACHE_KEY;
+static pthread_once_t POOL_CACHE_ONCE = PTHREAD_ONCE_INIT;
+static int POOL_CACHE_READY = 0;
+
+static void pool_thread_cache_stats_flush(struct pool_thread_cache *cache)
+{
+    if (POOL_STATS_CB)
+        POOL_STATS_CB(cache->hits, cache->misses, cache->transfers, cache->contention);
+    cache->hits = cache->misses = cache->transfers = cache->contention = 0;
+}
+
+/*Releases the items of a magazine whose pool is destroyed*/
+static void pool_magazine_drop(struct pool_magazine *mag)
+{
+    while (mag->count > 0)
+        free(mag->items[--mag->count]);
+    free(mag);
+}
+
+/*Called on thread exit: returns the cached items to the pools depots*/
+static void pool_thread_cache_destroy(void *data)
+{
+    struct pool_thread_cache *cache = (struct pool_thread_cache *)data;
+    struct pool_magazine *mag;
+    struct pool_allocator *palloc;
+    struct pool_item *item;
+    int i;
+
+    ci_thread_mutex_lock(&POOL_SLOTS_MTX);
+    for (i = 0; i < POOL_SLOTS_MAX; i++) {
+        if ((mag = cache->magazines[i]) == NULL)
+            continue;
+        if (mag->generation != POOL_SLOTS_GENERATION[i]) {
+            pool_magazine_drop(mag);
+            continue;
+        }
+        palloc = POOL_SLOTS[i];
+        ci_thread_mutex_lock(&palloc->mutex);
+        palloc->depot_count += mag->count;
+        while (mag->count > 0) {
+            item = (struct pool_item *)mag->items[--mag->count];
+            item->next = palloc->free;
+            palloc->free = item;
+        }
+        ci_thread_mutex_unlock(&palloc->mutex);
+        free(mag);
+    }
+    ci_thread_mutex_unlock(&POOL_SLOTS_MTX);
+
+    pool_thread_cache_stats_flush(cache);
+    free(cache);
+}
+
+static void pool_thread_cache_init()
+{
+    ci_thread_mutex_init(&POOL_SLOTS_MTX);
+    if (pthread_key_create(&POOL_CACHE_KEY, pool_thread_cache_destroy) == 0)
+        POOL_CACHE_READY = 1;
+}
+
+static struct pool_thread_cache *pool_thread_cache()
+{
+    struct pool_thread_cache *cache;
+
+    if (!POOL_CACHE_READY)
+        return NULL;
+
+    if ((cache = pthread_getspecific(POOL_CACHE_KEY)) != NULL)
+        return cache;
+
+    if ((cache = calloc(1, sizeof(struct pool_thread_cache))) == NULL)
+        return NULL;
+    if (pthread_setspecific(POOL_CACHE_KEY, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static struct pool_magazine *pool_magazine(struct pool_allocator *palloc, struct pool_thread_cache **pcache)
+{
+    struct pool_thread_cache *cache;
+    struct pool_magazine *mag;
+
+    if (palloc->slot < 0 || (cache = pool_thread_cache()) == NULL)
+        return NULL;
+
+    *pcache = cache;
+    if ((mag = cache->magazines[palloc->slot]) != NULL) {
+        if (mag->generation == POOL_SLOTS_GENERATION[palloc->slot])
+            return mag;
+        /*Left by a destroyed pool which used the same slot*/
+        pool_magazine_drop(mag);
+        cache->magazines[palloc->slot] = NULL;
+    }
+
+    mag = malloc(sizeof(struct pool_magazine) + (palloc->magazine_size - 1) * sizeof(void *));
+    if (!mag)
+        return NULL;
+    mag->count = 0;
+    mag->generation = POOL_SLOTS_GENERATION[palloc->slot];
+    cache->magazines[palloc->slot] = mag;
+    return mag;
+}
+
+static void pool_slot_assign(struct pool_allocator *palloc)
+{
+    int i;
+
+    palloc->slot = -1;
+    pthread_once(&POOL_CACHE_ONCE, pool_thread_cache_init);
+    if (!POOL_CACHE_READY)
+        return;
+
+    ci_thread_mutex_lock(&POOL_SLOTS_MTX);
+    for (i = 0; i < POOL_SLOTS_MAX; i++) {
+        if (POOL_SLOTS[i] == NULL) {
+            POOL_SLOTS[i] = palloc;
+            palloc->slot = i;
+            break;
+        }
+    }
+    ci_thread_mutex_unlock(&POOL_SLOTS_MTX);
+}
+
+/*Invalidates the magazines of the pool. The items cached by the threads
+  for the pool are dropped by their owner threads. If release is set the
+  slot of the pool is released too.*/
+static void pool_slot_invalidate(struct pool_allocator *palloc, int release)
+{
+    struct pool_thread_cache *cache;
+    struct pool_magazine *mag;
+
+    if (palloc->slot < 0)
+        return;
+
+    ci_thread_mutex_lock(&POOL_SLOTS_MTX);
+    POOL_SLOTS_GENERATION[palloc->slot]++;
+    if (release)
+        POOL_SLOTS[palloc->slot] = NULL;
+    ci_thread_mutex_unlock(&POOL_SLOTS_MTX);
+
+    if ((cache = pthread_getspecific(POOL_CACHE_KEY)) != NULL &&
+            (mag = cache->magazines[palloc->slot]) != NULL) {
+        pool_magazine_drop(mag);
+        cache->magazines[palloc->slot] = NULL;
+    }
+    if (release)
+        palloc->slot = -1;
+}
+
+static void *pool_magazine_alloc(struct pool_allocator *palloc, struct pool_magazine *mag, struct pool_thread_cache *cache)
+{
+    struct pool_item *item;
+    void *data;
+    int batch = palloc->magazine_size / 2;
+
+    /*Do not lock an empty depot, just allocate a new item*/
+    if (mag->count == 0 && palloc->depot_count > 0) {
+        pool_depot_lock(palloc, &cache->contention);
+        while (mag->count < batch && (item = palloc->free) != NULL) {
+            palloc->free = item->next;
+            mag->items[mag->count++] = item;
+        }
+        palloc->depot_count -= mag->count;
+        if (mag->count > 0)
+            palloc->hits_count++;
+        else
+            palloc->alloc_count++;
+        ci_thread_mutex_unlock(&palloc->mutex);
+        cache->transfers++;
+    }
+
+    if (mag->count > 0) {
+        data = mag->items[--mag->count];
+        cache->hits++;
+    } else {
+        data = malloc(palloc->items_size);
+        cache->misses++;
+    }
+
+    if (cache->hits + cache->misses >= POOL_STATS_FLUSH)
+        pool_thread_cache_stats_flush(cache);
+    return data;
+}
+
+static void pool_magazine_free(struct pool_allocator *palloc, struct pool_magazine *mag, struct pool_thread_cache *cache, void *p)
+{
+    struct pool_item *item;
+    int batch = palloc->magazine_size / 2;
+
+    if (mag->count < palloc->magazine_size) {
+        mag->items[mag->count++] = p;
+        return;
+    }
+
+    pool_depot_lock(palloc, &cache->contention);
+    palloc->depot_count += batch;
+    while (batch-- > 0) {
+        item = (struct pool_item *)mag->items[--mag->count];
+        item->next = palloc->free;
+        palloc->free = item;
+    }
+    ci_thread_mutex_unlock(&palloc->mutex);
+    cache->transfers++;
+    mag->items[mag->count++] = p;
+}
+
+#else /*_WIN32*/
+
+struct pool_magazine;
+struct pool_thread_cache;
+
+static void pool_slot_assign(struct pool_allocator *palloc)
+{
+    palloc->slot = -1;
+}
+
+static void pool_slot_invalidate(struct pool_allocator *palloc, int release)
+{
+}
+
+static struct pool_magazine *pool_magazine(struct pool_allocator *palloc, struct pool_thread_cache **pcache)
+{
+    return NULL;
+}
+
+static void *pool_magazine_alloc(struct pool_allocator *palloc, struct pool_magazine *mag, struct pool_thread_cache *cache)
+{
+    return NULL;
+}
+
+static void pool_magazine_free(struct pool_allocator *palloc, struct pool_magazine *mag, struct pool_thread_cache *cache, void *p)
+{
+}
+
+#endif
+
 static struct pool_allocator *pool_allocator_build(int items_size,
         int strict)
 {
@@ -780,102 +1091,96 @@ static struct pool_allocator *pool_allocator_build(int items_size,
         return NULL;
     }
 
+    if (items_size < sizeof(struct pool_item))
+        items_size = sizeof(struct pool_item);
     palloc->items_size = items_size;
     palloc->strict = strict;
     palloc->free = NULL;
-    palloc->allocated = NULL;
+    palloc->depot_count = 0;
     palloc->alloc_count = 0;
     palloc->hits_count = 0;
+    palloc->magazine_size = POOL_MAGAZINE_BYTES / items_size;
+    if (palloc->magazine_size > POOL_MAGAZINE_MAX)
+        palloc->magazine_size = POOL_MAGAZINE_MAX;
+    else if (palloc->magazine_size < 2)
+        palloc->magazine_size = 2;
     ci_thread_mutex_init(&palloc->mutex);
+    pool_slot_assign(palloc);
     return palloc;
 }
 
 static void *pool_allocator_alloc(ci_mem_allocator_t *allocator,size_t size)
 {
-    struct mem_block_item *mem_item;
-    void *data = NULL;
+    struct pool_item *item;
+    struct pool_magazine *mag;
+    struct pool_thread_cache *cache = NULL;
     struct pool_allocator *palloc = (struct pool_allocator *)allocator->data;
 
     if (size > palloc->items_size)
         return NULL;
 
-    ci_thread_mutex_lock(&palloc->mutex);
+    if ((mag = pool_magazine(palloc, &cache)) != NULL)
+        return pool_magazine_alloc(palloc, mag, cache);
 
-    if (palloc->free) {
-        mem_item = palloc->free;
-        palloc->free=palloc->free->next;
-        data = mem_item->data;
-        mem_item->data = NULL;
+    ci_thread_mutex_lock(&palloc->mutex);
+    if ((item = palloc->free) != NULL) {
+        palloc->free = item->next;
+        palloc->depot_count--;
         palloc->hits_count++;
-    } else {
-        mem_item = malloc(sizeof(struct mem_block_item));
-        mem_item->data = NULL;
-        data = malloc(palloc->items_size);
+    } else
         palloc->alloc_count++;
-    }
-
-    mem_item->next = palloc->allocated;
-    palloc->allocated = mem_item;
-
     ci_thread_mutex_unlock(&palloc->mutex);
+
     ci_debug_printf(8, "pool hits: %d allocations: %d\n", palloc->hits_count, palloc->alloc_count);
-    return data;
+    return item ? (void *)item : malloc(palloc->items_size);
 }
 
 static void pool_allocator_free(ci_mem_allocator_t *allocator,void *p)
 {
-    struct mem_block_item *mem_item;
+    struct pool_item *item = (struct pool_item *)p;
+    struct pool_magazine *mag;
+    struct pool_thread_cache *cache = NULL;
     struct pool_allocator *palloc = (struct pool_allocator *)allocator->data;
 
-    ci_thread_mutex_lock(&palloc->mutex);
-    if (!palloc->allocated) {
-        /*Yes can happen! after a reset but users did not free all objects*/
-        free(p);
-    } else {
-        mem_item = palloc->allocated;
-        palloc->allocated = palloc->allocated->next;
-
-        mem_item->data = p;
-        mem_item->next = palloc->free;
-        palloc->free = mem_item;
+    if ((mag = pool_magazine(palloc, &cache)) != NULL) {
+        pool_magazine_free(palloc, mag, cache, p);
+        return;
     }
+
+    ci_thread_mutex_lock(&palloc->mutex);
+    item->next = palloc->free;
+    palloc->free = item;
+    palloc->depot_count++;
     ci_thread_mutex_unlock(&palloc->mutex);
 }
 
+/*Releases the items stored in the depot and the magazines of the current
+  thread. The magazines of the other threads are dropped by their owners
+  the next time they use the pool. Items still in use are not affected.*/
 static void pool_allocator_reset(ci_mem_allocator_t *allocator)
 {
-    struct mem_block_item *mem_item, *cur;
+    struct pool_item *item, *cur;
     struct pool_allocator *palloc = (struct pool_allocator *)allocator->data;
 
+    pool_slot_invalidate(palloc, 0);
     ci_thread_mutex_lock(&palloc->mutex);
-    if (palloc->allocated) {
-        mem_item = palloc->allocated;
-        while (mem_item != NULL) {
-            cur = mem_item;
-            mem_item = mem_item->next;
-            free(cur);
-        }
-
-    }
-    palloc->allocated = NULL;
-    if (palloc->free) {
-        mem_item = palloc->free;
-        while (mem_item != NULL) {
-            cur = mem_item;
-            mem_item = mem_item->next;
-            free(cur->data);
-            free(cur);
-        }
+    item = palloc->free;
+    while (item != NULL) {
+        cur = item;
+        item = item->next;
+        free(cur);
     }
     palloc->free = NULL;
+    palloc->depot_count = 0;
     ci_thread_mutex_unlock(&palloc->mutex);
 }
 
 
 static void pool_allocator_destroy(ci_mem_allocator_t *allocator)
 {
-    pool_allocator_reset(allocator);
     struct pool_allocator *palloc = (struct pool_allocator *)allocator->data;
+    pool_slot_invalidate(palloc, 1);
+    pool_allocator_reset(allocator);
     ci_thread_mutex_destroy(&palloc->mutex);
     free(palloc);
 }
@@ -886,10 +1191,16 @@ ci_mem_allocator_t *ci_create_pool_allocator(int items_size)
     ci_mem_allocator_t *allocator;
 
     palloc = pool_allocator_build(items_size, 0);
+    if (!palloc)
+        return NULL;
     /*Use always malloc for ci_mem_alocator struct.*/
     allocator = (ci_mem_allocator_t *) malloc(sizeof(ci_mem_allocator_t));
-    if (!allocator)
+    if (!allocator) {
+        pool_slot_invalidate(palloc, 1);
+        ci_thread_mutex_destroy(&palloc->mutex);
+        free(palloc);
         return NULL;
+    }
     allocator->alloc = pool_allocator_alloc;
     allocator->free = pool_allocator_free;
     allocator->reset = pool_allocator_reset;
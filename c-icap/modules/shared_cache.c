@@ -6,23 +6,46 @@
 #include "module.h"
 #include "proc_mutex.h"
 #include "shared_mem.h"
+#include "stats.h"
+#include "body.h"
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 static int init_shared_cache(struct ci_server_conf *server_conf);
 static void release_shared_cache();
 
+static char *MMAP_CACHE_DIR = NULL;
+
+static struct ci_conf_entry conf_variables[] = {
+    {"MmapCacheDir", &MMAP_CACHE_DIR, ci_cfg_set_str, NULL},
+    {NULL, NULL, NULL, NULL}
+};
+
 CI_DECLARE_MOD_DATA common_module_t module = {
     "shared_cache",
     init_shared_cache,
     NULL,
     release_shared_cache,
-    NULL,
+    conf_variables,
 };
 
 struct ci_cache_type ci_shared_cache;
+#if defined(__ATOMIC_ACQUIRE)
+struct ci_cache_type ci_mmap_cache;
+#endif
 static int init_shared_cache(struct ci_server_conf *server_conf)
 {
     ci_cache_type_register(&ci_shared_cache);
+#if defined(__ATOMIC_ACQUIRE)
+    ci_cache_type_register(&ci_mmap_cache);
+#endif
     return 1;
 }
 
@@ -43,41 +66,153 @@ struct ci_cache_type ci_shared_cache = {
     "shared"
 };
 
-/*Should be power of 2 and equal or less than 64*/
-#define CACHE_PAGES 4
+#if defined(__ATOMIC_ACQUIRE)
+int ci_mmap_cache_init(struct ci_cache *cache, const char *name);
+void ci_mmap_cache_destroy(struct ci_cache *cache);
+
+struct ci_cache_type ci_mmap_cache = {
+    ci_mmap_cache_init,
+    ci_shared_cache_search,
+    ci_shared_cache_update,
+    ci_mmap_cache_destroy,
+    "mmap"
+};
+#endif
+
+/*
+  The shared memory holds a hash index of fixed size entries and a data
+  area. The index is split to stripes, each one protected by a sequence
+  lock. Writers take the stripe lock by making its sequence number odd.
+  Readers do not lock: they copy the entry and retry if the sequence
+  number changed while they were reading it.
+
+  The data area is split to pages which are assigned on demand to slab
+  classes of power of 2 chunk sizes, from CACHE_CLASS_MIN_SIZE up to the
+  cache max_object_size. Each index entry points to a chunk of the
+  smallest class which can hold its key and value. When a class has no
+  free chunks and no free pages left, a CLOCK hand evicts the least
+  recently used of its chunks.
+*/
+#define CACHE_STRIPE_ENTRIES 16
+#define CACHE_STRIPES_MAX 4096
+/*Positions of the stripe searched for a key*/
+#define CACHE_PROBES 4
+/*The shared memory bytes per index entry*/
+#define CACHE_INDEX_RATIO 128
+#define CACHE_CLASS_MIN_SIZE 64
+#define CACHE_CLASSES_MAX 24
+#define CACHE_PAGE_MIN_SIZE 16384
+/*Chunks examined by the CLOCK hand before an update is rejected*/
+#define CACHE_EVICT_TRIES 64
+/*Optimistic read attempts before a reader takes the stripe lock*/
+#define CACHE_READ_RETRIES 4
+/*Values up to this size are copied on stack while reading*/
+#define CACHE_READ_BUF_SIZE 512
 
-struct shared_cache_stats {
+#if defined(__ATOMIC_ACQUIRE)
+#define USE_CACHE_SEQLOCK 1
+#endif
+
+struct shared_cache_lock {
+    unsigned int seq;
+    int owner;
+    char pad[64 - sizeof(unsigned int) - sizeof(int)];
+};
+
+/*The parameters which define the shared memory layout*/
+struct shared_cache_layout {
+    uint64_t mem_size;
+    uint64_t page_size;
+    uint32_t entries;
+    uint32_t stripes;
+    uint32_t pages;
+    uint32_t classes;
+    uint32_t class_size[CACHE_CLASSES_MAX];
+};
+
+#define CACHE_MAGIC 0x43494d43
+#define CACHE_VERSION 2
+enum shared_cache_state {CACHE_STATE_OPEN = 1, CACHE_STATE_CLEAN};
+
+struct shared_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    struct shared_cache_layout layout;
+    uint32_t checksum;
+    int state;
     int cache_users;
-    struct page_stats {
-        int64_t hits;
-        int64_t searches;
-        int64_t updates;
-        int64_t update_hits;
-    } page[CACHE_PAGES];
+    int next_page;
+    int stats_reporter;
+};
+
+struct shared_cache_class {
+    struct shared_cache_lock lock;
+    uint32_t free_head;
+    int carve_page;
+    uint32_t carve_next;
+    int hand_page;
+    uint32_t hand_chunk;
+    int pages;
+    int entries;
+};
+
+/*The chunks index entries, a zero chunk marks an empty entry*/
+struct shared_cache_entry {
+    uint32_t hash;
+    uint32_t chunk;
+    uint32_t key_size;
+    uint32_t value_size;
+    int64_t expires;
+    uint32_t referenced;
+    uint32_t pad;
+};
+
+#define CACHE_CHUNK_FREE 0xFFFFFFFF
+struct shared_cache_chunk {
+    uint32_t owner;
+    uint32_t next;
+    unsigned char bytes[];
 };
 
 struct shared_cache_data {
     void *mem_ptr;
-    void *slots;
     ci_shared_mem_id_t id;
     size_t max_hash;
-    size_t entry_size;
     size_t shared_mem_size;
+    size_t page_size;
     int entries;
+    int stripes;
+    int stripe_shift;
+    int classes;
     int pages;
-    int page_size;
-    int page_shift_op;
-    struct shared_cache_stats *stats;
+    uint32_t class_size[CACHE_CLASSES_MAX];
+    size_t classes_offset;
+    size_t page_class_offset;
+    size_t stripes_offset;
+    size_t index_offset;
+    size_t data_offset;
+    struct shared_cache_header *header;
+    struct shared_cache_class *class;
+    unsigned char *page_class;
+    struct shared_cache_lock *stripe;
+    struct shared_cache_entry *index;
+    unsigned char *data;
     ci_proc_mutex_t cache_mutex;
-    ci_proc_mutex_t mutex[CACHE_PAGES];
-};
-
-struct shared_cache_slot {
-    unsigned int hash;
-    time_t expires;
-    size_t key_size;
-    size_t value_size;
-    unsigned char bytes[];
+#if !defined(USE_CACHE_SEQLOCK)
+    ci_proc_mutex_t mutex;
+#endif
+    /*The backing file of the mmap caches*/
+    int fd;
+    char path[CI_MAX_PATH];
+    struct {
+        int searches;
+        int hits;
+        int updates;
+        int update_hits;
+        int read_retries;
+        int evictions;
+        int class_entries[CACHE_CLASSES_MAX];
+    } stat;
 };
 
 unsigned int
@@ -108,38 +243,204 @@ const char *ci_shared_mem_print_id(char *buf, size_t size, ci_shared_mem_id_t *i
     return buf;
 }
 
+static void shared_cache_set_pointers(struct shared_cache_data *data)
+{
+    data->header = (struct shared_cache_header *)data->mem_ptr;
+    data->class = (struct shared_cache_class *)(data->mem_ptr + data->classes_offset);
+    data->page_class = (unsigned char *)(data->mem_ptr + data->page_class_offset);
+    data->stripe = (struct shared_cache_lock *)(data->mem_ptr + data->stripes_offset);
+    data->index = (struct shared_cache_entry *)(data->mem_ptr + data->index_offset);
+    data->data = (unsigned char *)(data->mem_ptr + data->data_offset);
+}
+
+/*
+  The entries of each class are counted in the shared memory. One child,
+  the stats reporter, copies the counts to the class entries gauges and
+  the other children keep their gauges at zero. When the reporter exits
+  another child takes over.
+*/
+static int shared_cache_stats_reporter(struct shared_cache_data *data)
+{
+    int pid = (int)getpid();
+    int reporter;
+#if defined(USE_CACHE_SEQLOCK)
+    reporter = __atomic_load_n(&data->header->stats_reporter, __ATOMIC_RELAXED);
+    if (reporter == pid)
+        return 1;
+    if (reporter > 0 && (kill(reporter, 0) == 0 || errno != ESRCH))
+        return 0;
+    return __atomic_compare_exchange_n(&data->header->stats_reporter, &reporter, pid, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#else
+    ci_proc_mutex_lock(&data->mutex);
+    reporter = data->header->stats_reporter;
+    if (reporter != pid && (reporter <= 0 || (kill(reporter, 0) != 0 && errno == ESRCH)))
+        data->header->stats_reporter = reporter = pid;
+    ci_proc_mutex_unlock(&data->mutex);
+    return reporter == pid;
+#endif
+}
+
+void command_report_shared_cache_stats(const char *name, int type, void *data)
+{
+    struct shared_cache_data *cache_data = (struct shared_cache_data *)data;
+    int i;
+    if (shared_cache_stats_reporter(cache_data)) {
+        for (i = 0; i < cache_data->classes; ++i)
+            ci_stat_gauge_set(cache_data->stat.class_entries[i], cache_data->class[i].entries);
+    }
+    ci_command_schedule("shared_cache_stats_cmd", data, 1);
+}
+
+void command_stop_shared_cache_stats(const char *name, int type, void *data)
+{
+    struct shared_cache_data *cache_data = (struct shared_cache_data *)data;
+    int pid = (int)getpid();
+#if defined(USE_CACHE_SEQLOCK)
+    __atomic_compare_exchange_n(&cache_data->header->stats_reporter, &pid, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#else
+    ci_proc_mutex_lock(&cache_data->mutex);
+    if (cache_data->header->stats_reporter == pid)
+        cache_data->header->stats_reporter = 0;
+    ci_proc_mutex_unlock(&cache_data->mutex);
+#endif
+}
+
 void command_attach_shared_mem(const char *name, int type, void *data)
 {
     char buf[128];
     struct shared_cache_data *shared_cache = (struct shared_cache_data *)data;
     shared_cache->mem_ptr = ci_shared_mem_attach(&shared_cache->id);
-    shared_cache->stats = (struct shared_cache_stats *)shared_cache->mem_ptr;
-    shared_cache->slots = (void *)(shared_cache->mem_ptr + sizeof(struct shared_cache_stats));
+    shared_cache_set_pointers(shared_cache);
     ci_debug_printf(3, "Shared cache id:'%s' attached on address %p\n", ci_shared_mem_print_id(buf, sizeof(buf), &shared_cache->id), shared_cache->mem_ptr);
     ci_proc_mutex_lock(&(shared_cache->cache_mutex));
-    ++shared_cache->stats->cache_users;
+    ++shared_cache->header->cache_users;
     ci_proc_mutex_unlock(&(shared_cache->cache_mutex));
+    command_report_shared_cache_stats(name, type, data);
 }
 
-int ci_shared_cache_init(struct ci_cache *cache, const char *name)
+static void shared_cache_stats_register(struct shared_cache_data *data, const char *name)
+{
+    char group[128], label[256];
+    int i;
+    snprintf(group, sizeof(group), "Shared cache %s", name);
+    snprintf(label, sizeof(label), "%s SEARCHES", group);
+    data->stat.searches = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s HITS", group);
+    data->stat.hits = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s UPDATES", group);
+    data->stat.updates = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s UPDATE HITS", group);
+    data->stat.update_hits = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s READ RETRIES", group);
+    data->stat.read_retries = ci_stat_entry_register(label, STAT_INT64_T, group);
+    snprintf(label, sizeof(label), "%s EVICTIONS", group);
+    data->stat.evictions = ci_stat_entry_register(label, STAT_INT64_T, group);
+    for (i = 0; i < data->classes; ++i) {
+        snprintf(label, sizeof(label), "%s CLASS %u ENTRIES", group, (unsigned int)data->class_size[i]);
+        data->stat.class_entries[i] = ci_stat_entry_register(label, STAT_GAUGE_T, group);
+    }
+}
+
+/*Computes the shared memory layout for the cache*/
+static void shared_cache_layout(struct shared_cache_data *data, size_t mem_size, size_t max_object_size)
 {
     unsigned int next_hash = 63;
     unsigned int final_max_hash = 63;
-    int i;
-    struct shared_cache_data *data;
-    data = (struct shared_cache_data *)malloc(sizeof(struct shared_cache_data));
-    data->entry_size = _CI_ALIGN(cache->max_object_size > 0 ? cache->max_object_size : 1);
-    data->entries = _CI_ALIGN(cache->mem_size) / data->entry_size;
+    size_t max_chunk, size, rest, page_size;
+    size_t index_entries = mem_size / CACHE_INDEX_RATIO;
 
-    while (next_hash < data->entries) {
+    while (next_hash < index_entries) {
         final_max_hash = next_hash;
         next_hash++;
         next_hash = (next_hash << 1) -1;
     }
-
     data->max_hash = final_max_hash;
     data->entries = final_max_hash + 1;
-    data->shared_mem_size = sizeof(struct shared_cache_stats) + data->entries * data->entry_size;
+
+    /* Both entries and stripes are powers of 2, the minimum entries
+       value is 64*/
+    for (data->stripes = 1;
+            data->stripes < CACHE_STRIPES_MAX && data->stripes * CACHE_STRIPE_ENTRIES < data->entries;
+            data->stripes <<= 1);
+    assert(data->entries % data->stripes == 0);
+    for (data->stripe_shift = 0; (data->stripes << data->stripe_shift) < data->entries; ++data->stripe_shift);
+
+    max_chunk = _CI_ALIGN(max_object_size > CACHE_CLASS_MIN_SIZE ? max_object_size : CACHE_CLASS_MIN_SIZE);
+    for (data->classes = 0, size = CACHE_CLASS_MIN_SIZE;
+            size < max_chunk && data->classes < CACHE_CLASSES_MAX - 1;
+            size <<= 1)
+        data->class_size[data->classes++] = size;
+    data->class_size[data->classes++] = max_chunk;
+
+    data->classes_offset = _CI_ALIGN(sizeof(struct shared_cache_header));
+    data->stripes_offset = data->classes_offset + data->classes * sizeof(struct shared_cache_class);
+    data->index_offset = data->stripes_offset + data->stripes * sizeof(struct shared_cache_lock);
+    data->page_class_offset = data->index_offset + data->entries * sizeof(struct shared_cache_entry);
+
+    /*Pages should hold a few of the largest chunks, but every class
+      should be able to take a page*/
+    rest = mem_size > data->page_class_offset ? mem_size - data->page_class_offset : 0;
+    page_size = max_chunk * 8 > CACHE_PAGE_MIN_SIZE ? max_chunk * 8 : CACHE_PAGE_MIN_SIZE;
+    if (page_size > rest / (2 * data->classes))
+        page_size = rest / (2 * data->classes);
+    page_size &= ~((size_t)CACHE_CLASS_MIN_SIZE - 1);
+    if (page_size < max_chunk)
+        page_size = max_chunk;
+    data->page_size = page_size;
+    data->pages = rest / (page_size + 1);
+    if (data->pages < 1)
+        data->pages = 1;
+    data->data_offset = data->page_class_offset + _CI_ALIGN(data->pages);
+    data->shared_mem_size = data->data_offset + data->pages * data->page_size;
+}
+
+static void shared_cache_layout_get(struct shared_cache_data *data, struct shared_cache_layout *layout)
+{
+    int i;
+    memset(layout, 0, sizeof(struct shared_cache_layout));
+    layout->mem_size = data->shared_mem_size;
+    layout->page_size = data->page_size;
+    layout->entries = data->entries;
+    layout->stripes = data->stripes;
+    layout->pages = data->pages;
+    layout->classes = data->classes;
+    for (i = 0; i < data->classes; ++i)
+        layout->class_size[i] = data->class_size[i];
+}
+
+/*Initializes the header and the classes of a zero filled cache memory*/
+static void shared_cache_format(struct shared_cache_data *data)
+{
+    int i;
+    data->header->magic = CACHE_MAGIC;
+    data->header->version = CACHE_VERSION;
+    shared_cache_layout_get(data, &data->header->layout);
+    data->header->checksum = ci_hash_compute(0xFFFFFFFF, &data->header->layout, sizeof(struct shared_cache_layout));
+    data->header->state = CACHE_STATE_OPEN;
+    data->header->cache_users = 1;
+    for (i = 0; i < data->classes; ++i) {
+        data->class[i].carve_page = -1;
+        data->class[i].hand_page = -1;
+    }
+}
+
+static void shared_cache_print_info(struct shared_cache_data *data, struct ci_cache *cache, const char *name, const char *type)
+{
+    char classes_buf[256];
+    size_t len;
+    int i;
+    for (i = 0, len = 0, classes_buf[0] = '\0'; i < data->classes && len < sizeof(classes_buf); ++i)
+        len += snprintf(classes_buf + len, sizeof(classes_buf) - len, "%s%u", i ? "," : "", (unsigned int)data->class_size[i]);
+    ci_debug_printf(1, "%s %s created\nMax shared memory: %u (of the %u requested), max entry size: %u, maximum entries: %u, lock stripes: %d, slab classes: %s, pages: %d of %u bytes\n", type, name, (unsigned int)data->shared_mem_size, (unsigned int)cache->mem_size, (unsigned int)data->class_size[data->classes - 1], data->entries, data->stripes, classes_buf, data->pages, (unsigned int)data->page_size);
+}
+
+int ci_shared_cache_init(struct ci_cache *cache, const char *name)
+{
+    struct shared_cache_data *data;
+    data = (struct shared_cache_data *)malloc(sizeof(struct shared_cache_data));
+    if (!data)
+        return 0;
+    shared_cache_layout(data, _CI_ALIGN(cache->mem_size), cache->max_object_size);
 
     data->mem_ptr = ci_shared_mem_create(&data->id, name, data->shared_mem_size);
     if (!data->mem_ptr) {
@@ -147,115 +448,518 @@ int ci_shared_cache_init(struct ci_cache *cache, const char *name)
         ci_debug_printf(1, "Error allocating shared mem for %s cache\n", name);
         return 0;
     }
-    data->stats = (struct shared_cache_stats *)data->mem_ptr;
-    data->slots = data->mem_ptr + sizeof(struct shared_cache_stats);
-    memset(data->stats, 0, sizeof(struct shared_cache_stats));
-    data->stats->cache_users = 1;
+    data->fd = -1;
+    shared_cache_set_pointers(data);
+    /*The last byte of each chunk is never written and stays zero*/
+    memset(data->mem_ptr, 0, data->shared_mem_size);
+    shared_cache_format(data);
 
     /*TODO: check for error*/
-    for (i = 0; i < CACHE_PAGES; ++i) {
-        ci_proc_mutex_init(&(data->mutex[i]), name);
-    }
+#if !defined(USE_CACHE_SEQLOCK)
+    ci_proc_mutex_init(&(data->mutex), name);
+#endif
     ci_proc_mutex_init(&(data->cache_mutex), name);
-
-    data->page_size = data->entries / CACHE_PAGES;
-    /* CACHE_PAGES can not be bigger than 64, the minimum entries value*/
-    assert(data->entries % data->page_size == 0);
-    data->pages = CACHE_PAGES;
-    /* The pages and page_size should be a power of 2*/
-    assert((data->pages & (data->pages - 1)) == 0);
-    assert((data->page_size & (data->page_size - 1)) == 0);
-    for (data->page_shift_op = 0; ((data->page_size >> data->page_shift_op) & 0x1) ==0 && data->page_shift_op < 64; ++data->page_shift_op );
-    assert(data->page_shift_op < 64);
-
-    ci_debug_printf(1, "Shared mem %s created\nMax shared memory: %u (of the %u requested), max entry size: %u, maximum entries: %u\n", name, (unsigned int)data->shared_mem_size, (unsigned int)cache->mem_size, (unsigned int)data->entry_size, data->entries);
+    shared_cache_stats_register(data, name);
+    shared_cache_print_info(data, cache, name, "Shared mem");
 
     cache->cache_data = data;
     ci_command_register_action("shared_cache_attach_cmd", CHILD_START_CMD, data, command_attach_shared_mem);
+    ci_command_register_action("shared_cache_stats_cmd", ONDEMAND_CMD, NULL, command_report_shared_cache_stats);
+    ci_command_register_action("shared_cache_stats_stop_cmd", CHILD_STOP_CMD, data, command_stop_shared_cache_stats);
     return 1;
 }
 
-int rw_lock_page(struct shared_cache_data *cache_data, int pos)
+/*Returns the chunk for a chunk reference or NULL if it is not valid.
+  The chunk class is stored to *cls.*/
+static struct shared_cache_chunk *chunk_get(struct shared_cache_data *cache_data, uint32_t ref, int *cls)
 {
-    ci_proc_mutex_lock(&cache_data->mutex[pos >> cache_data->page_shift_op]);
+    size_t offset, page;
+    int c;
+    if (ref == 0)
+        return NULL;
+    offset = (size_t)(ref - 1) << 3;
+    page = offset / cache_data->page_size;
+    if (page >= cache_data->pages)
+        return NULL;
+    c = (int)cache_data->page_class[page] - 1;
+    if (c < 0 || c >= cache_data->classes)
+        return NULL;
+    if ((offset % cache_data->page_size) + cache_data->class_size[c] > cache_data->page_size)
+        return NULL;
+    *cls = c;
+    return (struct shared_cache_chunk *)(cache_data->data + offset);
+}
+
+static uint32_t chunk_ref(struct shared_cache_data *cache_data, int page, uint32_t chunk, int cls)
+{
+    size_t offset = (size_t)page * cache_data->page_size + (size_t)chunk * cache_data->class_size[cls];
+    return (uint32_t)(offset >> 3) + 1;
+}
+
+/*The class of the smallest chunks which can hold the given sizes, or -1*/
+static int chunk_class(struct shared_cache_data *cache_data, size_t key_size, size_t value_size)
+{
+    /*The last byte of the chunk is kept zero, readers may rely on it*/
+    size_t size = sizeof(struct shared_cache_chunk) + key_size + 1 + value_size + 1;
+    int i;
+    for (i = 0; i < cache_data->classes; ++i) {
+        if (size <= cache_data->class_size[i])
+            return i;
+    }
+    return -1;
+}
+
+#if defined(USE_CACHE_SEQLOCK)
+/*Returns non zero if the lock is taken over from a dead process*/
+static int cache_lock_wait(struct shared_cache_lock *l, unsigned int seq, int *spins)
+{
+    int owner;
+
+    ++(*spins);
+    if (*spins < 64)
+        return 0;
+    sched_yield();
+    if ((*spins % 1024) != 0)
+        return 0;
+
+    /*The lock is held for too long, check if its owner is still alive*/
+    owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+    if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH)
+        return 0;
+    if (!__atomic_compare_exchange_n(&l->seq, &seq, seq + 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    ci_debug_printf(1, "Shared cache lock was held by the dead process %d, taking it over\n", owner);
+    __atomic_store_n(&l->owner, (int)getpid(), __ATOMIC_RELAXED);
+    return 1;
+}
+
+static int cache_trylock(struct shared_cache_lock *l)
+{
+    unsigned int seq = __atomic_load_n(&l->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) ||
+            !__atomic_compare_exchange_n(&l->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    /*Readers must see the odd sequence before any change*/
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&l->owner, (int)getpid(), __ATOMIC_RELAXED);
     return 1;
 }
 
-int rd_lock_page(struct shared_cache_data *cache_data, int pos)
+/*Returns non zero if the lock is taken over from a dead process*/
+static int cache_lock(struct shared_cache_lock *l)
+{
+    unsigned int seq;
+    int spins = 0;
+    while (!cache_trylock(l)) {
+        seq = __atomic_load_n(&l->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) && cache_lock_wait(l, seq, &spins))
+            return 1;
+    }
+    return 0;
+}
+
+static void cache_unlock(struct shared_cache_lock *l)
+{
+    __atomic_store_n(&l->owner, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->seq, __atomic_load_n(&l->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+static int new_page(struct shared_cache_data *cache_data)
+{
+    int page = __atomic_load_n(&cache_data->header->next_page, __ATOMIC_RELAXED);
+    do {
+        if (page >= cache_data->pages)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&cache_data->header->next_page, &page, page + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return page;
+}
+
+static void stripe_reset(struct shared_cache_data *cache_data, unsigned int stripe);
+static void class_reset(struct shared_cache_data *cache_data, int cls);
+
+static void stripe_lock(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    if (cache_lock(&cache_data->stripe[stripe]))
+        stripe_reset(cache_data, stripe);
+}
+
+static int victim_lock(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    return cache_trylock(&cache_data->stripe[stripe]);
+}
+
+static void victim_unlock(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    cache_unlock(&cache_data->stripe[stripe]);
+}
+
+static void stripe_unlock(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    cache_unlock(&cache_data->stripe[stripe]);
+}
+
+static void class_lock(struct shared_cache_data *cache_data, int cls)
+{
+    if (cache_lock(&cache_data->class[cls].lock))
+        class_reset(cache_data, cls);
+}
+
+static void class_unlock(struct shared_cache_data *cache_data, int cls)
+{
+    cache_unlock(&cache_data->class[cls].lock);
+}
+
+static unsigned int stripe_read_begin(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    struct shared_cache_lock *l = &cache_data->stripe[stripe];
+    unsigned int seq;
+    int spins = 0;
+    while ((seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE)) & 1) {
+        if (cache_lock_wait(l, seq, &spins)) {
+            stripe_reset(cache_data, stripe);
+            cache_unlock(l);
+        }
+    }
+    return seq;
+}
+
+/*Returns non zero if the stripe modified while it was read*/
+static int stripe_read_retry(struct shared_cache_data *cache_data, unsigned int stripe, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&cache_data->stripe[stripe].seq, __ATOMIC_RELAXED) != seq;
+}
+#else
+/*Without atomic builtins a process mutex protects the whole cache*/
+static int new_page(struct shared_cache_data *cache_data)
+{
+    if (cache_data->header->next_page >= cache_data->pages)
+        return -1;
+    return cache_data->header->next_page++;
+}
+
+static void stripe_lock(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    ci_proc_mutex_lock(&cache_data->mutex);
+}
+
+static int victim_lock(struct shared_cache_data *cache_data, unsigned int stripe)
 {
-    ci_proc_mutex_lock(&cache_data->mutex[pos >> cache_data->page_shift_op]);
     return 1;
 }
 
-void unlock_page(struct shared_cache_data *cache_data, int pos)
+static void victim_unlock(struct shared_cache_data *cache_data, unsigned int stripe)
 {
-    ci_proc_mutex_unlock(&cache_data->mutex[pos >> cache_data->page_shift_op]);
 }
 
-time_t ci_internal_time()
+static void stripe_unlock(struct shared_cache_data *cache_data, unsigned int stripe)
 {
-    return time(NULL);
+    ci_proc_mutex_unlock(&cache_data->mutex);
+}
+
+static void class_lock(struct shared_cache_data *cache_data, int cls)
+{
+}
+
+static void class_unlock(struct shared_cache_data *cache_data, int cls)
+{
+}
+
+static unsigned int stripe_read_begin(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    stripe_lock(cache_data, stripe);
+    return 0;
+}
+
+static int stripe_read_retry(struct shared_cache_data *cache_data, unsigned int stripe, unsigned int seq)
+{
+    stripe_unlock(cache_data, stripe);
+    return 0;
+}
+#endif
+
+/*Releases a chunk. Should be called with the owner stripe locked.*/
+static void chunk_free(struct shared_cache_data *cache_data, uint32_t ref)
+{
+    struct shared_cache_chunk *chunk;
+    int cls;
+    if (!(chunk = chunk_get(cache_data, ref, &cls)))
+        return;
+    class_lock(cache_data, cls);
+    chunk->owner = CACHE_CHUNK_FREE;
+    chunk->next = cache_data->class[cls].free_head;
+    cache_data->class[cls].free_head = ref;
+    cache_data->class[cls].entries--;
+    class_unlock(cache_data, cls);
+}
+
+/*
+  Runs the CLOCK hand of the class and evicts the first not recently
+  used chunk. Chunks owned by stripes locked by other writers are
+  skipped. Should be called with the class locked and its free list
+  empty, so any chunk marked as free is a chunk lost by a dead process.
+  The class entries count the chunks not marked as free, so a reused
+  chunk is uncounted even if its index entry no longer points to it.
+*/
+static uint32_t class_evict(struct shared_cache_data *cache_data, int cls, unsigned int stripe)
+{
+    struct shared_cache_class *c = &cache_data->class[cls];
+    struct shared_cache_chunk *chunk;
+    struct shared_cache_entry *entry;
+    uint32_t ref, owner;
+    uint32_t per_page = cache_data->page_size / cache_data->class_size[cls];
+    unsigned int victim_stripe;
+    int i, page, evicted;
+
+    if (c->pages == 0)
+        return 0;
+    for (i = 0; i < CACHE_EVICT_TRIES; ++i) {
+        if (c->hand_page < 0 || ++c->hand_chunk >= per_page) {
+            /*Move to the next page of the class*/
+            page = c->hand_page;
+            do {
+                page = (page + 1) % cache_data->pages;
+            } while (cache_data->page_class[page] != cls + 1);
+            c->hand_page = page;
+            c->hand_chunk = 0;
+        }
+        ref = chunk_ref(cache_data, c->hand_page, c->hand_chunk, cls);
+        chunk = (struct shared_cache_chunk *)(cache_data->data + (((size_t)ref - 1) << 3));
+        owner = chunk->owner;
+        if (owner >= cache_data->entries)
+            return ref; /*Free chunk lost by a dead process, not counted*/
+
+        entry = &cache_data->index[owner];
+        if (entry->chunk == ref && entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        victim_stripe = owner >> cache_data->stripe_shift;
+        if (victim_stripe != stripe && !victim_lock(cache_data, victim_stripe))
+            continue;
+        evicted = (entry->chunk == ref);
+        if (evicted)
+            entry->chunk = 0;
+        if (victim_stripe != stripe)
+            victim_unlock(cache_data, victim_stripe);
+        if (evicted)
+            ci_stat_uint64_inc(cache_data->stat.evictions, 1);
+        c->entries--;
+        return ref;
+    }
+    return 0;
+}
+
+/*Allocates a chunk for the index entry pos. Should be called with the
+  stripe of the entry locked.*/
+static uint32_t chunk_alloc(struct shared_cache_data *cache_data, int cls, uint32_t pos)
+{
+    struct shared_cache_class *c = &cache_data->class[cls];
+    struct shared_cache_chunk *chunk;
+    uint32_t ref;
+    uint32_t per_page = cache_data->page_size / cache_data->class_size[cls];
+    int page;
+
+    class_lock(cache_data, cls);
+    if ((ref = c->free_head) != 0) {
+        chunk = (struct shared_cache_chunk *)(cache_data->data + (((size_t)ref - 1) << 3));
+        c->free_head = chunk->next;
+    } else if (c->carve_page >= 0 && c->carve_next < per_page) {
+        ref = chunk_ref(cache_data, c->carve_page, c->carve_next++, cls);
+    } else if ((page = new_page(cache_data)) >= 0) {
+        cache_data->page_class[page] = cls + 1;
+        c->pages++;
+        c->carve_page = page;
+        c->carve_next = 1;
+        ref = chunk_ref(cache_data, page, 0, cls);
+    } else
+        ref = class_evict(cache_data, cls, pos >> cache_data->stripe_shift);
+
+    if (ref) {
+        chunk = (struct shared_cache_chunk *)(cache_data->data + (((size_t)ref - 1) << 3));
+        chunk->owner = pos;
+        c->entries++;
+    }
+    class_unlock(cache_data, cls);
+    return ref;
+}
+
+#if defined(USE_CACHE_SEQLOCK)
+/*Drops the entries of a stripe left locked by a dead process*/
+static void stripe_reset(struct shared_cache_data *cache_data, unsigned int stripe)
+{
+    struct shared_cache_entry *entry;
+    struct shared_cache_chunk *chunk;
+    uint32_t pos, first = stripe << cache_data->stripe_shift;
+    int cls;
+    for (pos = first; pos < first + (1 << cache_data->stripe_shift); ++pos) {
+        entry = &cache_data->index[pos];
+        if ((chunk = chunk_get(cache_data, entry->chunk, &cls)) && chunk->owner == pos)
+            chunk_free(cache_data, entry->chunk);
+        memset(entry, 0, sizeof(struct shared_cache_entry));
+    }
+}
+
+/*
+  Rebuilds the free list, the pages and the entries count of a class
+  left locked by a dead process. The chunks marked as free are linked to
+  the free list and all the others are counted as used. Used chunks whose
+  index entry does not point to them are reused by the CLOCK hand.
+*/
+static void class_reset(struct shared_cache_data *cache_data, int cls)
+{
+    struct shared_cache_class *c = &cache_data->class[cls];
+    struct shared_cache_chunk *chunk;
+    uint32_t ref, n, per_page = cache_data->page_size / cache_data->class_size[cls];
+    int page, next_page;
+
+    next_page = __atomic_load_n(&cache_data->header->next_page, __ATOMIC_RELAXED);
+    if (next_page > cache_data->pages)
+        next_page = cache_data->pages;
+    if (c->carve_next > per_page)
+        c->carve_next = per_page;
+    c->free_head = 0;
+    c->pages = 0;
+    c->entries = 0;
+    for (page = 0; page < next_page; ++page) {
+        if (cache_data->page_class[page] != cls + 1)
+            continue;
+        c->pages++;
+        for (n = 0; n < (page == c->carve_page ? c->carve_next : per_page); ++n) {
+            ref = chunk_ref(cache_data, page, n, cls);
+            chunk = (struct shared_cache_chunk *)(cache_data->data + (((size_t)ref - 1) << 3));
+            if (chunk->owner == CACHE_CHUNK_FREE) {
+                chunk->next = c->free_head;
+                c->free_head = ref;
+            } else
+                c->entries++;
+        }
+    }
+    if (c->pages == 0)
+        c->hand_page = -1;
+}
+#endif
+
+static inline uint32_t probe_pos(struct shared_cache_data *cache_data, unsigned int hash, int i)
+{
+    uint32_t mask = (1 << cache_data->stripe_shift) - 1;
+    return (hash & ~mask) | ((hash + i) & mask);
+}
+
+/*
+  Looks up the key in the stripe and copies the value of a matching
+  entry to the val_buf (or to a new ci_buffer if it does not fit).
+  The entries may be modified while they are read, so every size is
+  checked against the chunk size before used.
+*/
+static const void *shared_cache_read(struct ci_cache *cache, struct shared_cache_data *cache_data, unsigned int hash, const void *key, size_t key_size, void *val_buf, void **val, size_t *val_size)
+{
+    struct shared_cache_entry *entry;
+    struct shared_cache_chunk *chunk;
+    size_t entry_key_size, entry_value_size;
+    int i, cls;
+
+    *val = NULL;
+    *val_size = 0;
+    for (i = 0; i < CACHE_PROBES; ++i) {
+        entry = &cache_data->index[probe_pos(cache_data, hash, i)];
+        entry_key_size = entry->key_size;
+        if (entry->hash != hash || entry_key_size != key_size)
+            continue;
+        if (!(chunk = chunk_get(cache_data, entry->chunk, &cls)))
+            continue;
+        entry_value_size = entry->value_size;
+        if (sizeof(struct shared_cache_chunk) + entry_key_size + 1 + entry_value_size + 1 > cache_data->class_size[cls])
+            continue;
+        if (cache->key_ops->compare(chunk->bytes, key) != 0)
+            continue;
+
+        if (entry->expires < ci_coarse_time())
+            return NULL;
+        if (!entry->referenced)
+            entry->referenced = 1;
+        if (entry_value_size) {
+            if (entry_value_size <= CACHE_READ_BUF_SIZE)
+                *val = val_buf;
+            else if (!(*val = ci_buffer_alloc(entry_value_size)))
+                return chunk->bytes;
+            memcpy(*val, &chunk->bytes[entry_key_size + 1], entry_value_size);
+            *val_size = entry_value_size;
+        }
+        return chunk->bytes;
+    }
+    return NULL;
 }
 
 const void *ci_shared_cache_search(struct ci_cache *cache, const void *key, void **val, void *user_data, void *(*dup_from_cache)(const void *stored_val, size_t stored_val_size, void *user_data))
 {
-    time_t current_time;
-    const void *cache_key, *cache_val;
+    const void *cache_key;
+    void *cache_val;
+    size_t val_size;
+    unsigned int seq = 0;
+    int attempt, locked;
+    uint64_t val_buf[CACHE_READ_BUF_SIZE / sizeof(uint64_t)];
     struct shared_cache_data *cache_data = cache->cache_data;
-    unsigned int hash = ci_hash_compute(cache_data->max_hash, key, cache->key_ops->size(key));
+    size_t key_size = cache->key_ops->size(key);
+    unsigned int hash = ci_hash_compute(cache_data->max_hash, key, key_size);
+    unsigned int stripe;
     *val = NULL;
     if (hash >= cache_data->entries)
         hash = cache_data->entries -1;
 
-    if (!rd_lock_page(cache_data, hash))
-        return NULL;
-    unsigned int page = (hash >> cache_data->page_shift_op);
-    ++cache_data->stats->page[page].searches;
-    unsigned int pos;
-    int done;
-    for (pos = hash, done = 0, cache_key = NULL;
-            !cache_key && !done && ((pos >> cache_data->page_shift_op) == page);
-            ++pos) {
-        struct shared_cache_slot *slot = cache_data->slots + (pos * cache_data->entry_size);
-        cache_key = (const void *)slot->bytes;
-        cache_val = (const void *)(&slot->bytes[slot->key_size + 1]);
-
-        if (slot->hash != hash) {
-            cache_key = NULL;
-            done = 1;
-        } else if (cache->key_ops->compare(cache_key, key) == 0) {
-            current_time = ci_internal_time();
-            if (slot->expires < current_time)
-                cache_key = NULL;
-            else if (slot->value_size) {
-                if (dup_from_cache)
-                    *val = (*dup_from_cache)(cache_val, slot->value_size, user_data);
-                else {
-                    if ((*val = ci_buffer_alloc(slot->value_size)))
-                        memcpy(*val, cache_val, slot->value_size);
-                }
-            }
-        } else
-            cache_key = NULL;
+    stripe = (hash >> cache_data->stripe_shift);
+    ci_stat_uint64_inc(cache_data->stat.searches, 1);
+    for (attempt = 0; ; ++attempt) {
+        locked = (attempt >= CACHE_READ_RETRIES);
+        if (locked)
+            stripe_lock(cache_data, stripe);
+        else
+            seq = stripe_read_begin(cache_data, stripe);
+
+        cache_key = shared_cache_read(cache, cache_data, hash, key, key_size, val_buf, &cache_val, &val_size);
+
+        if (locked) {
+            stripe_unlock(cache_data, stripe);
+            break;
+        }
+        if (!stripe_read_retry(cache_data, stripe, seq))
+            break;
+        /*The entry modified while it was copied*/
+        if (cache_val && cache_val != val_buf)
+            ci_buffer_free(cache_val);
+        ci_stat_uint64_inc(cache_data->stat.read_retries, 1);
+    }
+
+    if (cache_key && cache_val) {
+        if (dup_from_cache)
+            *val = (*dup_from_cache)(cache_val, val_size, user_data);
+        else if (cache_val != val_buf)
+            *val = cache_val;
+        else if ((*val = ci_buffer_alloc(val_size)))
+            memcpy(*val, cache_val, val_size);
     }
+    if (cache_val && cache_val != val_buf && cache_val != *val)
+        ci_buffer_free(cache_val);
 
     if (cache_key)
-        ++cache_data->stats->page[page].hits;
+        ci_stat_uint64_inc(cache_data->stat.hits, 1);
 
-    unlock_page(cache_data, hash);
     return cache_key;
 }
 
 int ci_shared_cache_update(struct ci_cache *cache, const void *key, const void *val, size_t val_size, void *(*copy_to_cache)(void *buf, const void *val, size_t buf_size))
 {
-    time_t expire_time, current_time;
-    void *cache_key, *cache_val;
+    time_t current_time;
+    struct shared_cache_entry *entry, *target;
+    struct shared_cache_chunk *chunk;
     size_t key_size;
-    int ret, can_updated;
+    uint32_t pos, target_pos, ref;
+    int i, cls, entry_cls;
     struct shared_cache_data *cache_data = cache->cache_data;
     key_size = cache->key_ops->size(key);
-    if ((key_size + val_size + sizeof(struct shared_cache_slot)) > cache_data->entry_size) {
-        /*Does not fit to a cache_data slot.*/
+    ci_stat_uint64_inc(cache_data->stat.updates, 1);
+    if ((cls = chunk_class(cache_data, key_size, val_size)) < 0) {
+        /*Does not fit to the largest chunks.*/
         return 0;
     }
 
@@ -263,85 +967,340 @@ int ci_shared_cache_update(struct ci_cache *cache, const void *key, const void *
     if (hash >= cache_data->entries)
         hash = cache_data->entries -1;
 
-    current_time = ci_internal_time();
-    expire_time = current_time + cache->ttl;
-
-    if (!rw_lock_page(cache_data, hash))
-        return 0; /*not able to obtain a rw lock*/
-
-    unsigned int page = (hash >> cache_data->page_shift_op);
-    ++cache_data->stats->page[page].updates;
-
-    unsigned int pos;
-    int done;
-    for (pos = hash, ret = 0, done = 0;
-            ret == 0 && !done && ((hash >> cache_data->page_shift_op) == (pos >> cache_data->page_shift_op));
-            ++pos) {
-        struct shared_cache_slot *slot = cache_data->slots + (pos * cache_data->entry_size);
-
-        cache_key = (void *)slot->bytes;
-        can_updated = 0;
-        if (slot->hash < hash) {
-            can_updated = 1;
-        } else if (cache->key_ops->compare(cache_key, key) == 0) {
-            /*we are updating key with a new value*/
-            can_updated = 1;
-        } else if (slot->expires < current_time + cache->ttl) {
-            can_updated = 1;
-        } else if (pos == hash && slot->expires < (current_time + (cache->ttl / 2))) {
-            /*entries on pos == hash which are near to expire*/
-            can_updated = 1;
-        } else if (pos != hash && slot->hash == pos) {
-            /*entry is not expired, and it is not on a continues block we can use  */
-            done = 1;
+    current_time = ci_coarse_time();
+    unsigned int stripe = (hash >> cache_data->stripe_shift);
+    stripe_lock(cache_data, stripe);
+
+    /*Use the entry of the key if exists, else an empty or expired
+      entry, else the entry which expires first*/
+    target = NULL;
+    target_pos = 0;
+    for (i = 0; i < CACHE_PROBES; ++i) {
+        pos = probe_pos(cache_data, hash, i);
+        entry = &cache_data->index[pos];
+        chunk = chunk_get(cache_data, entry->chunk, &entry_cls);
+        if (chunk && entry->hash == hash && entry->key_size == key_size &&
+                cache->key_ops->compare(chunk->bytes, key) == 0) {
+            target = entry;
+            target_pos = pos;
+            break;
         }
-        if (can_updated) {
-            slot->hash = pos;
-            slot->expires = expire_time;
-            slot->key_size = key_size;
-            slot->value_size = val_size;
-            memcpy(cache_key, key, key_size);
-            cache_val = (void *)(&slot->bytes[slot->key_size + 1]);
-            if (copy_to_cache)
-                copy_to_cache(cache_val, val, slot->value_size);
-            else
-                memcpy(cache_val, val, slot->value_size);
-            ret = 1;
-            ++cache_data->stats->page[page].update_hits;
-        } else
-            ret = 0;
-    }
-
-    unlock_page(cache_data, hash);
-    return ret;
+        if (!target || (target->chunk && (!chunk || entry->expires < target->expires))) {
+            target = entry;
+            target_pos = pos;
+        }
+    }
+
+    ref = target->chunk;
+    if (ref && (!(chunk = chunk_get(cache_data, ref, &entry_cls)) || entry_cls != cls)) {
+        target->chunk = 0;
+        chunk_free(cache_data, ref);
+        ref = 0;
+    }
+    if (!ref)
+        ref = chunk_alloc(cache_data, cls, target_pos);
+
+    if (ref) {
+        chunk = (struct shared_cache_chunk *)(cache_data->data + (((size_t)ref - 1) << 3));
+        memcpy(chunk->bytes, key, key_size);
+        chunk->bytes[key_size] = '\0';
+        if (copy_to_cache)
+            copy_to_cache(&chunk->bytes[key_size + 1], val, val_size);
+        else
+            memcpy(&chunk->bytes[key_size + 1], val, val_size);
+        target->hash = hash;
+        target->key_size = key_size;
+        target->value_size = val_size;
+        target->expires = current_time + cache->ttl;
+        target->referenced = 0;
+        target->chunk = ref;
+    }
+
+    stripe_unlock(cache_data, stripe);
+    if (ref)
+        ci_stat_uint64_inc(cache_data->stat.update_hits, 1);
+    return ref != 0;
 }
 
 void ci_shared_cache_destroy(struct ci_cache *cache)
 {
-    int i, users;
-    uint64_t updates, update_hits, searches, hits;
+    int users;
     struct shared_cache_data *data = cache->cache_data;
     ci_proc_mutex_lock(&data->cache_mutex);
-    users = --data->stats->cache_users;
+    users = --data->header->cache_users;
     ci_proc_mutex_unlock(&data->cache_mutex);
     if (users == 0) {
-        updates = update_hits = searches = hits = 0;
-        for (i = 0; i < CACHE_PAGES; ++i) {
-            updates += data->stats->page[i].updates;
-            update_hits += data->stats->page[i].update_hits;
-            searches += data->stats->page[i].searches;
-            hits += data->stats->page[i].hits;
-        }
         ci_debug_printf(3, "Last user, the cache will be destroyed\n");
-        ci_debug_printf(3, "Cache updates: %" PRIu64 ", update hits:%" PRIu64 ", searches: %" PRIu64 ", hits: %" PRIu64 "\n",
-                        updates, update_hits, searches, hits
-                       );
         ci_shared_mem_destroy(&data->id);
         ci_proc_mutex_destroy(&data->cache_mutex);
-        for (i = 0; i < CACHE_PAGES; ++i) {
-            ci_proc_mutex_destroy(&data->mutex[i]);
-        }
+#if !defined(USE_CACHE_SEQLOCK)
+        ci_proc_mutex_destroy(&data->mutex);
+#endif
     } else
         ci_shared_mem_detach(&data->id);
 }
 
+#if defined(USE_CACHE_SEQLOCK)
+/*
+  The mmap cache uses the shared cache layout over a file backed shared
+  mapping. The mapping is created by the main process and inherited by
+  the children. Every process which uses the file holds a shared flock
+  on it, so a new main process can tell if the file is still used, for
+  example by the children of a reconfigured server.
+  A file which is not in use is recovered when opened: the locks are
+  reset, the entries of stripes which were locked are dropped, and the
+  free chunk lists are rebuilt from the index.
+*/
+static void mmap_cache_path(char *buf, size_t size, const char *name)
+{
+    char fname[65];
+    int i;
+    for (i = 0; name[i] && i < sizeof(fname) - 1; ++i)
+        fname[i] = isalnum((unsigned char)name[i]) ? name[i] : '_';
+    fname[i] = '\0';
+    snprintf(buf, size, "%s/c-icap-%s-%08x.cache",
+             MMAP_CACHE_DIR, fname,
+             ci_hash_compute(0xFFFFFFFF, name, 0));
+}
+
+/*
+  The cache contents are trusted when the file is reopened, so the cache
+  directory and file must be private to the c-icap user: owned by it and
+  not writable (the file not accessible at all) by other users.
+*/
+static int mmap_cache_dir_check()
+{
+    struct stat st;
+    if (!MMAP_CACHE_DIR) {
+        ci_debug_printf(1, "The mmap caches require the shared_cache.MmapCacheDir directory\n");
+        return 0;
+    }
+    if (stat(MMAP_CACHE_DIR, &st) != 0) {
+        ci_debug_printf(1, "Error accessing mmap cache directory %s: %s\n", MMAP_CACHE_DIR, strerror(errno));
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        ci_debug_printf(1, "The mmap cache directory %s must be owned by the c-icap user and not writable by others\n", MMAP_CACHE_DIR);
+        return 0;
+    }
+    return 1;
+}
+
+static int mmap_cache_open(const char *path)
+{
+    struct stat st;
+    int fd;
+    if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+        ci_debug_printf(1, "Error opening mmap cache file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+            st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        ci_debug_printf(1, "The mmap cache file %s is not a private file of the c-icap user, refusing to use it\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int mmap_cache_valid(struct shared_cache_data *data)
+{
+    struct shared_cache_layout layout;
+    struct shared_cache_header *header = data->header;
+    if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION)
+        return 0;
+    if (header->checksum != ci_hash_compute(0xFFFFFFFF, &header->layout, sizeof(struct shared_cache_layout)))
+        return 0;
+    shared_cache_layout_get(data, &layout);
+    return memcmp(&layout, &header->layout, sizeof(struct shared_cache_layout)) == 0;
+}
+
+static void mmap_cache_recover(struct shared_cache_data *data)
+{
+    struct shared_cache_entry *entry;
+    struct shared_cache_chunk *chunk;
+    struct shared_cache_class *c;
+    unsigned char *used;
+    uint32_t pos, ref, per_page, n;
+    int i, page, cls, dropped = 0;
+    int entries[CACHE_CLASSES_MAX];
+    size_t used_size = (data->pages * data->page_size) / CACHE_CLASS_MIN_SIZE;
+
+    if (data->header->state != CACHE_STATE_CLEAN)
+        ci_debug_printf(1, "The mmap cache %s was not closed cleanly, recovering\n", data->path);
+
+    for (i = 0; i < data->stripes; ++i) {
+        if (data->stripe[i].seq & 1) {
+            pos = i << data->stripe_shift;
+            memset(&data->index[pos], 0, sizeof(struct shared_cache_entry) << data->stripe_shift);
+        }
+        data->stripe[i].seq = 0;
+        data->stripe[i].owner = 0;
+    }
+    if (data->header->next_page > data->pages || data->header->next_page < 0)
+        data->header->next_page = data->pages;
+
+    data->header->stats_reporter = 0;
+
+    /*Keep the chunks referenced by valid entries*/
+    memset(entries, 0, sizeof(entries));
+    used = calloc(used_size, 1);
+    for (pos = 0; pos < data->entries; ++pos) {
+        entry = &data->index[pos];
+        if (!entry->chunk)
+            continue;
+        chunk = chunk_get(data, entry->chunk, &cls);
+        if (!chunk || chunk->owner != pos ||
+                sizeof(struct shared_cache_chunk) + entry->key_size + 1 + entry->value_size + 1 > data->class_size[cls] ||
+                (used && used[(((size_t)entry->chunk - 1) << 3) / CACHE_CLASS_MIN_SIZE])) {
+            memset(entry, 0, sizeof(struct shared_cache_entry));
+            dropped++;
+            continue;
+        }
+        if (used)
+            used[(((size_t)entry->chunk - 1) << 3) / CACHE_CLASS_MIN_SIZE] = 1;
+        entries[cls]++;
+    }
+
+    /*Rebuild the free lists from the other chunks of the class pages*/
+    for (cls = 0; cls < data->classes; ++cls) {
+        c = &data->class[cls];
+        memset(&c->lock, 0, sizeof(struct shared_cache_lock));
+        c->free_head = 0;
+        c->pages = 0;
+        c->entries = entries[cls];
+        c->hand_page = -1;
+        c->hand_chunk = 0;
+        per_page = data->page_size / data->class_size[cls];
+        if (c->carve_page >= data->header->next_page || (c->carve_page >= 0 && data->page_class[c->carve_page] != cls + 1))
+            c->carve_page = -1;
+        if (c->carve_next > per_page)
+            c->carve_next = per_page;
+    }
+    for (page = 0; page < data->header->next_page; ++page) {
+        cls = (int)data->page_class[page] - 1;
+        if (cls < 0 || cls >= data->classes)
+            continue;
+        c = &data->class[cls];
+        c->pages++;
+        per_page = data->page_size / data->class_size[cls];
+        if (page == c->carve_page)
+            per_page = c->carve_next;
+        for (n = 0; n < per_page; ++n) {
+            ref = chunk_ref(data, page, n, cls);
+            if (used && used[(((size_t)ref - 1) << 3) / CACHE_CLASS_MIN_SIZE])
+                continue;
+            chunk = (struct shared_cache_chunk *)(data->data + (((size_t)ref - 1) << 3));
+            chunk->owner = CACHE_CHUNK_FREE;
+            chunk->next = c->free_head;
+            c->free_head = ref;
+        }
+    }
+    free(used);
+    if (dropped)
+        ci_debug_printf(1, "%d invalid entries dropped from mmap cache %s\n", dropped, data->path);
+}
+
+void command_attach_mmap_cache(const char *name, int type, void *data)
+{
+    struct shared_cache_data *cache_data = (struct shared_cache_data *)data;
+    __atomic_add_fetch(&cache_data->header->cache_users, 1, __ATOMIC_RELAXED);
+    command_report_shared_cache_stats(name, type, data);
+}
+
+int ci_mmap_cache_init(struct ci_cache *cache, const char *name)
+{
+    struct stat st;
+    int fd, warm = 0, in_use = 0, entries = 0, i;
+    struct shared_cache_data *data;
+    if (!mmap_cache_dir_check())
+        return 0;
+    data = (struct shared_cache_data *)calloc(1, sizeof(struct shared_cache_data));
+    if (!data)
+        return 0;
+    shared_cache_layout(data, _CI_ALIGN(cache->mem_size), cache->max_object_size);
+    mmap_cache_path(data->path, sizeof(data->path), name);
+
+    if ((fd = mmap_cache_open(data->path)) < 0) {
+        free(data);
+        return 0;
+    }
+    in_use = (flock(fd, LOCK_EX | LOCK_NB) != 0);
+    if (fstat(fd, &st) == 0 && st.st_size == data->shared_mem_size)
+        warm = 1;
+    else if (in_use) {
+        ci_debug_printf(1, "The mmap cache file %s is in use with a different size\n", data->path);
+        close(fd);
+        free(data);
+        return 0;
+    } else if (ftruncate(fd, 0) != 0 || ftruncate(fd, data->shared_mem_size) != 0) {
+        ci_debug_printf(1, "Error resizing mmap cache file %s: %s\n", data->path, strerror(errno));
+        close(fd);
+        free(data);
+        return 0;
+    }
+
+    data->mem_ptr = mmap(NULL, data->shared_mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data->mem_ptr == MAP_FAILED) {
+        ci_debug_printf(1, "Error mapping mmap cache file %s: %s\n", data->path, strerror(errno));
+        close(fd);
+        free(data);
+        return 0;
+    }
+    data->fd = fd;
+    shared_cache_set_pointers(data);
+
+    if (warm && !mmap_cache_valid(data)) {
+        if (in_use) {
+            ci_debug_printf(1, "The mmap cache file %s is in use with a different layout\n", data->path);
+            munmap(data->mem_ptr, data->shared_mem_size);
+            close(fd);
+            free(data);
+            return 0;
+        }
+        ci_debug_printf(1, "The mmap cache file %s has an incompatible layout, resetting\n", data->path);
+        memset(data->mem_ptr, 0, data->shared_mem_size);
+        warm = 0;
+    }
+
+    shared_cache_stats_register(data, name);
+    if (!warm)
+        shared_cache_format(data);
+    else if (in_use) {
+        __atomic_add_fetch(&data->header->cache_users, 1, __ATOMIC_RELAXED);
+    } else {
+        mmap_cache_recover(data);
+        data->header->cache_users = 1;
+        data->header->state = CACHE_STATE_OPEN;
+    }
+    if (warm) {
+        for (i = 0; i < data->classes; ++i)
+            entries += data->class[i].entries;
+    }
+    flock(fd, LOCK_SH);
+    msync(data->mem_ptr, data->classes_offset, MS_SYNC);
+
+    shared_cache_print_info(data, cache, name, "Mmap cache");
+    if (warm)
+        ci_debug_printf(1, "Mmap cache %s reopened from %s with %d entries%s\n", name, data->path, entries, in_use ? ", shared with running processes" : "");
+
+    cache->cache_data = data;
+    ci_command_register_action("mmap_cache_attach_cmd", CHILD_START_CMD, data, command_attach_mmap_cache);
+    ci_command_register_action("shared_cache_stats_cmd", ONDEMAND_CMD, NULL, command_report_shared_cache_stats);
+    ci_command_register_action("shared_cache_stats_stop_cmd", CHILD_STOP_CMD, data, command_stop_shared_cache_stats);
+    return 1;
+}
+
+void ci_mmap_cache_destroy(struct ci_cache *cache)
+{
+    struct shared_cache_data *data = cache->cache_data;
+    if (__atomic_sub_fetch(&data->header->cache_users, 1, __ATOMIC_RELAXED) == 0) {
+        ci_debug_printf(3, "Last user, closing the mmap cache %s\n", data->path);
+        data->header->state = CACHE_STATE_CLEAN;
+        msync(data->mem_ptr, data->shared_mem_size, MS_SYNC);
+    }
+    munmap(data->mem_ptr, data->shared_mem_size);
+    close(data->fd);
+    free(data);
+}
+#endif
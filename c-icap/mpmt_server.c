@@ -51,6 +51,7 @@
 #include "cfg_param.h"
 #include "commands.h"
 #include "util.h"
+#include "stats.h"
 
 #define MULTICHILD
 //#undef MULTICHILD
@@ -957,6 +958,7 @@ void child_main(int pipefd)
             child_data->to_be_killed = GRACEFULLY;
         }
         commands_exec_scheduled();
+        ci_stat_publish();
     }
 
     ci_debug_printf(5, "Child :%d going down :%s\n", getpid(),
@@ -964,6 +966,7 @@ void child_main(int pipefd)
                     "IMMEDIATELY" : "GRACEFULLY");
 
     cancel_all_threads();
+    ci_stat_publish();
     commands_execute_stop_child();
     exit_normaly();
 }
@@ -1151,6 +1154,7 @@ int start_server()
 
             if (c_icap_going_to_term)
                 break;
+            childs_queue_stats_sample(childs_queue);
             childs_queue_stats(childs_queue, &childs, &freeservers, &used,
                                &maxrequests);
             ci_debug_printf(10,
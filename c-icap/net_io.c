@@ -345,6 +345,37 @@ int ci_connection_wait(ci_connection_t *conn, int secs, int what_wait)
     return ci_wait_for_data(conn->fd, secs, what_wait);
 }
 
+int ci_connection_wait_rw(ci_connection_t *conn, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    assert(conn);
+#ifdef USE_OPENSSL
+    if (conn->bio) {
+        int ret, bytes;
+        int rsize = (what_wait & ci_wait_for_read) ? *rlen : 0;
+        int wcnt = (what_wait & ci_wait_for_write) ? wiovcnt : 0;
+        if (rlen)
+            *rlen = 0;
+        if (wlen)
+            *wlen = 0;
+        ret = ci_connection_wait_tls(conn, secs, what_wait);
+        if (ret <= 0 || (ret & ci_wait_should_retry))
+            return ret;
+        if ((ret & ci_wait_for_read) && rsize) {
+            if ((bytes = ci_connection_read_nonblock_tls(conn, rbuf, rsize)) < 0)
+                return -1;
+            *rlen = bytes;
+        }
+        if ((ret & ci_wait_for_write) && wcnt) {
+            if ((bytes = ci_connection_writev_nonblock(conn, wiov, wiovcnt)) < 0)
+                return -1;
+            *wlen = bytes;
+        }
+        return ret;
+    }
+#endif
+    return ci_connection_wait_rw_raw(conn, secs, what_wait, rbuf, rlen, wiov, wiovcnt, wlen);
+}
+
 int ci_connection_read(ci_connection_t *conn, void *buf, size_t count, int timeout)
 {
     assert(conn);
@@ -385,6 +416,39 @@ int ci_connection_write_nonblock(ci_connection_t *conn, void *buf, size_t count)
     return ci_write_nonblock(conn->fd, buf, count);
 }
 
+int ci_connection_writev_nonblock(ci_connection_t *conn, const struct iovec *iov, int iovcnt)
+{
+    assert(conn);
+#ifdef USE_OPENSSL
+    if (conn->bio) {
+        /*Write the buffers one by one, until a short write*/
+        int i, bytes, written = 0;
+        for (i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len == 0)
+                continue;
+            bytes = ci_connection_write_nonblock_tls(conn, iov[i].iov_base, iov[i].iov_len);
+            if (bytes < 0)
+                return written > 0 ? written : -1;
+            written += bytes;
+            if (bytes < (int)iov[i].iov_len)
+                break;
+        }
+        return written;
+    }
+#endif
+    return ci_writev_nonblock(conn->fd, iov, iovcnt);
+}
+
+int ci_connection_sendfile_nonblock(ci_connection_t *conn, int file_fd, ci_off_t offset, size_t count)
+{
+    assert(conn);
+#ifdef USE_OPENSSL
+    if (conn->bio)
+        return ci_connection_sendfile_nonblock_tls(conn, file_fd, offset, count);
+#endif
+    return ci_sendfile_nonblock(conn->fd, file_fd, offset, count);
+}
+
 int ci_connection_linger_close(ci_connection_t *conn, int timeout)
 {
     assert(conn);
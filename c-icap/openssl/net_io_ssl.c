@@ -626,6 +626,41 @@ int ci_connection_write_nonblock_tls(ci_connection_t *conn, const void *buf, siz
     return bytes;
 }
 
+int ci_connection_sendfile_nonblock_tls(ci_connection_t *conn, int file_fd, ci_off_t offset, size_t count)
+{
+    char buf[8192];
+    int bytes;
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(OPENSSL_NO_KTLS)
+    SSL *ssl = NULL;
+    assert(conn && conn->bio);
+    BIO_get_ssl(conn->bio, &ssl);
+    if (ssl && BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        /*Kernel TLS is used, the kernel encrypts the file data*/
+        ossl_ssize_t sent = SSL_sendfile(ssl, file_fd, offset, count, 0);
+        if (sent <= 0) {
+            int err = SSL_get_error(ssl, (int)sent);
+            return (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? 0 : -1;
+        }
+        return (int)sent;
+    }
+#endif
+    assert(conn && conn->bio);
+    if (count > sizeof(buf))
+        count = sizeof(buf);
+#if defined(HAVE_PREAD)
+    do {
+        bytes = pread(file_fd, buf, count, offset);
+    } while (bytes < 0 && errno == EINTR);
+#else
+    if (lseek(file_fd, offset, SEEK_SET) < 0)
+        return -1;
+    bytes = read(file_fd, buf, count);
+#endif
+    if (bytes <= 0)
+        return -1;
+    return ci_connection_write_nonblock_tls(conn, buf, bytes);
+}
+
 int ci_connection_hard_close_tls(ci_connection_t *conn)
 {
     assert(conn && conn->bio);
@@ -27,13 +27,24 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#endif
 #if defined(USE_POLL)
 #include <poll.h>
 #else
 #include <sys/select.h>
 #endif
+#if defined(USE_IO_URING)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "debug.h"
 #include "net_io.h"
+#include "util.h"
 
 
 const char *ci_sockaddr_t_to_host(ci_sockaddr_t * addr, char *hname,
@@ -360,6 +371,412 @@ int ci_wait_for_data(int fd, int secs, int what_wait)
 #endif
 
 
+#if defined(USE_IO_URING)
+/*
+  io_uring based socket I/O.
+  Every thread owns a small ring, created on first use. The receive
+  and/or send operations are submitted and waited, with the timeout
+  passed as an io_uring_enter(2) argument, by a single io_uring_enter
+  call, which replaces the poll(2) followed by the read(2)/write(2)
+  calls. If the kernel does not support io_uring the classic
+  poll/read/write path is used.
+*/
+
+#define URING_ENTRIES    8
+#define URING_RECV       0
+#define URING_SEND       1
+#define URING_CANCEL     2
+#define URING_FALLBACK   -100
+#define URING_NOWAIT     -101 /*The socket was not waited, use poll*/
+
+struct ci_uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static pthread_key_t URING_KEY;
+static pthread_once_t URING_KEY_ONCE = PTHREAD_ONCE_INIT;
+static volatile int URING_DISABLED = 0;
+
+static void uring_destroy(void *data)
+{
+    struct ci_uring *ring = (struct ci_uring *)data;
+    if (!ring)
+        return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+static void uring_key_init()
+{
+    if (pthread_key_create(&URING_KEY, uring_destroy) != 0)
+        URING_DISABLED = 1;
+}
+
+static struct ci_uring *uring_create()
+{
+    struct io_uring_params p;
+    struct ci_uring *ring;
+    void *addr;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        ci_debug_printf(3, "io_uring is not supported (errno=%d), using poll for network I/O\n", errno);
+        URING_DISABLED = 1;
+        return NULL;
+    }
+
+    /*Without fast poll every pending receive occupies a kernel worker*/
+    if (!(p.features & IORING_FEAT_FAST_POLL) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        ci_debug_printf(3, "io_uring fast poll or timed waits are not supported, using poll for network I/O\n");
+        URING_DISABLED = 1;
+        close(fd);
+        return NULL;
+    }
+
+    if (!(ring = calloc(1, sizeof(struct ci_uring)))) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+
+    addr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (addr == MAP_FAILED)
+        goto uring_create_fail;
+    ring->sq_ring = addr;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        addr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (addr == MAP_FAILED)
+            goto uring_create_fail;
+        ring->cq_ring = addr;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    addr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (addr == MAP_FAILED)
+        goto uring_create_fail;
+    ring->sqes = addr;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return ring;
+
+uring_create_fail:
+    ci_debug_printf(1, "Failed to map io_uring rings (errno=%d), using poll for network I/O\n", errno);
+    URING_DISABLED = 1;
+    uring_destroy(ring);
+    return NULL;
+}
+
+static struct ci_uring *uring_get()
+{
+    struct ci_uring *ring;
+    if (URING_DISABLED)
+        return NULL;
+
+    pthread_once(&URING_KEY_ONCE, uring_key_init);
+    if (URING_DISABLED)
+        return NULL;
+
+    if ((ring = pthread_getspecific(URING_KEY)) != NULL)
+        return ring;
+
+    if ((ring = uring_create()) != NULL)
+        pthread_setspecific(URING_KEY, ring);
+    return ring;
+}
+
+static struct io_uring_sqe *uring_sqe(struct ci_uring *ring, unsigned *tail, int op, int fd, int id)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index = *tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = id;
+    ring->sq_array[index] = index;
+    (*tail)++;
+    return sqe;
+}
+
+/*Submits the queued entries and waits at most usecs microseconds, or for
+  ever if usecs is negative, for wait completions*/
+static int uring_enter(struct ci_uring *ring, unsigned submit, unsigned wait, int64_t usecs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if (usecs >= 0) {
+        ts.tv_sec = usecs / 1000000;
+        ts.tv_nsec = (usecs % 1000000) * 1000;
+        arg.ts = (unsigned long)&ts;
+    }
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                   (wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static void uring_reap(struct ci_uring *ring, int *done, int *res, unsigned *inflight)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data < URING_CANCEL) {
+            done[cqe->user_data] = 1;
+            res[cqe->user_data] = cqe->res;
+        }
+        (*inflight)--;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_rw(struct ci_uring *ring, int fd, int secs, int what_wait,
+                    void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    struct io_uring_sqe *sqe;
+    struct msghdr msg;
+    int done[URING_CANCEL] = {0, 0}, res[URING_CANCEL] = {0, 0};
+    int queued[URING_CANCEL] = {0, 0};
+    int order[URING_CANCEL];
+    unsigned tail, submit = 0, inflight = 0;
+    int i, ret, interrupted = 0, timedout = 0, rclosed = 0;
+    int64_t usecs = secs >= 0 ? (int64_t)secs * 1000000 : -1;
+    uint64_t deadline = 0;
+
+    tail = *ring->sq_tail;
+    if (what_wait & ci_wait_for_read) {
+        sqe = uring_sqe(ring, &tail, IORING_OP_RECV, fd, URING_RECV);
+        sqe->addr = (unsigned long)rbuf;
+        sqe->len = *rlen;
+        order[submit++] = URING_RECV;
+    }
+    if ((what_wait & ci_wait_for_write) && wiovcnt == 1) {
+        sqe = uring_sqe(ring, &tail, IORING_OP_SEND, fd, URING_SEND);
+        sqe->addr = (unsigned long)wiov[0].iov_base;
+        sqe->len = wiov[0].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        order[submit++] = URING_SEND;
+    } else if (what_wait & ci_wait_for_write) {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = (struct iovec *)wiov;
+        msg.msg_iovlen = wiovcnt;
+        sqe = uring_sqe(ring, &tail, IORING_OP_SENDMSG, fd, URING_SEND);
+        sqe->addr = (unsigned long)&msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        order[submit++] = URING_SEND;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    if (usecs >= 0)
+        deadline = ci_clock_usec() + usecs;
+    errno = 0;
+    ret = uring_enter(ring, submit, 1, usecs);
+    if (ret < (int)submit) {
+        /*Drop the entries not consumed by the kernel*/
+        if (ret < 0)
+            ret = 0;
+        __atomic_store_n(ring->sq_tail, tail - (submit - ret), __ATOMIC_RELEASE);
+        if (ret == 0) {
+            if (errno == EINTR)
+                return ci_wait_should_retry;
+            ci_debug_printf(3, "io_uring_enter failed (errno=%d), using poll for network I/O\n", errno);
+            if (errno == EINVAL || errno == EOPNOTSUPP)
+                URING_DISABLED = 1;
+            return URING_FALLBACK;
+        }
+        submit = ret;
+    }
+    for (i = 0; i < (int)submit; i++)
+        queued[order[i]] = 1;
+    inflight = submit;
+
+    /*The io_uring_enter returns the number of submitted entries even if
+      its wait is interrupted or expires, check the time left*/
+    for (;;) {
+        uring_reap(ring, done, res, &inflight);
+        if (done[URING_RECV] || done[URING_SEND] || inflight == 0)
+            break;
+        if (usecs >= 0 && (usecs = (int64_t)(deadline - ci_clock_usec())) <= 0) {
+            timedout = 1;
+            break;
+        }
+        errno = 0;
+        if (uring_enter(ring, 0, 1, usecs) < 0) {
+            if (errno == EINTR) {
+                interrupted = 1;
+                break;
+            }
+            if (errno == ETIME) {
+                timedout = 1;
+                break;
+            }
+        }
+    }
+
+    /*The buffers must not be used by the kernel after we return,
+      cancel any pending operation and wait for it.*/
+    submit = 0;
+    tail = *ring->sq_tail;
+    if (queued[URING_RECV] && !done[URING_RECV]) {
+        sqe = uring_sqe(ring, &tail, IORING_OP_ASYNC_CANCEL, -1, URING_CANCEL);
+        sqe->addr = URING_RECV;
+        submit++;
+    }
+    if (queued[URING_SEND] && !done[URING_SEND]) {
+        sqe = uring_sqe(ring, &tail, IORING_OP_ASYNC_CANCEL, -1, URING_CANCEL);
+        sqe->addr = URING_SEND;
+        submit++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    inflight += submit;
+
+    while (inflight > 0) {
+        if ((ret = uring_enter(ring, submit, inflight, -1)) > 0)
+            submit -= (ret < (int)submit ? ret : (int)submit);
+        uring_reap(ring, done, res, &inflight);
+    }
+
+    ret = 0;
+    *rlen = 0;
+    *wlen = 0;
+    if (done[URING_RECV]) {
+        if (res[URING_RECV] > 0) {
+            *rlen = res[URING_RECV];
+            ret |= ci_wait_for_read;
+        } else if (res[URING_RECV] == 0 ||
+                   (res[URING_RECV] != -ECANCELED && res[URING_RECV] != -EAGAIN && res[URING_RECV] != -EINTR)) {
+            /*EOF or connection error*/
+            rclosed = 1;
+        }
+    }
+    if (done[URING_SEND]) {
+        if (res[URING_SEND] >= 0) {
+            *wlen = res[URING_SEND];
+            ret |= ci_wait_for_write;
+        } else if (res[URING_SEND] != -ECANCELED && res[URING_SEND] != -EAGAIN && res[URING_SEND] != -EINTR) {
+            return -1;
+        }
+    }
+    /*Report the data written in the same round, the next receive will
+      return the EOF or error again*/
+    if (rclosed && !(ret & ci_wait_for_write))
+        return -1;
+    if (ret == 0 && interrupted)
+        return ci_wait_should_retry;
+    if (ret == 0 && !timedout)
+        return URING_NOWAIT;
+    return ret;
+}
+#endif
+
+/*
+  If conn_flags is not NULL, the CI_CONNECTION_NO_URING flag is set when
+  the kernel does not wait for the socket using the io_uring, and the
+  next calls for the connection use poll.
+*/
+static int wait_rw(int fd, int32_t *conn_flags, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    int ret, bytes, i;
+#if defined(USE_IO_URING)
+    struct ci_uring *ring;
+#endif
+    int rsize = (what_wait & ci_wait_for_read) ? *rlen : 0;
+    int wsize = 0;
+
+    if (what_wait & ci_wait_for_write) {
+        for (i = 0; i < wiovcnt; i++)
+            wsize += wiov[i].iov_len;
+    }
+    if (!rsize)
+        what_wait &= ~ci_wait_for_read;
+    if (!wsize)
+        what_wait &= ~ci_wait_for_write;
+#if defined(USE_IO_URING)
+    if (what_wait && !(conn_flags && (*conn_flags & CI_CONNECTION_NO_URING)) &&
+            (ring = uring_get()) != NULL) {
+        ret = uring_rw(ring, fd, secs, what_wait, rbuf, &rsize, wiov, wiovcnt, &wsize);
+        if (ret == URING_NOWAIT && conn_flags)
+            *conn_flags |= CI_CONNECTION_NO_URING;
+        if (ret != URING_FALLBACK && ret != URING_NOWAIT) {
+            if (rlen)
+                *rlen = rsize;
+            if (wlen)
+                *wlen = wsize;
+            return ret;
+        }
+    }
+#endif
+    if (rlen)
+        *rlen = 0;
+    if (wlen)
+        *wlen = 0;
+
+    ret = ci_wait_for_data(fd, secs, what_wait);
+    if (ret <= 0 || (ret & ci_wait_should_retry))
+        return ret;
+
+    if ((ret & ci_wait_for_read) && rsize) {
+        if ((bytes = ci_read_nonblock(fd, rbuf, rsize)) < 0)
+            return -1;
+        *rlen = bytes;
+    }
+    if ((ret & ci_wait_for_write) && wsize) {
+        if ((bytes = ci_writev_nonblock(fd, wiov, wiovcnt)) < 0)
+            return -1;
+        *wlen = bytes;
+    }
+    return ret;
+}
+
+int ci_wait_rw(int fd, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    return wait_rw(fd, NULL, secs, what_wait, rbuf, rlen, wiov, wiovcnt, wlen);
+}
+
+int ci_connection_wait_rw_raw(ci_connection_t *conn, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    return wait_rw(conn->fd, &conn->flags, secs, what_wait, rbuf, rlen, wiov, wiovcnt, wlen);
+}
+
 int ci_read(int fd, void *buf, size_t count, int timeout)
 {
     int bytes = 0;
@@ -368,17 +785,16 @@ int ci_read(int fd, void *buf, size_t count, int timeout)
     } while (bytes == -1 && errno == EINTR);
 
     if (bytes == -1 && errno == EAGAIN) {
-        int ret;
+        int ret, rlen;
         do {
-            ret = ci_wait_for_data(fd, timeout, wait_for_read);
-        } while (ret & ci_wait_should_retry);
+            rlen = count;
+            ret = ci_wait_rw(fd, timeout, wait_for_read, buf, &rlen, NULL, 0, NULL);
+        } while (ret > 0 && (ret & ci_wait_should_retry));
 
         if (ret <= 0)  /*timeout or connection closed*/
             return -1;
 
-        do {
-            bytes = read(fd, buf, count);
-        } while (bytes == -1 && errno == EINTR);
+        bytes = rlen;
     }
     if (bytes == 0) {
         return -1;
@@ -399,18 +815,18 @@ int ci_write(int fd, const void *buf, size_t count, int timeout)
         } while (bytes == -1 && errno == EINTR);
 
         if (bytes == -1 && errno == EAGAIN) {
-            int ret;
+            int ret, wlen;
+            struct iovec iov;
+            iov.iov_base = b;
+            iov.iov_len = remains;
             do {
-                ret = ci_wait_for_data(fd, timeout, wait_for_write);
-            } while (ret & ci_wait_should_retry);
+                ret = ci_wait_rw(fd, timeout, wait_for_write, NULL, NULL, &iov, 1, &wlen);
+            } while (ret > 0 && (ret & ci_wait_should_retry));
 
             if (ret <= 0) /*timeout or connection closed*/
                 return -1;
 
-            do {
-                bytes = write(fd, b, remains);
-            } while (bytes == -1 && errno == EINTR);
-
+            bytes = wlen;
         }
         if (bytes < 0)
             return bytes;
@@ -455,6 +871,67 @@ int ci_write_nonblock(int fd, const void *buf, size_t count)
     return bytes;
 }
 
+int ci_writev_nonblock(int fd, const struct iovec *iov, int iovcnt)
+{
+    int bytes = 0;
+    do {
+        bytes = writev(fd, iov, iovcnt);
+    } while (bytes == -1 && errno == EINTR);
+
+    if (bytes < 0 && errno == EAGAIN)
+        return 0;
+
+    if (bytes == 0) /*connection is closed?*/
+        return -1;
+
+    return bytes;
+}
+
+
+
+static int sendfile_copy(int sock, int fd, ci_off_t offset, size_t count)
+{
+    char buf[8192];
+    int bytes;
+    if (count > sizeof(buf))
+        count = sizeof(buf);
+#if defined(HAVE_PREAD)
+    do {
+        bytes = pread(fd, buf, count, offset);
+    } while (bytes == -1 && errno == EINTR);
+#else
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    bytes = read(fd, buf, count);
+#endif
+    if (bytes <= 0) /*read error or the file is shorter?*/
+        return -1;
+    return ci_write_nonblock(sock, buf, bytes);
+}
+
+int ci_sendfile_nonblock(int sock, int fd, ci_off_t offset, size_t count)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    int bytes;
+    off_t off = offset;
+    do {
+        bytes = sendfile(sock, fd, &off, count);
+    } while (bytes == -1 && errno == EINTR);
+
+    if (bytes < 0 && errno == EAGAIN)
+        return 0;
+
+    if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) /*not supported for this file*/
+        return sendfile_copy(sock, fd, offset, count);
+
+    if (bytes == 0) /*the file is shorter?*/
+        return -1;
+
+    return bytes;
+#else
+    return sendfile_copy(sock, fd, offset, count);
+#endif
+}
 
 
 int ci_linger_close(int fd, int timeout)
@@ -51,8 +51,7 @@ static const char *months[] = {
 void ci_strtime(char *buf)
 {
     struct tm br_tm;
-    time_t tm;
-    time(&tm);
+    time_t tm = ci_coarse_time();
     asctime_r(localtime_r(&tm, &br_tm), buf);
     buf[STR_TIME_SIZE - 1] = '\0';
     buf[strlen(buf) - 1] = '\0';
@@ -61,8 +60,7 @@ void ci_strtime(char *buf)
 void ci_strtime_rfc822(char *buf)
 {
     struct tm br_tm;
-    time_t tm;
-    time(&tm);
+    time_t tm = ci_coarse_time();
     gmtime_r(&tm, &br_tm);
 
     snprintf(buf, STR_TIME_SIZE, "%s, %.2d %s %d %.2d:%.2d:%.2d GMT",
@@ -90,3 +88,43 @@ int ci_usleep(unsigned long usec)
     nanosleep(&us, &ur);
     return 0;
 }
+
+uint64_t ci_clock_usec()
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    return (uint64_t)time(NULL) * 1000000;
+}
+
+/*The coarse clocks are kept by the kernel in memory shared with the
+  process and updated at every tick, reading them costs no system call*/
+#if defined(CLOCK_REALTIME_COARSE)
+#define CI_CLOCK_REALTIME_COARSE CLOCK_REALTIME_COARSE
+#define CI_CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC_COARSE
+#elif defined(CLOCK_REALTIME_FAST)
+#define CI_CLOCK_REALTIME_COARSE CLOCK_REALTIME_FAST
+#define CI_CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC_FAST
+#endif
+
+time_t ci_coarse_time()
+{
+#if defined(CI_CLOCK_REALTIME_COARSE)
+    struct timespec ts;
+    if (clock_gettime(CI_CLOCK_REALTIME_COARSE, &ts) == 0)
+        return ts.tv_sec;
+#endif
+    return time(NULL);
+}
+
+uint64_t ci_coarse_msec()
+{
+#if defined(CI_CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    if (clock_gettime(CI_CLOCK_MONOTONIC_COARSE, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    return ci_clock_usec() / 1000;
+}
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include "debug.h"
 #include "net_io.h"
+#include <io.h>
 #include "cfg_param.h"
 
 
@@ -311,6 +312,93 @@ int ci_write_nonblock(ci_socket fd, const void *buf, size_t count)
     return bytes;
 }
 
+#define WRITEV_MAX 64
+int ci_writev_nonblock(ci_socket fd, const struct iovec *iov, int iovcnt)
+{
+    WSABUF bufs[WRITEV_MAX];
+    DWORD bytes = 0;
+    int i, ret;
+
+    if (iovcnt > WRITEV_MAX)
+        iovcnt = WRITEV_MAX;
+    for (i = 0; i < iovcnt; i++) {
+        bufs[i].buf = iov[i].iov_base;
+        bufs[i].len = iov[i].iov_len;
+    }
+    do {
+        ret = WSASend(fd, bufs, iovcnt, &bytes, 0, NULL, NULL);
+    } while (ret == SOCKET_ERROR && WSAGetLastError() == WSAEINTR);
+
+    if (ret == SOCKET_ERROR)
+        return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+
+    return bytes;
+}
+
+/*There is not a non blocking sendfile, copy the data through a buffer*/
+int ci_sendfile_nonblock(ci_socket fd, int file_fd, ci_off_t offset, size_t count)
+{
+    char buf[8192];
+    int bytes;
+    if (count > sizeof(buf))
+        count = sizeof(buf);
+    if (_lseeki64(file_fd, offset, SEEK_SET) < 0)
+        return -1;
+    if ((bytes = _read(file_fd, buf, count)) <= 0) /*read error or the file is shorter?*/
+        return -1;
+    do {
+        bytes = send(fd, buf, bytes, 0);
+    } while (bytes == SOCKET_ERROR && WSAGetLastError() == WSAEINTR);
+
+    if (bytes == SOCKET_ERROR)
+        return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+
+    return bytes;
+}
+
+int ci_wait_rw(ci_socket fd, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    int ret, bytes, i;
+    int rsize = (what_wait & ci_wait_for_read) ? *rlen : 0;
+    int wsize = 0;
+
+    if (what_wait & ci_wait_for_write) {
+        for (i = 0; i < wiovcnt; i++)
+            wsize += wiov[i].iov_len;
+    }
+    if (!rsize)
+        what_wait &= ~ci_wait_for_read;
+    if (!wsize)
+        what_wait &= ~ci_wait_for_write;
+    if (rlen)
+        *rlen = 0;
+    if (wlen)
+        *wlen = 0;
+
+    ret = ci_wait_for_data(fd, secs, what_wait);
+    if (ret <= 0)
+        return ret;
+
+    if ((ret & ci_wait_for_read) && rsize) {
+        /*The socket is readable, 0 bytes means the connection is closed*/
+        bytes = ci_read_nonblock(fd, rbuf, rsize);
+        if (bytes == 0 || (bytes == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK))
+            return -1;
+        *rlen = bytes > 0 ? bytes : 0;
+    }
+    if ((ret & ci_wait_for_write) && wsize) {
+        if ((bytes = ci_writev_nonblock(fd, wiov, wiovcnt)) < 0)
+            return -1;
+        *wlen = bytes;
+    }
+    return ret;
+}
+
+int ci_connection_wait_rw_raw(ci_connection_t *conn, int secs, int what_wait, void *rbuf, int *rlen, const struct iovec *wiov, int wiovcnt, int *wlen)
+{
+    return ci_wait_rw(conn->fd, secs, what_wait, rbuf, rlen, wiov, wiovcnt, wlen);
+}
+
 int ci_linger_close(ci_socket fd, int timeout)
 {
     char buf[10];
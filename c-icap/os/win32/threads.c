@@ -42,6 +42,11 @@ int ci_thread_mutex_unlock(ci_thread_mutex_t * pmutex)
     return 0;
 }
 
+int ci_thread_mutex_trylock(ci_thread_mutex_t * pmutex)
+{
+    return TryEnterCriticalSection(pmutex) ? 0 : -1;
+}
+
 int ci_thread_cond_init(ci_thread_cond_t * pcond)
 {
     *pcond = CreateEvent(NULL, FALSE, FALSE, NULL);
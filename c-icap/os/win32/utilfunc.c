@@ -27,6 +27,27 @@
 #include "util.h"
 
 
+uint64_t ci_clock_usec()
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / freq.QuadPart) * 1000000 +
+        (uint64_t)(counter.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+time_t ci_coarse_time()
+{
+    return time(NULL);
+}
+
+uint64_t ci_coarse_msec()
+{
+    return (uint64_t)GetTickCount64();
+}
+
 int strncasecmp(const char *s1, const char *s2, size_t n)
 {
     int r = 0;
@@ -23,6 +23,7 @@
 #include "log.h"
 #include "proc_threads_queues.h"
 #include "shared_mem.h"
+#include "util.h"
 #include <assert.h>
 
 
@@ -130,7 +131,9 @@ struct childs_queue *create_childs_queue(int size)
     q->shared_mem_size = sizeof(child_shared_data_t) * size /*child shared data*/
                          + q->stats_block_size * size /*child stats area*/
                          + q->stats_block_size /*Server history  stats area*/
-                         + sizeof(struct server_statistics); /*Server general statistics*/
+                         + _CI_ALIGN(sizeof(struct server_statistics)) /*Server general statistics*/
+                         + STATS_WINDOWS_NUM * sizeof(struct stats_window) /*Statistics samples*/
+                         + STATS_WINDOWS_NUM * STATS_WINDOW_SLOTS * q->stats_block_size;
     if ((q->childs =
                 ci_shared_mem_create(&(q->shmid), "kids-queue", q->shared_mem_size)) == NULL) {
         log_server(NULL, "can't get shared memory!");
@@ -154,6 +157,18 @@ struct childs_queue *create_childs_queue(int size)
     stat_memblock_fix(q->stats_history);
     ci_stat_memblock_reset(q->stats_history);
 
+    q->stats_windows = (void *)q->srv_stats + _CI_ALIGN(sizeof(struct server_statistics));
+    q->stats_samples = (void *)q->stats_windows + STATS_WINDOWS_NUM * sizeof(struct stats_window);
+    for (i = 0; i < STATS_WINDOWS_NUM; i++) {
+        q->stats_windows[i].pos = 0;
+        q->stats_windows[i].samples = 0;
+    }
+    for (i = 0; i < STATS_WINDOWS_NUM * STATS_WINDOW_SLOTS; i++) {
+        mem_block = q->stats_samples + i * q->stats_block_size;
+        mem_block->sig = MEMBLOCK_SIG;
+        stat_memblock_fix(mem_block);
+    }
+
     for (i = 0; i < q->size; i++) {
         q->childs[i].pid = 0;
         q->childs[i].pipe = -1;
@@ -291,7 +306,7 @@ void announce_child(struct childs_queue *q, process_pid_t pid)
 
 int remove_child(struct childs_queue *q, process_pid_t pid, int status)
 {
-    int i;
+    int i, k;
     struct stat_memblock *child_stats;
     if (!q->childs)
         return 0;
@@ -308,6 +323,9 @@ int remove_child(struct childs_queue *q, process_pid_t pid, int status)
             child_stats = q->stats_area + i * (q->stats_block_size);
             /*re-arange pointers in childs memblock*/
             stat_memblock_reconstruct(child_stats);
+            /*The current levels of a closed child are meaningless*/
+            for (k = 0; k < child_stats->gauges_size; k++)
+                child_stats->gauges[k] = 0;
             ci_stat_memblock_merge(q->stats_history, child_stats);
             q->srv_stats->closed_childs++;
             if (status)
@@ -432,11 +450,7 @@ void dump_queue_statistics(struct childs_queue *q)
                            );
 
             child_stats = q->stats_area + i * (q->stats_block_size);
-            copy_stats.counters64_size = child_stats->counters64_size;
-            copy_stats.counterskbs_size = child_stats->counterskbs_size;
-            copy_stats.counters64 = (void *)child_stats + sizeof(struct stat_memblock);
-            copy_stats.counterskbs = (void *)child_stats + sizeof(struct stat_memblock)
-                                     + child_stats->counters64_size*sizeof(uint64_t);
+            stat_memblock_view(&copy_stats, child_stats);
 
             for (k=0; k < copy_stats.counters64_size && k < STAT_INT64.entries_num; k++)
                 ci_debug_printf(1,"\t%s:%llu\n", STAT_INT64.entries[k].label,
@@ -462,3 +476,98 @@ void dump_queue_statistics(struct childs_queue *q)
                         q->stats_history->counterskbs[k].bytes);
 
 }
+
+
+static struct stat_memblock *stats_sample(struct childs_queue *q, int window, int slot)
+{
+    return q->stats_samples + (window * STATS_WINDOW_SLOTS + slot) * q->stats_block_size;
+}
+
+/*
+  Called by the main process every second. Stores the merged statistics of
+  the running and closed children to the per second window, and once per
+  minute to the per minute window.
+*/
+void childs_queue_stats_sample(struct childs_queue *q)
+{
+    int i, slot;
+    time_t now;
+    struct stat_memblock *sample, child_stats;
+    struct stats_window *seconds = &q->stats_windows[STATS_WINDOW_SECONDS];
+    struct stats_window *minutes = &q->stats_windows[STATS_WINDOW_MINUTES];
+
+    if (!q->childs)
+        return;
+
+    now = ci_coarse_time();
+    if (seconds->samples && seconds->times[seconds->pos] == now)
+        return;
+
+    slot = (seconds->pos + 1) % STATS_WINDOW_SLOTS;
+    sample = stats_sample(q, STATS_WINDOW_SECONDS, slot);
+    ci_stat_memblock_reset(sample);
+    ci_proc_mutex_lock(&(q->queue_mtx));
+    for (i = 0; i < q->size; i++) {
+        if (q->childs[i].pid == 0)
+            continue;
+        stat_memblock_view(&child_stats, q->stats_area + i * q->stats_block_size);
+        if (child_stats.sig == MEMBLOCK_SIG)
+            ci_stat_memblock_merge(sample, &child_stats);
+    }
+    ci_stat_memblock_merge(sample, q->stats_history);
+    ci_proc_mutex_unlock(&(q->queue_mtx));
+    seconds->times[slot] = now;
+    seconds->pos = slot;
+    if (seconds->samples < STATS_WINDOW_SLOTS)
+        seconds->samples++;
+
+    if (minutes->samples && minutes->times[minutes->pos] / 60 == now / 60)
+        return;
+
+    slot = (minutes->pos + 1) % STATS_WINDOW_SLOTS;
+    memcpy(stats_sample(q, STATS_WINDOW_MINUTES, slot), sample, q->stats_block_size);
+    stat_memblock_reconstruct(stats_sample(q, STATS_WINDOW_MINUTES, slot));
+    minutes->times[slot] = now;
+    minutes->pos = slot;
+    if (minutes->samples < STATS_WINDOW_SLOTS)
+        minutes->samples++;
+}
+
+/*
+  Fills the latest sample and the sample taken the given seconds before,
+  or the oldest available. Windows up to a minute use the per second
+  samples. Returns the seconds between the two samples, or 0 if there
+  are not enough samples.
+*/
+int childs_queue_stats_window(struct childs_queue *q, int seconds,
+                              struct stat_memblock *latest,
+                              struct stat_memblock *oldest)
+{
+    int window, steps, pos, old;
+    struct stats_window *w;
+
+    if (!q->childs || seconds <= 0)
+        return 0;
+
+    if (seconds <= 60) {
+        window = STATS_WINDOW_SECONDS;
+        steps = seconds;
+    } else {
+        window = STATS_WINDOW_MINUTES;
+        steps = seconds / 60;
+    }
+    w = &q->stats_windows[window];
+    /*Do not use the slot the main process writes next*/
+    if (steps > STATS_WINDOW_SLOTS - 2)
+        steps = STATS_WINDOW_SLOTS - 2;
+    if (steps > w->samples - 1)
+        steps = w->samples - 1;
+    if (steps <= 0)
+        return 0;
+
+    pos = w->pos;
+    old = (pos + STATS_WINDOW_SLOTS - steps) % STATS_WINDOW_SLOTS;
+    stat_memblock_view(latest, stats_sample(q, window, pos));
+    stat_memblock_view(oldest, stats_sample(q, window, old));
+    return (int)(w->times[pos] - w->times[old]);
+}
@@ -2,8 +2,13 @@
 #include "debug.h"
 #include "array.h"
 #include "ci_regex.h"
+#include <ctype.h>
 
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#include <pthread.h>
+#elif defined(HAVE_PCRE)
 #include <pcre.h>
 #else
 #include <regex.h>
@@ -29,7 +34,9 @@ char *ci_regex_parse(const char *str, int *flags, int *recursive)
     s[slen] = '\0';
 
     *flags = 0;
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+    /*the newline convention is set in the compile context*/
+#elif defined(HAVE_PCRE)
     *flags |= PCRE_NEWLINE_ANY;
     *flags |= PCRE_NEWLINE_ANYCRLF;
 #else
@@ -38,7 +45,24 @@ char *ci_regex_parse(const char *str, int *flags, int *recursive)
 #endif
 
     while (*e != '\0') {
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+        if (*e == 'i')
+            *flags |= PCRE2_CASELESS;
+        else if (*e == 'm')
+            *flags |= PCRE2_MULTILINE;
+        else if (*e == 's')
+            *flags |= PCRE2_DOTALL;
+        else if (*e == 'x')
+            *flags |= PCRE2_EXTENDED;
+        else if (*e == 'A')
+            *flags |= PCRE2_ANCHORED;
+        else if (*e == 'D')
+            *flags |= PCRE2_DOLLAR_ENDONLY;
+        else if (*e == 'U')
+            *flags |= PCRE2_UNGREEDY;
+        else if (*e == 'u')
+            *flags |= PCRE2_UTF;
+#elif defined(HAVE_PCRE)
         if (*e == 'i')
             *flags = *flags | PCRE_CASELESS;
         else if (*e == 'm')
@@ -74,7 +98,31 @@ char *ci_regex_parse(const char *str, int *flags, int *recursive)
 
 ci_regex_t ci_regex_build(const char *regex_str, int regex_flags)
 {
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+    pcre2_code *re;
+    pcre2_compile_context *ccontext;
+    PCRE2_UCHAR error[256];
+    PCRE2_SIZE erroffset;
+    int errcode;
+
+    ccontext = pcre2_compile_context_create(NULL);
+    if (ccontext)
+        pcre2_set_newline(ccontext, PCRE2_NEWLINE_ANYCRLF);
+    re = pcre2_compile((PCRE2_SPTR)regex_str, PCRE2_ZERO_TERMINATED, (uint32_t)regex_flags, &errcode, &erroffset, ccontext);
+    if (ccontext)
+        pcre2_compile_context_free(ccontext);
+
+    if (re == NULL) {
+        pcre2_get_error_message(errcode, error, sizeof(error));
+        ci_debug_printf(2, "PCRE2 compilation failed at offset %d: %s\n", (int)erroffset, (char *)error);
+        return NULL;
+    }
+    /*Without JIT support the interpreter is used*/
+    if ((errcode = pcre2_jit_compile(re, PCRE2_JIT_COMPLETE)) != 0)
+        ci_debug_printf(5, "PCRE2 JIT compilation of '%s' failed: %d\n", regex_str, errcode);
+    return re;
+
+#elif defined(HAVE_PCRE)
     pcre *re;
     const char *error;
     int erroffset;
@@ -101,9 +149,207 @@ ci_regex_t ci_regex_build(const char *regex_str, int regex_flags)
 #endif
 }
 
+/*
+  Returns the last char of the escape sequence starting at the alphanumeric
+  char after a '\\', or NULL if the sequence is not terminated. The chars
+  of the hex, octal and control escapes, of the properties and of the named
+  references are part of the escape, not literal chars.
+*/
+static const char *regex_escape_end(const char *s)
+{
+    int i;
+
+    switch (*s) {
+    case 'x':
+    case 'o':
+    case 'N':
+    case 'p':
+    case 'P':
+        if (s[1] == '{')
+            return strchr(s + 2, '}');
+        if (*s == 'x') {
+            for (i = 0; i < 2 && isxdigit((unsigned char)s[1]); i++)
+                s++;
+        } else if (*s == 'p' || *s == 'P') {
+            if (s[1] == '\0')
+                return NULL;
+            s++;
+        }
+        return s;
+    case 'c':
+        return s[1] != '\0' ? s + 1 : NULL;
+    case 'k':
+    case 'g':
+        if (s[1] == '{')
+            return strchr(s + 2, '}');
+        if (s[1] == '<')
+            return strchr(s + 2, '>');
+        if (s[1] == '\'')
+            return strchr(s + 2, '\'');
+        if (*s == 'g') {
+            if (s[1] == '-' || s[1] == '+')
+                s++;
+            while (isdigit((unsigned char)s[1]))
+                s++;
+        }
+        return s;
+    default:
+        /*back references and octal escapes*/
+        if (isdigit((unsigned char)*s)) {
+            while (isdigit((unsigned char)s[1]))
+                s++;
+        }
+        return s;
+    }
+}
+
+/*
+  Find the longest literal string which appears in every string matching the
+  regex. The regex is scanned at the top level only: groups, classes,
+  escaped classes and anchors end the current literal and an optional
+  quantifier removes the last literal char. Patterns with a top level
+  alternation or with inline options have no required literal.
+*/
+int ci_regex_literal(const char *regex_str, int regex_flags, char *buf, size_t buf_size)
+{
+    const char *s;
+    size_t run_start = 0, run_len = 0, best_start = 0, best_len = 0;
+    int depth, caseless, c;
+
+#if defined(HAVE_PCRE2)
+    if (regex_flags & PCRE2_EXTENDED)
+        return 0;
+    caseless = (regex_flags & PCRE2_CASELESS);
+#elif defined(HAVE_PCRE)
+    if (regex_flags & PCRE_EXTENDED)
+        return 0;
+    caseless = (regex_flags & PCRE_CASELESS);
+#else
+    if (!(regex_flags & REG_EXTENDED))
+        return 0;
+    caseless = (regex_flags & REG_ICASE);
+#endif
+
+#define END_RUN() do {                                          \
+        if (run_len > best_len) {                               \
+            best_start = run_start;                             \
+            best_len = run_len;                                 \
+        }                                                       \
+        run_len = 0;                                            \
+    } while (0)
+
+    for (s = regex_str; *s != '\0'; s++) {
+        c = (unsigned char)*s;
+        switch (c) {
+        case '|':
+            return 0;
+        case ')':
+            return 0; /*unbalanced*/
+        case '.':
+        case '^':
+        case '$':
+            END_RUN();
+            break;
+        case '*':
+        case '?':
+        case '{':
+            if (run_len)
+                run_len--;
+            END_RUN();
+            if (c == '{') {
+                while (*s != '\0' && *s != '}') s++;
+                if (*s == '\0')
+                    return 0;
+            }
+            break;
+        case '+':
+            END_RUN();
+            break;
+        case '[':
+            END_RUN();
+            s++;
+            if (*s == '^') s++;
+            if (*s == ']') s++;
+            while (*s != '\0' && *s != ']') {
+                if (*s == '[' && (s[1] == ':' || s[1] == '.' || s[1] == '=')) {
+                    c = s[1];
+                    for (s += 2; *s != '\0' && !(*s == c && s[1] == ']'); s++);
+                    if (*s == '\0')
+                        return 0;
+                    s++;
+                }
+#if defined(HAVE_PCRE2) || defined(HAVE_PCRE)
+                else if (*s == '\\' && s[1] != '\0')
+                    s++;
+#endif
+                s++;
+            }
+            if (*s == '\0')
+                return 0;
+            break;
+        case '(':
+            /*inline options and verbs may change the matching of the
+              following chars*/
+            if (s[1] == '*' || (s[1] == '?' && (isalpha((unsigned char)s[2]) || s[2] == '-' || s[2] == '^' || s[2] == ')')))
+                return 0;
+            END_RUN();
+            for (depth = 1, s++; *s != '\0' && depth > 0; s++) {
+                if (*s == '\\' && s[1] != '\0')
+                    s++;
+                else if (*s == '(')
+                    depth++;
+                else if (*s == ')')
+                    depth--;
+            }
+            if (depth)
+                return 0;
+            s--;
+            break;
+        case '\\':
+            s++;
+            c = (unsigned char)*s;
+            if (c == '\0')
+                return 0;
+            if (isalnum(c)) { /*classes, back references, \Q..\E etc*/
+                if (c == 'Q')
+                    return 0;
+                END_RUN();
+                if (!(s = regex_escape_end(s)))
+                    return 0;
+                break;
+            }
+            /*fall through*/
+        default:
+            if (caseless && c > 127) {
+                END_RUN(); /*no case folding for non ASCII chars*/
+                break;
+            }
+            if (!run_len)
+                run_start = s - regex_str;
+            run_len++;
+            break;
+        }
+    }
+    END_RUN();
+#undef END_RUN
+
+    if (best_len >= buf_size)
+        best_len = buf_size - 1;
+    /*copy the literal chars, removing the escapes*/
+    for (s = regex_str + best_start, run_len = 0; run_len < best_len; s++) {
+        if (*s == '\\')
+            s++;
+        buf[run_len++] = *s;
+    }
+    buf[run_len] = '\0';
+    return (int)run_len;
+}
+
 void ci_regex_free(ci_regex_t regex)
 {
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+    pcre2_code_free((pcre2_code *)regex);
+#elif defined(HAVE_PCRE)
     pcre_free((pcre *)regex);
 #else
     regfree((regex_t *)regex);
@@ -111,7 +357,42 @@ void ci_regex_free(ci_regex_t regex)
 #endif
 }
 
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+#define OVECPAIRS 10
+
+/*Each thread reuses its match data, which is big enough for the
+  10 sub-matches reported to the callers*/
+static pthread_key_t MATCH_DATA_KEY;
+static pthread_once_t MATCH_DATA_ONCE = PTHREAD_ONCE_INIT;
+static int MATCH_DATA_READY = 0;
+
+static void match_data_destroy(void *data)
+{
+    pcre2_match_data_free((pcre2_match_data *)data);
+}
+
+static void match_data_key_init()
+{
+    if (pthread_key_create(&MATCH_DATA_KEY, match_data_destroy) == 0)
+        MATCH_DATA_READY = 1;
+}
+
+static pcre2_match_data *match_data_get(int *shared)
+{
+    pcre2_match_data *md;
+    *shared = 0;
+    pthread_once(&MATCH_DATA_ONCE, match_data_key_init);
+    if (MATCH_DATA_READY && (md = pthread_getspecific(MATCH_DATA_KEY)) != NULL) {
+        *shared = 1;
+        return md;
+    }
+    if ((md = pcre2_match_data_create(OVECPAIRS, NULL)) == NULL)
+        return NULL;
+    if (MATCH_DATA_READY && pthread_setspecific(MATCH_DATA_KEY, md) == 0)
+        *shared = 1;
+    return md;
+}
+#elif defined(HAVE_PCRE)
 #define OVECCOUNT 30    /* should be a multiple of 3 */
 #endif
 
@@ -123,7 +404,38 @@ int ci_regex_apply(const ci_regex_t regex, const char *str, int len, int recurs,
     if (!str)
         return 0;
 
-#ifdef HAVE_PCRE
+#if defined(HAVE_PCRE2)
+    pcre2_match_data *md;
+    PCRE2_SIZE *ovector;
+    int rc, shared;
+    PCRE2_SIZE offset = 0;
+    PCRE2_SIZE str_length = len >= 0 ? (PCRE2_SIZE)len : strlen(str);
+    if ((md = match_data_get(&shared)) == NULL)
+        return 0;
+    ovector = pcre2_get_ovector_pointer(md);
+    do {
+        rc = pcre2_match((const pcre2_code *)regex, (PCRE2_SPTR)str, str_length, offset, 0, md, NULL);
+        if (rc >= 0 && ovector[0] != ovector[1]) {
+            ++count;
+            ci_debug_printf(9, "Match pattern (pos:%d-%d): '%.*s'\n",
+                            (int)ovector[0], (int)ovector[1], (int)(ovector[1]-ovector[0]), str+ovector[0]);
+            offset = ovector[1];
+            if (matches) {
+                parts.user_data = user_data;
+                memset(parts.matches, 0, sizeof(ci_regex_matches_t));
+                for (i = 0; i < OVECPAIRS && (rc == 0 || i < rc) && ovector[2*i+1] > ovector[2*i]; ++i) {
+                    ci_debug_printf(9, "\t sub-match pattern (pos:%d-%d): '%.*s'\n", (int)ovector[2*i], (int)ovector[2*i+1], (int)(ovector[2*i + 1] - ovector[2*i]), str+ovector[2*i]);
+                    parts.matches[i].s = ovector[2*i];
+                    parts.matches[i].e = ovector[2*i+1];
+                }
+                ci_list_push_back(matches, (void *)&parts);
+            }
+        }
+    } while (recurs && rc >=0  && offset < str_length);
+    if (!shared)
+        pcre2_match_data_free(md);
+
+#elif defined(HAVE_PCRE)
     int ovector[OVECCOUNT];
     int rc;
     int offset = 0;
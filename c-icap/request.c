@@ -36,6 +36,7 @@
 #include "cfg_param.h"
 #include "stats.h"
 #include "body.h"
+#include "log.h"
 
 
 extern int TIMEOUT;
@@ -45,6 +46,7 @@ extern int PIPELINING;
 extern int CHECK_FOR_BUGGY_CLIENT;
 extern int ALLOW204_AS_200OK_ZERO_ENCAPS;
 extern int FAKE_ALLOW204;
+extern int SLOW_REQUEST_THRESHOLD;
 
 /*This variable defined in mpm_server.c and become 1 when the child must
   halt imediatelly:*/
@@ -65,6 +67,19 @@ static int STAT_REQMODS = -1;
 static int STAT_RESPMODS = -1;
 static int STAT_OPTIONS = -1;
 static int STAT_ALLOW204 = -1;
+static int STAT_REQUEST_TIME = -1;
+static int STAT_POOL_HITS = -1;
+static int STAT_POOL_MISSES = -1;
+static int STAT_POOL_DEPOT_TRANSFERS = -1;
+static int STAT_POOL_DEPOT_CONTENTION = -1;
+
+static void pool_stats_update(int hits, int misses, int transfers, int contention)
+{
+    ci_stat_uint64_inc(STAT_POOL_HITS, hits);
+    ci_stat_uint64_inc(STAT_POOL_MISSES, misses);
+    ci_stat_uint64_inc(STAT_POOL_DEPOT_TRANSFERS, transfers);
+    ci_stat_uint64_inc(STAT_POOL_DEPOT_CONTENTION, contention);
+}
 
 void request_stats_init()
 {
@@ -80,6 +95,13 @@ void request_stats_init()
     STAT_HTTP_BYTES_OUT = ci_stat_entry_register("HTTP BYTES OUT", STAT_KBS_T, "General");
     STAT_BODY_BYTES_IN = ci_stat_entry_register("BODY BYTES IN", STAT_KBS_T, "General");
     STAT_BODY_BYTES_OUT = ci_stat_entry_register("BODY BYTES OUT", STAT_KBS_T, "General");
+    STAT_REQUEST_TIME = ci_stat_entry_register("REQUEST TIME USEC", STAT_HISTOGRAM_T, "General");
+
+    STAT_POOL_HITS = ci_stat_entry_register("POOL HITS", STAT_INT64_T, "Memory pools");
+    STAT_POOL_MISSES = ci_stat_entry_register("POOL MISSES", STAT_INT64_T, "Memory pools");
+    STAT_POOL_DEPOT_TRANSFERS = ci_stat_entry_register("POOL DEPOT TRANSFERS", STAT_INT64_T, "Memory pools");
+    STAT_POOL_DEPOT_CONTENTION = ci_stat_entry_register("POOL DEPOT CONTENTION", STAT_INT64_T, "Memory pools");
+    ci_mem_pool_stats_callback(pool_stats_update);
 }
 
 static int wait_for_data(ci_connection_t *conn, int secs, int what_wait)
@@ -104,6 +126,34 @@ static int wait_for_data(ci_connection_t *conn, int secs, int what_wait)
     return wait_status;
 }
 
+/*
+  Waits for data and reads them in the same step. Returns the number of
+  bytes read or -1 on timeout or error.
+*/
+static int wait_and_read(ci_connection_t *conn, int secs, char *buf, int size)
+{
+    int wait_status, bytes;
+
+    if (CHILD_HALT)
+        return -1;
+
+    do {
+        bytes = size;
+        wait_status = ci_connection_wait_rw(conn, secs, ci_wait_for_read, buf, &bytes, NULL, 0, NULL);
+        if (wait_status < 0)
+            return -1;
+        if (wait_status == 0 && CHILD_HALT) /*abort*/
+            return -1;
+    } while (wait_status & ci_wait_should_retry);
+
+    if (wait_status == 0) /* timeout */
+        return -1;
+
+    return bytes;
+}
+
+static int wait_and_rw(ci_request_t * req, int secs, int what_wait);
+
 ci_request_t *newrequest(ci_connection_t * connection)
 {
     ci_request_t *req;
@@ -115,6 +165,7 @@ ci_request_t *newrequest(ci_connection_t * connection)
     assert(conn);
     ci_copy_connection(conn, connection);
     req = ci_request_alloc(conn);
+    ci_request_phase_mark(req, CI_PHASE_ACCEPT);
 
     if ((access = access_check_client(req)) == CI_ACCESS_DENY) { /*Check for client access */
         len = strlen(FORBITTEN_STR);
@@ -136,6 +187,7 @@ int recycle_request(ci_request_t * req, ci_connection_t * connection)
 
     ci_request_reset(req);
     ci_copy_connection(req->connection, connection);
+    ci_request_phase_mark(req, CI_PHASE_ACCEPT);
 
     if ((access = access_check_client(req)) == CI_ACCESS_DENY) { /*Check for client access */
         len = strlen(FORBITTEN_STR);
@@ -148,6 +200,7 @@ int recycle_request(ci_request_t * req, ci_connection_t * connection)
 
 int keepalive_request(ci_request_t *req)
 {
+    int ret;
     /* Preserve extra read bytes*/
     char *pstrblock = req->pstrblock_read;
     int pstrblock_len = req->pstrblock_read_len;
@@ -158,9 +211,14 @@ int keepalive_request(ci_request_t *req)
         req->pstrblock_read_len = pstrblock_len;
     }
 
-    if (req->pstrblock_read && req->pstrblock_read_len > 0)
+    if (req->pstrblock_read && req->pstrblock_read_len > 0) {
+        ci_request_phase_mark(req, CI_PHASE_ACCEPT);
         return 1;
-    return wait_for_data(req->connection, KEEPALIVE_TIMEOUT, ci_wait_for_read);
+    }
+    ret = wait_for_data(req->connection, KEEPALIVE_TIMEOUT, ci_wait_for_read);
+    if (ret > 0)
+        ci_request_phase_mark(req, CI_PHASE_ACCEPT);
+    return ret;
 }
 
 /*Here we want to read in small blocks icap header becouse in most cases
@@ -177,12 +235,16 @@ static int icap_header_check_realloc(char **buf, int *size, int used, int mustad
     int len;
     if (*size - used < mustadded) {
         len = *size + ICAP_HEADER_READSIZE;
+        /*The pipelined data kept from the previous request may be as
+          big as the I/O buffer, grow enough to hold them*/
+        if (len < used + mustadded)
+            len = used + mustadded;
         newbuf = realloc(*buf, len);
         if (!newbuf) {
             return EC_500;
         }
         *buf = newbuf;
-        *size = *size + ICAP_HEADER_READSIZE;
+        *size = len;
     }
     return EC_100;
 }
@@ -190,9 +252,9 @@ static int icap_header_check_realloc(char **buf, int *size, int used, int mustad
 
 static int ci_read_icap_header(ci_request_t * req, ci_headers_list_t * h, int timeout)
 {
-    int bytes, request_status = EC_100, i, eoh = 0, startsearch = 0, readed = 0;
-    int wait_status = 0;
+    int bytes, request_status = EC_100, startsearch = 0, readed = 0;
     char *buf_end;
+    const char *eoh_pos;
     int dataPrefetch = 0;
 
     buf_end = h->buf;
@@ -217,10 +279,7 @@ static int ci_read_icap_header(ci_request_t * req, ci_headers_list_t * h, int ti
     do {
 
         if (!dataPrefetch) {
-            if ((wait_status = wait_for_data(req->connection, timeout, ci_wait_for_read)) < 0)
-                return EC_408;
-
-            bytes = ci_connection_read_nonblock(req->connection, buf_end, ICAP_HEADER_READSIZE);
+            bytes = wait_and_read(req->connection, timeout, buf_end, ICAP_HEADER_READSIZE);
             if (bytes < 0)
                 return EC_408;
 
@@ -232,15 +291,11 @@ static int ci_read_icap_header(ci_request_t * req, ci_headers_list_t * h, int ti
         } else
             dataPrefetch = 0;
 
-        for (i = startsearch; i < bytes - 3; i++) {   /*search for end of header.... */
-            if (strncmp(buf_end + i, "\r\n\r\n", 4) == 0) {
-                buf_end = buf_end + i + 2;
-                eoh = 1;
-                break;
-            }
-        }
-        if (eoh)
+        /*search for end of header.... */
+        if ((eoh_pos = ci_find_crlfcrlf(buf_end + startsearch, bytes - startsearch)) != NULL) {
+            buf_end = (char *)eoh_pos + 2;
             break;
+        }
 
         if ((request_status =
                     icap_header_check_realloc(&(h->buf), &(h->bufsize), readed,
@@ -283,9 +338,7 @@ static int read_encaps_header(ci_request_t * req, ci_headers_list_t * h, int siz
 
     remains = size - readed;
     while (remains > 0) {
-        if (wait_for_data(req->connection, TIMEOUT, ci_wait_for_read) < 0)
-            return CI_ERROR;
-        if ((bytes = ci_connection_read_nonblock(req->connection, buf_end, remains)) < 0)
+        if ((bytes = wait_and_read(req->connection, TIMEOUT, buf_end, remains)) < 0)
             return CI_ERROR;
         remains -= bytes;
         buf_end += bytes;
@@ -539,7 +592,7 @@ static int parse_encaps_headers(ci_request_t * req)
     ci_encaps_entity_t *e = NULL;
     for (i = 0; (e = req->entities[i]) != NULL; i++) {
         if (e->type > ICAP_RES_HDR)   //res_body,req_body or opt_body so the end of the headers.....process_encapsulated
-            return EC_100;
+            break;
 
         if (req->entities[i + 1] == NULL)
             return EC_400;
@@ -552,9 +605,10 @@ static int parse_encaps_headers(ci_request_t * req)
             return request_status;
 
         if ((request_status =
-                    ci_headers_unpack((ci_headers_list_t *) e->entity)) != EC_100)
+                    ci_headers_unpack_wire((ci_headers_list_t *) e->entity)) != EC_100)
             return request_status;
     }
+    req->data_generation++;
     return EC_100;
 }
 
@@ -572,10 +626,7 @@ static int read_preview_data(ci_request_t * req)
     req->write_to_module_pending = 0;
 
     if (req->pstrblock_read_len == 0) {
-        if (wait_for_data(req->connection, TIMEOUT, ci_wait_for_read) < 0)
-            return CI_ERROR;
-
-        if (net_data_read(req) == CI_ERROR)
+        if (wait_and_rw(req, TIMEOUT, ci_wait_for_read) < 0)
             return CI_ERROR;
     }
 
@@ -592,6 +643,8 @@ static int read_preview_data(ci_request_t * req)
                     (&(req->preview_data), wdata,
                      req->write_to_module_pending) < 0)
                 return CI_ERROR;
+            if (req->write_to_module_pending)
+                req->data_generation++;
             req->write_to_module_pending = 0;
 
             if (ret == CI_EOF) {
@@ -603,9 +656,7 @@ static int read_preview_data(ci_request_t * req)
             }
         } while (ret != CI_NEEDS_MORE);
 
-        if (wait_for_data(req->connection, TIMEOUT, ci_wait_for_read) < 0)
-            return CI_ERROR;
-        if (net_data_read(req) == CI_ERROR)
+        if (wait_and_rw(req, TIMEOUT, ci_wait_for_read) < 0)
             return CI_ERROR;
     } while (1);
 
@@ -742,15 +793,146 @@ const char *eol_str = "\r\n";
 const char *eof_str = "0\r\n\r\n";
 
 
-static int send_current_block_data(ci_request_t * req)
+static int update_send_status(ci_request_t * req);
+
+/*The maximum number of buffers written with a single writev call*/
+#define SEND_IOV_MAX 32
+
+#define has_pending_send(req) ((req)->remain_send_block_bytes > 0 || (req)->body_refs_num > 0)
+
+static int iov_add(struct iovec *iov, const char *buf, int len, int *skip)
 {
+    if (*skip >= len) {
+        *skip -= len;
+        return 0;
+    }
+    iov->iov_base = (char *)buf + *skip;
+    iov->iov_len = len - *skip;
+    *skip = 0;
+    return 1;
+}
+
+/*
+  Fills iov with the data pending to be sent: the current response block,
+  the HTTP headers blocks which follow it and the chunks of the body
+  blocks handed over by the service. It stops before the data of a file
+  block, which are sent with sendfile.
+  Returns the number of buffers and stores their total size to size.
+*/
+static int build_send_iov(ci_request_t * req, struct iovec *iov, int *size)
+{
+    int i, n = 0, status, skip;
+    ci_encaps_entity_t *e;
+    ci_headers_list_t *h;
+    struct ci_body_ref *ref;
+
+    if (req->remain_send_block_bytes > 0) {
+        iov[n].iov_base = req->pstrblock_responce;
+        iov[n].iov_len = req->remain_send_block_bytes;
+        n++;
+        /*The next headers blocks, as update_send_status will select them*/
+        if (!req->data_locked && req->status >= SEND_RESPHEAD && req->status < SEND_HEAD3) {
+            for (status = req->status + 1; status <= SEND_HEAD3; status++) {
+                e = req->entities[status - SEND_HEAD1];
+                if (!e || (e->type != ICAP_REQ_HDR && e->type != ICAP_RES_HDR))
+                    break;
+                h = (ci_headers_list_t *) e->entity;
+                if (h->bufused <= 0)
+                    break;
+                iov[n].iov_base = h->buf;
+                iov[n].iov_len = h->bufused;
+                n++;
+            }
+        }
+    }
+
+    skip = req->body_refs_sent;
+    for (i = 0; i < req->body_refs_num && n + 3 <= SEND_IOV_MAX; i++) {
+        ref = &req->body_refs[i];
+        n += iov_add(&iov[n], ref->head, ref->head_len, &skip);
+        if (ref->fd >= 0) {
+            if (skip < ref->len)
+                break;
+            skip -= ref->len;
+        } else
+            n += iov_add(&iov[n], ref->data, ref->len, &skip);
+        n += iov_add(&iov[n], eol_str, 2, &skip);
+    }
+
+    *size = 0;
+    for (i = 0; i < n; i++)
+        *size += iov[i].iov_len;
+    return n;
+}
+
+static void block_data_sent(ci_request_t * req, int bytes)
+{
+    int n;
+    struct ci_body_ref *ref;
+
+    req->bytes_out += bytes;
+    while (bytes > 0) {
+        if (req->remain_send_block_bytes > 0) {
+            n = bytes < req->remain_send_block_bytes ? bytes : req->remain_send_block_bytes;
+            req->pstrblock_responce += n;
+            req->remain_send_block_bytes -= n;
+            if (req->status >= SEND_HEAD1 &&  req->status <= SEND_HEAD3)
+                req->http_bytes_out += n;
+            bytes -= n;
+            /*The next headers block is sent with this one*/
+            if (req->remain_send_block_bytes == 0 && bytes > 0 &&
+                    req->status >= SEND_RESPHEAD && req->status < SEND_BODY)
+                update_send_status(req);
+        } else if (req->body_refs_num > 0) {
+            ref = &req->body_refs[0];
+            n = ref->head_len + ref->len + 2 - req->body_refs_sent;
+            if (bytes < n) {
+                req->body_refs_sent += bytes;
+                break;
+            }
+            bytes -= n;
+            req->body_refs_sent = 0;
+            req->body_refs_num--;
+            memmove(req->body_refs, req->body_refs + 1, req->body_refs_num * sizeof(struct ci_body_ref));
+        } else
+            break;
+    }
+}
+
+/*
+  Sends the data of the first body block handed over by the service, if
+  it is stored in a file and the chunk size line is already sent.
+*/
+static int send_body_file(ci_request_t * req)
+{
+    struct ci_body_ref *ref = &req->body_refs[0];
     int bytes;
-    if (req->remain_send_block_bytes == 0)
+    bytes = ci_connection_sendfile_nonblock(req->connection, ref->fd,
+                                            ref->offset + req->body_refs_sent - ref->head_len,
+                                            ref->head_len + ref->len - req->body_refs_sent);
+    if (bytes < 0) {
+        ci_debug_printf(5, "Error sending file data to socket (errno:%d)\n", errno);
+        return CI_ERROR;
+    }
+    block_data_sent(req, bytes);
+    return bytes;
+}
+
+static int send_current_block_data(ci_request_t * req)
+{
+    struct iovec iov[SEND_IOV_MAX];
+    int bytes, iovcnt, size;
+    if (!has_pending_send(req))
         return 0;
+    iovcnt = build_send_iov(req, iov, &size);
+    if (size == 0) {
+        if (send_body_file(req) == CI_ERROR)
+            return CI_ERROR;
+        return req->remain_send_block_bytes;
+    }
     if ((bytes =
-                ci_connection_write_nonblock(req->connection, req->pstrblock_responce,
-                        req->remain_send_block_bytes)) < 0) {
-        ci_debug_printf(5, "Error writing to socket (errno:%d, bytes:%d. string:\"%s\")", errno, req->remain_send_block_bytes, req->pstrblock_responce);
+                ci_connection_writev_nonblock(req->connection, iov, iovcnt)) < 0) {
+        ci_debug_printf(5, "Error writing to socket (errno:%d, bytes:%d)", errno, size);
         return CI_ERROR;
     }
 
@@ -761,14 +943,127 @@ static int send_current_block_data(ci_request_t * req)
          }
     */
 
-    req->pstrblock_responce += bytes;
-    req->remain_send_block_bytes -= bytes;
-    req->bytes_out += bytes;
-    if (req->status >= SEND_HEAD1 &&  req->status <= SEND_HEAD3)
-        req->http_bytes_out +=bytes;
+    block_data_sent(req, bytes);
     return req->remain_send_block_bytes;
 }
 
+/*The number of successive reads which fill the read buffer before the
+  buffer is doubled*/
+#define IO_BUF_GROW_READS 4
+
+static void block_data_read(ci_request_t * req, int bytes, int size)
+{
+    req->pstrblock_read_len += bytes;
+    req->bytes_in += bytes;
+    if (bytes == size)
+        req->full_reads++;
+    else
+        req->full_reads = 0;
+}
+
+/*
+  Like wait_and_rw but the pending data are the data of a file block,
+  which are sent with sendfile after the wait
+*/
+static int wait_and_sendfile(ci_request_t * req, int secs, int what_wait, int rsize)
+{
+    int wait_status, bytes;
+
+    if ((wait_status = wait_for_data(req->connection, secs, what_wait)) < 0)
+        return -1;
+
+    if (wait_status & ci_wait_for_write) {
+        if (send_body_file(req) == CI_ERROR)
+            return -1;
+    }
+    if ((wait_status & ci_wait_for_read) && rsize > 0) {
+        bytes = ci_connection_read_nonblock(req->connection,
+                                            req->rbuf + req->pstrblock_read_len, rsize);
+        if (bytes < 0) {
+            ci_debug_printf(5, "Error reading data (errno=%d)\n", errno);
+            return -1;
+        }
+        block_data_read(req, bytes, rsize);
+    }
+    return wait_status;
+}
+
+/*
+  Waits for the connection to become readable and/or writable and reads
+  the next block of data to req->rbuf and/or writes the pending response
+  blocks. When io_uring support is enabled the wait and the I/O operations
+  are done with a single system call.
+  Returns the ci_wait_for_read/ci_wait_for_write flags of the completed
+  operations or -1 on timeout or error.
+*/
+static int wait_and_rw(ci_request_t * req, int secs, int what_wait)
+{
+    struct iovec wiov[SEND_IOV_MAX];
+    int wait_status, rbytes, wbytes, rsize = 0, wsize = 0, wiovcnt = 0;
+
+    /*if we are going down do not wait....*/
+    if (CHILD_HALT)
+        return -1;
+
+    if (what_wait & ci_wait_for_read) {
+        /*A large object is transfered, use a larger buffer*/
+        if (req->full_reads >= IO_BUF_GROW_READS && req->rbuf_size < CI_IO_MAX_BUF_SIZE) {
+            ci_request_resize_rbuf(req, 2 * req->rbuf_size);
+            req->full_reads = 0;
+        }
+        if (req->pstrblock_read != req->rbuf) {
+            /*... put the current data to the begining of buf .... */
+            if (req->pstrblock_read_len)
+                memmove(req->rbuf, req->pstrblock_read, req->pstrblock_read_len);
+            req->pstrblock_read = req->rbuf;
+        }
+        rsize = req->rbuf_size - req->pstrblock_read_len;
+        if (rsize <= 0) {
+            ci_debug_printf(5,
+                            "Not enough space to read data! Is this a bug (%d %d)?????\n",
+                            req->pstrblock_read_len, req->rbuf_size);
+            return -1;
+        }
+    }
+
+    if (what_wait & ci_wait_for_write) {
+        if (!req->data_locked && req->status == SEND_NOTHING)
+            update_send_status(req);
+        if (has_pending_send(req))
+            wiovcnt = build_send_iov(req, wiov, &wsize);
+        if (wsize <= 0 && req->body_refs_num > 0)
+            return wait_and_sendfile(req, secs, what_wait, rsize);
+        if (wsize <= 0)
+            what_wait &= ~ci_wait_for_write;
+    }
+
+    if (!what_wait)
+        return 0;
+
+    do {
+        rbytes = rsize;
+        wait_status = ci_connection_wait_rw(req->connection, secs, what_wait,
+                                            req->rbuf + req->pstrblock_read_len, &rbytes,
+                                            wiov, wiovcnt, &wbytes);
+        if (wait_status < 0) {
+            ci_debug_printf(5, "Error reading/writing data (errno=%d)\n", errno);
+            return -1;
+        }
+        if (wait_status == 0 && CHILD_HALT) /*abort*/
+            return -1;
+    } while (wait_status & ci_wait_should_retry);
+
+    if (wait_status == 0) /* timeout */
+        return -1;
+
+    if (wait_status & ci_wait_for_read)
+        block_data_read(req, rbytes, rsize);
+    if (wait_status & ci_wait_for_write)
+        block_data_sent(req, wbytes);
+
+    return wait_status;
+}
+
 
 static int format_body_chunk(ci_request_t * req)
 {
@@ -779,7 +1074,7 @@ static int format_body_chunk(ci_request_t * req)
     if (!req->responce_hasbody)
         return CI_EOF;
     if (req->remain_send_block_bytes > 0) {
-        assert(req->remain_send_block_bytes <= MAX_CHUNK_SIZE);
+        assert(req->remain_send_block_bytes <= ci_req_max_chunk_size(req));
 
         /*The data are not written yet but I hope there is not any problem.
           It is difficult to compute data sent */
@@ -958,21 +1253,8 @@ static int get_send_body(ci_request_t * req, int parse_only)
                             (action & ci_wait_for_read ? "Read" : "-"),
                             (action & ci_wait_for_write ? "Write" : "-")
                            );
-            if ((ret =
-                        wait_for_data(req->connection, TIMEOUT,
-                                      action)) < 0)
+            if ((ret = wait_and_rw(req, TIMEOUT, action)) < 0)
                 break;
-            if (ret & ci_wait_for_read) {
-                if (net_data_read(req) == CI_ERROR)
-                    return CI_ERROR;
-            }
-            if (ret & ci_wait_for_write) {
-                if (!req->data_locked && req->status == SEND_NOTHING) {
-                    update_send_status(req);
-                }
-                if (send_current_block_data(req) == CI_ERROR)
-                    return CI_ERROR;
-            }
             ci_debug_printf(9,
                             "OK done reading/writing going to process\n");
         }
@@ -992,22 +1274,27 @@ static int get_send_body(ci_request_t * req, int parse_only)
            At the same time reads the data from module and try to fill
            the req->wbuf
          */
-        if (req->remain_send_block_bytes)
+        if (has_pending_send(req))
             has_formated_data = 1;
         else
             has_formated_data = 0;
         parse_chunk_ret = 0;
         do {
+            /*After the eof chunk the read bytes belong to the next
+              pipelined request*/
             if (req->pstrblock_read_len != 0
-                    && req->write_to_module_pending == 0) {
+                    && req->write_to_module_pending == 0
+                    && !req->eof_received) {
                 if ((parse_chunk_ret =
                             parse_chunk_data(req, &wchunkdata)) == CI_ERROR) {
                     ci_debug_printf(1, "Error parsing chunks!\n");
                     return CI_ERROR;
                 }
 
-                if (parse_chunk_ret == CI_EOF)
+                if (parse_chunk_ret == CI_EOF) {
                     req->eof_received = 1;
+                    ci_request_phase_mark(req, CI_PHASE_EOF);
+                }
             }
             if (wchunkdata && req->write_to_module_pending)
                 wbytes = req->write_to_module_pending;
@@ -1016,14 +1303,19 @@ static int get_send_body(ci_request_t * req, int parse_only)
 
             if (req->status == SEND_BODY && !service_eof) {
                 if (req->remain_send_block_bytes == 0) {
+                    /*The read buffer grown, use similar chunks size*/
+                    if (req->wbuf_size < req->rbuf_size)
+                        ci_request_resize_wbuf(req, req->rbuf_size);
                     /*Leave space for chunk spec.. */
                     rchunkdata = req->wbuf + EXTRA_CHUNK_SIZE;
                     req->pstrblock_responce = rchunkdata;  /*does not needed! */
                     rchunkisfull = 0;
                 }
-                if ((MAX_CHUNK_SIZE - req->remain_send_block_bytes) > 0
-                        && has_formated_data == 0) {
-                    rbytes = MAX_CHUNK_SIZE - req->remain_send_block_bytes;
+                /*Do not ask for more data while the body blocks handed
+                  over by the service are not sent*/
+                if ((ci_req_max_chunk_size(req) - req->remain_send_block_bytes) > 0
+                        && has_formated_data == 0 && req->body_refs_num == 0) {
+                    rbytes = ci_req_max_chunk_size(req) - req->remain_send_block_bytes;
                 } else {
                     rchunkisfull = 1;
                     rbytes = 0;
@@ -1047,7 +1339,7 @@ static int get_send_body(ci_request_t * req, int parse_only)
                 req->remain_send_block_bytes += rbytes;
             } else if (rbytes == CI_EOF)
                 service_eof = 1;
-        } while (no_io == 0 && req->pstrblock_read_len != 0
+        } while (no_io == 0 && req->pstrblock_read_len != 0 && !req->eof_received
                  && parse_chunk_ret != CI_NEEDS_MORE && parse_chunk_ret != CI_EOF && !rchunkisfull);
 
         action = 0;
@@ -1057,7 +1349,7 @@ static int get_send_body(ci_request_t * req, int parse_only)
         }
 
         if (req->status == SEND_BODY) {
-            if (req->remain_send_block_bytes == 0 && service_eof == 1)
+            if (req->remain_send_block_bytes == 0 && req->body_refs_num == 0 && service_eof == 1)
                 req->remain_send_block_bytes = CI_EOF;
             if (has_formated_data == 0) {
                 if (format_body_chunk(req) == CI_EOF)
@@ -1065,7 +1357,7 @@ static int get_send_body(ci_request_t * req, int parse_only)
             }
         }
 
-        if (req->remain_send_block_bytes) {
+        if (has_pending_send(req)) {
             action = action | ci_wait_for_write;
         }
 
@@ -1100,7 +1392,7 @@ static int get_send_body(ci_request_t * req, int parse_only)
 /*Return CI_ERROR on error or CI_OK on success*/
 static int send_remaining_response(ci_request_t * req)
 {
-    int ret = 0;
+    int ret = 0, chunk_is_full = 0, service_eof = 0;
     int (*service_io) (char *rbuf, int *rlen, char *wbuf, int *wlen, int iseof,
                        ci_request_t *);
     if (req->echo_body)
@@ -1117,29 +1409,38 @@ static int send_remaining_response(ci_request_t * req)
         return CI_OK;
     }
     do {
-        while (req->remain_send_block_bytes > 0) {
-            if ((ret =
-                        wait_for_data(req->connection, TIMEOUT,
-                                      ci_wait_for_write)) < 0) {
+        while (has_pending_send(req)) {
+            if (wait_and_rw(req, TIMEOUT, ci_wait_for_write) < 0) {
                 ci_debug_printf(3,
                                 "Timeout sending data. Ending .......\n");
                 return CI_ERROR;
             }
-            if (send_current_block_data(req) == CI_ERROR)
-                return CI_ERROR;
         }
 
-        if (req->status == SEND_BODY && req->remain_send_block_bytes == 0) {
+        if (req->status == SEND_BODY && service_eof) {
+            req->remain_send_block_bytes = CI_EOF;
+            if ((ret = format_body_chunk(req)) == CI_EOF)
+                req->status = SEND_EOF;
+        } else if (req->status == SEND_BODY && req->remain_send_block_bytes == 0) {
+            /*The service filled the previous chunk, it has more data to send*/
+            if (chunk_is_full)
+                ci_request_resize_wbuf(req, 2 * req->wbuf_size);
             req->pstrblock_responce = req->wbuf + EXTRA_CHUNK_SIZE;  /*Leave space for chunk spec.. */
-            req->remain_send_block_bytes = MAX_CHUNK_SIZE;
+            req->remain_send_block_bytes = ci_req_max_chunk_size(req);
             ci_debug_printf(9, "rest response: going to read: %d bytes\n", req->remain_send_block_bytes);
             service_io(req->pstrblock_responce,
                        &(req->remain_send_block_bytes), NULL, NULL, 1, req);
             ci_debug_printf(9, "rest response: read: %d bytes\n", req->remain_send_block_bytes);
             if (req->remain_send_block_bytes == CI_ERROR)    /*CI_EOF of CI_ERROR, stop sending.... */
                 return CI_ERROR;
-            if (req->remain_send_block_bytes == 0)
+            if (req->remain_send_block_bytes == CI_EOF && req->body_refs_num > 0) {
+                /*Send the body blocks of the service before the eof chunk*/
+                req->remain_send_block_bytes = 0;
+                service_eof = 1;
+            }
+            if (req->remain_send_block_bytes == 0 && req->body_refs_num == 0)
                 break;
+            chunk_is_full = (req->remain_send_block_bytes == ci_req_max_chunk_size(req));
 
             if ((ret = format_body_chunk(req)) == CI_EOF) {
                 req->status = SEND_EOF;
@@ -1525,11 +1826,35 @@ static int do_end_of_data(ci_request_t * req)
 }
 
 void print_headers(ci_request_t * req);
+/*
+  Grow the read buffer for large objects, using the Content-Length header
+  of the encapsulated HTTP object. The write buffer follows when the
+  body data are sent.
+*/
+static void request_size_io_buffers(ci_request_t * req)
+{
+    ci_off_t content_len;
+    int size;
+
+    if (!req->hasbody || req->rbuf_size >= CI_IO_MAX_BUF_SIZE)
+        return;
+
+    content_len = ci_http_content_length(req);
+    if (content_len <= req->rbuf_size)
+        return;
+
+    size = req->rbuf_size;
+    while (size < content_len && size < CI_IO_MAX_BUF_SIZE)
+        size *= 2;
+    ci_request_resize_rbuf(req, size);
+}
+
 static int do_request(ci_request_t * req)
 {
     ci_service_xdata_t *srv_xdata = NULL;
     int res, preview_status = 0, auth_status;
     int ret_status = CI_OK; /*By default ret_status is CI_OK, on error must set to CI_ERROR*/
+    ci_request_phase_mark(req, CI_PHASE_ACCEPT);
     res = parse_header(req);
     if (res != EC_100) {
         /*if read some data, bad request or Service not found or Server error or what else,
@@ -1542,6 +1867,7 @@ static int do_request(ci_request_t * req)
                         res, req->request_header->bufused);
         return CI_ERROR;
     }
+    ci_request_phase_mark(req, CI_PHASE_HEADER);
     assert(req->current_service_mod);
     srv_xdata = service_data(req->current_service_mod);
     if (!srv_xdata || srv_xdata->status != CI_SERVICE_OK) {
@@ -1587,12 +1913,14 @@ static int do_request(ci_request_t * req)
         break;
     case ICAP_REQMOD:
     case ICAP_RESPMOD:
+        request_size_io_buffers(req);
         if (req->preview >= 0) /*we are inside preview*/
             preview_status = do_request_preview(req);
         else {
             /* do_fake_preview return CI_OK or CI_ERROR. */
             preview_status = do_fake_preview(req);
         }
+        ci_request_phase_mark(req, CI_PHASE_PREVIEW);
 
         if (preview_status == CI_ERROR) {
             ret_status = CI_ERROR;
@@ -1623,7 +1951,9 @@ static int do_request(ci_request_t * req)
         }
 
         /*We have received all data from the client. Call the end-of-data service handler and process*/
+        ci_request_phase_mark(req, CI_PHASE_EOF);
         ret_status = do_end_of_data(req);
+        ci_request_phase_mark(req, CI_PHASE_SERVICE);
         if (ret_status == CI_ERROR) {
             req->keepalive = 0; /*close the connection*/
             break;
@@ -1656,11 +1986,34 @@ static int do_request(ci_request_t * req)
     return ret_status;
 }
 
+static void log_slow_request(ci_request_t *req, int64_t usecs)
+{
+    static const char *phases[CI_PHASES_NUM] = {
+        NULL, "header", "preview", "body", "service", "send"
+    };
+    char buf[256];
+    int i, len = 0;
+    int64_t t;
+
+    buf[0] = '\0';
+    for (i = CI_PHASE_ACCEPT + 1; i < CI_PHASES_NUM && len < (int)sizeof(buf); i++) {
+        if ((t = ci_request_phase_time(req, i)) >= 0)
+            len += snprintf(buf + len, sizeof(buf) - len, " %s=%" PRId64 "us", phases[i], t);
+    }
+    log_server(req, "Slow request %s %s, status %d, total %" PRId64 "us:%s\n",
+               ci_method_string(req->type),
+               req->current_service_mod ? req->current_service_mod->mod_name : "-",
+               ci_error_code(req->return_code),
+               usecs, buf);
+}
+
 int process_request(ci_request_t * req)
 {
     int res;
     ci_service_xdata_t *srv_xdata;
+    int64_t usecs;
     res = do_request(req);
+    ci_request_phase_mark(req, CI_PHASE_SENT);
 
     if (req->pstrblock_read_len) {
         ci_debug_printf(5, "There are unparsed data of size %d: \"%.*s\"\n. Move to connection buffer\n", req->pstrblock_read_len, (req->pstrblock_read_len < 64 ? req->pstrblock_read_len : 64), req->pstrblock_read);
@@ -1675,54 +2028,52 @@ int process_request(ci_request_t * req)
         else
             srv_xdata = NULL;
 
-        STATS_LOCK();
-        if (STAT_REQUESTS >= 0) STATS_INT64_INC(STAT_REQUESTS,1);
+        ci_stat_uint64_inc(STAT_REQUESTS, 1);
 
         if (req->type == ICAP_REQMOD) {
-            STATS_INT64_INC(STAT_REQMODS, 1);
+            ci_stat_uint64_inc(STAT_REQMODS, 1);
             if (srv_xdata)
-                STATS_INT64_INC(srv_xdata->stat_reqmods, 1);
+                ci_stat_uint64_inc(srv_xdata->stat_reqmods, 1);
         } else if (req->type == ICAP_RESPMOD) {
-            STATS_INT64_INC(STAT_RESPMODS, 1);
+            ci_stat_uint64_inc(STAT_RESPMODS, 1);
             if (srv_xdata)
-                STATS_INT64_INC(srv_xdata->stat_respmods, 1);
+                ci_stat_uint64_inc(srv_xdata->stat_respmods, 1);
         } else if (req->type == ICAP_OPTIONS) {
-            STATS_INT64_INC(STAT_OPTIONS, 1);
+            ci_stat_uint64_inc(STAT_OPTIONS, 1);
             if (srv_xdata)
-                STATS_INT64_INC(srv_xdata->stat_options, 1);
+                ci_stat_uint64_inc(srv_xdata->stat_options, 1);
         }
 
-        if (res <0 && STAT_FAILED_REQUESTS >= 0)
-            STATS_INT64_INC(STAT_FAILED_REQUESTS,1);
+        if (res <0)
+            ci_stat_uint64_inc(STAT_FAILED_REQUESTS, 1);
         else if (req->return_code == EC_204) {
-            STATS_INT64_INC(STAT_ALLOW204, 1);
+            ci_stat_uint64_inc(STAT_ALLOW204, 1);
             if (srv_xdata)
-                STATS_INT64_INC(srv_xdata->stat_allow204, 1);
+                ci_stat_uint64_inc(srv_xdata->stat_allow204, 1);
         }
 
-
-        if (STAT_BYTES_IN >= 0) STATS_KBS_INC(STAT_BYTES_IN, req->bytes_in);
-        if (STAT_BYTES_OUT >= 0) STATS_KBS_INC(STAT_BYTES_OUT, req->bytes_out);
-        if (STAT_HTTP_BYTES_IN >= 0) STATS_KBS_INC(STAT_HTTP_BYTES_IN, req->http_bytes_in);
-        if (STAT_HTTP_BYTES_OUT >= 0) STATS_KBS_INC(STAT_HTTP_BYTES_OUT, req->http_bytes_out);
-        if (STAT_BODY_BYTES_IN >= 0) STATS_KBS_INC(STAT_BODY_BYTES_IN, req->body_bytes_in);
-        if (STAT_BODY_BYTES_OUT >= 0) STATS_KBS_INC(STAT_BODY_BYTES_OUT, req->body_bytes_out);
+        ci_stat_kbs_add(STAT_BYTES_IN, req->bytes_in);
+        ci_stat_kbs_add(STAT_BYTES_OUT, req->bytes_out);
+        ci_stat_kbs_add(STAT_HTTP_BYTES_IN, req->http_bytes_in);
+        ci_stat_kbs_add(STAT_HTTP_BYTES_OUT, req->http_bytes_out);
+        ci_stat_kbs_add(STAT_BODY_BYTES_IN, req->body_bytes_in);
+        ci_stat_kbs_add(STAT_BODY_BYTES_OUT, req->body_bytes_out);
 
         if (srv_xdata) {
-            if (srv_xdata->stat_bytes_in >= 0)
-                STATS_KBS_INC(srv_xdata->stat_bytes_in, req->bytes_in);
-            if (srv_xdata->stat_bytes_out >= 0)
-                STATS_KBS_INC(srv_xdata->stat_bytes_out, req->bytes_out);
-            if (srv_xdata->stat_http_bytes_in >= 0)
-                STATS_KBS_INC(srv_xdata->stat_http_bytes_in, req->http_bytes_in);
-            if (srv_xdata->stat_http_bytes_out >= 0)
-                STATS_KBS_INC(srv_xdata->stat_http_bytes_out, req->http_bytes_out);
-            if (srv_xdata->stat_body_bytes_in >= 0)
-                STATS_KBS_INC(srv_xdata->stat_body_bytes_in, req->body_bytes_in);
-            if (srv_xdata->stat_body_bytes_out >= 0)
-                STATS_KBS_INC(srv_xdata->stat_body_bytes_out, req->body_bytes_out);
+            ci_stat_kbs_add(srv_xdata->stat_bytes_in, req->bytes_in);
+            ci_stat_kbs_add(srv_xdata->stat_bytes_out, req->bytes_out);
+            ci_stat_kbs_add(srv_xdata->stat_http_bytes_in, req->http_bytes_in);
+            ci_stat_kbs_add(srv_xdata->stat_http_bytes_out, req->http_bytes_out);
+            ci_stat_kbs_add(srv_xdata->stat_body_bytes_in, req->body_bytes_in);
+            ci_stat_kbs_add(srv_xdata->stat_body_bytes_out, req->body_bytes_out);
         }
-        STATS_UNLOCK();
+    }
+
+    usecs = ci_request_phase_time(req, CI_PHASE_ACCEPT);
+    if (usecs >= 0) {
+        ci_stat_histogram_add(STAT_REQUEST_TIME, (uint64_t)usecs);
+        if (SLOW_REQUEST_THRESHOLD > 0 && usecs >= (int64_t)SLOW_REQUEST_THRESHOLD * 1000)
+            log_slow_request(req, usecs);
     }
 
     return res; /*Allow to log even the failed requests*/
@@ -1741,12 +2092,14 @@ void print_headers(ci_request_t * req)
 {
     int type;
     ci_headers_list_t *headers;
+    if (CI_DEBUG_LEVEL < 5)
+        return;
     ci_debug_printf(5, "\nICAP HEADERS:\n");
     ci_headers_iterate(req->response_header, NULL, printhead);
     ci_debug_printf(5, "\n");
 
-    if ((headers =  ci_http_response_headers(req)) == NULL) {
-        headers = ci_http_request_headers(req);
+    if ((headers =  ci_http_response_headers_ro(req)) == NULL) {
+        headers = ci_http_request_headers_ro(req);
         type = ICAP_REQMOD;
     } else
         type = ICAP_RESPMOD;
@@ -23,15 +23,20 @@
 #include <ctype.h>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
 #include "debug.h"
 #include "request.h"
 #include "simple_api.h"
 #include "util.h"
 #include "body.h"
+#include "mem.h"
 
 const char *CI_DEFAULT_USER_AGENT = "C-ICAP-Client-Library/" VERSION;
 char *CI_USER_AGENT = NULL;
 
+int CI_IO_BUF_SIZE = BUFSIZE;
+int CI_IO_MAX_BUF_SIZE = 32768;
+
 static void * _os_malloc(int size)
 {
     return malloc(size);
@@ -255,6 +260,18 @@ ci_request_t *ci_request_alloc(ci_connection_t * connection)
     if (!req)
         return NULL;
 
+    req->rbuf = ci_buffer_alloc(CI_IO_BUF_SIZE);
+    req->wbuf = ci_buffer_alloc(CI_IO_BUF_SIZE);
+    if (!req->rbuf || !req->wbuf) {
+        ci_buffer_free(req->rbuf);
+        ci_buffer_free(req->wbuf);
+        __intl_free(req);
+        return NULL;
+    }
+    req->rbuf_size = CI_IO_BUF_SIZE;
+    req->wbuf_size = CI_IO_BUF_SIZE;
+    req->full_reads = 0;
+
     req->connection = connection;
     req->packed = 0;
     req->user[0] = '\0';
@@ -292,6 +309,8 @@ ci_request_t *ci_request_alloc(ci_connection_t * connection)
 
     req->pstrblock_responce = NULL;
     req->remain_send_block_bytes = 0;
+    req->body_refs_num = 0;
+    req->body_refs_sent = 0;
     req->data_locked = 1;
     req->i206_use_original_body = -1;
 
@@ -303,6 +322,9 @@ ci_request_t *ci_request_alloc(ci_connection_t * connection)
 
     req->log_str = NULL;
     req->attributes = NULL;
+    req->arena = NULL;
+    req->acl_memo = NULL;
+    req->data_generation = 0;
     memset(&(req->xclient_ip), 0, sizeof(ci_ip_t));
 
     req->bytes_in = 0;
@@ -312,6 +334,7 @@ ci_request_t *ci_request_alloc(ci_connection_t * connection)
     req->http_bytes_out = 0;
     req->body_bytes_in = 0;
     req->body_bytes_out = 0;
+    memset(req->phase_time, 0, sizeof(req->phase_time));
 
     for (i = 0; i < 5; i++)    //
         req->entities[i] = NULL;
@@ -360,9 +383,12 @@ void ci_request_reset(ci_request_t * req)
     req->chunk_bytes_read = 0;
     req->pstrblock_responce = NULL;
     req->remain_send_block_bytes = 0;
+    req->body_refs_num = 0;
+    req->body_refs_sent = 0;
     req->write_to_module_pending = 0;
     req->data_locked = 1;
     req->i206_use_original_body = -1;
+    req->full_reads = 0;
 
     if (req->echo_body) {
         ci_ring_buf_destroy(req->echo_body);
@@ -372,13 +398,15 @@ void ci_request_reset(ci_request_t * req)
     req->preview_data_type = -1;
     req->auth_required = 0;
 
-    if (req->log_str)
-        __intl_free(req->log_str);
+    /*The log string and attributes are allocated in request arena*/
     req->log_str = NULL;
-
     if (req->attributes)
         ci_array_destroy(req->attributes);
     req->attributes = NULL;
+    req->acl_memo = NULL;
+    req->data_generation = 0;
+    if (req->arena)
+        req->arena->reset(req->arena);
     memset(&(req->xclient_ip), 0, sizeof(ci_ip_t));
 
     req->bytes_in = 0;
@@ -388,6 +416,7 @@ void ci_request_reset(ci_request_t * req)
     req->http_bytes_out = 0;
     req->body_bytes_in = 0;
     req->body_bytes_out = 0;
+    memset(req->phase_time, 0, sizeof(req->phase_time));
 
     for (i = 0; req->entities[i] != NULL; i++) {
         ci_request_release_entity(req, i);
@@ -425,23 +454,116 @@ void ci_request_destroy(ci_request_t * req)
         req->echo_body = NULL;
     }
 
-    if (req->log_str)
-        __intl_free(req->log_str);
-
     if (req->attributes)
         ci_array_destroy(req->attributes);
 
+    if (req->arena)
+        ci_mem_allocator_destroy(req->arena);
+
+    ci_buffer_free(req->rbuf);
+    ci_buffer_free(req->wbuf);
+
     __intl_free(req);
 }
 
+/*
+  Grow the read buffer of the request, keeping the unparsed data.
+*/
+int ci_request_resize_rbuf(ci_request_t *req, int new_size)
+{
+    char *buf;
+    if (new_size > CI_IO_MAX_BUF_SIZE)
+        new_size = CI_IO_MAX_BUF_SIZE;
+    if (new_size <= req->rbuf_size)
+        return 0;
+
+    if (!(buf = ci_buffer_alloc(new_size)))
+        return 0;
+
+    if (req->pstrblock_read && req->pstrblock_read_len > 0)
+        memcpy(buf, req->pstrblock_read, req->pstrblock_read_len);
+    req->pstrblock_read = buf;
+    ci_buffer_free(req->rbuf);
+    req->rbuf = buf;
+    req->rbuf_size = new_size;
+    ci_debug_printf(8, "Request read buffer resized to %d bytes\n", new_size);
+    return 1;
+}
+
+/*
+  Grow the write buffer of the request. It can not resized while a block
+  from the write buffer is not sent yet.
+*/
+int ci_request_resize_wbuf(ci_request_t *req, int new_size)
+{
+    char *buf;
+    if (new_size > CI_IO_MAX_BUF_SIZE)
+        new_size = CI_IO_MAX_BUF_SIZE;
+    if (new_size <= req->wbuf_size)
+        return 0;
+
+    if (req->remain_send_block_bytes > 0 &&
+            req->pstrblock_responce >= req->wbuf &&
+            req->pstrblock_responce < req->wbuf + req->wbuf_size)
+        return 0;
+
+    if (!(buf = ci_buffer_alloc(new_size)))
+        return 0;
+
+    ci_buffer_free(req->wbuf);
+    req->wbuf = buf;
+    req->wbuf_size = new_size;
+    ci_debug_printf(8, "Request write buffer resized to %d bytes\n", new_size);
+    return 1;
+}
+
+void ci_request_phase_mark(ci_request_t *req, int phase)
+{
+    if (phase >= 0 && phase < CI_PHASES_NUM && !req->phase_time[phase])
+        req->phase_time[phase] = ci_clock_usec();
+}
+
+int64_t ci_request_phase_time(const ci_request_t *req, int phase)
+{
+    int i;
+    if (phase < 0 || phase >= CI_PHASES_NUM || !req->phase_time[phase])
+        return -1;
+
+    if (phase == CI_PHASE_ACCEPT) {
+        /*The total time, up to the last recorded phase*/
+        for (i = CI_PHASES_NUM - 1; i > CI_PHASE_ACCEPT && !req->phase_time[i]; i--);
+        return (int64_t)(req->phase_time[i] - req->phase_time[CI_PHASE_ACCEPT]);
+    }
+
+    for (i = phase - 1; i >= 0 && !req->phase_time[i]; i--);
+    if (i < 0)
+        return -1;
+    return (int64_t)(req->phase_time[phase] - req->phase_time[i]);
+}
+
+/*The initial size of the request memory arena*/
+#define REQUEST_ARENA_SIZE 8192
+
+ci_mem_allocator_t *ci_request_mem_allocator(ci_request_t *req)
+{
+    if (!req->arena && !(req->arena = ci_create_serial_allocator(REQUEST_ARENA_SIZE)))
+        ci_debug_printf(1, "Error allocating request memory arena!\n");
+    return req->arena;
+}
+
+void *ci_request_mem_alloc(ci_request_t *req, size_t size)
+{
+    ci_mem_allocator_t *arena;
+    if (!(arena = ci_request_mem_allocator(req)))
+        return NULL;
+    return arena->alloc(arena, size);
+}
+
 char *ci_request_set_log_str(ci_request_t *req, char *logstr)
 {
     int size;
-    if (req->log_str)
-        __intl_free(req->log_str);
-
     size = strlen(logstr) + 1;
-    req->log_str = __intl_malloc(size*sizeof(char));
+    req->log_str = ci_request_mem_alloc(req, size*sizeof(char));
     if (!req->log_str)
         return NULL;
     strcpy(req->log_str, logstr);
@@ -450,8 +572,10 @@ char *ci_request_set_log_str(ci_request_t *req, char *logstr)
 
 int  ci_request_set_str_attribute(ci_request_t *req, const char *name, const char *value)
 {
+    ci_mem_allocator_t *arena;
     if (req->attributes == NULL) {
-        req->attributes = ci_array_new(4096);
+        if ((arena = ci_request_mem_allocator(req)))
+            req->attributes = ci_array_new_from_allocator(arena, 4096);
         if (!req->attributes) {
             ci_debug_printf(1, "Error allocating request attributes array!\n");
             return 0;
@@ -485,6 +609,78 @@ int ci_request_206_origin_body(ci_request_t *req, uint64_t offset)
     return 1;
 }
 
+static struct ci_body_ref *body_ref_add(ci_request_t *req, int len)
+{
+    struct ci_body_ref *ref;
+    if (!req || len <= 0)
+        return NULL;
+
+    if (req->status != SEND_BODY || req->body_refs_num >= CI_MAX_BODY_REFS)
+        return NULL;
+
+    ref = &req->body_refs[req->body_refs_num];
+    ref->data = NULL;
+    ref->fd = -1;
+    ref->offset = 0;
+    ref->len = len;
+    ref->head_len = snprintf(ref->head, sizeof(ref->head), "%x\r\n", len);
+    req->body_refs_num++;
+
+    /*Like the chunks formated in wbuf, count the data before sent*/
+    req->http_bytes_out += len;
+    req->body_bytes_out += len;
+    return ref;
+}
+
+int ci_request_send_body_ref(ci_request_t *req, const char *data, int len)
+{
+    struct ci_body_ref *ref;
+    if (!data || !(ref = body_ref_add(req, len)))
+        return 0;
+    ref->data = data;
+    return 1;
+}
+
+int ci_request_send_body_file(ci_request_t *req, int fd, ci_off_t offset, int len)
+{
+    struct ci_body_ref *ref;
+    if (fd < 0 || offset < 0 || !(ref = body_ref_add(req, len)))
+        return 0;
+    ref->fd = fd;
+    ref->offset = offset;
+    return 1;
+}
+
+int ci_request_send_body_simple_file(ci_request_t *req, ci_simple_file_t *body, int len)
+{
+    ci_off_t remains;
+    if (!body || len <= 0)
+        return 0;
+
+    if (body->readpos == body->endpos)
+        return (body->flags & CI_FILE_HAS_EOF) ? CI_EOF : 0;
+
+    /*In ring mode the space of the read data is reused*/
+    if (body->max_store_size)
+        return 0;
+
+    if ((body->flags & CI_FILE_USELOCK) && body->unlocked >= 0)
+        remains = body->unlocked - body->readpos;
+    else
+        remains = body->endpos - body->readpos;
+
+    if (remains <= 0)
+        return 0;
+    if (remains < len)
+        len = remains;
+
+    if (!ci_request_send_body_file(req, body->fd, body->readpos, len))
+        return 0;
+    body->readpos += len;
+    body->bytes_out += len;
+    return len;
+}
+
 int process_encapsulated(ci_request_t * req, const char *buf)
 {
     const char *start;
@@ -524,8 +720,9 @@ enum chunk_status { READ_CHUNK_DEF = 1, READ_CHUNK_DATA };
 int parse_chunk_data(ci_request_t * req, char **wdata)
 {
     char *end;
-    const char *eofChunk;
+    const char *eofChunk, *hexEnd;
     int chunkLen, remains, tmp;
+    int64_t chunkSize;
     int read_status = 0;
 
     *wdata = NULL;
@@ -541,9 +738,10 @@ int parse_chunk_data(ci_request_t * req, char **wdata)
             read_status = READ_CHUNK_DATA;
 
         if (read_status == READ_CHUNK_DEF) {
-            if ((eofChunk = strnstr(req->pstrblock_read, "\r\n", req->pstrblock_read_len)) == NULL) {
-                /*Check for wrong protocol data, or possible parse error*/
-                if (req->pstrblock_read_len >= BUFSIZE)
+            if ((eofChunk = ci_find_crlf(req->pstrblock_read, req->pstrblock_read_len)) == NULL) {
+                /*Check for wrong protocol data, or possible parse error.
+                  The chunk definition must fit in the read buffer*/
+                if (req->pstrblock_read_len >= req->rbuf_size)
                     return CI_ERROR; /* To big chunk definition?*/
                 return CI_NEEDS_MORE;
             }
@@ -552,15 +750,14 @@ int parse_chunk_data(ci_request_t * req, char **wdata)
             // Count parse data
             req->request_bytes_in += (eofChunk - req->pstrblock_read);
 
-            errno = 0;
-            tmp = strtol(req->pstrblock_read, &end, 16);
-            /*here must check for erron */
-            if (tmp == 0 && req->pstrblock_read == end) {    /*Oh .... an error ... */
-                ci_debug_printf(5, "Parse error:count=%d,start=%c\n",
-                                tmp, req->pstrblock_read[0]);
+            if (!ci_parse_hex(req->pstrblock_read, eofChunk - req->pstrblock_read, &hexEnd, &chunkSize)
+                    || chunkSize > INT_MAX - 2) {    /*Oh .... an error ... */
+                ci_debug_printf(5, "Parse error: start=%c\n",
+                                req->pstrblock_read[0]);
                 return CI_ERROR;
             }
-            req->current_chunk_len = tmp;
+            end = (char *)hexEnd;
+            req->current_chunk_len = (unsigned int)chunkSize;
             req->chunk_bytes_read = 0;
 
             while (*end == ' ' || *end == '\t') ++end; /*ignore spaces*/
@@ -662,11 +859,11 @@ int net_data_read(ci_request_t * req)
         req->pstrblock_read = req->rbuf;
     }
 
-    bytes = BUFSIZE - req->pstrblock_read_len;
+    bytes = req->rbuf_size - req->pstrblock_read_len;
     if (bytes <= 0) {
         ci_debug_printf(5,
                         "Not enough space to read data! Is this a bug (%d %d)?????\n",
-                        req->pstrblock_read_len, BUFSIZE);
+                        req->pstrblock_read_len, req->rbuf_size);
         return CI_ERROR;
     }
 
@@ -727,6 +924,8 @@ void ci_client_request_reuse(ci_request_t * req)
     req->chunk_bytes_read = 0;
     req->pstrblock_responce = NULL;
     req->remain_send_block_bytes = 0;
+    req->body_refs_num = 0;
+    req->body_refs_sent = 0;
     req->write_to_module_pending = 0;
     req->data_locked = 1;
 
@@ -740,6 +939,7 @@ void ci_client_request_reuse(ci_request_t * req)
     req->http_bytes_out = 0;
     req->body_bytes_in = 0;
     req->body_bytes_out = 0;
+    memset(req->phase_time, 0, sizeof(req->phase_time));
 
     for (i = 0; req->entities[i] != NULL; i++) {
         ci_request_release_entity(req, i);
@@ -798,14 +998,14 @@ static int get_request_options(ci_request_t * req, ci_headers_list_t * h)
 {
     const char *pstr;
 
-    if ((pstr = ci_headers_value(h, "Preview")) != NULL) {
+    if ((pstr = ci_headers_value_id(h, CI_HEADER_PREVIEW)) != NULL) {
         req->preview = strtol(pstr, NULL, 10);
     } else
         req->preview = -1;
 
 
     req->allow204 = 0;
-    if ((pstr = ci_headers_value(h, "Allow")) != NULL) {
+    if ((pstr = ci_headers_value_id(h, CI_HEADER_ALLOW)) != NULL) {
         if (strtol(pstr, NULL, 10) == 204)
             req->allow204 = 1;
     }
@@ -956,7 +1156,7 @@ static int client_parse_icap_header(ci_request_t * req, ci_headers_list_t * h)
     const char *end;
     if (req->pstrblock_read_len < 4)   /*we need 4 bytes for the end of headers "\r\n\r\n" string */
         return CI_NEEDS_MORE;
-    if ((end = strnstr(req->pstrblock_read, "\r\n\r\n", req->pstrblock_read_len)) != NULL) {
+    if ((end = ci_find_crlfcrlf(req->pstrblock_read, req->pstrblock_read_len)) != NULL) {
         readed = end - req->pstrblock_read + 4;
         eoh = 1;
     } else
@@ -1114,7 +1314,7 @@ static int client_prepere_body_chunk(ci_request_t * req, void *data,
 
 
     wbuf = req->wbuf + EXTRA_CHUNK_SIZE;       /*Let size of EXTRA_CHUNK_SIZE space in the beggining of chunk */
-    chunksize = (*readdata) (data, wbuf, MAX_CHUNK_SIZE);
+    chunksize = (*readdata) (data, wbuf, ci_req_max_chunk_size(req));
     if (chunksize == CI_EOF || chunksize == 0) {
         req->remain_send_block_bytes = 0;
         return chunksize == CI_EOF ? CI_EOF : CI_NEEDS_MORE;
@@ -1160,7 +1360,7 @@ static int client_parse_incoming_data(ci_request_t * req, void *data_dest,
             return 204;
         }
 
-        if ((val = ci_headers_search(req->response_header, "Encapsulated")) == NULL) {
+        if ((val = ci_headers_search_id(req->response_header, CI_HEADER_ENCAPSULATED)) == NULL) {
             ci_debug_printf(1, "No encapsulated entities!\n");
             return CI_ERROR;
         }
@@ -1372,7 +1572,7 @@ static int ci_client_handle_previewed_response(ci_request_t * req, int *preview_
         ci_headers_unpack(req->response_header);
     } else if ((req->eof_sent && *preview_status == 200) || *preview_status == 206) {
         ci_headers_unpack(req->response_header);
-        if ((val = ci_headers_search(req->response_header, "Encapsulated")) == NULL) {
+        if ((val = ci_headers_search_id(req->response_header, CI_HEADER_ENCAPSULATED)) == NULL) {
             ci_debug_printf(1, "No encapsulated entities!\n");
             return CI_ERROR;
         }
@@ -62,6 +62,8 @@ struct echo_req_data {
     ci_ring_buf_t *body;
     /*flag for marking the eof*/
     int eof;
+    /*the size of the body block handed over to c-icap to be sent*/
+    int body_ref_len;
 };
 
 
@@ -101,8 +103,9 @@ void *echo_init_request_data(ci_request_t * req)
 {
     struct echo_req_data *echo_data;
 
-    /*Allocate memory fot the echo_data*/
-    echo_data = malloc(sizeof(struct echo_req_data));
+    /*Allocate memory fot the echo_data from the request memory. It is
+      released when the request is released*/
+    echo_data = ci_request_mem_alloc(req, sizeof(struct echo_req_data));
     if (!echo_data) {
         ci_debug_printf(1, "Memory allocation failed inside echo_init_request_data!\n");
         return NULL;
@@ -117,6 +120,7 @@ void *echo_init_request_data(ci_request_t * req)
         echo_data->body = NULL;
 
     echo_data->eof = 0;
+    echo_data->body_ref_len = 0;
     /*Return to the c-icap server the allocated data*/
     return echo_data;
 }
@@ -130,8 +134,6 @@ void echo_release_request_data(void *data)
     /*if we had body data, release the related allocated data*/
     if (echo_data->body)
         ci_ring_buf_destroy(echo_data->body);
-
-    free(echo_data);
 }
 
 
@@ -213,10 +215,18 @@ int echo_end_of_data_handler(ci_request_t * req)
 int echo_io(char *wbuf, int *wlen, char *rbuf, int *rlen, int iseof,
             ci_request_t * req)
 {
-    int ret;
+    int ret, len;
+    char *block;
     struct echo_req_data *echo_data = ci_service_data(req);
     ret = CI_OK;
 
+    /*c-icap asks for more data, the body block handed over in the
+      previous call is sent, remove it from echo_data->body*/
+    if (wbuf && wlen && *wlen > 0) {
+        ci_ring_buf_consume(echo_data->body, echo_data->body_ref_len);
+        echo_data->body_ref_len = 0;
+    }
+
     /*write the data read from icap_client to the echo_data->body*/
     if (rlen && rbuf) {
         *rlen = ci_ring_buf_write(echo_data->body, rbuf, *rlen);
@@ -224,12 +234,18 @@ int echo_io(char *wbuf, int *wlen, char *rbuf, int *rlen, int iseof,
             ret = CI_ERROR;
     }
 
-    /*read some data from the echo_data->body and put them to the write buffer to be send
-     to the ICAP client*/
-    if (wbuf && wlen) {
-        *wlen = ci_ring_buf_read(echo_data->body, wbuf, *wlen);
-        if (*wlen == 0 && echo_data->eof == 1)
-            *wlen = CI_EOF;
+    /*send the data of echo_data->body to the ICAP client. The data are
+      not copied to the write buffer, they are handed over to c-icap*/
+    if (wbuf && wlen && *wlen > 0) {
+        ci_ring_buf_read_block(echo_data->body, &block, &len);
+        if (len > 0 && ci_request_send_body_ref(req, block, len)) {
+            echo_data->body_ref_len = len;
+            *wlen = 0;
+        } else {
+            *wlen = ci_ring_buf_read(echo_data->body, wbuf, *wlen);
+            if (*wlen == 0 && echo_data->eof == 1)
+                *wlen = CI_EOF;
+        }
     }
 
     return ret;
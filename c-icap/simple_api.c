@@ -23,6 +23,16 @@
 #include <ctype.h>
 #include <errno.h>
 
+#define header_end(e) (e == '\0' || e == '\n' || e == '\r')
+
+/*The headers read from the network are kept packed, and their lines are
+  not NUL-terminated. Returns the size of a line up to its end.*/
+static size_t header_line_len(const char *line)
+{
+    size_t len;
+    for (len = 0; !header_end(line[len]); len++);
+    return len;
+}
 
 /*
 int ci_resp_check_body(ci_request_t *req){
@@ -36,7 +46,7 @@ int ci_resp_check_body(ci_request_t *req){
 */
 
 
-ci_headers_list_t * ci_http_response_headers(ci_request_t * req)
+static ci_headers_list_t * http_response_headers(ci_request_t * req)
 {
     int i;
     ci_encaps_entity_t **e_list;
@@ -49,7 +59,7 @@ ci_headers_list_t * ci_http_response_headers(ci_request_t * req)
     return NULL;
 }
 
-ci_headers_list_t *ci_http_request_headers(ci_request_t * req)
+static ci_headers_list_t *http_request_headers(ci_request_t * req)
 {
     ci_encaps_entity_t **e_list;
     e_list = req->entities;
@@ -67,10 +77,44 @@ ci_headers_list_t *ci_http_request_headers(ci_request_t * req)
     return NULL;
 }
 
+/*
+  The HTTP headers read from the network are kept packed, as they were
+  received, and they are sent back unchanged if the service does not
+  touch them. Unpack them when they are retrieved for editing while the
+  request is still in edit mode. The read only users retrieve them with
+  ci_http_request_headers_ro and ci_http_response_headers_ro.
+*/
+static ci_headers_list_t *edit_headers(ci_request_t * req, ci_headers_list_t *heads)
+{
+    if (heads && heads->packed && !req->packed)
+        ci_headers_unpack(heads);
+    return heads;
+}
+
+ci_headers_list_t * ci_http_response_headers(ci_request_t * req)
+{
+    return edit_headers(req, http_response_headers(req));
+}
+
+ci_headers_list_t *ci_http_request_headers(ci_request_t * req)
+{
+    return edit_headers(req, http_request_headers(req));
+}
+
+ci_headers_list_t *ci_http_response_headers_ro(ci_request_t * req)
+{
+    return http_response_headers(req);
+}
+
+ci_headers_list_t *ci_http_request_headers_ro(ci_request_t * req)
+{
+    return http_request_headers(req);
+}
+
 int ci_http_response_reset_headers(ci_request_t * req)
 {
     ci_headers_list_t *heads;
-    if (!(heads =  ci_http_response_headers(req)))
+    if (!(heads =  http_response_headers(req)))
         return 0;
     ci_headers_reset(heads);
     return 1;
@@ -79,7 +123,7 @@ int ci_http_response_reset_headers(ci_request_t * req)
 int ci_http_request_reset_headers(ci_request_t * req)
 {
     ci_headers_list_t *heads;
-    if (!(heads = ci_http_request_headers(req)))
+    if (!(heads = http_request_headers(req)))
         return 0;
     ci_headers_reset(heads);
     return 1;
@@ -139,7 +183,7 @@ const char *ci_http_response_add_header(ci_request_t * req, const char *header)
     ci_headers_list_t *heads;
     if (req->packed)  /*Not in edit mode*/
         return NULL;
-    if (!(heads =  ci_http_response_headers(req)))
+    if (!(heads =  http_response_headers(req)))
         return NULL;
     return ci_headers_add(heads, header);
 }
@@ -150,7 +194,7 @@ const char *ci_http_request_add_header(ci_request_t * req, const char *header)
     ci_headers_list_t *heads;
     if (req->packed)  /*Not in edit mode*/
         return NULL;
-    if (!(heads = ci_http_request_headers(req)))
+    if (!(heads = http_request_headers(req)))
         return NULL;
     return ci_headers_add(heads, header);
 }
@@ -206,12 +250,12 @@ ci_off_t ci_http_content_length(ci_request_t * req)
     const char *val;
     ci_off_t res = 0;
     char *e;
-    if (!(heads =  ci_http_response_headers(req))) {
+    if (!(heads =  http_response_headers(req))) {
         /*Then maybe is a reqmod reauest, try to get request headers */
-        if (!(heads = ci_http_request_headers(req)))
+        if (!(heads = http_request_headers(req)))
             return 0;
     }
-    if (!(val = ci_headers_value(heads, "Content-Length")))
+    if (!(val = ci_headers_value_id(heads, CI_HEADER_CONTENT_LENGTH)))
         return -1;
 
     errno = 0;
@@ -221,7 +265,7 @@ ci_off_t ci_http_content_length(ci_request_t * req)
         return -2;
     }
     if (val == e) {
-        ci_debug_printf(4, "Content-Length: not valid value: '%s' \n", val);
+        ci_debug_printf(4, "Content-Length: not valid value: '%.*s' \n", (int)header_line_len(val), val);
         return -2;
     }
     return res;
@@ -230,13 +274,25 @@ ci_off_t ci_http_content_length(ci_request_t * req)
 const char *ci_http_request(ci_request_t * req)
 {
     ci_headers_list_t *heads;
+    char *line;
+    size_t len;
     if (!(heads = ci_http_request_headers(req)))
         return NULL;
 
     if (!heads->used)
         return NULL;
 
-    return heads->headers[0];
+    if (!heads->packed)
+        return heads->headers[0];
+
+    /*Not in edit mode, the line is not NUL-terminated. Return a copy
+      allocated in the request memory arena.*/
+    len = header_line_len(heads->headers[0]);
+    if (!(line = ci_request_mem_alloc(req, len + 1)))
+        return NULL;
+    memcpy(line, heads->headers[0], len);
+    line[len] = '\0';
+    return line;
 }
 
 const char *ci_icap_add_xheader(ci_request_t * req, const char *header)
@@ -249,7 +305,6 @@ int ci_icap_append_xheaders(ci_request_t *req,ci_headers_list_t *headers)
     return ci_headers_addheaders(req->xheaders, headers);
 }
 
-#define header_end(e) (e == '\0' || e == '\n' || e == '\r')
 int ci_http_request_url(ci_request_t * req, char *buf, int buf_size)
 {
     ci_headers_list_t *heads;
@@ -258,7 +313,7 @@ int ci_http_request_url(ci_request_t * req, char *buf, int buf_size)
     /*The request must have the form:
          GET url HTTP/X.X
     */
-    if (!(heads = ci_http_request_headers(req)))
+    if (!(heads = http_request_headers(req)))
         return 0;
 
     if (!heads->used)
@@ -266,9 +321,11 @@ int ci_http_request_url(ci_request_t * req, char *buf, int buf_size)
 
     str = heads->headers[0];
 
-    if ((str = strchr(str, ' ')) == NULL) { /*Ignore method i*/
+    /*Ignore method, the line may not be NUL-terminated*/
+    while (!header_end(*str) && *str != ' ')
+        str++;
+    if (*str != ' ')
         return 0;
-    }
     while (*str == ' ') /*ignore spaces*/
         str++;
 
@@ -24,6 +24,8 @@
 
 struct stat_entry_list STAT_INT64 = {NULL, 0, 0};
 struct stat_entry_list STAT_KBS = {NULL, 0, 0};
+struct stat_entry_list STAT_GAUGES = {NULL, 0, 0};
+struct stat_entry_list STAT_HISTOGRAMS = {NULL, 0, 0};
 struct stat_groups_list STAT_GROUPS = {NULL, 0, 0};;
 
 struct stat_area *STATS = NULL;
@@ -32,7 +34,8 @@ struct stat_area *STATS = NULL;
 
 int ci_stat_memblock_size(void)
 {
-    return _CI_ALIGN(sizeof(struct stat_memblock))+STAT_INT64.entries_num*sizeof(uint64_t)+STAT_KBS.entries_num*sizeof(kbs_t);
+    return _CI_ALIGN(sizeof(struct stat_memblock))+STAT_INT64.entries_num*sizeof(uint64_t)+STAT_KBS.entries_num*sizeof(kbs_t)
+           + STAT_GAUGES.entries_num*sizeof(int64_t) + STAT_HISTOGRAMS.entries_num*sizeof(stat_histogram_t);
 }
 
 int stat_entry_by_name(struct stat_entry_list *list, const char *label);
@@ -136,6 +139,10 @@ int ci_stat_entry_register(char *label, int type, char *group)
         return stat_entry_add(&STAT_INT64, label, type, gid);
     } else if (type == STAT_KBS_T) {
         return stat_entry_add(&STAT_KBS, label, type, gid);
+    } else if (type == STAT_GAUGE_T) {
+        return stat_entry_add(&STAT_GAUGES, label, type, gid);
+    } else if (type == STAT_HISTOGRAM_T) {
+        return stat_entry_add(&STAT_HISTOGRAMS, label, type, gid);
     }
     return -1;
 }
@@ -144,54 +151,384 @@ void ci_stat_entry_release_lists()
 {
     stat_entry_release_list(&STAT_INT64);
     stat_entry_release_list(&STAT_KBS);
+    stat_entry_release_list(&STAT_GAUGES);
+    stat_entry_release_list(&STAT_HISTOGRAMS);
 }
 
+#if !defined(_WIN32) && defined(__ATOMIC_RELAXED)
+#define USE_STAT_SHARDS 1
+#endif
+
+#if defined(USE_STAT_SHARDS)
+/*
+  Every thread increases the counters in its own shard, without locking.
+  The shards are folded into the attached stats memblock by the
+  ci_stat_publish() function and when the thread exits. Only the
+  difference from the previous publish is added to the memblock, so
+  counters updated directly in memblock are not affected.
+*/
+struct stat_shard {
+    int counters64_size;
+    int counterskbs_size;
+    uint64_t *values;
+    uint64_t *published;
+    struct stat_shard *prev;
+    struct stat_shard *next;
+};
+
+static struct stat_shard *STAT_SHARDS = NULL;
+static ci_thread_mutex_t STAT_SHARDS_MTX;
+static pthread_key_t STAT_SHARD_KEY;
+static pthread_once_t STAT_SHARD_ONCE = PTHREAD_ONCE_INIT;
+static int STAT_SHARDS_READY = 0;
+
+/*Must called with STAT_SHARDS_MTX and STATS->mtx locked*/
+static void stat_shard_publish(struct stat_shard *shard)
+{
+    struct stat_memblock *block = STATS->mem_block;
+    uint64_t v, d;
+    int i, k;
+
+    for (i = 0; i < shard->counters64_size && i < block->counters64_size; i++) {
+        v = __atomic_load_n(&shard->values[i], __ATOMIC_RELAXED);
+        block->counters64[i] += v - shard->published[i];
+        shard->published[i] = v;
+    }
+
+    for (i = 0; i < shard->counterskbs_size && i < block->counterskbs_size; i++) {
+        k = shard->counters64_size + i;
+        v = __atomic_load_n(&shard->values[k], __ATOMIC_RELAXED);
+        d = v - shard->published[k];
+        shard->published[k] = v;
+        block->counterskbs[i].kb += (d >> 10);
+        block->counterskbs[i].bytes += (d & 0x3FF);
+        block->counterskbs[i].kb += (block->counterskbs[i].bytes >> 10);
+        block->counterskbs[i].bytes &= 0x3FF;
+    }
+}
+
+static void stat_shard_destroy(void *data)
+{
+    struct stat_shard *shard = (struct stat_shard *)data;
+
+    ci_thread_mutex_lock(&STAT_SHARDS_MTX);
+    if (STATS && STATS->mem_block) {
+        ci_thread_mutex_lock(&STATS->mtx);
+        stat_shard_publish(shard);
+        ci_thread_mutex_unlock(&STATS->mtx);
+    }
+    if (shard->prev)
+        shard->prev->next = shard->next;
+    else
+        STAT_SHARDS = shard->next;
+    if (shard->next)
+        shard->next->prev = shard->prev;
+    ci_thread_mutex_unlock(&STAT_SHARDS_MTX);
+    free(shard);
+}
+
+static void stat_shards_init()
+{
+    ci_thread_mutex_init(&STAT_SHARDS_MTX);
+    if (pthread_key_create(&STAT_SHARD_KEY, stat_shard_destroy) == 0)
+        STAT_SHARDS_READY = 1;
+}
+
+static struct stat_shard *stat_shard()
+{
+    struct stat_shard *shard;
+    int values;
+
+    if (!STAT_SHARDS_READY)
+        return NULL;
+
+    if ((shard = pthread_getspecific(STAT_SHARD_KEY)) != NULL)
+        return shard;
+
+    values = STATS->mem_block->counters64_size + STATS->mem_block->counterskbs_size;
+    shard = calloc(1, _CI_ALIGN(sizeof(struct stat_shard)) + 2 * values * sizeof(uint64_t));
+    if (!shard)
+        return NULL;
+    shard->counters64_size = STATS->mem_block->counters64_size;
+    shard->counterskbs_size = STATS->mem_block->counterskbs_size;
+    shard->values = (void *)shard + _CI_ALIGN(sizeof(struct stat_shard));
+    shard->published = shard->values + values;
+    if (pthread_setspecific(STAT_SHARD_KEY, shard) != 0) {
+        free(shard);
+        return NULL;
+    }
+
+    ci_thread_mutex_lock(&STAT_SHARDS_MTX);
+    shard->next = STAT_SHARDS;
+    if (STAT_SHARDS)
+        STAT_SHARDS->prev = shard;
+    STAT_SHARDS = shard;
+    ci_thread_mutex_unlock(&STAT_SHARDS_MTX);
+    return shard;
+}
+
+static inline void stat_shard_add(uint64_t *value, uint64_t count)
+{
+    /*Only the owner thread modifies the value*/
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + count, __ATOMIC_RELAXED);
+}
+#endif
+
 void ci_stat_attach_mem(void *mem_block,int size,void (*release_mem)(void *))
 {
     if (STATS)
         return;
 
     STATS = ci_stat_area_construct(mem_block, size, release_mem);
+#if defined(USE_STAT_SHARDS)
+    pthread_once(&STAT_SHARD_ONCE, stat_shards_init);
+#endif
 }
 
 void ci_stat_release()
 {
     if (!STATS)
         return;
+    ci_stat_publish();
     ci_stat_area_destroy(STATS);
     STATS = NULL;
 }
 
+void ci_stat_publish()
+{
+#if defined(USE_STAT_SHARDS)
+    struct stat_shard *shard;
+
+    if (!STATS || !STATS->mem_block || !STAT_SHARDS_READY)
+        return;
+
+    ci_thread_mutex_lock(&STAT_SHARDS_MTX);
+    ci_thread_mutex_lock(&STATS->mtx);
+    for (shard = STAT_SHARDS; shard != NULL; shard = shard->next)
+        stat_shard_publish(shard);
+    ci_thread_mutex_unlock(&STATS->mtx);
+    ci_thread_mutex_unlock(&STAT_SHARDS_MTX);
+#endif
+}
+
 void ci_stat_uint64_inc(int ID, int count)
 {
+#if defined(USE_STAT_SHARDS)
+    struct stat_shard *shard;
+#endif
     if (!STATS || !STATS->mem_block)
         return;
     if (ID < 0 || ID >= STATS->mem_block->counters64_size)
         return;
+#if defined(USE_STAT_SHARDS)
+    if ((shard = stat_shard()) != NULL && ID < shard->counters64_size) {
+        stat_shard_add(&shard->values[ID], count);
+        return;
+    }
+#endif
     ci_thread_mutex_lock(&STATS->mtx);
     STATS->mem_block->counters64[ID] += count;
     ci_thread_mutex_unlock(&STATS->mtx);
 }
 
-void ci_stat_kbs_inc(int ID, int count)
+void ci_stat_kbs_add(int ID, uint64_t bytes)
 {
-    if (!STATS->mem_block)
+#if defined(USE_STAT_SHARDS)
+    struct stat_shard *shard;
+#endif
+    if (!STATS || !STATS->mem_block)
         return;
 
     if (ID < 0 || ID >= STATS->mem_block->counterskbs_size)
         return;
 
+#if defined(USE_STAT_SHARDS)
+    if ((shard = stat_shard()) != NULL && ID < shard->counterskbs_size) {
+        stat_shard_add(&shard->values[shard->counters64_size + ID], bytes);
+        return;
+    }
+#endif
     ci_thread_mutex_lock(&STATS->mtx);
-    STATS->mem_block->counterskbs[ID].bytes += count;
+    STATS->mem_block->counterskbs[ID].kb += (bytes >> 10);
+    STATS->mem_block->counterskbs[ID].bytes += (bytes & 0x3FF);
     STATS->mem_block->counterskbs[ID].kb += (STATS->mem_block->counterskbs[ID].bytes >> 10);
     STATS->mem_block->counterskbs[ID].bytes &= 0x3FF;
     ci_thread_mutex_unlock(&STATS->mtx);
 }
 
+void ci_stat_kbs_inc(int ID, int count)
+{
+    ci_stat_kbs_add(ID, (uint64_t)count);
+}
+
+
+void ci_stat_gauge_set(int ID, int64_t value)
+{
+    if (!STATS || !STATS->mem_block)
+        return;
+
+    if (ID < 0 || ID >= STATS->mem_block->gauges_size)
+        return;
+
+#if defined(USE_STAT_SHARDS)
+    __atomic_store_n(&STATS->mem_block->gauges[ID], value, __ATOMIC_RELAXED);
+#else
+    ci_thread_mutex_lock(&STATS->mtx);
+    STATS->mem_block->gauges[ID] = value;
+    ci_thread_mutex_unlock(&STATS->mtx);
+#endif
+}
+
+void ci_stat_gauge_add(int ID, int64_t count)
+{
+    if (!STATS || !STATS->mem_block)
+        return;
+
+    if (ID < 0 || ID >= STATS->mem_block->gauges_size)
+        return;
+
+#if defined(USE_STAT_SHARDS)
+    __atomic_fetch_add(&STATS->mem_block->gauges[ID], count, __ATOMIC_RELAXED);
+#else
+    ci_thread_mutex_lock(&STATS->mtx);
+    STATS->mem_block->gauges[ID] += count;
+    ci_thread_mutex_unlock(&STATS->mtx);
+#endif
+}
+
+static int histogram_bucket(uint64_t value)
+{
+    int e;
+    if (value < 8)
+        return (int)value;
+#if defined(__GNUC__)
+    e = 63 - __builtin_clzll(value);
+#else
+    for (e = 3; (value >> (e + 1)) != 0; e++);
+#endif
+    return 8 + (e - 3) * 8 + (int)((value >> (e - 3)) & 0x7);
+}
+
+/*The middle value of the bucket*/
+static uint64_t histogram_bucket_value(int bucket)
+{
+    int e;
+    uint64_t low;
+    if (bucket < 8)
+        return bucket;
+    e = (bucket - 8) / 8 + 3;
+    low = (uint64_t)(8 + (bucket - 8) % 8) << (e - 3);
+    return low + (((uint64_t)1 << (e - 3)) >> 1);
+}
+
+/*The largest value of the bucket*/
+static uint64_t histogram_bucket_high(int bucket)
+{
+    int e;
+    uint64_t low;
+    if (bucket < 8)
+        return bucket;
+    e = (bucket - 8) / 8 + 3;
+    low = (uint64_t)(8 + (bucket - 8) % 8) << (e - 3);
+    return low + ((uint64_t)1 << (e - 3)) - 1;
+}
+
+void ci_stat_histogram_add(int ID, uint64_t value)
+{
+    stat_histogram_t *h;
+#if defined(USE_STAT_SHARDS)
+    uint64_t max;
+#endif
+
+    if (!STATS || !STATS->mem_block)
+        return;
+
+    if (ID < 0 || ID >= STATS->mem_block->histograms_size)
+        return;
+
+    h = &STATS->mem_block->histograms[ID];
+#if defined(USE_STAT_SHARDS)
+    __atomic_fetch_add(&h->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+            !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+    ci_thread_mutex_lock(&STATS->mtx);
+    h->buckets[histogram_bucket(value)]++;
+    h->sum += value;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+    ci_thread_mutex_unlock(&STATS->mtx);
+#endif
+}
+
+/*
+  Computes the histogram of the values added between two snapshots of a
+  histogram. The max of the snapshots is the max since the start: if it
+  grew the new max was added between the snapshots, else the max of the
+  difference is bounded by the largest used bucket.
+*/
+void ci_stat_histogram_diff(stat_histogram_t *diff, const stat_histogram_t *latest, const stat_histogram_t *oldest)
+{
+    int b, top = -1;
+
+    diff->count = latest->count - oldest->count;
+    diff->sum = latest->sum - oldest->sum;
+    for (b = 0; b < STAT_HISTOGRAM_BUCKETS; b++) {
+        if ((diff->buckets[b] = latest->buckets[b] - oldest->buckets[b]) != 0)
+            top = b;
+    }
+    if (top < 0)
+        diff->max = 0;
+    else if (latest->max > oldest->max)
+        diff->max = latest->max;
+    else
+        diff->max = histogram_bucket_high(top) < latest->max ? histogram_bucket_high(top) : latest->max;
+}
+
+uint64_t ci_stat_histogram_percentile(const stat_histogram_t *histogram, double percentile)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (!histogram->count)
+        return 0;
+
+    if (percentile >= 100)
+        return histogram->max;
+
+    rank = (uint64_t)((double)histogram->count * percentile / 100.0);
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    if (i == STAT_HISTOGRAM_BUCKETS)
+        return histogram->max;
+    return histogram_bucket_value(i) < histogram->max ? histogram_bucket_value(i) : histogram->max;
+}
+
 
 /***********************************************
    Low level functions
 */
+static void stat_memblock_layout(struct stat_memblock *view, void *mem_block)
+{
+    void *p = mem_block + _CI_ALIGN(sizeof(struct stat_memblock));
+    view->counters64 = p;
+    p += view->counters64_size * sizeof(uint64_t);
+    view->counterskbs = p;
+    p += view->counterskbs_size * sizeof(kbs_t);
+    view->gauges = p;
+    p += view->gauges_size * sizeof(int64_t);
+    view->histograms = p;
+}
+
 struct stat_area *ci_stat_area_construct(void *mem_block, int size, void (*release_mem)(void *))
 {
     struct stat_area  *area = NULL;
@@ -207,25 +544,15 @@ struct stat_area *ci_stat_area_construct(void *mem_block, int size, void (*relea
     ci_thread_mutex_init(&(area->mtx));
     area->mem_block = mem_block;
     area->release_mem = release_mem;
-    area->mem_block->counters64 = mem_block + _CI_ALIGN(sizeof(struct stat_memblock));
-    area->mem_block->counterskbs = mem_block + _CI_ALIGN(sizeof(struct stat_memblock)) + STAT_INT64.entries_num*sizeof(uint64_t);
-    area->mem_block->counters64_size =  STAT_INT64.entries_num;
-    area->mem_block->counterskbs_size = STAT_KBS.entries_num;
+    stat_memblock_fix(area->mem_block);
     ci_stat_area_reset(area);
     return area;
 }
 
 void ci_stat_area_reset(struct stat_area *area)
 {
-    int i;
-
     ci_thread_mutex_lock(&(area->mtx));
-    for (i = 0; i < area->mem_block->counters64_size; i++)
-        area->mem_block->counters64[i] = 0;
-    for (i = 0; i < area->mem_block->counterskbs_size; i++) {
-        area->mem_block->counterskbs[i].kb = 0;
-        area->mem_block->counterskbs[i].bytes = 0;
-    }
+    ci_stat_memblock_reset(area->mem_block);
     ci_thread_mutex_unlock(&(area->mtx));
 }
 
@@ -272,18 +599,28 @@ void stat_memblock_fix(struct stat_memblock *mem_block)
     assert(mem_block->sig == MEMBLOCK_SIG);
     mem_block->counters64_size =  STAT_INT64.entries_num;
     mem_block->counterskbs_size = STAT_KBS.entries_num;
-    mem_block->counters64 = (void *)mem_block + _CI_ALIGN(sizeof(struct stat_memblock));
-    mem_block->counterskbs = (void *)mem_block + _CI_ALIGN(sizeof(struct stat_memblock))
-                             + mem_block->counters64_size*sizeof(uint64_t);
+    mem_block->gauges_size = STAT_GAUGES.entries_num;
+    mem_block->histograms_size = STAT_HISTOGRAMS.entries_num;
+    stat_memblock_layout(mem_block, mem_block);
 }
 
 /*Reconstruct a memblock which is located to a continues memory block*/
 void stat_memblock_reconstruct(struct stat_memblock *mem_block)
 {
     assert(mem_block->sig == MEMBLOCK_SIG);
-    mem_block->counters64 = (void *)mem_block + _CI_ALIGN(sizeof(struct stat_memblock));
-    mem_block->counterskbs = (void *)mem_block + _CI_ALIGN(sizeof(struct stat_memblock))
-                             + mem_block->counters64_size*sizeof(uint64_t);
+    stat_memblock_layout(mem_block, mem_block);
+}
+
+/*Fill a memblock struct pointing to the data of the given memblock, without
+  modifying it*/
+void stat_memblock_view(struct stat_memblock *view, struct stat_memblock *mem_block)
+{
+    view->sig = mem_block->sig;
+    view->counters64_size = mem_block->counters64_size;
+    view->counterskbs_size = mem_block->counterskbs_size;
+    view->gauges_size = mem_block->gauges_size;
+    view->histograms_size = mem_block->histograms_size;
+    stat_memblock_layout(view, mem_block);
 }
 
 void ci_stat_memblock_reset(struct stat_memblock *block)
@@ -295,11 +632,17 @@ void ci_stat_memblock_reset(struct stat_memblock *block)
         block->counterskbs[i].kb = 0;
         block->counterskbs[i].bytes = 0;
     }
+    for (i = 0; i < block->gauges_size; i++)
+        block->gauges[i] = 0;
+    if (block->histograms_size)
+        memset(block->histograms, 0, block->histograms_size * sizeof(stat_histogram_t));
 }
 
+/*Counters and gauges are summed, histograms are merged bucket by bucket*/
 void ci_stat_memblock_merge(struct stat_memblock *dest_block, struct stat_memblock *mem_block)
 {
-    int i;
+    int i, k;
+    stat_histogram_t *dh, *sh;
     if (!dest_block || !mem_block)
         return;
 
@@ -312,6 +655,20 @@ void ci_stat_memblock_merge(struct stat_memblock *dest_block, struct stat_memblo
         dest_block->counterskbs[i].kb += (dest_block->counterskbs[i].bytes >> 10);
         dest_block->counterskbs[i].bytes &= 0x3FF;
     }
+
+    for (i = 0; i < dest_block->gauges_size && i < mem_block->gauges_size; i++)
+        dest_block->gauges[i] += mem_block->gauges[i];
+
+    for (i = 0; i < dest_block->histograms_size && i < mem_block->histograms_size; i++) {
+        dh = &dest_block->histograms[i];
+        sh = &mem_block->histograms[i];
+        dh->count += sh->count;
+        dh->sum += sh->sum;
+        if (sh->max > dh->max)
+            dh->max = sh->max;
+        for (k = 0; k < STAT_HISTOGRAM_BUCKETS; k++)
+            dh->buckets[k] += sh->buckets[k];
+    }
 }
 
 
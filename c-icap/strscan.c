@@ -0,0 +1,233 @@
+/*
+ *  Copyright (C) 2004-2011 Christos Tsantilas
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA.
+ */
+
+#include "common.h"
+#include "c-icap.h"
+#include "util.h"
+#if defined(HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+
+/*
+  Scanning functions for the ICAP protocol parsers. On x86 processors
+  the SSE2 or AVX2 implementation is selected at the first call,
+  depending on the processor features.
+*/
+
+static const char *find_crlf_scalar(const char *s, size_t len)
+{
+    const char *e = s + len, *p = s;
+    while (p + 1 < e && (p = memchr(p, '\r', e - p - 1)) != NULL) {
+        if (p[1] == '\n')
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+static const char *find_crlfcrlf_scalar(const char *s, size_t len)
+{
+    const char *e = s + len, *p = s;
+    while (p + 3 < e && (p = memchr(p, '\r', e - p - 3)) != NULL) {
+        if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(HAVE_X86_SIMD)
+__attribute__((target("sse2")))
+static const char *find_crlf_sse2(const char *s, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    __m128i a, b;
+    unsigned int mask;
+    size_t i = 0;
+
+    for (; i + 17 <= len; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(s + i));
+        b = _mm_loadu_si128((const __m128i *)(s + i + 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, cr), _mm_cmpeq_epi8(b, lf)));
+        if (mask)
+            return s + i + __builtin_ctz(mask);
+    }
+    return find_crlf_scalar(s + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static const char *find_crlfcrlf_sse2(const char *s, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    __m128i m;
+    unsigned int mask;
+    size_t i = 0;
+
+    for (; i + 19 <= len; i += 16) {
+        m = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + 1)), lf));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + 2)), cr));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + 3)), lf));
+        if ((mask = _mm_movemask_epi8(m)) != 0)
+            return s + i + __builtin_ctz(mask);
+    }
+    return find_crlfcrlf_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *find_crlf_avx2(const char *s, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    __m256i a, b;
+    unsigned int mask;
+    size_t i = 0;
+
+    for (; i + 33 <= len; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(s + i));
+        b = _mm256_loadu_si256((const __m256i *)(s + i + 1));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, cr), _mm256_cmpeq_epi8(b, lf)));
+        if (mask)
+            return s + i + __builtin_ctz(mask);
+    }
+    return find_crlf_sse2(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *find_crlfcrlf_avx2(const char *s, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    __m256i m;
+    unsigned int mask;
+    size_t i = 0;
+
+    for (; i + 35 <= len; i += 32) {
+        m = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i + 1)), lf));
+        m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i + 2)), cr));
+        m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i + 3)), lf));
+        if ((mask = _mm256_movemask_epi8(m)) != 0)
+            return s + i + __builtin_ctz(mask);
+    }
+    return find_crlfcrlf_sse2(s + i, len - i);
+}
+#endif
+
+static const char *find_crlf_select(const char *s, size_t len);
+static const char *find_crlfcrlf_select(const char *s, size_t len);
+
+/*The selected implementations. Threads may select them concurrently,
+  but they all store the same values.*/
+static const char *(*find_crlf)(const char *s, size_t len) = find_crlf_select;
+static const char *(*find_crlfcrlf)(const char *s, size_t len) = find_crlfcrlf_select;
+static const char *SCAN_IMPL = NULL;
+
+static void scan_select()
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_crlf = find_crlf_avx2;
+        find_crlfcrlf = find_crlfcrlf_avx2;
+        SCAN_IMPL = "avx2";
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        find_crlf = find_crlf_sse2;
+        find_crlfcrlf = find_crlfcrlf_sse2;
+        SCAN_IMPL = "sse2";
+        return;
+    }
+#endif
+    find_crlf = find_crlf_scalar;
+    find_crlfcrlf = find_crlfcrlf_scalar;
+    SCAN_IMPL = "scalar";
+}
+
+static const char *find_crlf_select(const char *s, size_t len)
+{
+    scan_select();
+    return find_crlf(s, len);
+}
+
+static const char *find_crlfcrlf_select(const char *s, size_t len)
+{
+    scan_select();
+    return find_crlfcrlf(s, len);
+}
+
+const char *ci_find_crlf(const char *s, size_t len)
+{
+    return find_crlf(s, len);
+}
+
+const char *ci_find_crlfcrlf(const char *s, size_t len)
+{
+    return find_crlfcrlf(s, len);
+}
+
+const char *ci_scan_impl()
+{
+    if (!SCAN_IMPL)
+        scan_select();
+    return SCAN_IMPL;
+}
+
+static const signed char HEX_VALUES[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+int ci_parse_hex(const char *s, size_t len, const char **end, int64_t *val)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *e = p + len;
+    uint64_t v = 0;
+    int d;
+
+    while (p < e && (d = HEX_VALUES[*p]) >= 0) {
+        if (v > (uint64_t)(INT64_MAX >> 4)) /*overflow*/
+            return 0;
+        v = (v << 4) | d;
+        p++;
+    }
+    if (end)
+        *end = (const char *)p;
+    if (p == (const unsigned char *)s)
+        return 0;
+    *val = (int64_t)v;
+    return 1;
+}
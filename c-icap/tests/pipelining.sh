@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Starts the c-icap server from the build tree with the echo service and
+# sends pipelined requests with small and large bodies over one connection.
+
+top_builddir=${top_builddir:-..}
+PORT=${TEST_PORT:-13459}
+TESTDIR=`pwd`/pipelining.tmp
+
+rm -rf $TESTDIR
+mkdir -p $TESTDIR/tmp || exit 1
+cat > $TESTDIR/c-icap.conf <<CONF
+PidFile $TESTDIR/c-icap.pid
+CommandsSocket $TESTDIR/c-icap.ctl
+Port $PORT
+StartServers 1
+MaxServers 1
+ThreadsPerChild 2
+TmpDir $TESTDIR/tmp
+Pipelining on
+MaxKeepAliveRequests 100
+ModulesDir $top_builddir/modules/.libs
+ServicesDir $top_builddir/services/echo/.libs
+ServerLog $TESTDIR/server.log
+AccessLog $TESTDIR/access.log
+Service echo srv_echo.so
+CONF
+
+$top_builddir/c-icap -N -f $TESTDIR/c-icap.conf &
+SERVER=$!
+sleep 2
+
+ret=0
+# Bodies smaller and larger than the I/O buffers, followed by more requests
+./test-pipelining $PORT 4200 10 || ret=1
+./test-pipelining $PORT 5000 70000 || ret=1
+./test-pipelining $PORT 70000 99x100 || ret=1
+./test-pipelining $PORT 3x300000 20x5000 || ret=1
+
+kill $SERVER
+wait $SERVER 2>/dev/null
+if test $ret -ne 0; then
+    cat $TESTDIR/server.log
+else
+    rm -rf $TESTDIR
+fi
+exit $ret
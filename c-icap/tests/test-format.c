@@ -0,0 +1,115 @@
+/*
+ *  Copyright (C) 2004-2008 Christos Tsantilas
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA.
+ */
+
+/*
+  Checks that a format string compiled with ci_format_compile and run with
+  ci_format_program_run produces the same text as ci_format_text.
+*/
+
+#include "common.h"
+#include "c-icap.h"
+#include "txt_format.h"
+#include <stdio.h>
+
+/*Like most formating functions, writes up to len bytes and does not
+  terminate the output*/
+static int fmt_copy(char *buf, int len, const char *s)
+{
+    int i;
+    for (i = 0; i < len && s[i]; i++)
+        buf[i] = s[i];
+    return i;
+}
+
+static int fmt_word(ci_request_t *req, char *buf, int len, const char *param)
+{
+    return fmt_copy(buf, len, "word");
+}
+
+static int fmt_param(ci_request_t *req, char *buf, int len, const char *param)
+{
+    return fmt_copy(buf, len, param);
+}
+
+static int fmt_empty(ci_request_t *req, char *buf, int len, const char *param)
+{
+    return 0;
+}
+
+static struct ci_fmt_entry USER_TABLE[] = {
+    {"%Zw", "A word", fmt_word},
+    {"%Zp", "The parameter", fmt_param},
+    {"%Ze", "Nothing", fmt_empty},
+    {NULL, NULL, NULL}
+};
+
+static struct {
+    const char *fmt;
+    int len;              /*the output buffer size*/
+    const char *expect;
+} TESTS[] = {
+    {"plain text", 64, "plain text"},
+    {"", 64, ""},
+    {"%Zw", 64, "word"},
+    {"a %Zw b %Zw c", 64, "a word b word c"},
+    {"[%8Zw]", 64, "[    word]"},
+    {"[%-8Zw]", 64, "[word    ]"},
+    {"[%2Zw]", 64, "[wo]"},
+    {"[%{abc}Zp]", 64, "[abc]"},
+    {"[%-6{ab}Zp]", 64, "[ab    ]"},
+    {"[%Ze]", 64, "[-]"},
+    {"[%3Ze]", 64, "[  -]"},
+    {"100%% %Q %", 64, "100% %Q %"},
+    {"[%{abc]", 64, "[%{abc]"},
+    {"abcdef", 4, "abc"},
+    {"ab%Zw", 5, "abwo"},
+    {"ab%8Zw", 6, "abwor"},
+    {"ab%6Zw", 9, "ab  word"},
+    {"ab%-8Zw", 6, "abwor"},
+    {"%Zw", 1, ""},
+    {NULL, 0, NULL}
+};
+
+int main(int argc, char *argv[])
+{
+    char text[64], run[64];
+    ci_fmt_program_t *prog;
+    int i, text_len, run_len, failed = 0;
+
+    for (i = 0; TESTS[i].fmt != NULL; i++) {
+        text_len = ci_format_text(NULL, TESTS[i].fmt, text, TESTS[i].len, USER_TABLE);
+        if (strcmp(text, TESTS[i].expect) != 0) {
+            printf("FAIL '%s': ci_format_text '%s', expected '%s'\n", TESTS[i].fmt, text, TESTS[i].expect);
+            failed = 1;
+        }
+
+        if (!(prog = ci_format_compile(TESTS[i].fmt, USER_TABLE))) {
+            printf("FAIL '%s': can not compile\n", TESTS[i].fmt);
+            failed = 1;
+            continue;
+        }
+        run_len = ci_format_program_run(NULL, prog, run, TESTS[i].len);
+        if (strcmp(run, TESTS[i].expect) != 0 || run_len != text_len) {
+            printf("FAIL '%s': ci_format_program_run '%s'/%d, expected '%s'/%d\n", TESTS[i].fmt, run, run_len, TESTS[i].expect, text_len);
+            failed = 1;
+        }
+        ci_format_program_free(prog);
+    }
+    return failed;
+}
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2004-2008 Christos Tsantilas
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA.
+ */
+
+/*
+  Checks the longest prefix matches of the IP networks radix trie, and
+  that the networks the trie can not store are rejected.
+*/
+
+#include "common.h"
+#include "c-icap.h"
+#include "mem.h"
+#include "net_io.h"
+#include "types_ops.h"
+#include <stdio.h>
+
+int mem_init();
+
+static struct {
+    const char *net;
+    const char *data;
+    int added;          /*the expected ci_ip_trie_add result*/
+} NETS[] = {
+    {"0.0.0.0/0.0.0.0", "any", 1},
+    {"10.0.0.0/255.0.0.0", "ten", 1},
+    {"10.1.0.0/255.255.0.0", "ten-one", 1},
+    {"10.1.2.3", "host", 1},
+    {"10.1.2.3/255.255.255.255", "host-again", 1},
+    {"192.168.7.1/255.255.0.0", "lan", 1},
+    {"172.16.0.1/255.0.255.0", "non-contiguous", 0},
+#ifdef HAVE_IPV6
+    {"::/::", "any6", 1},
+    {"2001:db8::/ffff:ffff::", "doc", 1},
+    {"2001:db8::1", "host6", 1},
+    {"2001:db8:1::/ffff:ffff:ffff:ff00::", "doc-one", 1},
+    {"::ffff:10.0.0.0/ffff:ffff:ffff:ffff:ffff:ffff:ff00:0", "v4-mapped", 0},
+    {"2001:db9::/ffff:0:ffff::", "non-contiguous6", 0},
+#endif
+    {NULL, NULL, 0}
+};
+
+static struct {
+    const char *ip;
+    const char *expect; /*the data of the longest matching network*/
+} SEARCHES[] = {
+    {"10.1.2.3", "host"},
+    {"10.1.2.4", "ten-one"},
+    {"10.2.0.1", "ten"},
+    {"192.168.200.200", "lan"},
+    {"172.16.5.1", "any"},
+    {"8.8.8.8", "any"},
+#ifdef HAVE_IPV6
+    {"2001:db8::1", "host6"},
+    {"2001:db8::2", "doc"},
+    {"2001:db8:1:ff::5", "doc-one"},
+    {"2001:db9::1", "any6"},
+    {"::ffff:10.1.2.3", "host"},
+    {"::ffff:10.9.9.9", "ten"},
+    {"::ffff:8.8.8.8", "any"},
+#endif
+    {NULL, NULL}
+};
+
+int main(int argc, char *argv[])
+{
+    ci_ip_trie_t *trie;
+    ci_ip_t *ip;
+    const void *address;
+    const char *data;
+    int i, family, added, failed = 0;
+
+    mem_init();
+    if (!(trie = ci_ip_trie_create())) {
+        printf("FAIL: can not create the trie\n");
+        return 1;
+    }
+
+    if (ci_ip_trie_size(trie) == 0) {
+        printf("FAIL: the size of an empty trie is 0\n");
+        failed = 1;
+    }
+
+    for (i = 0; NETS[i].net != NULL; i++) {
+        if (!(ip = ci_ip_ops.dup(NETS[i].net, default_allocator))) {
+            printf("FAIL %s: can not parse\n", NETS[i].net);
+            failed = 1;
+            continue;
+        }
+        /*The trie keeps a pointer to the data, not the network*/
+        added = ci_ip_trie_add(trie, ip, (void *)NETS[i].data);
+        if (added != NETS[i].added) {
+            printf("FAIL %s: ci_ip_trie_add returned %d, expected %d\n", NETS[i].net, added, NETS[i].added);
+            failed = 1;
+        }
+        ci_ip_ops.free(ip, default_allocator);
+    }
+
+    for (i = 0; SEARCHES[i].ip != NULL; i++) {
+        if (!(ip = ci_ip_ops.dup(SEARCHES[i].ip, default_allocator))) {
+            printf("FAIL %s: can not parse\n", SEARCHES[i].ip);
+            failed = 1;
+            continue;
+        }
+        address = ci_ip_key_address(&ci_ip_ops, ip, &family);
+        data = ci_ip_trie_search(trie, family, address);
+        if (!data || strcmp(data, SEARCHES[i].expect) != 0) {
+            printf("FAIL %s: found '%s', expected '%s'\n", SEARCHES[i].ip, data ? data : "-", SEARCHES[i].expect);
+            failed = 1;
+        }
+        ci_ip_ops.free(ip, default_allocator);
+    }
+    ci_ip_trie_destroy(trie);
+
+    /*Without the /0 networks the unmatched addresses are not found*/
+    trie = ci_ip_trie_create();
+    ip = ci_ip_ops.dup("10.0.0.0/255.0.0.0", default_allocator);
+    ci_ip_trie_add(trie, ip, (void *)"ten");
+    ci_ip_ops.free(ip, default_allocator);
+    ip = ci_ip_ops.dup("11.0.0.1", default_allocator);
+    address = ci_ip_key_address(&ci_ip_ops, ip, &family);
+    if ((data = ci_ip_trie_search(trie, family, address)) != NULL) {
+        printf("FAIL 11.0.0.1: found '%s', expected nothing\n", data);
+        failed = 1;
+    }
+    ci_ip_ops.free(ip, default_allocator);
+    ci_ip_trie_destroy(trie);
+
+    return failed;
+}
@@ -0,0 +1,212 @@
+/*
+ *  Copyright (C) 2004-2008 Christos Tsantilas
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA.
+ */
+
+/*
+  Sends pipelined RESPMOD requests to the echo service over one connection
+  and checks that every response carries back the request body.
+  Usage: test-pipelining port body_size [body_size ...]
+  A body_size of the form NxS sends N requests with S bytes bodies.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_REQUESTS 1024
+
+static int PORT = 0;
+static int REQUESTS = 0;
+static int SIZES[MAX_REQUESTS];
+
+static void fill_body(char *body, int size, int n)
+{
+    int i;
+    for (i = 0; i < size; i++)
+        body[i] = 'a' + (i + n) % 26;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t bytes;
+    while (len > 0) {
+        if ((bytes = write(fd, buf, len)) <= 0)
+            return 0;
+        buf += bytes;
+        len -= bytes;
+    }
+    return 1;
+}
+
+static void *send_requests(void *arg)
+{
+    int fd = *(int *)arg;
+    char head[512], http_head[128], *body;
+    int n, hlen, http_len;
+
+    for (n = 0; n < REQUESTS; n++) {
+        http_len = snprintf(http_head, sizeof(http_head),
+                            "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n", SIZES[n]);
+        hlen = snprintf(head, sizeof(head),
+                        "RESPMOD icap://127.0.0.1:%d/echo ICAP/1.0\r\n"
+                        "Host: 127.0.0.1\r\n"
+                        "Encapsulated: res-hdr=0, res-body=%d\r\n\r\n"
+                        "%s%x\r\n", PORT, http_len, http_head, SIZES[n]);
+        if (!(body = malloc(SIZES[n] + 1)))
+            return NULL;
+        fill_body(body, SIZES[n], n);
+        if (!write_all(fd, head, hlen) ||
+                !write_all(fd, body, SIZES[n]) ||
+                !write_all(fd, "\r\n0\r\n\r\n", 7)) {
+            free(body);
+            return NULL;
+        }
+        free(body);
+    }
+    return NULL;
+}
+
+/*A buffered reader over the connection*/
+static char RBUF[65536];
+static int RBUF_POS = 0, RBUF_LEN = 0;
+
+static int read_byte(int fd)
+{
+    if (RBUF_POS == RBUF_LEN) {
+        if ((RBUF_LEN = read(fd, RBUF, sizeof(RBUF))) <= 0)
+            return -1;
+        RBUF_POS = 0;
+    }
+    return (unsigned char)RBUF[RBUF_POS++];
+}
+
+static int read_line(int fd, char *line, int size)
+{
+    int c, len = 0;
+    while ((c = read_byte(fd)) >= 0) {
+        if (len < size - 1)
+            line[len++] = c;
+        if (c == '\n')
+            break;
+    }
+    line[len] = '\0';
+    return c < 0 ? -1 : len;
+}
+
+static int check_response(int fd, int n)
+{
+    char line[1024], *body, *expect, *s;
+    int c, i, body_offset = -1, chunk, body_len = 0;
+
+    if (read_line(fd, line, sizeof(line)) < 0 || strncmp(line, "ICAP/1.0 200", 12) != 0) {
+        fprintf(stderr, "Request %d: bad response line: %s\n", n, line);
+        return 0;
+    }
+    while (read_line(fd, line, sizeof(line)) > 2) {
+        if (strncasecmp(line, "Encapsulated:", 13) == 0 && (s = strstr(line, "res-body=")))
+            body_offset = atoi(s + 9);
+    }
+    if (body_offset < 0) {
+        fprintf(stderr, "Request %d: no res-body in response\n", n);
+        return 0;
+    }
+    for (i = 0; i < body_offset; i++) {
+        if (read_byte(fd) < 0)
+            return 0;
+    }
+
+    if (!(body = malloc(SIZES[n] + 1)))
+        return 0;
+    do {
+        if (read_line(fd, line, sizeof(line)) < 0) {
+            free(body);
+            return 0;
+        }
+        chunk = strtol(line, NULL, 16);
+        for (i = 0; i < chunk; i++) {
+            if ((c = read_byte(fd)) < 0) {
+                free(body);
+                return 0;
+            }
+            if (body_len < SIZES[n])
+                body[body_len] = c;
+            body_len++;
+        }
+        read_line(fd, line, sizeof(line)); /*The chunk CRLF*/
+    } while (chunk > 0);
+
+    expect = malloc(SIZES[n] + 1);
+    if (expect)
+        fill_body(expect, SIZES[n], n);
+    c = (expect && body_len == SIZES[n] && memcmp(body, expect, SIZES[n]) == 0);
+    if (!c)
+        fprintf(stderr, "Request %d: body mismatch (%d bytes, expected %d)\n", n, body_len, SIZES[n]);
+    free(expect);
+    free(body);
+    return c;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    pthread_t writer;
+    int fd, i, n, num, size;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s port body_size [body_size ...]\n", argv[0]);
+        return 2;
+    }
+    PORT = atoi(argv[1]);
+    for (i = 2; i < argc; i++) {
+        if (sscanf(argv[i], "%dx%d", &num, &size) != 2) {
+            num = 1;
+            size = atoi(argv[i]);
+        }
+        for (n = 0; n < num && REQUESTS < MAX_REQUESTS; n++)
+            SIZES[REQUESTS++] = size;
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+
+    pthread_create(&writer, NULL, send_requests, &fd);
+    for (n = 0; n < REQUESTS; n++) {
+        if (!check_response(fd, n)) {
+            fprintf(stderr, "Failed at request %d of %d\n", n + 1, REQUESTS);
+            return 1;
+        }
+    }
+    pthread_join(writer, NULL);
+    close(fd);
+    printf("%d pipelined requests OK\n", REQUESTS);
+    return 0;
+}
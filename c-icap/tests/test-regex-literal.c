@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2004-2008 Christos Tsantilas
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA.
+ */
+
+/*
+  Checks that the literal ci_regex_literal reports for a regex appears in
+  strings matched by the regex. The regex lookup tables skip the rows whose
+  literal is not found in the searched key.
+*/
+
+#include "common.h"
+#include "c-icap.h"
+#include "array.h"
+#include "ci_regex.h"
+#include <stdio.h>
+#include <ctype.h>
+
+#if defined(USE_REGEX)
+
+static struct {
+    const char *regex;
+    const char *subject; /*a string matching the regex*/
+    const char *literal; /*the expected literal, or NULL to not check*/
+} TESTS[] = {
+    {"/example\\.com/", "www.example.com", "example.com"},
+    {"/ab+cd/", "abbbcd", "ab"},
+    {"/abcd?/", "abc", "abc"},
+    {"/\\x41bcd/", "Abcd", "bcd"},
+    {"/\\x{41}bcd/", "Abcd", "bcd"},
+    {"/\\101bc/", "Abc", "bc"},
+    {"/\\cJabc/", "\nabc", "abc"},
+    {"/\\p{Lu}abc/", "Xabc", "abc"},
+    {"/\\pLabc/", "Xabc", "abc"},
+    {"/(?<n>xy)\\k<n>abc/", "xyxyabc", "abc"},
+    {"/(xy)\\g1abc/", "xyxyabc", "abc"},
+    {"/(xy)\\g{-1}abc/", "xyxyabc", "abc"},
+    {"/(?x) a b c d/", "abcd", ""},
+    {"/(?i)abcd/", "ABCD", ""},
+    {"/(?i:ab)cd/", "ABcd", ""},
+    {"/bad|good/", "good", ""},
+    {NULL, NULL, NULL}
+};
+
+static void lower(char *s)
+{
+    for (; *s; s++)
+        *s = tolower(*s);
+}
+
+int main(int argc, char *argv[])
+{
+    char literal[256], subject[256], *pattern;
+    int i, flags, recursive, len, failed = 0;
+    ci_regex_t regex;
+
+    for (i = 0; TESTS[i].regex != NULL; i++) {
+        flags = 0;
+        recursive = 0;
+        if (!(pattern = ci_regex_parse(TESTS[i].regex, &flags, &recursive))) {
+            printf("FAIL %s: can not parse\n", TESTS[i].regex);
+            failed = 1;
+            continue;
+        }
+        literal[0] = '\0';
+        len = ci_regex_literal(pattern, flags, literal, sizeof(literal));
+        if (TESTS[i].literal && strcmp(literal, TESTS[i].literal) != 0 &&
+                !(len == 0 && TESTS[i].literal[0] == '\0')) {
+            printf("FAIL %s: literal '%s', expected '%s'\n", TESTS[i].regex, literal, TESTS[i].literal);
+            failed = 1;
+        }
+
+        /*The escapes and options supported depend on the regex library,
+          check the literal only against the subjects the regex matches*/
+        regex = ci_regex_build(pattern, flags);
+        if (regex && ci_regex_apply(regex, TESTS[i].subject, -1, 0, NULL, NULL)) {
+            strncpy(subject, TESTS[i].subject, sizeof(subject) - 1);
+            subject[sizeof(subject) - 1] = '\0';
+            lower(subject);
+            lower(literal);
+            if (len > 0 && !strstr(subject, literal)) {
+                printf("FAIL %s: literal '%s' is not in the matching '%s'\n", TESTS[i].regex, literal, TESTS[i].subject);
+                failed = 1;
+            }
+        }
+        if (regex)
+            ci_regex_free(regex);
+        free(pattern);
+    }
+    return failed;
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+    return 77; /*skip, no regex support*/
+}
+#endif
@@ -44,6 +44,8 @@ typedef struct {
     char *SERVICE_NAME;
     char *LANGUAGE;
     ci_membuf_t *data;
+    ci_fmt_program_t *program; /*The compiled data*/
+    struct ci_fmt_entry *program_table; /*The user table used to compile data*/
     time_t last_used;
     time_t loaded;
     time_t modified;
@@ -86,6 +88,7 @@ int ci_txt_template_init(void)
         // The following three elements are critical to be cleared,
         // the rest can be left unintialized
         templates[i].data = NULL;
+        templates[i].program = NULL;
         templates[i].loaded = 0;
         templates[i].locked = 0;
         templates[i].must_free = 0;
@@ -110,8 +113,7 @@ static int templateExpired(txtTemplate_t *template)
 {
     char path[CI_MAX_PATH];
     struct stat file;
-    time_t current_time;
-    time(&current_time);
+    time_t current_time = ci_coarse_time();
 
     if (current_time - template->loaded >= TEMPLATE_RELOAD_TIME) {
         makeTemplatePathFileName(path, CI_MAX_PATH,
@@ -147,6 +149,10 @@ static void templateFree(txtTemplate_t *template)
     template->TEMPLATE_NAME = template->SERVICE_NAME = template->LANGUAGE = NULL;
     ci_membuf_free(template->data);
     template->data = NULL;
+    if (template->program)
+        ci_format_program_free(template->program);
+    template->program = NULL;
+    template->program_table = NULL;
 }
 
 static void template_release(txtTemplate_t *template)
@@ -260,7 +266,7 @@ static txtTemplate_t *templateTryLoadText(const ci_request_t * req, const char *
     txtTemplate_t *tempTemplate = NULL;
     time_t current_time;
 
-    time(&current_time);
+    current_time = ci_coarse_time();
     // Protect the template cache structure
     ci_thread_mutex_lock(&templates_mutex);
 
@@ -332,6 +338,8 @@ static txtTemplate_t *templateTryLoadText(const ci_request_t * req, const char *
     tempTemplate->TEMPLATE_NAME = strdup(page_name);
     tempTemplate->LANGUAGE = strdup(lang);
     tempTemplate->data = textbuff;
+    tempTemplate->program = NULL;
+    tempTemplate->program_table = NULL;
     tempTemplate->loaded = current_time;
     tempTemplate->modified = file.st_mtime;
     tempTemplate->last_used = current_time;
@@ -391,6 +399,39 @@ static txtTemplate_t *templateLoadText(const ci_request_t * req, const char *ser
     return templateTryLoadText(req, service_name, page_name, TEMPLATE_DEF_LANG);
 }
 
+/*Returns the compiled template. The template is compiled at the first
+  use and cached. If the template is already compiled with a different
+  user table a non cached compiled template is returned and the
+  must_free is set.
+  The compiled templates keep pointers to the user table entries. They
+  are released by ci_txt_template_reset, which the system_shutdown calls
+  before the services and modules are unloaded, so a table address reused
+  after a reconfigure never matches a stale program.*/
+static ci_fmt_program_t *template_program(txtTemplate_t *template, struct ci_fmt_entry *user_table, int *must_free)
+{
+    ci_fmt_program_t *prog;
+
+    *must_free = 0;
+    ci_thread_mutex_lock(&templates_mutex);
+    if ((prog = template->program) != NULL && template->program_table == user_table) {
+        ci_thread_mutex_unlock(&templates_mutex);
+        return prog;
+    }
+    ci_thread_mutex_unlock(&templates_mutex);
+
+    if (!(prog = ci_format_compile(template->data->buf, user_table)))
+        return NULL;
+
+    ci_thread_mutex_lock(&templates_mutex);
+    if (!template->program) {
+        template->program = prog;
+        template->program_table = user_table;
+    } else
+        *must_free = 1;
+    ci_thread_mutex_unlock(&templates_mutex);
+    return prog;
+}
+
 // Caller should release the returned buffer when they have finished with it.
 ci_membuf_t *ci_txt_template_build_content(const ci_request_t *req, const char *SERVICE_NAME,
         const char *TEMPLATE_NAME, struct ci_fmt_entry *user_table)
@@ -398,6 +439,8 @@ ci_membuf_t *ci_txt_template_build_content(const ci_request_t *req, const char *
     ci_membuf_t *content;
     char templpath[CI_MAX_PATH];
     txtTemplate_t *template = NULL;
+    ci_fmt_program_t *prog;
+    int must_free;
 
     content = ci_membuf_new_sized(TEMPLATE_MEMBUF_SIZE);
     if (!content) {
@@ -408,7 +451,12 @@ ci_membuf_t *ci_txt_template_build_content(const ci_request_t *req, const char *
     /*templateLoadText also locks the template*/
     template = templateLoadText(req, SERVICE_NAME, TEMPLATE_NAME);
     if (template) {
-        content->endpos = ci_format_text((ci_request_t *)req, template->data->buf, content->buf, content->bufsize, user_table);
+        if ((prog = template_program(template, user_table, &must_free)) != NULL) {
+            content->endpos = ci_format_program_run((ci_request_t *)req, prog, content->buf, content->bufsize);
+            if (must_free)
+                ci_format_program_free(prog);
+        } else
+            content->endpos = ci_format_text((ci_request_t *)req, template->data->buf, content->buf, content->bufsize, user_table);
         ci_membuf_write(content, "\0", 1, 1);      // terminate the string for safety (????)
         if (template->LANGUAGE)
             ci_membuf_attr_add(content, "lang", template->LANGUAGE, strlen(template->LANGUAGE) + 1);
@@ -23,6 +23,8 @@
 #include "simple_api.h"
 #include "debug.h"
 #include "txt_format.h"
+#include "util.h"
+#include <assert.h>
 
 #define MAX_VARIABLE_SIZE 256
 
@@ -38,6 +40,8 @@ int fmt_request(ci_request_t *req_data, char *buf,int len, const char *param);
 int fmt_localtime(ci_request_t *req_data, char *buf,int len, const char *param);
 int fmt_gmttime(ci_request_t *req_data, char *buf,int len, const char *param);
 int fmt_seconds(ci_request_t *req_data, char *buf,int len, const char *param);
+int fmt_response_time(ci_request_t *req_data, char *buf,int len, const char *param);
+int fmt_phase_time(ci_request_t *req_data, char *buf,int len, const char *param);
 int fmt_httpclientip(ci_request_t *req_data, char *buf,int len, const char *param);
 int fmt_httpserverip(ci_request_t *req_data, char *buf,int len, const char *param);
 int fmt_http_req_url_o(ci_request_t *req_data, char *buf,int len, const char *param);
@@ -69,6 +73,10 @@ int fmt_req_attribute(ci_request_t *req_data, char *buf,int len, const char *par
    * \em "%ts": Seconds since epoch \n
    * \em "%tl": Local time \n
    * \em "%tg": GMT time \n
+   * \em "%tr": Response time in milliseconds \n
+   * \em "%tp": Time in microseconds spent in a request processing phase.
+   *            The phase name (header, preview, body, service, send or
+   *            total) is given as argument, by default the total time \n
    * \em "%>ho": Modified Http request header \n
    * \em "%huo": Modified Http request url \n
    * \em "%<ho": Modified Http reply header \n
@@ -90,7 +98,6 @@ int fmt_req_attribute(ci_request_t *req_data, char *buf,int len, const char *par
    * \em "%Sa": Attribute value set by service\n
    *
    * Not yet implemented:\n
-   * \em "%tr": Response time \n
    * \em "%hu": Http request url \n
    * \em "%>hi": Http request header \n
    * \em "%<hi": Http reply header \n
@@ -106,7 +113,8 @@ struct ci_fmt_entry GlobalTable [] = {
     {"%ts", "Seconds since epoch", fmt_seconds},
     {"%tl", "Local time", fmt_localtime},
     {"%tg", "GMT time", fmt_gmttime},
-    {"%tr", "Response time", fmt_none},
+    {"%tr", "Response time", fmt_response_time},
+    {"%tp", "Request phase time", fmt_phase_time},
     {"%>hi", "Http request header", fmt_none},
     {"%>ho", "Modified Http request header", fmt_http_req_head_o},
     {"%huo", "Modified Http request url", fmt_http_req_url_o},
@@ -235,6 +243,159 @@ struct ci_fmt_entry *check_tables(const char *var, struct ci_fmt_entry *u_table,
     return NULL;
 }
 
+struct ci_fmt_op {
+    struct ci_fmt_entry *fmte; /*NULL for literal text*/
+    const char *str;           /*The literal text or the directive parameter*/
+    int len;                   /*The literal text length*/
+    int width;
+    int left_align;
+};
+
+struct ci_fmt_program {
+    int ops_num;
+    struct ci_fmt_op *ops;
+};
+
+/*Parses the format string. If ops is NULL just computes the number of
+  operations and the memory required for the literals and parameters*/
+static int fmt_compile_pass(const char *fmt, struct ci_fmt_entry *user_table,
+                            struct ci_fmt_op *ops, char *strings, size_t *strings_size)
+{
+    const char *s, *lit = NULL;
+    struct ci_fmt_entry *fmte;
+    int n = 0, directive_len, left_align;
+    unsigned int width;
+    size_t str_len = 0, len;
+    char parameter[MAX_VARIABLE_SIZE];
+
+    for (s = fmt; ; ) {
+        fmte = NULL;
+        if (*s == '%')
+            fmte = check_tables(s, user_table, &directive_len,
+                                &width, &left_align, parameter);
+        if (*s && !fmte) {
+            if (!lit)
+                lit = s;
+            s++;
+            continue;
+        }
+
+        if (lit) {
+            len = s - lit;
+            if (ops) {
+                memcpy(strings + str_len, lit, len);
+                ops[n].fmte = NULL;
+                ops[n].str = strings + str_len;
+                ops[n].len = len;
+            }
+            str_len += len;
+            n++;
+            lit = NULL;
+        }
+
+        if (!*s)
+            break;
+
+        len = strlen(parameter) + 1;
+        if (ops) {
+            memcpy(strings + str_len, parameter, len);
+            ops[n].fmte = fmte;
+            ops[n].str = strings + str_len;
+            ops[n].len = 0;
+            ops[n].width = width;
+            ops[n].left_align = left_align;
+        }
+        str_len += len;
+        n++;
+        s += directive_len;
+    }
+    *strings_size = str_len;
+    return n;
+}
+
+ci_fmt_program_t *ci_format_compile(const char *fmt, struct ci_fmt_entry *user_table)
+{
+    ci_fmt_program_t *prog;
+    size_t strings_size;
+    int ops_num;
+
+    ops_num = fmt_compile_pass(fmt, user_table, NULL, NULL, &strings_size);
+    prog = malloc(sizeof(ci_fmt_program_t) + ops_num * sizeof(struct ci_fmt_op) + strings_size);
+    if (!prog) {
+        ci_debug_printf(1, "Error allocating memory to compile format string\n");
+        return NULL;
+    }
+    prog->ops = (struct ci_fmt_op *)((char *)prog + sizeof(ci_fmt_program_t));
+    prog->ops_num = fmt_compile_pass(fmt, user_table, prog->ops,
+                                     (char *)(prog->ops + ops_num), &strings_size);
+    assert(prog->ops_num == ops_num);
+    return prog;
+}
+
+void ci_format_program_free(ci_fmt_program_t *prog)
+{
+    free(prog);
+}
+
+/*Formats a single directive at b and pads it up to width.
+  Returns the number of bytes written*/
+static int fmt_field(ci_request_t *req_data, struct ci_fmt_entry *fmte,
+                     const char *parameter, int width, int left_align,
+                     char *b, int remains)
+{
+    int val_len, space;
+
+    ci_debug_printf(7,"Width: %d, Parameter:%s\n", width, parameter);
+    if (width != 0)
+        space = width = (remains < width ? remains : width);
+    else
+        space = remains;
+
+    val_len = fmte->format(req_data, b, space, parameter);
+    if (val_len <= 0) val_len = fmt_none(req_data, b, space, parameter);
+    if (val_len > space) val_len = space;
+
+    if (!width)
+        return val_len;
+
+    /*Pad the field up to width, in place*/
+    if (val_len < width) {
+        if (left_align)
+            memset(b + val_len, ' ', width - val_len);
+        else {
+            memmove(b + width - val_len, b, val_len);
+            memset(b, ' ', width - val_len);
+        }
+    }
+    return width;
+}
+
+int ci_format_program_run(ci_request_t *req_data, const ci_fmt_program_t *prog,
+                          char *buffer, int len)
+{
+    const struct ci_fmt_op *op;
+    char *b;
+    int i, n, remains;
+
+    b = buffer;
+    remains = len - 1;
+    for (i = 0; i < prog->ops_num && remains > 0; i++) {
+        op = &prog->ops[i];
+        if (!op->fmte) {
+            n = op->len < remains ? op->len : remains;
+            memcpy(b, op->str, n);
+        } else
+            n = fmt_field(req_data, op->fmte, op->str, op->width, op->left_align, b, remains);
+        b += n;
+        remains -= n;
+    }
+    *b = '\0';
+    return len-remains;
+}
+
+/*Interprets the format string directly. Used for one-off formats, the
+  callers which format the same string many times should compile it once
+  with ci_format_compile*/
 int ci_format_text(
     ci_request_t *req_data,
     const char *fmt,
@@ -242,65 +403,28 @@ int ci_format_text(
     struct ci_fmt_entry *user_table)
 {
     const char *s;
-    char *b, *lb;
+    char *b;
     struct ci_fmt_entry *fmte;
-    int directive_len, val_len, remains, left_align, i;
-    unsigned int width, space = 0;
+    int directive_len, left_align, n, remains;
+    unsigned int width;
     char parameter[MAX_VARIABLE_SIZE];
 
-    lb = NULL;
     s = fmt;
     b = buffer;
     remains = len - 1;
     while (*s && remains > 0) {
-        if (*s == '%') {
-            fmte = check_tables(s, user_table, &directive_len,
-                                &width, &left_align, parameter);
-            ci_debug_printf(7,"Width: %d, Parameter:%s\n", width, parameter);
-            if (width != 0)
-                space = width = (remains<width?remains:width);
-            else
-                space = remains;
-            if (fmte != NULL) {
-                if (width) {
-                    if (left_align) {
-                        val_len = fmte->format(req_data, b, space, parameter);
-                        if (val_len <= 0) val_len = fmt_none(req_data, b, space, parameter);
-
-                        if (val_len > space) val_len = space;
-                        b += val_len;
-                        for (i = 0; i < width-val_len; i++) b[i]=' ';
-                        b += width-val_len;
-                    } else if ((lb = malloc((space+1)*sizeof(char))) != NULL) {
-                        val_len = fmte->format(req_data, lb, space, parameter);
-                        if (val_len <= 0) val_len = fmt_none(req_data, lb, space, parameter);
-
-                        if (val_len > space) val_len = space;
-                        for (i = 0; i < width-val_len; i++) b[i] = ' ';
-                        b += width-val_len;
-                        for (i = 0; i < val_len; i++) b[i] = lb[i];
-                        b += val_len;
-                        free(lb);
-                        lb = NULL;
-                    }
-                    /*else allocation failed! Just ignore?????*/
-
-                    remains -= width;
-                } else {
-                    val_len = fmte->format(req_data, b, space, parameter);
-                    if (val_len <= 0) val_len = fmt_none(req_data, b, space, parameter);
-
-                    if (val_len > space) val_len = space;
-                    b += val_len;
-                    remains -= val_len;
-                }
-                s += directive_len;
-            } else
-                *b++ = *s++, remains--;
+        if (*s == '%' &&
+            (fmte = check_tables(s, user_table, &directive_len,
+                                 &width, &left_align, parameter)) != NULL) {
+            n = fmt_field(req_data, fmte, parameter, width, left_align, b, remains);
+            b += n;
+            remains -= n;
+            s += directive_len;
         } else
             *b++ = *s++, remains--;
     }
-    *b = '\0';
+    if (len > 0)
+        *b = '\0';
     return len-remains;
 }
 
@@ -385,7 +509,7 @@ int fmt_localtime(ci_request_t *req, char *buf,int len, const char *param)
     if (param && param[0] != '\0') {
         tfmt = param;
     }
-    t = time(&t);
+    t = ci_coarse_time();
     localtime_r(&t, &tm);
     return strftime(buf, len, tfmt, &tm);
 }
@@ -402,7 +526,7 @@ int fmt_gmttime(ci_request_t *req, char *buf,int len, const char *param)
     if (param && param[0] != '\0') {
         tfmt = param;
     }
-    t = time(&t);
+    t = ci_coarse_time();
     gmtime_r(&t, &tm);
     return strftime(buf, len, tfmt, &tm);
 }
@@ -415,11 +539,46 @@ int fmt_icapstatus(ci_request_t *req, char *buf,int len, const char *param)
 
 int fmt_seconds(ci_request_t *req, char *buf,int len, const char *param)
 {
-    time_t tm;
-    time(&tm);
+    time_t tm = ci_coarse_time();
     return snprintf(buf, len, "%ld", tm);
 }
 
+int fmt_response_time(ci_request_t *req, char *buf,int len, const char *param)
+{
+    int64_t usecs = ci_request_phase_time(req, CI_PHASE_ACCEPT);
+    if (usecs < 0)
+        return 0;
+    return snprintf(buf, len, "%" PRId64, usecs / 1000);
+}
+
+static const struct {
+    const char *name;
+    int phase;
+} PHASE_NAMES[] = {
+    {"total", CI_PHASE_ACCEPT},
+    {"header", CI_PHASE_HEADER},
+    {"preview", CI_PHASE_PREVIEW},
+    {"body", CI_PHASE_EOF},
+    {"service", CI_PHASE_SERVICE},
+    {"send", CI_PHASE_SENT},
+    {NULL, -1}
+};
+
+int fmt_phase_time(ci_request_t *req, char *buf,int len, const char *param)
+{
+    int i, phase = CI_PHASE_ACCEPT;
+    int64_t usecs;
+    if (param && *param) {
+        for (i = 0; PHASE_NAMES[i].name && strcmp(PHASE_NAMES[i].name, param) != 0; i++);
+        if (!PHASE_NAMES[i].name)
+            return 0;
+        phase = PHASE_NAMES[i].phase;
+    }
+    if ((usecs = ci_request_phase_time(req, phase)) < 0)
+        return 0;
+    return snprintf(buf, len, "%" PRId64, usecs);
+}
+
 int fmt_httpclientip(ci_request_t *req, char *buf,int len, const char *param)
 {
     const char *s;
@@ -467,13 +626,21 @@ int fmt_http_req_head_o(ci_request_t *req, char *buf,int len, const char *param)
 {
     const char *s = NULL;
     int i;
+    ci_headers_list_t *http_req_headers;
+
     if (!len)
         return 0;
 
-    if (!param || param[0] == '\0') {
-        s = ci_http_request(req);
+    /*The values are copied up to the end of line, the headers do not
+      need to be unpacked*/
+    http_req_headers = ci_http_request_headers_ro(req);
+    if (!http_req_headers)
+        s = NULL;
+    else if (!param || param[0] == '\0') {
+        if (http_req_headers->used)
+            s = http_req_headers->headers[0];
     } else {
-        s = ci_http_request_get_header(req, param);
+        s = ci_headers_value(http_req_headers, param);
     }
 
     if (s)  {
@@ -495,12 +662,14 @@ int fmt_http_res_head_o(ci_request_t *req, char *buf,int len, const char *param)
     if (!len)
         return 0;
 
-    if (!param || param[0] == '\0') {
-        http_resp_headers = ci_http_response_headers(req);
-        if (http_resp_headers && http_resp_headers->used)
+    http_resp_headers = ci_http_response_headers_ro(req);
+    if (!http_resp_headers)
+        s = NULL;
+    else if (!param || param[0] == '\0') {
+        if (http_resp_headers->used)
             s = http_resp_headers->headers[0];
     } else {
-        s = ci_http_response_get_header(req, param);
+        s = ci_headers_value(http_resp_headers, param);
     }
 
     if (s) {
@@ -289,6 +289,13 @@ size_t regex_len(const void *key)
     return strlen(((const struct ci_acl_regex *)key)->str);
 }
 
+const char *regex_pattern(const void *key, int *flags)
+{
+    const struct ci_acl_regex *reg = (const struct ci_acl_regex *)key;
+    *flags = reg->flags;
+    return reg->str;
+}
+
 void regex_free(void *key, ci_mem_allocator_t *allocator)
 {
     struct ci_acl_regex *reg = (struct ci_acl_regex *)key;
@@ -515,10 +522,12 @@ size_t ip_len(const void *key)
     return sizeof(ci_ip_t);
 }
 
+int ip_equal(const void *ref_key, const void *key_check);
 int ip_cmp(const void *ref_key, const void *key_check)
 {
-    /*Not implemented*/
-    return 0;
+    /*There is not an order for the networks, return 0 if the address
+      belongs to the network*/
+    return !ip_equal(ref_key, key_check);
 }
 
 int ip_equal(const void *ref_key, const void *key_check)
@@ -553,10 +562,12 @@ int ip_equal(const void *ref_key, const void *key_check)
 
 }
 
+int ip_sockaddr_equal(const void *ref_key, const void *key_check);
 int ip_sockaddr_cmp(const void *ref_key, const void *key_check)
 {
-    /*Not implemented*/
-    return 1;
+    /*There is not an order for the networks, return 0 if the address
+      belongs to the network*/
+    return !ip_sockaddr_equal(ref_key, key_check);
 }
 
 int ip_sockaddr_equal(const void *ref_key, const void *key_check)
@@ -610,3 +621,252 @@ const ci_type_ops_t ci_ip_sockaddr_ops = {
     ip_len,
     ip_sockaddr_equal
 };
+
+/*
+  The IP networks radix trie. The networks are stored as path compressed
+  binary prefixes, in host byte order, one trie for the IPv4 and one for
+  the IPv6 networks. A search walks at most 32 (IPv4) or 128 (IPv6)
+  levels, whatever the number of networks, and returns the data of the
+  longest matching prefix. The networks with non contiguous netmasks and
+  the IPv4 mapped IPv6 networks can not be stored, ci_ip_trie_add returns
+  0 for them and the callers should check them one by one.
+*/
+struct ci_ip_trie_node {
+    uint32_t key[4];
+    int bits;
+    void *data;
+    struct ci_ip_trie_node *child[2];
+};
+
+struct ci_ip_trie {
+    struct ci_ip_trie_node *ipv4;
+    struct ci_ip_trie_node *ipv6;
+    int nodes;
+};
+
+#define ip_trie_bit(key, i) (((key)[(i) >> 5] >> (31 - ((i) & 31))) & 1)
+
+static uint32_t ip_trie_word_mask(int bits)
+{
+    return bits <= 0 ? 0 : (bits >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> bits));
+}
+
+/*Returns the number of the leading common bits, up to max_bits*/
+static int ip_trie_common_bits(const uint32_t *key1, const uint32_t *key2, int max_bits)
+{
+    uint32_t diff;
+    int i, bits;
+    for (i = 0, bits = 0; bits < max_bits; i++, bits += 32) {
+        if ((diff = key1[i] ^ key2[i]) != 0) {
+            while (!(diff & 0x80000000)) {
+                diff <<= 1;
+                bits++;
+            }
+            break;
+        }
+    }
+    return bits < max_bits ? bits : max_bits;
+}
+
+/*Returns the prefix length of the netmask, or -1 if it is not contiguous*/
+static int ip_trie_mask_bits(const uint32_t *mask, int words)
+{
+    int i, bits = 0;
+    uint32_t inv;
+    for (i = 0; i < words; i++) {
+        inv = ~mask[i];
+        if (inv & (inv + 1))
+            return -1;
+        if (bits != i * 32 && mask[i] != 0)
+            return -1;
+        for (; inv != 0xFFFFFFFF && !(inv & 0x80000000); inv = (inv << 1) | 1)
+            bits++;
+    }
+    return bits;
+}
+
+static struct ci_ip_trie_node *ip_trie_node_new(ci_ip_trie_t *trie, const uint32_t *key, int bits, void *data)
+{
+    struct ci_ip_trie_node *node;
+    int i;
+    if (!(node = malloc(sizeof(struct ci_ip_trie_node))))
+        return NULL;
+    for (i = 0; i < 4; i++)
+        node->key[i] = key[i] & ip_trie_word_mask(bits - i * 32);
+    node->bits = bits;
+    node->data = data;
+    node->child[0] = node->child[1] = NULL;
+    trie->nodes++;
+    return node;
+}
+
+static int ip_trie_insert(ci_ip_trie_t *trie, struct ci_ip_trie_node **link, const uint32_t *key, int bits, void *data)
+{
+    struct ci_ip_trie_node *node, *glue, *leaf;
+    int common;
+
+    while ((node = *link) != NULL) {
+        common = ip_trie_common_bits(node->key, key, node->bits < bits ? node->bits : bits);
+        if (common < node->bits) {
+            /*The new prefix diverges inside this node prefix, split it*/
+            if (common == bits) {
+                if (!(leaf = ip_trie_node_new(trie, key, bits, data)))
+                    return 0;
+                leaf->child[ip_trie_bit(node->key, bits)] = node;
+                *link = leaf;
+                return 1;
+            }
+            if (!(glue = ip_trie_node_new(trie, key, common, NULL)))
+                return 0;
+            if (!(leaf = ip_trie_node_new(trie, key, bits, data))) {
+                free(glue);
+                trie->nodes--;
+                return 0;
+            }
+            glue->child[ip_trie_bit(key, common)] = leaf;
+            glue->child[ip_trie_bit(node->key, common)] = node;
+            *link = glue;
+            return 1;
+        }
+        if (node->bits == bits) {
+            if (!node->data) /*keep the first data added for a network*/
+                node->data = data;
+            return 1;
+        }
+        link = &node->child[ip_trie_bit(key, node->bits)];
+    }
+    return (*link = ip_trie_node_new(trie, key, bits, data)) != NULL;
+}
+
+static const struct ci_ip_trie_node *ip_trie_lookup(const struct ci_ip_trie_node *node, const uint32_t *key, int max_bits)
+{
+    const struct ci_ip_trie_node *best = NULL;
+    while (node) {
+        if (ip_trie_common_bits(node->key, key, node->bits) < node->bits)
+            break;
+        if (node->data)
+            best = node;
+        if (node->bits >= max_bits)
+            break;
+        node = node->child[ip_trie_bit(key, node->bits)];
+    }
+    return best;
+}
+
+static void ip_trie_nodes_free(struct ci_ip_trie_node *node)
+{
+    if (!node)
+        return;
+    ip_trie_nodes_free(node->child[0]);
+    ip_trie_nodes_free(node->child[1]);
+    free(node);
+}
+
+ci_ip_trie_t *ci_ip_trie_create()
+{
+    ci_ip_trie_t *trie = malloc(sizeof(ci_ip_trie_t));
+    if (!trie)
+        return NULL;
+    trie->ipv4 = NULL;
+    trie->ipv6 = NULL;
+    trie->nodes = 0;
+    return trie;
+}
+
+void ci_ip_trie_destroy(ci_ip_trie_t *trie)
+{
+    if (!trie)
+        return;
+    ip_trie_nodes_free(trie->ipv4);
+    ip_trie_nodes_free(trie->ipv6);
+    free(trie);
+}
+
+int ci_ip_trie_add(ci_ip_trie_t *trie, const ci_ip_t *net, void *data)
+{
+    uint32_t key[4] = {0, 0, 0, 0}, mask[4] = {0, 0, 0, 0};
+    int bits;
+#ifdef HAVE_IPV6
+    int i;
+#endif
+
+    if (!trie || !net || !data)
+        return 0;
+
+#ifdef HAVE_IPV6
+    if (net->family == AF_INET6) {
+        if (ci_ipv6_inaddr_is_v4mapped(net->address))
+            return 0;
+        for (i = 0; i < 4; i++) {
+            key[i] = ntohl(ci_in6_addr_u32(net->address)[i]);
+            mask[i] = ntohl(ci_in6_addr_u32(net->netmask)[i]);
+        }
+        if ((bits = ip_trie_mask_bits(mask, 4)) < 0)
+            return 0;
+        return ip_trie_insert(trie, &trie->ipv6, key, bits, data);
+    }
+    key[0] = ntohl(net->address.ipv4_addr.s_addr);
+    mask[0] = ntohl(net->netmask.ipv4_addr.s_addr);
+#else
+    key[0] = ntohl(net->address.s_addr);
+    mask[0] = ntohl(net->netmask.s_addr);
+#endif
+    if ((bits = ip_trie_mask_bits(mask, 1)) < 0)
+        return 0;
+    return ip_trie_insert(trie, &trie->ipv4, key, bits, data);
+}
+
+void *ci_ip_trie_search(const ci_ip_trie_t *trie, int family, const void *addr)
+{
+    const ci_in_addr_t *address = (const ci_in_addr_t *)addr;
+    const struct ci_ip_trie_node *node = NULL;
+    uint32_t key[4] = {0, 0, 0, 0};
+#ifdef HAVE_IPV6
+    const struct ci_ip_trie_node *node6;
+    int i;
+#endif
+
+    if (!trie || !addr)
+        return NULL;
+
+#ifdef HAVE_IPV6
+    if (family == AF_INET6) {
+        for (i = 0; i < 4; i++)
+            key[i] = ntohl(ci_in6_addr_u32(*address)[i]);
+        node6 = ip_trie_lookup(trie->ipv6, key, 128);
+        /*The IPv4 mapped addresses match the IPv4 networks too*/
+        if (ci_ipv6_inaddr_is_v4mapped(*address)) {
+            key[0] = key[3];
+            node = ip_trie_lookup(trie->ipv4, key, 32);
+            if (node && node6 && node6->bits > node->bits + 96)
+                node = node6;
+        }
+        if (!node)
+            node = node6;
+    } else {
+        key[0] = ntohl(address->ipv4_addr.s_addr);
+        node = ip_trie_lookup(trie->ipv4, key, 32);
+    }
+#else
+    key[0] = ntohl(address->s_addr);
+    node = ip_trie_lookup(trie->ipv4, key, 32);
+#endif
+    return node ? node->data : NULL;
+}
+
+size_t ci_ip_trie_size(const ci_ip_trie_t *trie)
+{
+    return trie ? sizeof(ci_ip_trie_t) + trie->nodes * sizeof(struct ci_ip_trie_node) : 0;
+}
+
+const void *ci_ip_key_address(const ci_type_ops_t *ops, const void *key, int *family)
+{
+    if (!key)
+        return NULL;
+    if (ops == &ci_ip_sockaddr_ops) {
+        *family = ((const ci_sockaddr_t *)key)->ci_sin_family;
+        return ((const ci_sockaddr_t *)key)->ci_sin_addr;
+    }
+    *family = ((const ci_ip_t *)key)->family;
+    return &((const ci_ip_t *)key)->address;
+}
@@ -0,0 +1,143 @@
+/*
+ *  Copyright (C) 2004-2011 Christos Tsantilas
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA.
+ */
+
+/*
+  A small benchmark for the ICAP protocol scanning functions. It compares
+  the ci_find_crlf, ci_find_crlfcrlf and ci_parse_hex functions with the
+  byte loops previously used by the protocol parsers.
+*/
+
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "util.h"
+
+#define LOOPS 200000
+
+static const char *HEADER =
+    "REQMOD icap://127.0.0.1:1344/echo ICAP/1.0\r\n"
+    "Host: 127.0.0.1:1344\r\n"
+    "Date: Mon, 19 Oct 2026 10:00:00 GMT\r\n"
+    "Encapsulated: req-hdr=0, req-body=412\r\n"
+    "Preview: 1024\r\n"
+    "Allow: 204\r\n"
+    "X-Client-IP: 192.168.1.10\r\n"
+    "X-Authenticated-User: Q049dXNlcixPVT1Vc2VycyxEQz1leGFtcGxlLERDPWNvbQ==\r\n"
+    "User-Agent: C-ICAP-Client-Library/0.5.10\r\n"
+    "\r\n";
+
+static const char *CHUNKS[] = {
+    "400\r\n", "1f40; ieof\r\n", "0\r\n", "ffff\r\n", "7ffe0\r\n", NULL
+};
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval stop;
+    gettimeofday(&stop, NULL);
+    return (stop.tv_sec - start->tv_sec) + (stop.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static const char *loop_find_crlfcrlf(const char *s, size_t len)
+{
+    size_t i;
+    for (i = 0; i + 3 < len; i++) {
+        if (strncmp(s + i, "\r\n\r\n", 4) == 0)
+            return s + i;
+    }
+    return NULL;
+}
+
+static const char *loop_find_crlf(const char *s, size_t len)
+{
+    return strnstr(s, "\r\n", len);
+}
+
+static void report(const char *name, double secs, size_t bytes)
+{
+    printf("%-24s %8.3f sec %10.1f MB/s\n", name, secs,
+           (double)bytes / (1024 * 1024) / secs);
+}
+
+int main(int argc, char **argv)
+{
+    struct timeval start;
+    size_t hlen = strlen(HEADER), bytes;
+    const char *p, *end;
+    volatile size_t found = 0;
+    int64_t val;
+    long int lval;
+    char *lend;
+    int i, k;
+
+    printf("Scanner implementation: %s\n", ci_scan_impl());
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < LOOPS; i++) {
+        if ((p = loop_find_crlfcrlf(HEADER, hlen)) != NULL)
+            found += p - HEADER;
+    }
+    report("crlfcrlf byte loop", elapsed(&start), hlen * LOOPS);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < LOOPS; i++) {
+        if ((p = ci_find_crlfcrlf(HEADER, hlen)) != NULL)
+            found += p - HEADER;
+    }
+    report("ci_find_crlfcrlf", elapsed(&start), hlen * LOOPS);
+
+    gettimeofday(&start, NULL);
+    for (i = 0, bytes = 0; i < LOOPS; i++) {
+        for (p = HEADER; (end = loop_find_crlf(p, hlen - (p - HEADER))) != NULL; p = end + 2)
+            found++;
+        bytes += hlen;
+    }
+    report("crlf strnstr", elapsed(&start), bytes);
+
+    gettimeofday(&start, NULL);
+    for (i = 0, bytes = 0; i < LOOPS; i++) {
+        for (p = HEADER; (end = ci_find_crlf(p, hlen - (p - HEADER))) != NULL; p = end + 2)
+            found++;
+        bytes += hlen;
+    }
+    report("ci_find_crlf", elapsed(&start), bytes);
+
+    gettimeofday(&start, NULL);
+    for (i = 0, bytes = 0; i < LOOPS; i++) {
+        for (k = 0; CHUNKS[k]; k++) {
+            lval = strtol(CHUNKS[k], &lend, 16);
+            found += lval + (lend - CHUNKS[k]);
+            bytes += lend - CHUNKS[k];
+        }
+    }
+    report("chunk size strtol", elapsed(&start), bytes);
+
+    gettimeofday(&start, NULL);
+    for (i = 0, bytes = 0; i < LOOPS; i++) {
+        for (k = 0; CHUNKS[k]; k++) {
+            if (ci_parse_hex(CHUNKS[k], strlen(CHUNKS[k]), &end, &val))
+                found += val + (end - CHUNKS[k]);
+            bytes += end - CHUNKS[k];
+        }
+    }
+    report("ci_parse_hex", elapsed(&start), bytes);
+
+    return found == 0;
+}